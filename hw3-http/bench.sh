@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# bench.sh - wall clock times of the clients against delay-server.py
+#
+# Starts delay-server.py on loopback, so every response comes back a fixed
+# delay after its request like it would from a remote server, runs each
+# client configuration BENCH_RUNS times and prints the median wall clock time.
+#
+#   usage: ./bench.sh pipe | ep
+#
+#   pipe    client-cc, client-ka and client-ka -p 2, 4 and 8, for the three
+#           usual resources and for 10 small paths (the table in timing.txt)
+#   ep      client-ep -h 4 with -c 1 through 16, fetching 50 URLs spread over
+#           5 servers on consecutive ports (the table in readme.md)
+#
+# BENCH_DELAY is the server delay in ms (default 20), BENCH_RUNS the runs per
+# number (default 5) and BENCH_PORT the first port to listen on (default 8080).
+
+MODE=${1:-pipe}
+DELAY=${BENCH_DELAY:-20}
+RUNS=${BENCH_RUNS:-5}
+PORT=${BENCH_PORT:-8080}
+
+cd "$(dirname "$0")"
+NEED="client-cc client-ka"
+[ "$MODE" = ep ] && NEED=client-ep
+for exe in $NEED; do
+    if [ ! -x ./$exe ]; then
+        echo "build the clients first (make)" >&2
+        exit 1
+    fi
+done
+
+# Median wall clock seconds of RUNS runs of the command line
+median(){
+    local TIMEFORMAT=%R
+    for r in $(seq 1 $RUNS); do
+        { time "$@" > /dev/null 2>&1 ; } 2>&1
+    done | sort -n | awk '{ t[NR] = $1 } END { printf "%.3fs", t[int((NR + 1) / 2)] }'
+}
+
+# Starts the server on the given ports and waits until it is listening
+start_server(){
+    ./delay-server.py -d $DELAY "$@" > /dev/null &
+    SERVER=$!
+    trap 'kill $SERVER 2>/dev/null' EXIT
+    for i in $(seq 1 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return
+        sleep 0.1
+    done
+    echo "delay-server.py did not start" >&2
+    exit 1
+}
+
+case $MODE in
+pipe)
+    start_server $PORT
+    echo "delay: ${DELAY}ms, median of $RUNS runs"
+    printf "%-10s %-10s %-10s %-10s %-10s %-10s\n" "requests" "client-cc" "client-ka" "-p 2" "-p 4" "-p 8"
+    THREE="/ /json /html"
+    TEN=$(seq -f "/%g" 1 10)
+    for paths in "$THREE" "$TEN"; do
+        n=$(echo $paths | wc -w)
+        printf "%-10s %-10s %-10s" $n $(median ./client-cc 127.0.0.1 $PORT $paths) \
+            $(median ./client-ka 127.0.0.1 $PORT $paths)
+        for depth in 2 4 8; do
+            printf " %-10s" $(median ./client-ka -p $depth 127.0.0.1 $PORT $paths)
+        done
+        printf "\n"
+    done
+    ;;
+ep)
+    PORTS=$(seq $PORT $((PORT + 4)))
+    URLS=$(for p in $PORTS; do seq -f "http://127.0.0.1:$p/%g" 1 10; done)
+    start_server $PORTS
+    echo "delay: ${DELAY}ms, median of $RUNS runs, 50 URLs over 5 servers, -h 4"
+    printf "%-6s %-10s %-10s\n" "-c" "seconds" "requests/s"
+    for c in 1 2 4 8 16; do
+        t=$(median ./client-ep -c $c -h 4 $URLS)
+        printf "%-6s %-10s %-10s\n" $c $t $(awk -v t=${t%s} 'BEGIN { printf "%.0f", 50 / t }')
+    done
+    ;;
+*)
+    echo "usage: $0 pipe | ep" >&2
+    exit 1
+    ;;
+esac
@@ -7,7 +7,8 @@
 #include <string.h>
 #include <time.h>
 
-#define  BUFF_SZ 1024
+//Big enough to hold a whole response header, see http_parse_header()
+#define  BUFF_SZ HTTP_MAX_HEADER_BYTES
 
 char recv_buff[BUFF_SZ];
 
@@ -68,9 +69,33 @@ int process_request(const char *host, uint16_t port, char *resource){
         return -1;
     }
 
-    while((bytes_recvd = recv(sock, recv_buff, BUFF_SZ, 0)) > 0) {
-        printf("%.*s", bytes_recvd, recv_buff);
+    //The header is collected at the front of recv_buff until the parser finds its
+    //end, after that each recv() reuses the buffer from the start.  Knowing the
+    //body length means we can stop as soon as it is in rather than waiting for
+    //the server to close; if the header cant be parsed just read until close
+    http_parser parser;
+    int have = 0;
+    int header_len = 0;
+
+    http_parser_init(&parser);
+    while(!http_parse_done(&parser) &&
+          (bytes_recvd = recv(sock, recv_buff + have, BUFF_SZ - have, 0)) > 0) {
+        printf("%.*s", bytes_recvd, recv_buff + have);
         total_bytes += bytes_recvd;
+
+        if (header_len > 0) {
+            http_parse_body(&parser, recv_buff, bytes_recvd);
+            continue;
+        }
+        if (header_len < 0)
+            continue;
+
+        have += bytes_recvd;
+        header_len = http_parse_header(&parser, recv_buff, have);
+        if (header_len > 0)
+            http_parse_body(&parser, recv_buff + header_len, have - header_len);
+        if (header_len != 0)
+            have = 0;
     }
 
     close(sock);
@@ -0,0 +1,594 @@
+#include "http.h"
+#include "resolver.h"
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+
+//A concurrent fetcher: takes a list of URLs that can span many hosts and runs
+//them over a pool of non-blocking Keep-Alive connections driven by epoll.
+//Each host gets at most per_host connections and the whole run at most
+//max_conns, an idle connection is handed the next request queued for its host.
+
+#define  MAX_URLS            4096
+#define  MAX_HOSTS           256
+#define  MAX_CONNS           256
+#define  DEFAULT_MAX_CONNS   16
+#define  DEFAULT_PER_HOST    4
+#define  MAX_FETCH_TRIES     5
+#define  BACKOFF_BASE_MS     100
+#define  BACKOFF_MAX_MS      3200
+#define  MAX_EVENTS          64
+#define  MAX_PATH_LEN        1024
+#define  MAX_HOST_LEN        256
+
+struct host_pool;
+
+typedef struct fetch_job {
+    const char  *url;
+    char        path[MAX_PATH_LEN];
+    struct host_pool *host;
+    int         tries;
+    int         addr_fails;     //connects refused, each one moves on to the host's next address
+    double      not_before;     //backoff, dont retry before this time
+    double      start;
+    int         status;         //HTTP status once done, -1 if we gave up
+    long        body_len;
+    struct fetch_job *next;     //host queue
+} fetch_job;
+
+typedef struct host_pool {
+    char        name[MAX_HOST_LEN];
+    uint16_t    port;
+    int         open;           //connections to this host, connecting, busy or idle
+    fetch_job   *queue;         //jobs waiting for a connection, in URL order
+} host_pool;
+
+typedef enum conn_state {
+    CONN_FREE = 0,
+    CONN_CONNECTING,
+    CONN_SENDING,
+    CONN_RECEIVING,
+    CONN_IDLE
+} conn_state;
+
+typedef struct fetch_conn {
+    int         fd;
+    conn_state  state;
+    host_pool   *host;
+    fetch_job   *job;
+    struct sockaddr_storage peer;   //address being connected to
+    int         served;         //responses completed on this connection
+    int         job_bytes;      //bytes received for the current job
+    char        req[MAX_PATH_LEN + MAX_HOST_LEN + 64];
+    int         req_len;
+    int         req_sent;
+    http_parser parser;
+    int         have;           //header bytes collected at the front of buff
+    int         header_len;
+    char        buff[HTTP_MAX_HEADER_BYTES];
+} fetch_conn;
+
+static fetch_job    jobs[MAX_URLS];
+static host_pool    hosts[MAX_HOSTS];
+static fetch_conn   conns[MAX_CONNS];
+static int          job_count, host_count;
+static int          jobs_left;
+static int          total_open, max_conns = DEFAULT_MAX_CONNS, per_host = DEFAULT_PER_HOST;
+static int          conns_opened;
+static int          epfd;
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void print_usage(char *exe_name){
+    fprintf(stderr, "Usage: %s [-c max_conns] [-h per_host] <url...>\n", exe_name);
+    fprintf(stderr, "       url is [http://]host[:port][/path]\n");
+    fprintf(stderr, "       -c  connections open at once across all hosts (default %d, max %d)\n",
+            DEFAULT_MAX_CONNS, MAX_CONNS);
+    fprintf(stderr, "       -h  connections per host (default %d)\n", DEFAULT_PER_HOST);
+}
+
+static host_pool *find_host(const char *name, int name_len, uint16_t port){
+    for (int i = 0; i < host_count; i++)
+        if (hosts[i].port == port && (int)strlen(hosts[i].name) == name_len &&
+            strncasecmp(hosts[i].name, name, name_len) == 0)
+            return &hosts[i];
+
+    if (host_count == MAX_HOSTS || name_len >= MAX_HOST_LEN)
+        return NULL;
+    host_pool *h = &hosts[host_count++];
+    memcpy(h->name, name, name_len);
+    h->name[name_len] = '\0';
+    h->port = port;
+    return h;
+}
+
+/**
+ * parse_url() - Splits a URL into its host pool and path
+ * @job Job to fill in, job->url is the URL
+ *
+ * Accepts http://host[:port][/path], and the same without the scheme.  The
+ * path defaults to "/" and the port to 80.
+ *
+ * Return: 0 on success, -1 if the URL cant be fetched by this client
+ */
+static int parse_url(fetch_job *job){
+    const char *p = job->url;
+    const char *host_end, *path;
+    int port = DEFAULT_PORT;
+
+    if (strncasecmp(p, "http://", 7) == 0)
+        p += 7;
+    else if (strstr(p, "://") != NULL)
+        return -1;      //https and friends
+
+    path = strchr(p, '/');
+    if (path == NULL)
+        path = p + strlen(p);
+    host_end = memchr(p, ':', path - p);
+    if (host_end != NULL) {
+        port = atoi(host_end + 1);
+        if (port <= 0 || port > 65535)
+            return -1;
+    } else {
+        host_end = path;
+    }
+    if (host_end == p || strlen(*path ? path : "/") >= MAX_PATH_LEN)
+        return -1;
+
+    strcpy(job->path, *path ? path : "/");
+    job->host = find_host(p, host_end - p, port);
+    return job->host ? 0 : -1;
+}
+
+static void queue_job(host_pool *h, fetch_job *job){
+    fetch_job **tail = &h->queue;
+
+    while (*tail)
+        tail = &(*tail)->next;
+    job->next = NULL;
+    *tail = job;
+}
+
+//First job for this host that is not waiting out a backoff
+static fetch_job *pop_ready_job(host_pool *h, double now){
+    for (fetch_job **pp = &h->queue; *pp; pp = &(*pp)->next) {
+        if ((*pp)->not_before <= now) {
+            fetch_job *job = *pp;
+            *pp = job->next;
+            job->next = NULL;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+static void job_finished(fetch_job *job, int status, long body_len){
+    job->status = status;
+    job->body_len = body_len;
+    jobs_left--;
+    if (status < 0)
+        fprintf(stdout, "FAIL %8s %7.3fs %s\n", "-", now_sec() - job->start, job->url);
+    else
+        fprintf(stdout, "%4d %8ld %7.3fs %s\n", status, body_len, now_sec() - job->start, job->url);
+}
+
+static void conn_watch(fetch_conn *c, uint32_t events, int op){
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, op, c->fd, &ev) < 0)
+        perror("epoll_ctl");
+}
+
+static void conn_close(fetch_conn *c){
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->host->open--;
+    total_open--;
+    c->fd = -1;
+    c->state = CONN_FREE;
+    c->job = NULL;
+}
+
+/**
+ * job_retry() - Decides what happens to a request whose connection failed
+ * @h The job's host
+ * @job The job
+ * @why What went wrong, for the log
+ * @stale Retry at once: the connection had served a response before and
+ *        nothing of this one arrived (most likely the server closed it as idle
+ *        while our request was on the way), or the host has other addresses
+ *        left to try
+ *
+ * A stale failure puts the job straight back at the front of the queue without
+ * counting a try.  Anything else counts, and the job waits
+ * BACKOFF_BASE_MS, doubling on each try up to BACKOFF_MAX_MS, so a host that is
+ * down or overloaded isnt hammered.  After MAX_FETCH_TRIES the URL is reported
+ * as failed.
+ */
+static void job_retry(host_pool *h, fetch_job *job, const char *why, int stale){
+    if (stale) {
+        job->next = h->queue;
+        h->queue = job;
+        return;
+    }
+
+    if (++job->tries >= MAX_FETCH_TRIES) {
+        fprintf(stderr, "%s: %s, giving up after %d tries\n", job->url, why, job->tries);
+        job_finished(job, -1, 0);
+        return;
+    }
+
+    int delay_ms = BACKOFF_BASE_MS << (job->tries - 1);
+    if (delay_ms > BACKOFF_MAX_MS)
+        delay_ms = BACKOFF_MAX_MS;
+    fprintf(stderr, "%s: %s, retrying in %dms\n", job->url, why, delay_ms);
+    job->not_before = now_sec() + delay_ms / 1000.0;
+    queue_job(h, job);
+}
+
+static void conn_fail(fetch_conn *c, const char *why){
+    fetch_job *job = c->job;
+    host_pool *h = c->host;
+    int stale = c->served > 0 && c->job_bytes == 0;
+
+    conn_close(c);
+    if (job != NULL)
+        job_retry(h, job, why, stale);
+}
+
+static void conn_send(fetch_conn *c){
+    while (c->req_sent < c->req_len) {
+        int rc = send(c->fd, c->req + c->req_sent, c->req_len - c->req_sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;     //still EPOLLOUT, we get called again
+            conn_fail(c, strerror(errno));
+            return;
+        }
+        c->req_sent += rc;
+    }
+    c->state = CONN_RECEIVING;
+    conn_watch(c, EPOLLIN, EPOLL_CTL_MOD);
+}
+
+static void conn_start(fetch_conn *c, fetch_job *job){
+    c->job = job;
+    c->job_bytes = 0;
+    c->have = 0;
+    c->header_len = 0;
+    http_parser_init(&c->parser);
+    c->req_len = snprintf(c->req, sizeof(c->req),
+                          "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: Keep-Alive\r\n\r\n",
+                          job->path, c->host->name);
+    c->req_sent = 0;
+
+    //A connection still in its handshake sends once it is writable
+    if (c->state == CONN_CONNECTING)
+        return;
+    c->state = CONN_SENDING;
+    conn_watch(c, EPOLLOUT, EPOLL_CTL_MOD);
+    conn_send(c);
+}
+
+/**
+ * conn_open() - Starts a new connection to a host
+ * @h The host
+ * @out Set to the connection
+ *
+ * Return: 0 when the connect is under way, RESOLVER_PENDING if the host name
+ *         is still being looked up, negative if the connect failed
+ */
+static int conn_open(host_pool *h, fetch_conn **out){
+    fetch_conn *c = NULL;
+
+    for (int i = 0; i < MAX_CONNS && c == NULL; i++)
+        if (conns[i].state == CONN_FREE)
+            c = &conns[i];
+    if (c == NULL)
+        return -1;
+
+    c->fd = socket_connect_nb(h->name, h->port, &c->peer);
+    if (c->fd < 0) {
+        int rc = c->fd;
+        c->fd = -1;
+        return rc;
+    }
+    c->state = CONN_CONNECTING;
+    c->host = h;
+    c->served = 0;
+    h->open++;
+    total_open++;
+    conns_opened++;
+    conn_watch(c, EPOLLOUT, EPOLL_CTL_ADD);
+    *out = c;
+    return 0;
+}
+
+//Host names are looked up on the resolver threads, a host whose lookup is
+//still running is skipped until resolver_event_fd() wakes us
+static int host_resolving(host_pool *h){
+    resolved_addrs addrs;
+    return resolver_lookup_nb(h->name, h->port, &addrs) == RESOLVER_PENDING;
+}
+
+//At the global limit, an idle connection to a host with nothing queued is
+//worth less than a new one to a host that has work
+static int evict_idle_conn(void){
+    for (int i = 0; i < MAX_CONNS; i++) {
+        if (conns[i].state == CONN_IDLE && conns[i].host->queue == NULL) {
+            conn_close(&conns[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static fetch_conn *idle_conn(host_pool *h){
+    for (int i = 0; i < MAX_CONNS; i++)
+        if (conns[i].state == CONN_IDLE && conns[i].host == h)
+            return &conns[i];
+    return NULL;
+}
+
+static int has_ready_job(host_pool *h, double now){
+    for (fetch_job *job = h->queue; job; job = job->next)
+        if (job->not_before <= now)
+            return 1;
+    return 0;
+}
+
+/**
+ * dispatch() - Hands queued requests to connections
+ *
+ * For every host with a ready job: reuse an idle connection to that host if
+ * there is one, otherwise open a new one as long as the host is below per_host,
+ * its name is resolved, and the run is below max_conns (closing an idle
+ * connection to some other host to make room if need be).
+ */
+static void dispatch(void){
+    double now = now_sec();
+
+    for (int i = 0; i < host_count; i++) {
+        host_pool *h = &hosts[i];
+
+        while (has_ready_job(h, now)) {
+            fetch_conn *c = idle_conn(h);
+
+            if (c == NULL && (h->open >= per_host || host_resolving(h) ||
+                              (total_open >= max_conns && !evict_idle_conn())))
+                break;
+
+            fetch_job *job = pop_ready_job(h, now);
+            if (job->start == 0)
+                job->start = now;
+            if (c == NULL && conn_open(h, &c) < 0) {
+                job_retry(h, job, "connect failed", 0);
+                continue;
+            }
+            conn_start(c, job);
+        }
+    }
+}
+
+static void conn_done(fetch_conn *c){
+    fetch_job *job = c->job;
+
+    job_finished(job, c->parser.status, c->parser.body_len);
+    c->job = NULL;
+    c->served++;
+    if (!c->parser.keep_alive) {
+        conn_close(c);
+        return;
+    }
+    //Idle: watch for the server closing it so we dont hand it a request
+    c->state = CONN_IDLE;
+    conn_watch(c, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+}
+
+/**
+ * conn_recv() - Reads what is available of the current response
+ * @c The connection
+ *
+ * Same processing as submit_request() in client-ka: the header is collected
+ * at the front of buff until http_parse_header() finds its end, then the
+ * parser tracks the body (Content-Length, chunked or until close) so we know
+ * exactly when the connection is free for the next request.  One recv() per
+ * event, epoll is level triggered and calls again if there is more.
+ */
+static void conn_recv(fetch_conn *c){
+    char *at = c->header_len > 0 ? c->buff : c->buff + c->have;
+    int room = c->header_len > 0 ? (int)sizeof(c->buff) : (int)sizeof(c->buff) - c->have;
+    int bytes_recvd = recv(c->fd, at, room, 0);
+
+    if (bytes_recvd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            conn_fail(c, strerror(errno));
+        return;
+    }
+    if (bytes_recvd == 0) {
+        if (c->header_len > 0 && http_parse_eof(&c->parser) == 0) {
+            c->parser.keep_alive = 0;
+            conn_done(c);
+        } else {
+            conn_fail(c, "connection closed early");
+        }
+        return;
+    }
+    c->job_bytes += bytes_recvd;
+
+    if (c->header_len > 0) {
+        if (http_parse_body(&c->parser, c->buff, bytes_recvd) < 0) {
+            conn_fail(c, "malformed chunked body");
+            return;
+        }
+    } else {
+        c->have += bytes_recvd;
+        c->header_len = http_parse_header(&c->parser, c->buff, c->have);
+        if (c->header_len < 0) {
+            conn_fail(c, "malformed response header");
+            return;
+        }
+        if (c->header_len > 0 &&
+            http_parse_body(&c->parser, c->buff + c->header_len, c->have - c->header_len) < 0) {
+            conn_fail(c, "malformed chunked body");
+            return;
+        }
+    }
+
+    if (http_parse_done(&c->parser))
+        conn_done(c);
+}
+
+static void conn_event(fetch_conn *c, uint32_t events){
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    switch (c->state) {
+    case CONN_CONNECTING:
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            //The next connect to this host goes to its next address, and as
+            //long as some are untried that happens without a backoff
+            int addrs = resolver_connect_failed(c->host->name, (struct sockaddr *)&c->peer);
+            fetch_job *job = c->job;
+            host_pool *h = c->host;
+
+            conn_close(c);
+            job_retry(h, job, strerror(err ? err : errno), ++job->addr_fails < addrs);
+            return;
+        }
+        c->state = CONN_SENDING;
+        conn_send(c);
+        break;
+    case CONN_SENDING:
+        conn_send(c);
+        break;
+    case CONN_RECEIVING:
+        conn_recv(c);
+        break;
+    case CONN_IDLE:
+        //An idle connection has nothing to read, this is the server hanging up
+        conn_close(c);
+        break;
+    case CONN_FREE:
+        break;
+    }
+}
+
+//How long epoll_wait() may sleep before a job in backoff becomes ready, jobs
+//that are ready already are waiting for a connection and one will free up
+static int next_timeout_ms(void){
+    double now = now_sec(), first = 0;
+
+    for (int i = 0; i < host_count; i++)
+        for (fetch_job *job = hosts[i].queue; job; job = job->next)
+            if (job->not_before > now && (first == 0 || job->not_before < first))
+                first = job->not_before;
+    if (first == 0)
+        return -1;
+    return (int)((first - now) * 1000) + 1;
+}
+
+int main(int argc, char *argv[]){
+    struct epoll_event events[MAX_EVENTS];
+    double start = now_sec();
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:h:")) != -1) {
+        if (opt == 'c' && atoi(optarg) > 0) {
+            max_conns = atoi(optarg) < MAX_CONNS ? atoi(optarg) : MAX_CONNS;
+        } else if (opt == 'h' && atoi(optarg) > 0) {
+            per_host = atoi(optarg);
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc) {
+        print_usage(argv[0]);
+        exit(1);
+    }
+
+    for (int i = optind; i < argc && job_count < MAX_URLS; i++) {
+        fetch_job *job = &jobs[job_count];
+        job->url = argv[i];
+        if (parse_url(job) < 0) {
+            fprintf(stderr, "Skipping %s, only http://host[:port]/path URLs are supported\n", argv[i]);
+            continue;
+        }
+        queue_job(job->host, job);
+        job_count++;
+    }
+    jobs_left = job_count;
+
+    for (int i = 0; i < MAX_CONNS; i++)
+        conns[i].fd = -1;
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    //The resolver's notification pipe is the one fd in the set without a
+    //connection behind it.  Start every host's lookup now so they run in
+    //parallel instead of one by one as connections open.
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, resolver_event_fd(), &ev) < 0)
+        perror("epoll_ctl");
+    for (int i = 0; i < host_count; i++)
+        host_resolving(&hosts[i]);
+
+    fprintf(stdout, "Fetching %d URLs from %d hosts, %d connections max, %d per host\n",
+            job_count, host_count, max_conns, per_host);
+
+    while (jobs_left > 0) {
+        dispatch();
+        if (jobs_left == 0)
+            break;
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, next_timeout_ms());
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                resolver_event_ack();
+            else
+                conn_event(events[i].data.ptr, events[i].events);
+        }
+    }
+
+    for (int i = 0; i < MAX_CONNS; i++)
+        if (conns[i].state != CONN_FREE)
+            conn_close(&conns[i]);
+    close(epfd);
+
+    int ok = 0;
+    long body_bytes = 0;
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].status > 0) {
+            ok++;
+            body_bytes += jobs[i].body_len;
+        }
+    }
+
+    double elapsed = now_sec() - start;
+    fprintf(stdout, "\n%d of %d URLs fetched, %ld body bytes, %d connections opened\n",
+            ok, job_count, body_bytes, conns_opened);
+    fprintf(stdout, "Wall clock time: %.6f seconds (%.1f requests/s)\n",
+            elapsed, elapsed > 0 ? ok / elapsed : 0.0);
+    return ok == job_count ? 0 : 1;
+}
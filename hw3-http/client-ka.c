@@ -6,9 +6,13 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <getopt.h>
 
-#define  BUFF_SZ            1024
+//Big enough to hold a whole response header, see http_parse_header()
+#define  BUFF_SZ            HTTP_MAX_HEADER_BYTES
 #define  MAX_REOPEN_TRIES   5
+#define  REOPEN_BACKOFF_MS  50
+#define  MAX_PIPELINE_DEPTH 32
 
 char recv_buff[BUFF_SZ];
 
@@ -28,7 +32,8 @@ char *generate_cc_request(const char *host, int port, const char *path){
 
 
 void print_usage(char *exe_name){
-    fprintf(stderr, "Usage: %s <hostname> <port> <path...>\n", exe_name);
+    fprintf(stderr, "Usage: %s [-p depth] <hostname> <port> <path...>\n", exe_name);
+    fprintf(stderr, "       -p depth  pipeline up to depth requests (1-%d), default 1\n", MAX_PIPELINE_DEPTH);
     fprintf(stderr, "Using default host %s, port %d  and path [\\]\n", DEFAULT_HOST, DEFAULT_PORT);
 }
 
@@ -56,7 +61,11 @@ int reopen_socket(const char *host, uint16_t port) {
     //          5. If we fall out of the loop, we are unable to connect, return
     //             -1 to indicate a failure.
     //----------------------------------------------------------------------------
+    //Back off between attempts (REOPEN_BACKOFF_MS, doubling each time) so a
+    //server that is restarting or overloaded gets a chance to recover
     for(int i = 0; i < MAX_REOPEN_TRIES; i++) {
+        if (i > 0)
+            usleep((REOPEN_BACKOFF_MS << (i - 1)) * 1000);
         sock = socket_connect(host, port);
         if(sock > 0) {
             fprintf(stdout, "Successfully reconnected on attempt %d\n", i + 1);
@@ -126,20 +135,32 @@ int submit_request(int sock, const char *host, uint16_t port, char *resource){
         return -1;
     }
 
+    http_parser parser;
     int bytes_recvd = 0;    //used to track amount of data received on each recv() call
     int total_bytes = 0;    //used to accumulate the total number of bytes across all recv() calls
-
-    //do the first recv
-    bytes_recvd = recv(sock, recv_buff, sizeof(recv_buff),0);
-    if(bytes_recvd < 0) {
-        perror("initial receive failed");
-        close(sock);
-        return -1;
+    int have = 0;           //header bytes collected at the front of recv_buff so far
+
+    //remember the first receive has the HTTP header, and likely some body data.
+    //The header may also be spread over several segments, so keep appending to
+    //recv_buff and let the parser pick up where it left off until it sees the
+    //blank line that ends the header
+    http_parser_init(&parser);
+    int header_len = 0;
+    while (header_len == 0) {
+        bytes_recvd = recv(sock, recv_buff + have, sizeof(recv_buff) - have, 0);
+        if(bytes_recvd <= 0) {
+            if (bytes_recvd < 0)
+                perror("initial receive failed");
+            else
+                fprintf(stderr, "Server closed the connection before sending a response\n");
+            close(sock);
+            return -1;
+        }
+        have += bytes_recvd;
+        total_bytes += bytes_recvd;
+        header_len = http_parse_header(&parser, recv_buff, have);
     }
 
-    //remember the first receive we just did has the HTTP header, and likely some body
-    //data.  We need to determine how much data we expect
-
     //--------------------------------------------------------------------------------
     //TODO:  Get the header len
     //
@@ -148,8 +169,10 @@ int submit_request(int sock, const char *host, uint16_t port, char *resource){
     //    check the header_len variable and if its negative:
     //          a. close the socket -- close(sock)
     //          b. return -1 to exit this function
+    //
+    // NOTE: header_len now comes from http_parse_header() above, which also picked
+    //       up the content length on the same pass over the header
     //--------------------------------------------------------------------------------
-    int header_len = get_http_header_len(recv_buff, bytes_recvd);
     if(header_len < 0) {
         fprintf(stderr, "Failed to parse HTTP header\n");
         close(sock);
@@ -157,40 +180,19 @@ int submit_request(int sock, const char *host, uint16_t port, char *resource){
     }
 
     //--------------------------------------------------------------------------------
-    //TODO:  Get the conetent len
-    //
-    // 1. Use the get_http_content_len() function to set the content_len variable.
-    //
-    // Note that no error checking is needed, if the get_http_content_len() function
-    // cannot find a Content-Length header, its assumed as per the HTTP spec that ther
-    // is no body, AKA, content_len is zero;
-    //--------------------------------------------------------------------------------
-    int content_len = get_http_content_len(recv_buff, header_len);
-
-    //--------------------------------------------------------------------------------
-    // TODO:  Make sure you understand the calculations below
-    //
-    // You do not have to write any code, but add to this comment your thoughts on
-    // what the following 2 lines of code do to track the amount of data received
-    // from the server
+    // The body bytes that came in with the header count against the content length,
+    // http_parse_body() keeps track of how much of the body is still outstanding
+    // (parser.body_remaining), so we stop calling recv() as soon as we have it all.
+    // This is essential for Keep-Alive because we must receive exactly content_len
+    // bytes before the next request can be sent on the same socket.
     //
-    // YOUR ANSWER:
-    // `initial_data`: This is the amount of body data in the first recv. We subtract
-    // the header_len from total bytes_recvd to get just the body portion.
-    // `bytes_remaining`: This is how much more body data we still need to receive.
-    // We subtract the initial_data we already have from the total content_len
-    // to determine what's left to receive in subsequent recv() calls. This tracking
-    // is essential for Keep-Alive because we must receive exactly content_len bytes
-    // before the next request can be sent on the same socket.
+    // Servers that stream their response send "Transfer-Encoding: chunked" and no
+    // Content-Length, the parser then follows the chunk framing up to the zero size
+    // chunk and its trailers instead, which is where the response really ends.
     //--------------------------------------------------------------------------------
-    int initial_data =  bytes_recvd - header_len;
-    int bytes_remaining = content_len - initial_data;
-
+    int framing_ok = http_parse_body(&parser, recv_buff + header_len, have - header_len) >= 0;
 
-    //This loop keeps going until bytes_remaining is essentially zero, to be more
-    //defensive an prevent an infinite loop, i have it set to keep looping as long
-    //as bytes_remaining is positive
-    while(bytes_remaining > 0){
+    while(framing_ok && !http_parse_done(&parser)){
         //-----------------------------------------------------------------------------
         // TODO:  Continue receiving data from the server
         //
@@ -206,17 +208,42 @@ int submit_request(int sock, const char *host, uint16_t port, char *resource){
             close(sock);
             return -1;
         }
+        if(bytes_recvd == 0) {
+            //The server closed the socket, fine if the body was delimited by the
+            //close, otherwise the response got cut short
+            if (http_parse_eof(&parser) == 0)
+                break;
+            fprintf(stderr, "Connection closed before the response was complete, got %ld body bytes\n",
+                    parser.body_len);
+            close(sock);
+            return -1;
+        }
 
         //You can uncomment out the fprintf() calls below to see what is going on
 
         //fprintf(stdout, "%.*s", bytes_recvd, recv_buff);
         total_bytes += bytes_recvd;
-        //fprintf(stdout, "remaining %d, received %d\n", bytes_remaining, bytes_recvd);
-        bytes_remaining -= bytes_recvd;
+        //fprintf(stdout, "remaining %ld, received %d\n", parser.body_remaining, bytes_recvd);
+        framing_ok = http_parse_body(&parser, recv_buff, bytes_recvd) >= 0;
+    }
+
+    //Bad chunk framing means we no longer know where the next response starts
+    if (!framing_ok) {
+        fprintf(stderr, "Malformed chunked body\n");
+        close(sock);
+        return -1;
+    }
+
+    //The server told us it will close after this response, so dont hand back a
+    //socket the next request would only find dead
+    if (!parser.keep_alive) {
+        close(sock);
+        sock = -1;
     }
 
     fprintf(stdout, "\n\nOK\n");
     fprintf(stdout, "TOTAL BYTES: %d\n", total_bytes);
+    fprintf(stdout, "BODY BYTES: %ld%s\n", parser.body_len, parser.chunked > 0 ? " (chunked)" : "");
 
     //processed the request OK, return the socket, in case we had to reopen
     //so that it can be used in the next request
@@ -237,9 +264,180 @@ int submit_request(int sock, const char *host, uint16_t port, char *resource){
     return sock;
 }
 
+//send() the whole buffer, MSG_NOSIGNAL so a socket the server already closed
+//gives us EPIPE instead of killing the program
+static int send_all(int sock, const char *buff, int len){
+    int sent = 0;
+
+    while (sent < len) {
+        int rc = send(sock, buff + sent, len - sent, MSG_NOSIGNAL);
+        if (rc < 0)
+            return -1;
+        sent += rc;
+    }
+    return sent;
+}
+
+/**
+ * pipeline_read_response() - Receives one response off a pipelined socket
+ * @sock The socket
+ * @parser Parser to use, reset here
+ * @have Bytes already waiting at the front of recv_buff on entry, and the bytes
+ *       of the following responses left there on return
+ * @resp_bytes Set to the size of this response on the wire
+ *
+ * With several requests in flight one recv() can return the end of one
+ * response and the start of the next, so whatever follows this response is
+ * moved to the front of recv_buff for the next call instead of being dropped.
+ *
+ * Return: 0 on success, -1 if the connection broke first, -2 if the response
+ *         could not be parsed
+ */
+static int pipeline_read_response(int sock, http_parser *parser, int *have, int *resp_bytes){
+    int header_len, consumed, used, bytes_recvd;
+
+    http_parser_init(parser);
+    while ((header_len = http_parse_header(parser, recv_buff, *have)) == 0) {
+        bytes_recvd = recv(sock, recv_buff + *have, sizeof(recv_buff) - *have, 0);
+        if (bytes_recvd <= 0)
+            return -1;
+        *have += bytes_recvd;
+    }
+    if (header_len < 0)
+        return -2;
+
+    consumed = header_len;
+    *resp_bytes = header_len;
+    for (;;) {
+        if ((used = http_parse_body(parser, recv_buff + consumed, *have - consumed)) < 0)
+            return -2;
+        consumed += used;
+        *resp_bytes += used;
+        if (http_parse_done(parser))
+            break;
+
+        //Everything buffered belonged to this body, start over at the front
+        bytes_recvd = recv(sock, recv_buff, sizeof(recv_buff), 0);
+        if (bytes_recvd < 0)
+            return -1;
+        if (bytes_recvd == 0) {
+            //Only a body that runs until close may end like this
+            if (http_parse_eof(parser) < 0)
+                return -1;
+            *have = 0;
+            return 0;
+        }
+        *have = bytes_recvd;
+        consumed = 0;
+    }
+
+    memmove(recv_buff, recv_buff + consumed, *have - consumed);
+    *have -= consumed;
+    return 0;
+}
+
+/**
+ * pipeline_requests() - Fetches resources with HTTP/1.1 pipelining
+ * @sock Connected socket, or negative to open one
+ * @host The server
+ * @port The server's port
+ * @resources Paths to request, responses come back in this order
+ * @count Number of paths
+ * @depth Most requests to have outstanding at once
+ *
+ * submit_request() waits for each response before sending the next request,
+ * so every resource costs a round trip even on a reused socket.  Here up to
+ * depth requests are written ahead in a single send() and the responses are
+ * parsed in order as they arrive, so a batch costs about one round trip.
+ *
+ * Pipelining is only turned on once the first response on a connection shows
+ * an HTTP/1.1 server that keeps the connection open, until then one request
+ * is sent at a time.  When the server closes the socket (Connection: close,
+ * an idle timeout, or a reset) the requests that did not get an answer are
+ * sent again on a new connection; GETs are safe to repeat.  If the connection
+ * breaks or a response is garbled while several requests were outstanding,
+ * the server is taken not to handle pipelining and the rest of the run falls
+ * back to one request at a time.
+ *
+ * Return: The socket to use from here on (-1 if it is closed), or -1 if the
+ *         server could not be reached after MAX_REOPEN_TRIES
+ */
+int pipeline_requests(int sock, const char *host, uint16_t port, char **resources, int count, int depth){
+    static char send_buff[MAX_PIPELINE_DEPTH * 512];
+    http_parser parser;
+    int sent = 0;           //requests written, the next one to send is resources[sent]
+    int done = 0;           //responses received, always in request order
+    int window = 1;         //requests allowed in flight on this connection
+    int can_pipeline = depth > 1;
+    int have = 0;           //bytes of the next response(s) already in recv_buff
+    int failures = 0;
+
+    while (done < count) {
+        if (sock < 0) {
+            if ((sock = reopen_socket(host, port)) < 0)
+                return -1;
+            sent = done;    //anything sent on the old socket without an answer goes again
+            have = 0;
+        }
+
+        //Top up the window, all new requests go out in one segment
+        int len = 0;
+        while (sent < count && sent - done < window) {
+            const char *req = generate_cc_request(host, port, resources[sent]);
+            int req_len = strlen(req);
+            if (len + req_len > (int)sizeof(send_buff))
+                break;
+            memcpy(send_buff + len, req, req_len);
+            len += req_len;
+            sent++;
+        }
+
+        int resp_bytes = 0;
+        int rc = (len > 0 && send_all(sock, send_buff, len) < 0) ? -1 :
+                 pipeline_read_response(sock, &parser, &have, &resp_bytes);
+
+        if (rc == 0) {
+            fprintf(stdout, "\n\nResponse for %s\n", resources[done]);
+            fprintf(stdout, "OK\n");
+            fprintf(stdout, "TOTAL BYTES: %d\n", resp_bytes);
+            fprintf(stdout, "BODY BYTES: %ld%s\n", parser.body_len, parser.chunked > 0 ? " (chunked)" : "");
+            done++;
+            failures = 0;
+
+            if (can_pipeline && parser.keep_alive && parser.minor_version >= 1)
+                window = depth;
+            if (!parser.keep_alive) {
+                window = 1;     //the next connection has to show it keeps alive too
+                close(sock);
+                sock = -1;
+            }
+            continue;
+        }
+
+        if (can_pipeline && sent - done > 1) {
+            fprintf(stderr, "Server dropped %d pipelined requests, falling back to one at a time\n",
+                    sent - done);
+            can_pipeline = 0;
+        } else if (rc == -2) {
+            fprintf(stderr, "Failed to parse HTTP response for %s\n", resources[done]);
+        }
+        window = 1;
+        close(sock);
+        sock = -1;
+        if (++failures > MAX_REOPEN_TRIES) {
+            fprintf(stderr, "Giving up on %s after %d attempts\n", resources[done], failures);
+            return -1;
+        }
+    }
+
+    return sock;
+}
+
 int main(int argc, char *argv[]){
     clock_t start, end;
+    struct timespec wall_start, wall_end;
     start = clock();
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
 
     int sock;
 
@@ -247,14 +445,28 @@ int main(int argc, char *argv[]){
     uint16_t   port = DEFAULT_PORT;
     char       *resource = DEFAULT_PATH;
     int        remaining_args = 0;
+    int        depth = 1;
+    int        opt;
+
+    while ((opt = getopt(argc, argv, "p:")) != -1) {
+        if (opt == 'p' && atoi(optarg) > 0) {
+            depth = atoi(optarg) < MAX_PIPELINE_DEPTH ? atoi(optarg) : MAX_PIPELINE_DEPTH;
+        } else {
+            print_usage(argv[0]);
+            exit(1);
+        }
+    }
+    //Drop the options but keep the program name in argv[0]
+    argv[optind - 1] = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
 
     //YOU DONT NEED TO DO ANYTHING OR MODIFY ANYTHING IN MAIN().  MAKE SURE YOU UNDERSTAND
     //THE CODE HOWEVER
-    sock = server_connect(host, port);
-
     if(argc < 4){
         print_usage(argv[0]);
         //process the default request
+        sock = server_connect(host, port);
         submit_request(sock, host, port, resource);
     } else {
         host = argv[1];
@@ -266,16 +478,26 @@ int main(int argc, char *argv[]){
         }
         fprintf(stdout, "Running with host = %s, port = %d\n", host, port);
         remaining_args = argc-3;
-        for(int i = 0; i < remaining_args; i++){
-            resource = argv[3+i];
-            fprintf(stdout, "\n\nProcessing request for %s\n\n", resource);
-            sock = submit_request(sock, host, port, resource);
+        sock = server_connect(host, port);
+        if (depth > 1) {
+            fprintf(stdout, "Pipelining up to %d requests\n", depth);
+            sock = pipeline_requests(sock, host, port, argv + 3, remaining_args, depth);
+        } else {
+            for(int i = 0; i < remaining_args; i++){
+                resource = argv[3+i];
+                fprintf(stdout, "\n\nProcessing request for %s\n\n", resource);
+                sock = submit_request(sock, host, port, resource);
+            }
         }
     }
 
-    server_disconnect(sock);
+    if (sock >= 0)
+        server_disconnect(sock);
 
     end = clock();
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
     double cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+    double wall_time = (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9;
     printf("\n\nProgram execution time: %.6f seconds\n", cpu_time_used);
+    printf("Wall clock time: %.6f seconds\n", wall_time);
 }
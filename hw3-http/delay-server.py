@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+#
+# delay-server.py - local HTTP/1.1 server that stands in for a distant one
+#
+# Holds every response for a fixed delay after its request arrived, the way a
+# round trip to a remote server would, so the clients can be timed on loopback.
+# Requests are read as soon as they arrive and answered in order, so pipelined
+# requests each wait the delay from their own arrival, not one after another.
+# Connections are kept alive unless the request says "Connection: close".
+#
+#   usage: ./delay-server.py [-d delay_ms] [-s body_bytes] port ...
+#
+# Listens on 127.0.0.1 on every port given, so one process can stand in for
+# several hosts.  Stop it with Ctrl-C.
+
+import argparse
+import asyncio
+
+parser = argparse.ArgumentParser(description="HTTP/1.1 server that delays every response")
+parser.add_argument("-d", "--delay", type=float, default=20, help="delay in ms (default 20)")
+parser.add_argument("-s", "--size", type=int, default=512, help="body bytes (default 512)")
+parser.add_argument("ports", type=int, nargs="+")
+args = parser.parse_args()
+
+body = (b"x" * 63 + b"\n") * (args.size // 64) + b"x" * (args.size % 64)
+
+
+async def respond(writer, queue):
+    loop = asyncio.get_running_loop()
+    while True:
+        item = await queue.get()
+        if item is None:
+            break
+        arrived, path, close = item
+        await asyncio.sleep(max(0, arrived + args.delay / 1000 - loop.time()))
+        try:
+            writer.write(b"HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                         b"Content-Length: %d\r\nX-Path: %s\r\n%s\r\n" %
+                         (len(body), path, b"Connection: close\r\n" if close else b"") + body)
+            await writer.drain()
+        except ConnectionError:
+            break
+        if close:
+            break
+    writer.close()
+
+
+async def serve(reader, writer):
+    loop = asyncio.get_running_loop()
+    queue = asyncio.Queue()
+    sender = asyncio.create_task(respond(writer, queue))
+    try:
+        while True:
+            header = await reader.readuntil(b"\r\n\r\n")
+            lines = header.split(b"\r\n")
+            parts = lines[0].split()
+            close = any(l.lower().startswith(b"connection:") and b"close" in l.lower()
+                        for l in lines[1:])
+            queue.put_nowait((loop.time(), parts[1] if len(parts) > 1 else b"/", close))
+            if close:
+                break
+    except (asyncio.IncompleteReadError, asyncio.LimitOverrunError, ConnectionError):
+        pass
+    queue.put_nowait(None)
+    await sender
+
+
+async def main():
+    servers = [await asyncio.start_server(serve, "127.0.0.1", port) for port in args.ports]
+    print("delay-server: %gms on port %s" % (args.delay, ", ".join(map(str, args.ports))),
+          flush=True)
+    await asyncio.gather(*(s.serve_forever() for s in servers))
+
+
+try:
+    asyncio.run(main())
+except KeyboardInterrupt:
+    pass
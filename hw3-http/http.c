@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include <netinet/tcp.h>
 #include <sys/socket.h>
@@ -12,7 +13,12 @@
 #include <netinet/in.h>
 #include <netdb.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "http.h"
+#include "resolver.h"
 
 //---------------------------------------------------------------------------------
 // TODO:  Documentation
@@ -83,51 +89,90 @@ char *strnstr(const char *s, const char *find, size_t slen)
  * This function performs the complete sequence of operations needed to establish
  * a TCP connection to a remote server:
  *
- * 1. DNS Resolution: Uses gethostbyname() to resolve the hostname to an IP address.
- *    gethostbyname() queries DNS servers and returns a hostent structure containing
- *    the IP address(es) associated with the hostname.
- *
- * 2. Address Structure Setup: Constructs a sockaddr_in struct with:
- *    - IP address: Copied from the hostent struct using bcopy()
- *    - Port: Converted to network byte order (big-endian) using htons()
- *    - Address family: Set to AF_INET for IPv4
+ * 1. DNS Resolution: resolver_lookup() (see resolver.c) returns every address
+ *    the name has, IPv6 and IPv4, ordered so the two families alternate.  It
+ *    used to be gethostbyname() on every call, which blocks, is not thread safe
+ *    and only gave us the first IPv4 address.  The answer is now cached for as
+ *    long as its DNS TTL allows, so the reconnects done by reopen_socket() dont
+ *    go back to DNS each time, and the lookup itself runs on a resolver thread.
  *
- * 3. Socket Creation: Calls socket() with:
- *    - PF_INET: IPv4 protocol family
- *    - SOCK_STREAM: TCP
- *    - 0: Let system choose appropriate protocol (TCP for SOCK_STREAM)
+ * 2. Connection Establishment: happy_eyeballs_connect() starts a non-blocking
+ *    connect() (the TCP three-way handshake SYN, SYN-ACK, ACK) to the first
+ *    address, and if that has not completed within 250ms starts the next one
+ *    in parallel, keeping whichever finishes first.  A host whose IPv6 route is
+ *    broken, or that lists a dead address, then costs a fraction of a second
+ *    instead of a full connect timeout.
  *
- * 4. Connection Establishment: Uses connect() to initiate the TCP three-way
- *    handshake (SYN, SYN-ACK, ACK) with the server. This blocks until the
- *    connection is established or fails.
+ * 3. The winning socket is put back in blocking mode, the way the clients
+ *    expect it, and the other attempts are closed.
  *
  * Return: Socket file descriptor (positive int) on success, or negative on failure:
  *         -2 if DNS resolution fails, -1 if socket creation or connection fails
  */
 int socket_connect(const char *host, uint16_t port){
-    struct hostent *hp;
-    struct sockaddr_in addr;
+    resolved_addrs addrs;
     int sock;
 
-    if((hp = gethostbyname(host)) == NULL){
-        herror("gethostbyname");
+    if(resolver_lookup(host, port, &addrs, RESOLVER_TIMEOUT_MS) < 0){
+        fprintf(stderr, "resolve %s: %s\n", host, resolver_strerror(addrs.error));
         return -2;
     }
 
+    sock = happy_eyeballs_connect(&addrs, HE_CONNECT_TIMEOUT_MS);
+    if(sock == -1){
+        perror("connect");
+        return -1;
+    }
+
+    return sock;
+}
+
 
-    bcopy(hp->h_addr_list[0], &addr.sin_addr, hp->h_length);
-    addr.sin_port = htons(port);
-    addr.sin_family = AF_INET;
-    sock = socket(PF_INET, SOCK_STREAM, 0);
+/**
+ * socket_connect_nb() - Starts a non-blocking TCP connection to a server
+ * @host The hostname of the server
+ * @port The port number to connect to
+ * @peer If not NULL, set to the address the connection goes to
+ *
+ * For event loops, nothing in here waits.  If the name is not in the resolver
+ * cache yet its lookup is started and RESOLVER_PENDING is returned, try again
+ * once resolver_event_fd() is readable.  Otherwise the socket is switched to
+ * O_NONBLOCK before connect(), which returns straight away with EINPROGRESS
+ * while the handshake runs.  The caller waits for the socket to become
+ * writable and reads SO_ERROR to find out whether the connection worked.  Only
+ * the first address is tried, a caller that sees it fail should report it with
+ * resolver_connect_failed() so the next attempt goes to another address.
+ *
+ * Return: Socket file descriptor on success, RESOLVER_PENDING while the name is
+ *         being looked up, -2 if DNS resolution fails, -1 if the socket could not
+ *         be created or the connect failed at once
+ */
+int socket_connect_nb(const char *host, uint16_t port, struct sockaddr_storage *peer){
+    resolved_addrs addrs;
+    int sock, rc;
 
+    if((rc = resolver_lookup_nb(host, port, &addrs)) == RESOLVER_PENDING)
+        return RESOLVER_PENDING;
+    if(rc < 0){
+        fprintf(stderr, "resolve %s: %s\n", host, resolver_strerror(addrs.error));
+        return -2;
+    }
+    if(peer != NULL)
+        *peer = addrs.addr[0];
+
+    sock = socket(addrs.addr[0].ss_family, SOCK_STREAM, 0);
     if(sock == -1){
         perror("socket");
         return -1;
     }
 
-    if(connect(sock, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) == -1){
+    if(fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) == -1 ||
+       (connect(sock, (struct sockaddr *)&addrs.addr[0], addrs.addr_len[0]) == -1 &&
+        errno != EINPROGRESS)){
         perror("connect");
         close(sock);
+        if(peer != NULL)
+            resolver_connect_failed(host, (struct sockaddr *)peer);
         return -1;
     }
 
@@ -262,21 +307,487 @@ void print_header(char *http_buff, int http_header_len){
 // use this function to get full extra credit.
 //--------------------------------------------------------------------------------------
 int process_http_header(char *http_buff, int http_buff_len, int *header_len, int *content_len){
-    int h_len, c_len = 0;
-    h_len = get_http_header_len(http_buff, http_buff_len);
-    if (h_len < 0) {
-        *header_len = 0;
-        *content_len = 0;
-        return -1;
-    }
-    c_len = get_http_content_len(http_buff, http_buff_len);
-    if (c_len < 0) {
+    http_parser parser;
+    int h_len;
+
+    //One pass: the parser picks up Content-Length while it walks the lines
+    //looking for the blank one that ends the header
+    http_parser_init(&parser);
+    h_len = http_parse_header(&parser, http_buff, http_buff_len);
+    if (h_len <= 0) {
         *header_len = 0;
         *content_len = 0;
         return -1;
     }
 
     *header_len = h_len;
-    *content_len = c_len;
+    *content_len = parser.content_len < 0 ? 0 : (int)parser.content_len;
     return 0; //success
 }
+
+//--------------------------------------------------------------------------------------
+// Incremental response parser
+//
+// The helpers above need the whole header in one buffer and walk it twice.  The
+// parser below is fed the receive buffer every time it grows, remembers how far
+// it already looked, and hands back the header fields as slices that point into
+// that buffer.  Nothing is copied or NUL terminated.
+//--------------------------------------------------------------------------------------
+
+/**
+ * http_scan_eol() - Finds the next '\n' between s and end
+ * @s First byte to look at
+ * @end One past the last valid byte
+ *
+ * Compares 16 bytes at a time with SSE2 and uses the match mask to land on the
+ * first newline, the tail (or the whole thing on non-x86 builds) goes through
+ * memchr().  Only '\n' is searched for, the '\r' in front of it is checked by
+ * the caller so a bare '\n' line ending is tolerated.
+ *
+ * Return: Pointer to the newline, or NULL if there is none before end
+ */
+static const char *http_scan_eol(const char *s, const char *end){
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+
+    while (end - s >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)s);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        if (mask)
+            return s + __builtin_ctz(mask);
+        s += 16;
+    }
+#endif
+    if (s >= end)
+        return NULL;
+    return memchr(s, '\n', end - s);
+}
+
+static int http_slice_eq(http_slice s, const char *str){
+    return (int)strlen(str) == s.len && strncasecmp(s.ptr, str, s.len) == 0;
+}
+
+//Checks a comma separated header value, e.g. "Connection: keep-alive, Upgrade"
+static int http_slice_has_token(http_slice s, const char *token){
+    const char *p = s.ptr;
+    const char *end = s.ptr + s.len;
+
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        const char *tok_end = comma ? comma : end;
+        http_slice tok;
+
+        while (p < tok_end && (*p == ' ' || *p == '\t')) p++;
+        tok.ptr = p;
+        tok.len = tok_end - p;
+        while (tok.len > 0 && (tok.ptr[tok.len-1] == ' ' || tok.ptr[tok.len-1] == '\t')) tok.len--;
+        if (http_slice_eq(tok, token))
+            return 1;
+        p = tok_end + 1;
+    }
+    return 0;
+}
+
+//"HTTP/1.1 200 OK" - version, 3 digit status and an optional reason phrase
+static int http_parse_status_line(http_parser *parser, const char *line, int len){
+    if (len < 12 || memcmp(line, "HTTP/1.", 7) != 0 || !isdigit((unsigned char)line[7]) ||
+        line[8] != ' ' || !isdigit((unsigned char)line[9]) ||
+        !isdigit((unsigned char)line[10]) || !isdigit((unsigned char)line[11]) ||
+        (len > 12 && line[12] != ' '))
+        return -1;
+
+    parser->minor_version = line[7] - '0';
+    parser->status = (line[9] - '0') * 100 + (line[10] - '0') * 10 + (line[11] - '0');
+    parser->keep_alive = parser->minor_version >= 1;
+    parser->reason.ptr = line + (len > 12 ? 13 : 12);
+    parser->reason.len = len > 12 ? len - 13 : 0;
+    return 0;
+}
+
+//"Name: value" - the name runs up to the ':', the value has its surrounding
+//spaces and tabs trimmed off
+static int http_parse_field(http_parser *parser, const char *line, int len){
+    const char *colon = memchr(line, HTTP_HEADER_DELIM, len);
+    http_header h;
+
+    //No name, whitespace before the colon, or an obsolete folded line
+    if (colon == NULL || colon == line || line[0] == ' ' || line[0] == '\t' ||
+        colon[-1] == ' ' || colon[-1] == '\t')
+        return -1;
+
+    h.name.ptr = line;
+    h.name.len = colon - line;
+    h.value.ptr = colon + 1;
+    h.value.len = len - h.name.len - 1;
+    while (h.value.len > 0 && (*h.value.ptr == ' ' || *h.value.ptr == '\t')) {
+        h.value.ptr++;
+        h.value.len--;
+    }
+    while (h.value.len > 0 && (h.value.ptr[h.value.len-1] == ' ' || h.value.ptr[h.value.len-1] == '\t'))
+        h.value.len--;
+
+    if (http_slice_eq(h.name, CL_HEADER)) {
+        long content_len = 0;
+
+        if (h.value.len == 0 || h.value.len > 18)
+            return -1;
+        for (int i = 0; i < h.value.len; i++) {
+            if (!isdigit((unsigned char)h.value.ptr[i]))
+                return -1;
+            content_len = content_len * 10 + (h.value.ptr[i] - '0');
+        }
+        //Repeated Content-Length headers have to agree, otherwise we cant
+        //tell where this response stops and the next one starts
+        if (parser->content_len >= 0 && parser->content_len != content_len)
+            return -1;
+        parser->content_len = content_len;
+    } else if (http_slice_eq(h.name, "Transfer-Encoding")) {
+        //Only the last coding frames the message, anything else ahead of
+        //chunked (gzip etc.) is just part of the decoded body to us
+        const char *last = h.value.ptr + h.value.len;
+        http_slice coding;
+
+        while (last > h.value.ptr && last[-1] != ',') last--;
+        coding.ptr = last;
+        coding.len = h.value.ptr + h.value.len - last;
+        while (coding.len > 0 && (*coding.ptr == ' ' || *coding.ptr == '\t')) {
+            coding.ptr++;
+            coding.len--;
+        }
+        parser->chunked = http_slice_eq(coding, "chunked") ? 1 : -1;
+    } else if (http_slice_eq(h.name, "Connection")) {
+        if (http_slice_has_token(h.value, "close"))
+            parser->keep_alive = 0;
+        else if (http_slice_has_token(h.value, "keep-alive"))
+            parser->keep_alive = 1;
+    }
+
+    //Fields past HTTP_MAX_HEADERS are still checked above, just not kept
+    if (parser->header_count < HTTP_MAX_HEADERS)
+        parser->headers[parser->header_count++] = h;
+    return 0;
+}
+
+//An interim 1xx response (100 Continue, 103 Early Hints) has no body and the
+//real response to the same request follows it, so start over on the status
+//line right after its blank line
+static void http_interim_done(http_parser *parser){
+    int line_start = parser->line_start;
+    int interim_count = parser->interim_count;
+    void (*on_body)(void *, const char *, int) = parser->on_body;
+    void *on_body_arg = parser->on_body_arg;
+
+    http_parser_init(parser);
+    parser->line_start = line_start;
+    parser->interim_count = interim_count + 1;
+    parser->on_body = on_body;
+    parser->on_body_arg = on_body_arg;
+}
+
+//Called on the blank line, works out how the body is delimited
+static int http_header_complete(http_parser *parser, int header_len){
+    parser->header_len = header_len;
+
+    if (parser->status == 101) {
+        //Switching Protocols, whatever follows on the socket is not HTTP anymore
+        parser->body_remaining = 0;
+        parser->keep_alive = 0;
+    } else if (parser->status == 204 || parser->status == 304) {
+        parser->body_remaining = 0;
+    } else if (parser->chunked > 0) {
+        //Transfer-Encoding wins over any Content-Length that came along
+        parser->body_remaining = -1;
+        parser->chunk_state = HTTP_CHUNK_SIZE;
+        parser->chunk_remaining = 0;
+        parser->state = HTTP_PARSE_BODY;
+        return header_len;
+    } else if (parser->content_len >= 0 && parser->chunked == 0) {
+        parser->body_remaining = parser->content_len;
+    } else {
+        //No length, the body ends when the server closes the socket so
+        //this connection cant be reused
+        parser->body_remaining = -1;
+        parser->keep_alive = 0;
+    }
+
+    parser->state = parser->body_remaining == 0 ? HTTP_PARSE_DONE : HTTP_PARSE_BODY;
+    return header_len;
+}
+
+/**
+ * http_parser_init() - Resets a parser for the next response
+ * @parser The parser to reset
+ *
+ * Must be called before the first http_parse_header() call of every response,
+ * including each response on a Keep-Alive socket.
+ */
+void http_parser_init(http_parser *parser){
+    memset(parser, 0, sizeof(*parser));
+    parser->state = HTTP_PARSE_STATUS;
+    parser->content_len = -1;
+    parser->body_remaining = -1;
+}
+
+/**
+ * http_parse_header() - Feeds the response header to the parser
+ * @parser Parser set up with http_parser_init()
+ * @http_buff Buffer holding the response from its first byte
+ * @http_buff_len Number of valid bytes in http_buff
+ *
+ * Call this again every time recv() appends to http_buff, always passing the
+ * start of the buffer and its new total length.  Complete lines are parsed once
+ * and the end of line search resumes where the previous call stopped, so the
+ * total work is linear in the header size no matter how the server splits it
+ * across segments.  The status line fills in status, minor_version and reason,
+ * and every field is recorded in headers[] as name/value slices into
+ * http_buff, which therefore must not move or be overwritten while they are in
+ * use.  Content-Length and Connection are interpreted on the way through.
+ * Interim 1xx responses other than 101 are skipped over, the parser then
+ * describes the final response that came after them.
+ *
+ * Return: Header length in bytes (the body starts at http_buff + the return
+ *         value, any interim responses are counted in it) once the blank line
+ *         of the final response was seen, 0 if more data is needed, or -1 if
+ *         the header is malformed or longer than HTTP_MAX_HEADER_BYTES
+ */
+int http_parse_header(http_parser *parser, const char *http_buff, int http_buff_len){
+    const char *end = http_buff + http_buff_len;
+    const char *next = http_buff + parser->scanned;
+    const char *eol;
+
+    if (parser->state == HTTP_PARSE_ERROR)
+        return -1;
+    if (parser->state != HTTP_PARSE_STATUS && parser->state != HTTP_PARSE_HEADERS)
+        return parser->header_len;
+
+    while ((eol = http_scan_eol(next, end)) != NULL) {
+        const char *line = http_buff + parser->line_start;
+        int line_len = eol - line;
+        int rc;
+
+        if (line_len > 0 && line[line_len-1] == '\r')
+            line_len--;
+        parser->line_start = eol + 1 - http_buff;
+        next = eol + 1;
+
+        if (parser->state == HTTP_PARSE_STATUS) {
+            rc = http_parse_status_line(parser, line, line_len);
+            parser->state = HTTP_PARSE_HEADERS;
+        } else if (line_len == 0) {
+            if (parser->status < 200 && parser->status != 101) {
+                http_interim_done(parser);
+                continue;
+            }
+            return http_header_complete(parser, parser->line_start);
+        } else {
+            rc = http_parse_field(parser, line, line_len);
+        }
+
+        if (rc < 0) {
+            parser->state = HTTP_PARSE_ERROR;
+            return -1;
+        }
+    }
+
+    parser->scanned = http_buff_len;
+    if (http_buff_len >= HTTP_MAX_HEADER_BYTES) {
+        parser->state = HTTP_PARSE_ERROR;
+        return -1;
+    }
+    return 0;
+}
+
+static void http_body_data(http_parser *parser, const char *data, int len){
+    if (len <= 0)
+        return;
+    parser->body_len += len;
+    if (parser->on_body)
+        parser->on_body(parser->on_body_arg, data, len);
+}
+
+static int http_hex_digit(char c){
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * http_parse_chunked() - Runs the chunked body state machine over a buffer
+ * @parser Parser whose header said Transfer-Encoding: chunked
+ * @buff Body bytes
+ * @len Number of bytes in buff
+ *
+ * The body is a series of "<hex size>[;ext]\r\n<data>\r\n" chunks ending with a
+ * zero size chunk, optional trailer fields and a blank line.  The state lives in
+ * the parser so a chunk header, the data, or a trailer line can be split across
+ * any number of recv() calls.  Data runs are handed to on_body() where they sit
+ * in buff, the framing around them is skipped.
+ *
+ * Return: Bytes of buff consumed, less than len only if the body ended inside
+ *         buff, or -1 on a framing error
+ */
+static int http_parse_chunked(http_parser *parser, const char *buff, int len){
+    const char *p = buff;
+    const char *end = buff + len;
+
+    while (p < end && parser->state == HTTP_PARSE_BODY) {
+        switch (parser->chunk_state) {
+        case HTTP_CHUNK_SIZE: {
+            int digit = http_hex_digit(*p);
+            if (digit >= 0) {
+                //15 hex digits is already way more than any body we could want
+                if (parser->chunk_remaining > (0x7fffffffffffffffL >> 4))
+                    return -1;
+                parser->chunk_remaining = parser->chunk_remaining * 16 + digit;
+                parser->chunk_digits++;
+            } else if (parser->chunk_digits == 0) {
+                return -1;
+            } else if (*p == ';' || *p == ' ' || *p == '\t') {
+                parser->chunk_state = HTTP_CHUNK_EXT;
+            } else if (*p == '\r') {
+                parser->chunk_state = HTTP_CHUNK_SIZE_LF;
+            } else if (*p == '\n') {
+                parser->chunk_state = HTTP_CHUNK_SIZE_LF;
+                continue;
+            } else {
+                return -1;
+            }
+            p++;
+            break;
+        }
+        case HTTP_CHUNK_EXT: {
+            const char *eol = memchr(p, '\n', end - p);
+            if (eol == NULL)
+                return len;
+            p = eol;
+            parser->chunk_state = HTTP_CHUNK_SIZE_LF;
+            break;
+        }
+        case HTTP_CHUNK_SIZE_LF:
+            if (*p++ != '\n')
+                return -1;
+            parser->chunk_digits = 0;
+            parser->chunk_state = parser->chunk_remaining ? HTTP_CHUNK_DATA : HTTP_CHUNK_TRAILER;
+            break;
+        case HTTP_CHUNK_DATA: {
+            int n = end - p < parser->chunk_remaining ? (int)(end - p) : (int)parser->chunk_remaining;
+            http_body_data(parser, p, n);
+            p += n;
+            parser->chunk_remaining -= n;
+            if (parser->chunk_remaining == 0)
+                parser->chunk_state = HTTP_CHUNK_DATA_CR;
+            break;
+        }
+        case HTTP_CHUNK_DATA_CR:
+            parser->chunk_state = HTTP_CHUNK_DATA_LF;
+            if (*p == '\r')
+                p++;
+            break;
+        case HTTP_CHUNK_DATA_LF:
+            if (*p++ != '\n')
+                return -1;
+            parser->chunk_state = HTTP_CHUNK_SIZE;
+            break;
+        case HTTP_CHUNK_TRAILER:
+            if (*p == '\r') {
+                parser->chunk_state = HTTP_CHUNK_TRAILER_LF;
+                p++;
+            } else if (*p == '\n') {
+                parser->chunk_state = HTTP_CHUNK_TRAILER_LF;
+            } else {
+                parser->trailer_count++;
+                parser->chunk_state = HTTP_CHUNK_TRAILER_LINE;
+            }
+            break;
+        case HTTP_CHUNK_TRAILER_LINE: {
+            const char *eol = memchr(p, '\n', end - p);
+            if (eol == NULL)
+                return len;
+            p = eol + 1;
+            parser->chunk_state = HTTP_CHUNK_TRAILER;
+            break;
+        }
+        case HTTP_CHUNK_TRAILER_LF:
+            if (*p++ != '\n')
+                return -1;
+            parser->state = HTTP_PARSE_DONE;
+            break;
+        }
+    }
+    return p - buff;
+}
+
+/**
+ * http_parse_body() - Accounts for body bytes received after the header
+ * @parser Parser whose header is complete
+ * @body_buff Body bytes, e.g., http_buff + header_len for the first chunk
+ * @body_buff_len Number of bytes in body_buff
+ *
+ * Handles all three ways a response body can be delimited: Content-Length,
+ * Transfer-Encoding: chunked (including trailers), and reading until the
+ * server closes.  Anything past the end of this response is left alone, with
+ * Keep-Alive that would be the start of the next response.
+ *
+ * Return: Number of bytes of body_buff that belong to this response, or -1 if
+ *         the chunked framing is broken (the connection is then out of sync)
+ */
+int http_parse_body(http_parser *parser, const char *body_buff, int body_buff_len){
+    long used;
+
+    if (parser->state != HTTP_PARSE_BODY)
+        return parser->state == HTTP_PARSE_ERROR ? -1 : 0;
+
+    if (parser->chunked > 0) {
+        int rc = http_parse_chunked(parser, body_buff, body_buff_len);
+        if (rc < 0)
+            parser->state = HTTP_PARSE_ERROR;
+        return rc;
+    }
+
+    if (parser->body_remaining < 0) {
+        http_body_data(parser, body_buff, body_buff_len);
+        return body_buff_len;
+    }
+
+    used = body_buff_len < parser->body_remaining ? body_buff_len : parser->body_remaining;
+    http_body_data(parser, body_buff, (int)used);
+    parser->body_remaining -= used;
+    if (parser->body_remaining == 0)
+        parser->state = HTTP_PARSE_DONE;
+    return (int)used;
+}
+
+/**
+ * http_parse_eof() - Tells the parser that the server closed the socket
+ * @parser The parser
+ *
+ * Return: 0 if the close legitimately ended the response (it was complete, or
+ *         its body runs until close), -1 if the response was cut short
+ */
+int http_parse_eof(http_parser *parser){
+    if (parser->state == HTTP_PARSE_BODY && parser->body_remaining < 0 && parser->chunked <= 0)
+        parser->state = HTTP_PARSE_DONE;
+    if (parser->state == HTTP_PARSE_DONE)
+        return 0;
+    parser->state = HTTP_PARSE_ERROR;
+    return -1;
+}
+
+int http_parse_done(const http_parser *parser){
+    return parser->state == HTTP_PARSE_DONE;
+}
+
+/**
+ * http_find_header() - Looks up a header field by name, case-insensitive
+ * @parser Parser whose header is complete
+ * @name Field name, e.g., "Content-Type"
+ *
+ * Return: The first matching field, or NULL if the response did not have one
+ */
+const http_header *http_find_header(const http_parser *parser, const char *name){
+    for (int i = 0; i < parser->header_count; i++)
+        if (http_slice_eq(parser->headers[i].name, name))
+            return &parser->headers[i];
+    return NULL;
+}
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <sys/socket.h>
 
 //#define     DEFAULT_HOST    "httpbin.org"
 #define     DEFAULT_HOST    "cci-p141.cci.drexel.edu"
@@ -19,13 +20,89 @@
 //and the spec states the end of the headers is \r\n - so there will be 2 in a row
 #define     HTTP_HEADER_END "\r\n\r\n"
 
+//Largest response header the parser will wait for, clients size their receive
+//buffers with this so a header that spans several recv() calls still fits
+#define     HTTP_MAX_HEADER_BYTES   8192
+#define     HTTP_MAX_HEADERS        64
+
+//A slice points into the caller's receive buffer, nothing is copied so the
+//buffer must stay put for as long as the slices are used
+typedef struct http_slice {
+    const char  *ptr;
+    int         len;
+} http_slice;
+
+typedef struct http_header {
+    http_slice  name;
+    http_slice  value;
+} http_header;
+
+typedef enum http_parse_state {
+    HTTP_PARSE_STATUS = 0,      //waiting for the status line
+    HTTP_PARSE_HEADERS,         //inside the header fields
+    HTTP_PARSE_BODY,            //header done, counting body bytes
+    HTTP_PARSE_DONE,            //full response seen
+    HTTP_PARSE_ERROR
+} http_parse_state;
+
+//Where we are inside a Transfer-Encoding: chunked body
+typedef enum http_chunk_state {
+    HTTP_CHUNK_SIZE = 0,        //hex chunk size
+    HTTP_CHUNK_EXT,             //";name=value" extensions up to the end of the size line
+    HTTP_CHUNK_SIZE_LF,         //'\n' after the size line's '\r'
+    HTTP_CHUNK_DATA,            //chunk_remaining bytes of data
+    HTTP_CHUNK_DATA_CR,         //"\r\n" after the data
+    HTTP_CHUNK_DATA_LF,
+    HTTP_CHUNK_TRAILER,         //start of a trailer line, an empty one ends the body
+    HTTP_CHUNK_TRAILER_LINE,    //inside a trailer field
+    HTTP_CHUNK_TRAILER_LF       //'\n' of the empty line that ends the trailers
+} http_chunk_state;
+
+//Resumable response parser, feed it the header buffer as it grows and then the
+//body bytes, see http_parse_header() and http_parse_body()
+typedef struct http_parser {
+    http_parse_state state;
+    int         line_start;     //offset of the first unparsed header line
+    int         scanned;        //bytes already searched for an end of line
+    int         header_len;
+    int         status;
+    int         minor_version;  //1 for HTTP/1.1, 0 for HTTP/1.0
+    int         keep_alive;     //server will keep the socket open after this response
+    int         interim_count;  //1xx responses skipped before this one
+    long        content_len;    //-1 when there is no Content-Length header
+    long        body_remaining; //-1 when the body runs until the server closes or is chunked
+    long        body_len;       //decoded body bytes seen so far
+    int         chunked;        //Transfer-Encoding: chunked
+    http_chunk_state chunk_state;
+    long        chunk_remaining;
+    int         chunk_digits;   //hex digits read for the current chunk size
+    int         trailer_count;  //trailer fields after the last chunk, skipped not kept
+
+    //Optional, called with each run of decoded body bytes.  data points into
+    //the buffer passed to http_parse_body() so copy it if it has to outlive that
+    void        (*on_body)(void *arg, const char *data, int len);
+    void        *on_body_arg;
+    http_slice  reason;
+    int         header_count;
+    http_header headers[HTTP_MAX_HEADERS];
+} http_parser;
+
 //Exported funcitons
 int socket_connect(const char *host, uint16_t port);
+int socket_connect_nb(const char *host, uint16_t port, struct sockaddr_storage *peer);
 int get_http_header_len(char *http_buff, int http_buff_len);
 int get_http_content_len(char *http_buff, int http_buff_len);
 int process_http_header(char *http_buff, int http_buff_len, int *header_len, int *content_len);
 void print_header(char *http_buff, int http_header_len);
 
+//Incremental response parser
+void http_parser_init(http_parser *parser);
+int http_parse_header(http_parser *parser, const char *http_buff, int http_buff_len);
+int http_parse_body(http_parser *parser, const char *body_buff, int body_buff_len);
+int http_parse_eof(http_parser *parser);
+int http_parse_done(const http_parser *parser);
+const http_header *http_find_header(const http_parser *parser, const char *name);
+
 //Utilities
 char *strnstr(const char *s, const char *find, size_t slen);
 char *strcasestr(const char *s, const char *find);
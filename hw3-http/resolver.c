@@ -0,0 +1,542 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+
+#include "resolver.h"
+
+typedef enum cache_state {
+    CACHE_EMPTY = 0,
+    CACHE_PENDING,      //a worker is running getaddrinfo() for it
+    CACHE_READY,
+    CACHE_FAILED
+} cache_state;
+
+typedef struct cache_entry {
+    char        host[256];
+    cache_state state;
+    double      expires;
+    double      used;               //last lookup, the least recently used entry is replaced
+    resolved_addrs addrs;           //port left as 0, filled in per lookup
+    struct cache_entry *next;       //work queue
+} cache_entry;
+
+static cache_entry      cache[RESOLVER_CACHE_SIZE];
+static cache_entry      *work_head, *work_tail;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   done_cv = PTHREAD_COND_INITIALIZER;
+static pthread_once_t   start_once = PTHREAD_ONCE_INIT;
+static int              event_pipe[2] = {-1, -1};
+
+static double now_sec(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//Is host listed in /etc/hosts?  getaddrinfo() answers those from the file, so
+//there are no DNS records or TTLs to go and ask for
+static int in_hosts_file(const char *host){
+    char line[512];
+    FILE *f = fopen("/etc/hosts", "r");
+    int found = 0;
+
+    if (f == NULL)
+        return 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        char *save = NULL;
+        char *tok = strtok_r(line, " \t\r\n", &save);
+
+        //First token is the address, the names follow up to any comment
+        if (tok == NULL || tok[0] == '#')
+            continue;
+        while (!found && (tok = strtok_r(NULL, " \t\r\n", &save)) != NULL && tok[0] != '#')
+            found = strcasecmp(tok, host) == 0;
+    }
+    fclose(f);
+    return found;
+}
+
+/**
+ * dns_ttl() - Reads how long the DNS answer for a host may be cached
+ * @host The hostname
+ * @family Family of the first address getaddrinfo() returned
+ *
+ * getaddrinfo() does not pass record TTLs on, so ask for the A (or AAAA)
+ * records directly and take the smallest TTL in the answer.  That is one more
+ * round trip to the nameserver for every name not in the cache, there is no
+ * local DNS cache in front of it in a stock glibc setup, but it runs on the
+ * resolver thread so callers dont wait for it.  res_nsearch() applies the
+ * search list the same way getaddrinfo() did, so short names ask for the same
+ * record.  Names from /etc/hosts are not asked about at all, and they (and
+ * anything else without records of its own) get RESOLVER_DEFAULT_TTL.
+ *
+ * Return: Seconds to cache the answer, between 1 and RESOLVER_MAX_TTL
+ */
+static int dns_ttl(const char *host, int family){
+    struct __res_state res;
+    unsigned char answer[NS_PACKETSZ * 4];
+    ns_msg msg;
+    int ttl = -1;
+    int len;
+
+    if (in_hosts_file(host))
+        return RESOLVER_DEFAULT_TTL;
+
+    memset(&res, 0, sizeof(res));
+    if (res_ninit(&res) != 0)
+        return RESOLVER_DEFAULT_TTL;
+
+    len = res_nsearch(&res, host, ns_c_in, family == AF_INET6 ? ns_t_aaaa : ns_t_a,
+                      answer, sizeof(answer));
+    if (len > 0 && ns_initparse(answer, len, &msg) == 0) {
+        for (int i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+            ns_rr rr;
+            if (ns_parserr(&msg, ns_s_an, i, &rr) == 0 && (ttl < 0 || (int)ns_rr_ttl(rr) < ttl))
+                ttl = ns_rr_ttl(rr);
+        }
+    }
+    res_nclose(&res);
+
+    if (ttl < 0)
+        return RESOLVER_DEFAULT_TTL;
+    if (ttl < 1)
+        return 1;
+    return ttl < RESOLVER_MAX_TTL ? ttl : RESOLVER_MAX_TTL;
+}
+
+/**
+ * interleave_families() - Orders addresses for Happy Eyeballs
+ * @addrs Addresses in getaddrinfo() order
+ *
+ * getaddrinfo() already sorts by RFC 6724 preference, which usually puts all of
+ * one family first.  RFC 8305 section 4 wants the families to alternate after
+ * the first address, so that if one family is broken the second attempt is
+ * already on the other one rather than on another dead address.
+ */
+static void interleave_families(resolved_addrs *addrs){
+    resolved_addrs sorted;
+    int used[RESOLVER_MAX_ADDRS] = {0};
+    int family = addrs->addr[0].ss_family;
+
+    sorted.count = 0;
+    sorted.error = 0;
+    while (sorted.count < addrs->count) {
+        int pick = -1;
+
+        //Next unused address of the wanted family, or of any family if that one ran out
+        for (int i = 0; i < addrs->count && pick < 0; i++)
+            if (!used[i] && addrs->addr[i].ss_family == family)
+                pick = i;
+        for (int i = 0; i < addrs->count && pick < 0; i++)
+            if (!used[i])
+                pick = i;
+
+        used[pick] = 1;
+        sorted.addr[sorted.count] = addrs->addr[pick];
+        sorted.addr_len[sorted.count++] = addrs->addr_len[pick];
+        family = addrs->addr[pick].ss_family == AF_INET6 ? AF_INET : AF_INET6;
+    }
+    *addrs = sorted;
+}
+
+static void resolve_into(const char *host, resolved_addrs *out){
+    struct addrinfo hints, *res, *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    out->count = 0;
+    out->error = getaddrinfo(host, NULL, &hints, &res);
+    if (out->error != 0)
+        return;
+
+    for (ai = res; ai != NULL && out->count < RESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+            continue;
+        memcpy(&out->addr[out->count], ai->ai_addr, ai->ai_addrlen);
+        out->addr_len[out->count++] = ai->ai_addrlen;
+    }
+    freeaddrinfo(res);
+
+    if (out->count == 0)
+        out->error = EAI_NONAME;
+    else
+        interleave_families(out);
+}
+
+static void *resolver_worker(void *arg){
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        char host[256];
+        resolved_addrs addrs;
+        cache_entry *e;
+        int ttl;
+
+        while (work_head == NULL)
+            pthread_cond_wait(&work_cv, &lock);
+        e = work_head;
+        work_head = e->next;
+        if (work_head == NULL)
+            work_tail = NULL;
+        strcpy(host, e->host);
+        pthread_mutex_unlock(&lock);
+
+        //The slow part, with the lock dropped so other lookups and cache hits go on
+        resolve_into(host, &addrs);
+        ttl = addrs.count > 0 ? dns_ttl(host, addrs.addr[0].ss_family) : RESOLVER_NEGATIVE_TTL;
+
+        pthread_mutex_lock(&lock);
+        e->addrs = addrs;
+        e->state = addrs.count > 0 ? CACHE_READY : CACHE_FAILED;
+        e->expires = now_sec() + ttl;
+        pthread_cond_broadcast(&done_cv);
+        if (event_pipe[1] >= 0 && write(event_pipe[1], "r", 1) < 0 && errno != EAGAIN)
+            perror("resolver event");
+    }
+    return NULL;
+}
+
+static void resolver_start(void){
+    pthread_t tid;
+
+    if (pipe(event_pipe) == 0) {
+        fcntl(event_pipe[0], F_SETFL, fcntl(event_pipe[0], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(event_pipe[1], F_SETFL, fcntl(event_pipe[1], F_GETFL, 0) | O_NONBLOCK);
+    } else {
+        event_pipe[0] = event_pipe[1] = -1;
+    }
+
+    for (int i = 0; i < RESOLVER_THREADS; i++) {
+        if (pthread_create(&tid, NULL, resolver_worker, NULL) == 0)
+            pthread_detach(tid);
+    }
+}
+
+//Numeric addresses need no lookup and never expire, skip the cache for them
+static int resolve_numeric(const char *host, resolved_addrs *out){
+    struct sockaddr_in *sin = (struct sockaddr_in *)&out->addr[0];
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&out->addr[0];
+
+    memset(&out->addr[0], 0, sizeof(out->addr[0]));
+    if (inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        out->addr_len[0] = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        out->addr_len[0] = sizeof(*sin6);
+    } else {
+        return 0;
+    }
+    out->count = 1;
+    out->error = 0;
+    return 1;
+}
+
+static void set_port(resolved_addrs *out, uint16_t port){
+    for (int i = 0; i < out->count; i++) {
+        if (out->addr[i].ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)&out->addr[i])->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in *)&out->addr[i])->sin_port = htons(port);
+    }
+}
+
+/**
+ * cache_get() - Finds or starts the cache entry for a host, lock held
+ * @host The hostname
+ *
+ * A fresh entry (or one already being looked up) is returned as is.  A missing
+ * or expired one is queued for the workers and comes back CACHE_PENDING, so
+ * concurrent callers asking for the same host share one getaddrinfo() call.
+ */
+static cache_entry *cache_get(const char *host){
+    cache_entry *e = NULL, *victim = NULL;
+    double now = now_sec();
+
+    for (int i = 0; i < RESOLVER_CACHE_SIZE && e == NULL; i++) {
+        if (cache[i].state != CACHE_EMPTY && strcasecmp(cache[i].host, host) == 0)
+            e = &cache[i];
+        else if (cache[i].state != CACHE_PENDING &&
+                 (victim == NULL || cache[i].used < victim->used))
+            victim = &cache[i];
+    }
+
+    if (e == NULL) {
+        if (victim == NULL)
+            return NULL;        //every slot is mid lookup
+        e = victim;
+        snprintf(e->host, sizeof(e->host), "%s", host);
+        e->state = CACHE_EMPTY;
+    }
+    e->used = now;
+
+    if (e->state == CACHE_EMPTY || (e->state != CACHE_PENDING && e->expires <= now)) {
+        e->state = CACHE_PENDING;
+        e->next = NULL;
+        if (work_tail)
+            work_tail->next = e;
+        else
+            work_head = e;
+        work_tail = e;
+        pthread_cond_signal(&work_cv);
+    }
+    return e;
+}
+
+static int cache_result(cache_entry *e, uint16_t port, resolved_addrs *out){
+    if (e->state == CACHE_READY) {
+        *out = e->addrs;
+        set_port(out, port);
+        return out->count;
+    }
+    out->count = 0;
+    out->error = e->addrs.error;
+    return -1;
+}
+
+/**
+ * resolver_lookup() - Resolves a hostname, waiting for the answer
+ * @host The hostname or a numeric IPv4/IPv6 address
+ * @port Port to put in the returned addresses
+ * @out All addresses for the host, in the order they should be tried
+ * @timeout_ms Longest to wait for a lookup that is not cached
+ *
+ * Cached answers come straight back.  Otherwise the lookup runs on a resolver
+ * thread and this waits for it, or joins a lookup for the same host that is
+ * already running.  Unlike gethostbyname() this is thread safe and returns
+ * every address, IPv6 ones included.
+ *
+ * Return: Number of addresses, or -1 with out->error set (see
+ *         resolver_strerror())
+ */
+int resolver_lookup(const char *host, uint16_t port, resolved_addrs *out, int timeout_ms){
+    struct timespec deadline;
+    cache_entry *e;
+    int rc = 0;
+
+    if (resolve_numeric(host, out)) {
+        set_port(out, port);
+        return out->count;
+    }
+    pthread_once(&start_once, resolver_start);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&lock);
+    while ((e = cache_get(host)) == NULL || e->state == CACHE_PENDING) {
+        if ((rc = pthread_cond_timedwait(&done_cv, &lock, &deadline)) == ETIMEDOUT)
+            break;
+    }
+    if (rc == ETIMEDOUT) {
+        out->count = 0;
+        out->error = EAI_AGAIN;
+        pthread_mutex_unlock(&lock);
+        return -1;
+    }
+    rc = cache_result(e, port, out);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+/**
+ * resolver_lookup_nb() - Resolves a hostname without waiting
+ * @host The hostname or a numeric address
+ * @port Port to put in the returned addresses
+ * @out All addresses for the host when the answer is available
+ *
+ * For event loops: if the answer is not cached yet the lookup is started (or
+ * left running) and RESOLVER_PENDING comes back.  resolver_event_fd() becomes
+ * readable when a lookup finishes, call this again then.
+ *
+ * Return: Number of addresses, RESOLVER_PENDING, or -1 with out->error set
+ */
+int resolver_lookup_nb(const char *host, uint16_t port, resolved_addrs *out){
+    cache_entry *e;
+    int rc;
+
+    if (resolve_numeric(host, out)) {
+        set_port(out, port);
+        return out->count;
+    }
+    pthread_once(&start_once, resolver_start);
+
+    pthread_mutex_lock(&lock);
+    e = cache_get(host);
+    rc = (e == NULL || e->state == CACHE_PENDING) ? RESOLVER_PENDING : cache_result(e, port, out);
+    pthread_mutex_unlock(&lock);
+    return rc;
+}
+
+//Readable when a lookup started by resolver_lookup_nb() finishes
+int resolver_event_fd(void){
+    pthread_once(&start_once, resolver_start);
+    return event_pipe[0];
+}
+
+void resolver_event_ack(void){
+    char drain[64];
+
+    while (read(event_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+}
+
+/**
+ * resolver_connect_failed() - Moves an address that failed to the back
+ * @host The hostname it came from
+ * @addr The address that could not be connected to
+ *
+ * Callers that try one address at a time (socket_connect_nb()) then get the
+ * next address on their retry instead of the dead one again.
+ *
+ * Return: How many addresses the host has, so the caller knows when it has
+ *         been through all of them
+ */
+int resolver_connect_failed(const char *host, const struct sockaddr *addr){
+    int count = 1;
+
+    pthread_mutex_lock(&lock);
+    for (int i = 0; i < RESOLVER_CACHE_SIZE; i++) {
+        resolved_addrs *a = &cache[i].addrs;
+
+        if (cache[i].state != CACHE_READY || strcasecmp(cache[i].host, host) != 0)
+            continue;
+        count = a->count;
+        for (int k = 0; k < a->count - 1; k++) {
+            struct sockaddr_storage tmp = a->addr[k];
+            socklen_t tmp_len = a->addr_len[k];
+
+            //The cached copy has port 0, compare just the IP
+            if (tmp.ss_family != addr->sa_family ||
+                (tmp.ss_family == AF_INET &&
+                 memcmp(&((struct sockaddr_in *)&tmp)->sin_addr,
+                        &((const struct sockaddr_in *)addr)->sin_addr, sizeof(struct in_addr)) != 0) ||
+                (tmp.ss_family == AF_INET6 &&
+                 memcmp(&((struct sockaddr_in6 *)&tmp)->sin6_addr,
+                        &((const struct sockaddr_in6 *)addr)->sin6_addr, sizeof(struct in6_addr)) != 0))
+                continue;
+            memmove(&a->addr[k], &a->addr[k+1], (a->count - k - 1) * sizeof(a->addr[0]));
+            memmove(&a->addr_len[k], &a->addr_len[k+1], (a->count - k - 1) * sizeof(a->addr_len[0]));
+            a->addr[a->count-1] = tmp;
+            a->addr_len[a->count-1] = tmp_len;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return count;
+}
+
+const char *resolver_strerror(int error){
+    return error == 0 ? "no addresses" : gai_strerror(error);
+}
+
+/**
+ * happy_eyeballs_connect() - Races connections to a host's addresses
+ * @addrs Addresses in the order to try them, as returned by the resolver
+ * @timeout_ms Longest to wait for any of them to connect
+ *
+ * Implements the connection racing of RFC 8305.  Starts a non-blocking connect
+ * to the first address, and if it has not finished within
+ * HE_ATTEMPT_DELAY_MS starts the next one while the first keeps going, and so
+ * on.  An attempt that fails outright moves on to the next address straight
+ * away.  The first handshake to complete wins and the others are closed.
+ * Combined with the alternating order from the resolver, a broken IPv6 route
+ * or a dead server address costs 250ms instead of a full connect timeout.
+ *
+ * Return: Connected socket (blocking mode), or -1 with errno set from the last
+ *         failure (ETIMEDOUT if nothing answered in time)
+ */
+int happy_eyeballs_connect(const resolved_addrs *addrs, int timeout_ms){
+    struct pollfd fds[RESOLVER_MAX_ADDRS];
+    int active = 0, next = 0, winner = -1, last_err = ECONNREFUSED;
+    double deadline = now_sec() + timeout_ms / 1000.0;
+    double next_attempt = 0;
+
+    while (winner < 0) {
+        double now = now_sec();
+
+        if (next < addrs->count && (active == 0 || now >= next_attempt)) {
+            const struct sockaddr_storage *sa = &addrs->addr[next];
+            int sock = socket(sa->ss_family, SOCK_STREAM, 0);
+
+            next_attempt = now + HE_ATTEMPT_DELAY_MS / 1000.0;
+            if (sock < 0) {
+                last_err = errno;
+            } else if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0 ||
+                       (connect(sock, (const struct sockaddr *)sa, addrs->addr_len[next]) < 0 &&
+                        errno != EINPROGRESS)) {
+                last_err = errno;
+                close(sock);
+            } else {
+                fds[active].fd = sock;
+                fds[active++].events = POLLOUT;
+            }
+            next++;
+            continue;
+        }
+
+        if (active == 0 || now >= deadline)
+            break;
+
+        double wait = deadline - now;
+        if (next < addrs->count && next_attempt - now < wait)
+            wait = next_attempt - now;
+        if (poll(fds, active, (int)(wait * 1000) + 1) < 0 && errno != EINTR) {
+            last_err = errno;
+            break;
+        }
+
+        for (int i = 0; i < active; i++) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+
+            if (fds[i].revents == 0)
+                continue;
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+                winner = fds[i].fd;
+                fds[i] = fds[--active];
+                break;
+            }
+            //This one failed, dont wait out the delay before trying the next
+            last_err = err ? err : errno;
+            close(fds[i].fd);
+            fds[i--] = fds[--active];
+            next_attempt = 0;
+        }
+    }
+
+    for (int i = 0; i < active; i++)
+        close(fds[i].fd);
+
+    if (winner < 0) {
+        errno = now_sec() >= deadline ? ETIMEDOUT : last_err;
+        return -1;
+    }
+    fcntl(winner, F_SETFL, fcntl(winner, F_GETFL, 0) & ~O_NONBLOCK);
+    return winner;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+//Name resolution for the clients: getaddrinfo() runs on a few worker threads
+//so callers can keep going while a lookup is in flight, answers are cached for
+//as long as DNS says they are good, and happy_eyeballs_connect() races the
+//returned addresses (IPv6 and IPv4) so a dead address doesnt stall a connect.
+
+#define     RESOLVER_MAX_ADDRS      16
+#define     RESOLVER_THREADS        4
+#define     RESOLVER_CACHE_SIZE     64
+#define     RESOLVER_DEFAULT_TTL    60      //seconds, when the record TTL cant be read
+#define     RESOLVER_MAX_TTL        300
+#define     RESOLVER_NEGATIVE_TTL   5       //how long a failed lookup is remembered
+#define     RESOLVER_TIMEOUT_MS     5000
+
+#define     HE_ATTEMPT_DELAY_MS     250     //RFC 8305 Connection Attempt Delay
+#define     HE_CONNECT_TIMEOUT_MS   10000
+
+//resolver_lookup_nb() and socket_connect_nb() return this while the lookup runs
+#define     RESOLVER_PENDING        -3
+
+typedef struct resolved_addrs {
+    int         count;
+    int         error;                  //getaddrinfo() error when count is 0
+    struct sockaddr_storage addr[RESOLVER_MAX_ADDRS];
+    socklen_t   addr_len[RESOLVER_MAX_ADDRS];
+} resolved_addrs;
+
+int resolver_lookup(const char *host, uint16_t port, resolved_addrs *out, int timeout_ms);
+int resolver_lookup_nb(const char *host, uint16_t port, resolved_addrs *out);
+int resolver_event_fd(void);
+void resolver_event_ack(void);
+int resolver_connect_failed(const char *host, const struct sockaddr *addr);
+const char *resolver_strerror(int error);
+int happy_eyeballs_connect(const resolved_addrs *addrs, int timeout_ms);
@@ -0,0 +1,145 @@
+#include "http.h"
+
+#include <stdio.h>
+#include <string.h>
+
+//Feeds canned responses to the incremental parser in http.c, split at every
+//possible point the way recv() might hand them over, and checks each split
+//gives the same answer.  Run with "make test".
+
+typedef struct expect {
+    const char  *name;
+    const char  *resp;
+    int         rc;             //-1 if the parser should reject it
+    int         status;
+    int         keep_alive;
+    int         interim_count;
+    const char  *body;          //decoded body
+    int         trailing;       //bytes left over for the next response
+} expect;
+
+static const expect cases[] = {
+    { "content-length",
+      "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello",
+      0, 200, 1, 0, "hello", 0 },
+    { "keep-alive leaves the next response alone",
+      "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nhiHTTP/1.1 204 No Content\r\n\r\n",
+      0, 200, 1, 0, "hi", 27 },
+    { "http/1.0 closes",
+      "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nhi",
+      0, 200, 0, 0, "hi", 0 },
+    { "chunked with extension and trailer",
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "4;x=y\r\nWiki\r\n5\r\npedia\r\n0\r\nExpires: never\r\n\r\n",
+      0, 200, 1, 0, "Wikipedia", 0 },
+    { "103 early hints before the response",
+      "HTTP/1.1 103 Early Hints\r\nLink: </style.css>; rel=preload\r\n\r\n"
+      "HTTP/1.1 200 OK\r\nContent-Length: 3\r\n\r\nabc",
+      0, 200, 1, 1, "abc", 0 },
+    { "two 100 continues before a chunked response",
+      "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 100 Continue\r\n\r\n"
+      "HTTP/1.1 404 Not Found\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n"
+      "3\r\nnop\r\n0\r\n\r\n",
+      0, 404, 0, 2, "nop", 0 },
+    { "101 ends http on the socket",
+      "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\n\r\nws",
+      0, 101, 0, 0, "", 2 },
+    { "conflicting content-length",
+      "HTTP/1.1 200 OK\r\nContent-Length: 2\r\nContent-Length: 3\r\n\r\nabc",
+      -1, 0, 0, 0, NULL, 0 },
+    { "bad status line",
+      "HTTP/2 200 OK\r\n\r\n",
+      -1, 0, 0, 0, NULL, 0 },
+    { "bad chunk size",
+      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+      -1, 0, 0, 0, NULL, 0 },
+};
+
+typedef struct body_buff {
+    char    data[256];
+    int     len;
+} body_buff;
+
+static void collect_body(void *arg, const char *data, int len){
+    body_buff *b = arg;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+//Feeds resp in two pieces, the first split bytes then the rest
+static int run_split(const expect *t, int split, char *why, int why_len){
+    char buff[HTTP_MAX_HEADER_BYTES];
+    int len = strlen(t->resp);
+    int have = 0, header_len = 0, used = 0;
+    http_parser parser;
+    body_buff body = { .len = 0 };
+
+    memcpy(buff, t->resp, len);
+    http_parser_init(&parser);
+    parser.on_body = collect_body;
+    parser.on_body_arg = &body;
+
+    for (int piece = 0; piece < 2; piece++) {
+        int got = piece == 0 ? split : len - split;
+
+        if (header_len == 0) {
+            have += got;
+            header_len = http_parse_header(&parser, buff, have);
+            if (header_len > 0)
+                used = http_parse_body(&parser, buff + header_len, have - header_len);
+        } else {
+            int rc = http_parse_body(&parser, buff + have, got);
+            used = rc < 0 ? rc : used + rc;
+            have += got;
+        }
+        if (header_len < 0 || used < 0)
+            break;
+    }
+
+    if (t->rc < 0) {
+        if (header_len < 0 || used < 0 || !http_parse_done(&parser))
+            return 0;
+        snprintf(why, why_len, "accepted, status %d", parser.status);
+        return -1;
+    }
+    if (header_len <= 0 || used < 0 || !http_parse_done(&parser)) {
+        snprintf(why, why_len, "not done, header_len %d used %d", header_len, used);
+        return -1;
+    }
+    if (parser.status != t->status || parser.keep_alive != t->keep_alive ||
+        parser.interim_count != t->interim_count) {
+        snprintf(why, why_len, "status %d keep_alive %d interim %d", parser.status,
+                 parser.keep_alive, parser.interim_count);
+        return -1;
+    }
+    if (body.len != (int)strlen(t->body) || memcmp(body.data, t->body, body.len) != 0 ||
+        len - header_len - used != t->trailing) {
+        snprintf(why, why_len, "body \"%.*s\", %d bytes left over", body.len, body.data,
+                 len - header_len - used);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void){
+    int failed = 0;
+    char why[128];
+
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+        const expect *t = &cases[i];
+        int len = strlen(t->resp);
+        int bad_split = -1;
+
+        for (int split = 0; split <= len && bad_split < 0; split++)
+            if (run_split(t, split, why, sizeof(why)) < 0)
+                bad_split = split;
+
+        if (bad_split < 0) {
+            fprintf(stdout, "ok   %s\n", t->name);
+        } else {
+            fprintf(stdout, "FAIL %s (split at %d: %s)\n", t->name, bad_split, why);
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# du-bench.sh - loopback throughput of du-ftp against the send window size
+#
+# Starts a du-ftp server, pushes a random file through it once for every
+# window size, checks the copy arrived intact and prints a small table.
+#
+#   usage: ./du-bench.sh [size_kb] [window ...]
+#
+# Defaults to a 4MB file and windows of 1 (stop-and-wait) through 64.
+# BENCH_BATCH lists the du-ftp -b batch modes to try (default just 2, GSO),
+# e.g. BENCH_BATCH="0 1 2" compares one syscall per dgram with batching.
+# BENCH_IMPAIR is passed to both ends as du-ftp -I, e.g.
+# BENCH_IMPAIR="loss=1,delay=5ms,rate=100mbit,seed=7"; with a fixed seed
+# the same datagrams are lost on every run.
+# BENCH_STREAMS is the number of connections du-ftp -P stripes the file
+# across (default 1, so the window alone is measured).
+# BENCH_CHECK lists the du-ftp -k integrity levels to try (default just 2,
+# CRC32C on every datagram and file), BENCH_CHECK="0 1 2" shows their cost.
+# BENCH_FEC lists the du-ftp -F parity group sizes to try on both ends
+# (default just 0, no FEC), e.g. BENCH_FEC="0 4 8 16" with a lossy
+# BENCH_IMPAIR; the repaired column counts NACKd datagrams the parity
+# rebuilt before a resend was needed.
+# BENCH_DGRAM lists the du-ftp -D datagram sizes the client offers (default
+# just 16384, the most du-proto takes), BENCH_DGRAM="512 1472 16384"
+# compares the old fixed size with an Ethernet and a loopback sized one.
+# BENCH_PACE lists the du-ftp -R pacing settings to try on both ends
+# (default just 1, on); the drops column is what the server's kernel
+# dropped for want of receive buffer (SO_RXQ_OVFL).
+
+SIZE_KB=${1:-4096}
+shift
+WINDOWS=${@:-"1 2 4 8 16 32 64"}
+PORT=${BENCH_PORT:-2090}
+BATCHES=${BENCH_BATCH:-2}
+IMPAIR=${BENCH_IMPAIR:+-I $BENCH_IMPAIR}
+STREAMS=${BENCH_STREAMS:-1}
+CHECKS=${BENCH_CHECK:-2}
+FECS=${BENCH_FEC:-0}
+DGRAMS=${BENCH_DGRAM:-16384}
+PACES=${BENCH_PACE:-1}
+FNAME=bench.bin
+SVR_OUT=$(mktemp)
+
+cd "$(dirname "$0")"
+if [ ! -x ./du-ftp ]; then
+    echo "build du-ftp first (make)" >&2
+    exit 1
+fi
+
+head -c $((SIZE_KB * 1024)) /dev/urandom > ./outfile/$FNAME
+
+[ -n "$IMPAIR" ] && echo "impairment: $BENCH_IMPAIR"
+printf "%-6s %-6s %-6s %-6s %-6s %-8s %-10s %-10s %-10s %-10s %-10s %-10s\n" "pace" "dgram" "check" "fec" "batch" "window" "seconds" "KB/s" "syscalls" "retx" "repaired" "drops"
+for r in $PACES; do
+for d in $DGRAMS; do
+for k in $CHECKS; do
+for f in $FECS; do
+for b in $BATCHES; do
+for w in $WINDOWS; do
+    rm -f ./infile/$FNAME
+    ./du-ftp -s -p $PORT -f $FNAME -b $b -k $k -F $f -R $r $IMPAIR > $SVR_OUT 2>&1 &
+    svr=$!
+    sleep 0.2
+
+    out=$(./du-ftp -c -p $PORT -f $FNAME -w $w -b $b -k $k -F $f -D $d -R $r -P $STREAMS $IMPAIR 2>/dev/null)
+    wait $svr
+
+    if ! cmp -s ./outfile/$FNAME ./infile/$FNAME; then
+        printf "%-6s %-6s %-6s %-6s %-6s %-8s %s\n" "$r" "$d" "$k" "$f" "$b" "$w" "FAILED - file mismatch"
+        continue
+    fi
+    # Sent <bytes> bytes in <secs> seconds (<rate> KB/s)
+    line=$(echo "$out" | grep "^Sent .* bytes in")
+    secs=$(echo "$line" | awk '{print $5}')
+    rate=$(echo "$line" | awk '{print $7}' | tr -d '(')
+    # Used <n> send and <n> receive syscalls ... (client side)
+    calls=$(echo "$out" | grep "^Used" | awk '{print $2 + $5}')
+    # Retransmitted <n> datagrams ...
+    retx=$(echo "$out" | grep "^Retransmitted" | awk '{print $2}')
+    # Sent <n> FEC parity datagrams, <n> NACKd datagrams arrived ...
+    fixed=$(echo "$out" | grep "FEC parity" | awk '{print $6}')
+    # Session <id>: <n> datagrams dropped by a full receive buffer ... (server)
+    drops=$(grep "dropped by a full receive buffer" $SVR_OUT | awk '{print $3}')
+    printf "%-6s %-6s %-6s %-6s %-6s %-8s %-10s %-10s %-10s %-10s %-10s %-10s\n" "$r" "$d" "$k" "$f" "$b" "$w" "$secs" "$rate" "$calls" "$retx" "${fixed:-0}" "${drops:-0}"
+done
+done
+done
+done
+done
+done
+
+rm -f ./outfile/$FNAME ./infile/$FNAME $SVR_OUT
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "du-cc.h"
+
+//What is actually outstanding, after a loss the window can be ahead of it
+//and dgrams the peer already has (NACK) dont count
+static int dpccflight(dp_connp dp){
+    int flight = dp->txCount - dp->txSacked;
+    return (flight < dp->cwnd) ? flight : dp->cwnd;
+}
+
+static void dpccclamp(dp_connp dp){
+    if (dp->cwnd < 1)
+        dp->cwnd = 1;
+    if (dp->cwnd > DP_MAX_WINDOW)
+        dp->cwnd = DP_MAX_WINDOW;
+}
+
+
+/*
+ * NONE - no congestion control, the send window alone limits the sender
+ */
+static void none_init(dp_connp dp){
+    dp->cwnd = DP_MAX_WINDOW;
+    dp->ssthresh = DP_MAX_WINDOW;
+}
+
+static void none_onack(dp_connp dp, int acked, long long rtt){
+}
+
+static void none_onloss(dp_connp dp, _Bool timeout){
+}
+
+
+/*
+ * NEWRENO - RFC 5681/6582.  Slow start doubles cwnd every RTT up to
+ * ssthresh, congestion avoidance adds one dgram per RTT.  A fast retransmit
+ * halves cwnd, an RTO drops it to one dgram.  The window is not grown while
+ * the holes from a loss are being repaired.
+ */
+static void reno_init(dp_connp dp){
+    dp->cwnd = DP_CC_INIT_CWND;
+    dp->ssthresh = DP_MAX_WINDOW;
+    dp->cwndCnt = 0;
+}
+
+static void reno_onack(dp_connp dp, int acked, long long rtt){
+    if (dp->inRecovery)
+        return;
+    while (acked-- > 0) {
+        if (dp->cwnd < dp->ssthresh) {
+            dp->cwnd++;
+        } else if (++dp->cwndCnt >= dp->cwnd) {
+            dp->cwnd++;
+            dp->cwndCnt = 0;
+        }
+    }
+    dpccclamp(dp);
+}
+
+static void reno_onloss(dp_connp dp, _Bool timeout){
+    int half = dpccflight(dp) / 2;
+
+    dp->ssthresh = (half > DP_CC_MIN_CWND) ? half : DP_CC_MIN_CWND;
+    dp->cwnd = timeout ? 1 : dp->ssthresh;
+    dp->cwndCnt = 0;
+}
+
+
+/*
+ * VEGAS - delay based.  Once per RTT compare the lowest RTT of the round
+ * with the lowest RTT ever seen; the difference tells how many of our dgrams
+ * are sitting in queues along the path:
+ *
+ *      queued = cwnd * (rtt - baseRtt) / rtt
+ *
+ * Keep that between ALPHA and BETA by adding or taking away a dgram, and
+ * leave slow start as soon as a queue starts to build.  Losses are handled
+ * like NewReno but back off less, the queue estimate is what normally stops
+ * the window before the buffer overflows.
+ */
+static void vegas_init(dp_connp dp){
+    reno_init(dp);
+    dp->ccBaseRtt = 0;
+    dp->ccRoundRtt = 0;
+    dp->ccRoundLeft = dp->cwnd;
+}
+
+static void vegas_onack(dp_connp dp, int acked, long long rtt){
+    if (rtt > 0) {
+        if (dp->ccBaseRtt == 0 || rtt < dp->ccBaseRtt)
+            dp->ccBaseRtt = rtt;
+        if (dp->ccRoundRtt == 0 || rtt < dp->ccRoundRtt)
+            dp->ccRoundRtt = rtt;
+    }
+    if (dp->inRecovery)
+        return;
+    if ((dp->ccRoundLeft -= acked) > 0)
+        return;
+
+    //A windows worth was ACKd, so one RTT went by
+    if (dp->ccRoundRtt > 0) {
+        long long queued = dp->cwnd * (dp->ccRoundRtt - dp->ccBaseRtt) / dp->ccRoundRtt;
+
+        if (dp->cwnd < dp->ssthresh && queued < 1) {
+            dp->cwnd *= 2;
+        } else {
+            if (dp->cwnd < dp->ssthresh)
+                dp->ssthresh = dp->cwnd;
+            if (queued < DP_VEGAS_ALPHA)
+                dp->cwnd++;
+            else if (queued > DP_VEGAS_BETA)
+                dp->cwnd--;
+        }
+    } else {
+        dp->cwnd++;
+    }
+    if (dp->cwnd < DP_CC_MIN_CWND)
+        dp->cwnd = DP_CC_MIN_CWND;
+    dpccclamp(dp);
+    dp->ccRoundLeft = dp->cwnd;
+    dp->ccRoundRtt = 0;
+}
+
+static void vegas_onloss(dp_connp dp, _Bool timeout){
+    if (timeout) {
+        reno_onloss(dp, timeout);
+    } else {
+        dp->cwnd = dp->cwnd * 3 / 4;
+        if (dp->cwnd < DP_CC_MIN_CWND)
+            dp->cwnd = DP_CC_MIN_CWND;
+        dp->ssthresh = dp->cwnd;
+    }
+    dp->ccRoundLeft = dp->cwnd;
+    dp->ccRoundRtt = 0;
+}
+
+
+//Indexed by the DP_CC_* ids in du-proto.h
+static const dp_cc_ops _ccAlgs[] = {
+    { "none",    none_init,  none_onack,  none_onloss  },
+    { "newreno", reno_init,  reno_onack,  reno_onloss  },
+    { "vegas",   vegas_init, vegas_onack, vegas_onloss },
+};
+
+#define DP_CC_COUNT  (int)(sizeof(_ccAlgs) / sizeof(_ccAlgs[0]))
+
+const dp_cc_ops *dpccops(int id){
+    if (id < 0 || id >= DP_CC_COUNT)
+        return NULL;
+    return &_ccAlgs[id];
+}
+
+int dpccbyname(const char *name){
+    for (int i = 0; i < DP_CC_COUNT; i++)
+        if (strcmp(_ccAlgs[i].name, name) == 0)
+            return i;
+    return -1;
+}
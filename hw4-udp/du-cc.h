@@ -0,0 +1,28 @@
+#pragma once
+
+#include "du-proto.h"
+
+/*
+ * Congestion control for du-proto.  Each connection points at one of these
+ * and keeps its state (cwnd, ssthresh, ...) in the dp_connection itself.
+ * The sender never has more than min(wndSz, cwnd) dgrams outstanding.
+ *
+ *  init    - reset the state, called when the algorithm is picked
+ *  onack   - acked dgrams just left the window, rtt is a clean sample in
+ *            usec or -1 (Karn).  dp->inRecovery is set while repairing.
+ *  onloss  - a loss was detected, by duplicate ACKs or by the RTO
+ */
+typedef struct dp_cc_ops {
+    const char  *name;
+    void        (*init)(dp_connp dp);
+    void        (*onack)(dp_connp dp, int acked, long long rtt);
+    void        (*onloss)(dp_connp dp, _Bool timeout);
+} dp_cc_ops;
+
+#define     DP_CC_INIT_CWND         4       //dgrams, RFC 3390 for our MSS
+#define     DP_CC_MIN_CWND          2
+#define     DP_VEGAS_ALPHA          2       //dgrams queued in the path, grow below
+#define     DP_VEGAS_BETA           4       //and shrink above
+
+const dp_cc_ops *dpccops(int id);
+int dpccbyname(const char *name);
@@ -0,0 +1,355 @@
+/*
+ * du-ccsim - congestion control simulator for du-proto
+ *
+ * Runs the du-cc.c algorithms, unchanged, for several bulk transfers (think
+ * du-ftp clients) that share one bottleneck link.  The link is a FIFO with a
+ * drop-tail buffer, a fixed rate and a random loss rate, and every flow sees
+ * the same propagation RTT.  Each flow's window and RTT state lives in its
+ * own dp_connection just like it does in du-proto.  The receiver ACKs every
+ * dgram and the link never reorders, so a dgram is known to be lost as soon
+ * as one sent after it is ACKd (this is what the duplicate ACKs tell a real
+ * du-proto sender).
+ *
+ * For every scenario it prints the total goodput, how much of the link that
+ * is, Jain's fairness index over the per-flow goodputs (1.0 = perfectly
+ * fair, 1/n = one flow has it all), the average queue and the share of
+ * dgrams that had to be resent.
+ *
+ *   usage: ./du-ccsim [-n flows] [-r mbit] [-d rtt_ms] [-q queue] [-l loss_pct]
+ *                     [-t secs] [-s seed] [cc[+cc...] ...]
+ *
+ * A scenario is a cc name, or names joined with + which are handed out to
+ * the flows in turn (newreno+vegas runs half of each).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+
+#include "du-proto.h"
+#include "du-cc.h"
+
+#define SIM_TICK_US     10
+#define SIM_MAX_FLOWS   32
+#define SIM_PAYLOAD_SZ  DP_BASE_BUFF_SZ     //du-proto before path MTU discovery
+#define SIM_PKT_SZ      (SIM_PAYLOAD_SZ + DP_FEC_HDR_SZ + sizeof(dp_pdu))
+#define SIM_FIFO_SZ     (2 * DP_MAX_WINDOW)
+#define SIM_ACKQ_SZ     (8 * DP_MAX_WINDOW)  //a timeout can leave old ACKs coming
+
+#define SIM_NEW         0
+#define SIM_INFLIGHT    1
+#define SIM_LOST        2
+#define SIM_ACKED       3
+
+typedef struct sim_config {
+    int         flows;
+    double      rateMbit;
+    int         rttMs;
+    int         queueSz;
+    double      lossPct;
+    int         secs;
+    unsigned    seed;
+} sim_config;
+
+//One transmission of a dgram
+typedef struct sim_pkt {
+    int         flow;
+    int         seq;
+    long        order;          //per flow transmission counter
+    long long   sentAt;
+    long long   ackAt;
+    _Bool       retx;
+} sim_pkt;
+
+typedef struct sim_flow {
+    dp_connection   dp;         //cc state, as in du-proto
+    int             maxSeq;
+    char            *state;     //SIM_* per dgram
+    int             nextNew;
+    int             *lostQ;     //dgrams waiting to be resent
+    int             lostHead, lostCount;
+    sim_pkt         fifo[SIM_FIFO_SZ];  //in flight, in send order
+    int             fHead, fCount;
+    sim_pkt         acks[SIM_ACKQ_SZ];  //ACKs on their way back
+    int             aHead, aCount;
+    long            order;
+    long            recoverOrder;
+    long long       lastProgress;
+    long long       srtt, rttvar, rto;
+    long            delivered, sent, resent;
+} sim_flow;
+
+static unsigned int _simRand;
+
+static double simrand(){
+    _simRand ^= _simRand << 13;
+    _simRand ^= _simRand >> 17;
+    _simRand ^= _simRand << 5;
+    return (_simRand & 0xffffff) / (double)0x1000000;
+}
+
+//Loss is detected by a later dgram getting ACKd, so everything before it
+//in the fifo goes on the resend queue
+static void simlost(sim_flow *f, sim_pkt *p){
+    if (f->state[p->seq] == SIM_ACKED)
+        return;
+    f->state[p->seq] = SIM_LOST;
+    f->lostQ[(f->lostHead + f->lostCount++) % f->maxSeq] = p->seq;
+}
+
+static void simack(sim_flow *f, sim_pkt *ack, long long now){
+    _Bool loss = false;
+    long long rtt = -1;
+
+    if (f->state[ack->seq] != SIM_ACKED) {
+        f->state[ack->seq] = SIM_ACKED;
+        f->delivered++;
+    }
+
+    while (f->fCount > 0 && f->fifo[f->fHead].order < ack->order) {
+        simlost(f, &f->fifo[f->fHead]);
+        f->fHead = (f->fHead + 1) % SIM_FIFO_SZ;
+        f->fCount--;
+        loss = true;
+    }
+    if (f->fCount > 0 && f->fifo[f->fHead].order == ack->order) {
+        f->fHead = (f->fHead + 1) % SIM_FIFO_SZ;
+        f->fCount--;
+        if (!ack->retx)
+            rtt = now - ack->sentAt;
+    }
+    f->dp.txCount = f->fCount;
+
+    if (rtt > 0) {
+        if (f->srtt == 0) {
+            f->srtt = rtt;
+            f->rttvar = rtt / 2;
+        } else {
+            long long err = f->srtt - rtt;
+            f->rttvar += ((err < 0 ? -err : err) - f->rttvar) / 4;
+            f->srtt += (rtt - f->srtt) / 8;
+        }
+    }
+    f->rto = f->srtt + 4 * f->rttvar;
+    if (f->rto < DP_RTO_MIN_MS * 1000LL)
+        f->rto = DP_RTO_MIN_MS * 1000LL;
+    f->lastProgress = now;
+
+    if (loss && !f->dp.inRecovery) {
+        f->dp.cc->onloss(&f->dp, false);
+        f->dp.inRecovery = true;
+        f->recoverOrder = f->order;
+    }
+    f->dp.cc->onack(&f->dp, 1, rtt);
+    if (f->dp.inRecovery && ack->order >= f->recoverOrder)
+        f->dp.inRecovery = false;
+}
+
+static void simtimeout(sim_flow *f, long long now){
+    f->dp.txCount = f->fCount;
+    f->dp.cc->onloss(&f->dp, true);
+    while (f->fCount > 0) {
+        simlost(f, &f->fifo[f->fHead]);
+        f->fHead = (f->fHead + 1) % SIM_FIFO_SZ;
+        f->fCount--;
+    }
+    f->dp.txCount = 0;
+    f->dp.inRecovery = true;
+    f->recoverOrder = f->order;
+    f->rto *= 2;
+    if (f->rto > DP_RTO_MAX_MS * 1000LL)
+        f->rto = DP_RTO_MAX_MS * 1000LL;
+    f->lastProgress = now;
+}
+
+//Next dgram to put on the wire, resends first, -1 if there is nothing
+static int simnext(sim_flow *f){
+    while (f->lostCount > 0) {
+        int seq = f->lostQ[f->lostHead];
+        f->lostHead = (f->lostHead + 1) % f->maxSeq;
+        f->lostCount--;
+        if (f->state[seq] == SIM_LOST)
+            return seq;
+    }
+    if (f->nextNew < f->maxSeq)
+        return f->nextNew++;
+    return -1;
+}
+
+static void simrun(sim_config *cfg, const char *scenario){
+    sim_flow *flows = calloc(cfg->flows, sizeof(sim_flow));
+    sim_pkt *queue = calloc(cfg->queueSz, sizeof(sim_pkt));
+    int qHead = 0, qCount = 0;
+    double pktPerSec = cfg->rateMbit * 1e6 / 8 / SIM_PKT_SZ;
+    long long svcUs = (long long)(1e6 / pktPerSec);
+    long long rttUs = cfg->rttMs * 1000LL;
+    long long endUs = cfg->secs * 1000000LL;
+    long long linkFreeAt = 0;
+    double qSum = 0;
+    long qSamples = 0;
+    char names[128];
+    char *algs[SIM_MAX_FLOWS];
+    int nalgs = 0;
+
+    //cc names for the flows, handed out round robin
+    snprintf(names, sizeof(names), "%s", scenario);
+    for (char *tok = strtok(names, "+"); tok != NULL && nalgs < SIM_MAX_FLOWS;
+         tok = strtok(NULL, "+"))
+        algs[nalgs++] = tok;
+
+    _simRand = cfg->seed ? cfg->seed : 1;
+    for (int i = 0; i < cfg->flows; i++) {
+        sim_flow *f = &flows[i];
+        int id = dpccbyname(algs[i % nalgs]);
+        if (id < 0) {
+            printf("%-16s unknown congestion control %s\n", scenario, algs[i % nalgs]);
+            goto done;
+        }
+        f->maxSeq = (int)(pktPerSec * cfg->secs) + 1024;
+        f->state = calloc(f->maxSeq, 1);
+        f->lostQ = calloc(f->maxSeq, sizeof(int));
+        f->dp.wndSz = DP_MAX_WINDOW;
+        f->dp.cc = dpccops(id);
+        f->dp.cc->init(&f->dp);
+        f->rto = DP_RTO_INIT_MS * 1000LL;
+    }
+
+    for (long long now = 0; now < endUs; now += SIM_TICK_US) {
+        //ACKs that are back
+        for (int i = 0; i < cfg->flows; i++) {
+            sim_flow *f = &flows[i];
+            while (f->aCount > 0 && f->acks[f->aHead].ackAt <= now) {
+                sim_pkt ack = f->acks[f->aHead];
+                f->aHead = (f->aHead + 1) % SIM_ACKQ_SZ;
+                f->aCount--;
+                simack(f, &ack, now);
+            }
+            if (f->fCount > 0 && now - f->lastProgress > f->rto)
+                simtimeout(f, now);
+        }
+
+        //Send what the windows allow, starting with a different flow each
+        //tick so nobody always gets to the queue first
+        for (int k = 0; k < cfg->flows; k++) {
+            sim_flow *f = &flows[(now / SIM_TICK_US + k) % cfg->flows];
+            int wnd = (f->dp.cwnd < f->dp.wndSz) ? f->dp.cwnd : f->dp.wndSz;
+            int seq;
+
+            while (f->fCount < wnd && (seq = simnext(f)) >= 0) {
+                sim_pkt *p = &f->fifo[(f->fHead + f->fCount++) % SIM_FIFO_SZ];
+                p->flow = f - flows;
+                p->seq = seq;
+                p->order = f->order++;
+                p->sentAt = now;
+                p->retx = (f->state[seq] == SIM_LOST);
+                f->state[seq] = SIM_INFLIGHT;
+                f->sent++;
+                if (p->retx)
+                    f->resent++;
+                if (f->fCount == 1)
+                    f->lastProgress = now;
+                //drop-tail
+                if (qCount < cfg->queueSz)
+                    queue[(qHead + qCount++) % cfg->queueSz] = *p;
+            }
+            f->dp.txCount = f->fCount;
+        }
+
+        //The link sends one dgram every svcUs, some of them get lost on the way
+        while (qCount > 0 && linkFreeAt <= now) {
+            sim_pkt p = queue[qHead];
+            qHead = (qHead + 1) % cfg->queueSz;
+            qCount--;
+            linkFreeAt = ((linkFreeAt > now - SIM_TICK_US) ? linkFreeAt : now) + svcUs;
+            if (simrand() * 100 < cfg->lossPct)
+                continue;
+            sim_flow *f = &flows[p.flow];
+            p.ackAt = linkFreeAt + rttUs;
+            if (f->aCount < SIM_ACKQ_SZ)
+                f->acks[(f->aHead + f->aCount++) % SIM_ACKQ_SZ] = p;
+        }
+        qSum += qCount;
+        qSamples++;
+    }
+
+    double secs = cfg->secs;
+    double total = 0, sumSq = 0;
+    long sent = 0, resent = 0;
+    char perFlow[512] = "";
+    for (int i = 0; i < cfg->flows; i++) {
+        double kbs = flows[i].delivered * (double)SIM_PAYLOAD_SZ / 1024 / secs;
+        total += kbs;
+        sumSq += kbs * kbs;
+        sent += flows[i].sent;
+        resent += flows[i].resent;
+        snprintf(perFlow + strlen(perFlow), sizeof(perFlow) - strlen(perFlow),
+            "%s%.0f", i ? " " : "", kbs);
+    }
+    double capacity = 1e6 / svcUs * SIM_PAYLOAD_SZ / 1024;
+    printf("%-16s %10.0f %6.1f %6.3f %7.1f %6.2f   %s\n", scenario, total,
+        100 * total / capacity, sumSq > 0 ? total * total / (cfg->flows * sumSq) : 0,
+        qSum / qSamples, sent ? 100.0 * resent / sent : 0, perFlow);
+
+done:
+    for (int i = 0; i < cfg->flows; i++) {
+        free(flows[i].state);
+        free(flows[i].lostQ);
+    }
+    free(flows);
+    free(queue);
+}
+
+int main(int argc, char *argv[]){
+    sim_config cfg = { 4, 20, 20, 50, 0.5, 30, 1 };
+    int option;
+
+    while ((option = getopt(argc, argv, "n:r:d:q:l:t:s:h")) != -1){
+        switch(option) {
+            case 'n':
+                cfg.flows = atoi(optarg);
+                break;
+            case 'r':
+                cfg.rateMbit = atof(optarg);
+                break;
+            case 'd':
+                cfg.rttMs = atoi(optarg);
+                break;
+            case 'q':
+                cfg.queueSz = atoi(optarg);
+                break;
+            case 'l':
+                cfg.lossPct = atof(optarg);
+                break;
+            case 't':
+                cfg.secs = atoi(optarg);
+                break;
+            case 's':
+                cfg.seed = atoi(optarg);
+                break;
+            default:
+                printf("USAGE: %s [-n flows] [-r mbit] [-d rtt_ms] [-q queue] [-l loss_pct] "
+                    "[-t secs] [-s seed] [cc[+cc...] ...]\n", argv[0]);
+                exit(option == 'h' ? 0 : -1);
+        }
+    }
+    if (cfg.flows < 1 || cfg.flows > SIM_MAX_FLOWS || cfg.queueSz < 1 ||
+        cfg.rateMbit <= 0 || cfg.secs < 1) {
+        printf("ERROR: bad simulation parameters\n");
+        exit(-1);
+    }
+
+    printf("%d flows, %.1f Mbit/s link, %d ms rtt, %d dgram queue, %.2f%% loss, %d s\n\n",
+        cfg.flows, cfg.rateMbit, cfg.rttMs, cfg.queueSz, cfg.lossPct, cfg.secs);
+    printf("%-16s %10s %6s %6s %7s %6s   %s\n", "cc", "KB/s", "link%", "jain",
+        "avg q", "retx%", "per-flow KB/s");
+
+    if (optind == argc) {
+        const char *defaults[] = { "none", "newreno", "vegas", "newreno+vegas" };
+        for (int i = 0; i < 4; i++)
+            simrun(&cfg, defaults[i]);
+    }
+    for (int i = optind; i < argc; i++)
+        simrun(&cfg, argv[i]);
+    return 0;
+}
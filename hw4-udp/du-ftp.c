@@ -4,15 +4,121 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#include <endian.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "du-ftp.h"
 #include "du-proto.h"
+#include "du-cc.h"
+#include "du-netem.h"
+#include "du-sum.h"
+#include "du-pcap.h"
 
 
-#define BUFF_SZ 512
-static char sbuffer[BUFF_SZ];
-static char rbuffer[BUFF_SZ];
-static char full_file_path[FNAME_SZ];
+//The server lets dprecv() reassemble up to RBUFF_SZ of a data block at a
+//time and writes it at its offset with pwrite(), or with -m 1 writes up
+//to SVR_LEND_MAX dgrams lent by dprecvlend() with one pwritev()
+#define RBUFF_SZ        (1024 * 1024)
+#define SVR_LEND_MAX    32
+#define MBUFF_SZ        ((int)sizeof(ftp_pdu) + FTP_MANIFEST_SZ)
+
+/*
+ * Client side.  The manifest is built once, then every connection walks it
+ * and sends the blocks that are dealt to it.
+ */
+typedef struct cli_file {
+    char        path[FTP_PATH_SZ];      //relative to ./outfile
+    int         kind;
+    long long   size;
+    unsigned    mode;
+    int         status;                 //0, or -errno if it could not be read
+    int         svrStatus;              //what the server said about it
+    uint64_t    *sums;                  //FTP_MT_SUMS of what the server has
+    long long   nsums;
+    uint32_t    *crcs;                  //CRC32C of each block, as it is sent
+} cli_file;
+
+typedef struct cli_xfer {
+    prog_config     *cfg;
+    cli_file        *files;
+    int             nfiles;
+    int             cap;
+    long long       blocks;
+    int             blockSz;
+    unsigned int    sessionId;
+    int             streams;
+    pthread_mutex_t lock;
+} cli_xfer;
+
+typedef struct cli_stream {
+    cli_xfer        *xf;
+    int             idx;
+    dp_connp        dpc;
+    pthread_t       tid;
+    bool            joined;             //HELLO went out, the server counts it
+    long            bytes;
+    long long       skipped;            //bytes the server already had
+    int             rc;
+    struct dp_stats st;
+} cli_stream;
+
+/*
+ * Server side.  Each connection gets a thread, and the connections of one
+ * client transfer find each other through the session id in their HELLO.
+ */
+typedef struct svr_file {
+    char        path[FNAME_SZ + FTP_PATH_SZ];
+    int         kind;
+    int         fd;
+    long long   size;
+    long long   have;                   //old contents kept for FTP_MT_SUMS
+    long long   got;
+    int         status;
+    bool        hasDigest;              //FTP_MT_DIGEST came for it
+    uint32_t    digest;
+} svr_file;
+
+typedef struct svr_session {
+    unsigned int        id;
+    struct in_addr      peer;
+    char                root[FNAME_SZ];
+    int                 refs;
+    int                 dataDone;       //connections other than 0 that ended
+    bool                delta;          //client wants FTP_MT_SUMS
+    bool                manifestDone;
+    bool                closed;         //connection 0 ended
+    svr_file            *files;
+    int                 nfiles;
+    int                 cap;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    struct svr_session  *next;
+} svr_session;
+
+typedef struct svr_stream {
+    dp_connp    dpc;
+    svr_session *ss;
+    int         idx;
+    char        mbuffer[MBUFF_SZ];
+    char        rbuffer[RBUFF_SZ];
+} svr_stream;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    svr_session     *sessions;
+    int             finished;
+    prog_config     *cfg;
+} _svr = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
 
 /*
  *  Helper function that processes the command line arguements.  Highlights
@@ -29,13 +135,32 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
     //setup defaults if no arguements are passed
     static char cmdBuffer[64] = {0};
 
-    //setup defaults if no arguements are passed
+    //setup defaults if no arguements are passed, zeroed first so the
+    //strncpy()s below always leave a terminated string
+    memset(cfg, 0, sizeof(*cfg));
     cfg->prog_mode = PROG_MD_CLI;
     cfg->port_number = DEF_PORT_NO;
     strcpy(cfg->file_name, PROG_DEF_FNAME);
     strcpy(cfg->svr_ip_addr, PROG_DEF_SVR_ADDR);
+    cfg->wnd_sz = DP_DEF_WINDOW;
+    cfg->drop_pct = 0;
+    cfg->sessions = 1;
+    cfg->batch = DP_DEF_BATCH;
+    cfg->cc = DP_DEF_CC;
+    cfg->version = DP_DEF_VERSION;
+    cfg->use_mmap = 1;
+    cfg->streams = FTP_DEF_STREAMS;
+    cfg->delta = 1;
+    cfg->check = FTP_DEF_CHECK;
+    cfg->block_sz = FTP_BLOCK_SZ;
+    cfg->fec = 0;
+    cfg->dgram_sz = DP_DEF_DGRAM_SZ;
+    cfg->pacing = DP_DEF_PACING;
+    cfg->impair[0] = '\0';
+    cfg->trace[0] = '\0';
+    cfg->verbose = 0;
     
-    while ((option = getopt(argc, argv, ":p:f:a:csh")) != -1){
+    while ((option = getopt(argc, argv, ":p:f:a:w:l:n:b:C:V:I:m:P:d:k:B:F:D:R:t:vcsh")) != -1){
         switch(option) {
             case 'p':
                 strncpy(cmdBuffer, optarg, sizeof(cmdBuffer));
@@ -47,6 +172,90 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
             case 'a':
                 strncpy(cfg->svr_ip_addr, optarg, sizeof(cfg->svr_ip_addr));
                 break;
+            case 'w':
+                cfg->wnd_sz = atoi(optarg);
+                break;
+            case 'l':
+                cfg->drop_pct = atoi(optarg);
+                break;
+            case 'n':
+                cfg->sessions = atoi(optarg);
+                break;
+            case 'b':
+                cfg->batch = atoi(optarg);
+                break;
+            case 'C':
+                if ((cfg->cc = dpccbyname(optarg)) < 0) {
+                    printf("ERROR: Unknown congestion control %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'V':
+                cfg->version = atoi(optarg);
+                break;
+            case 'm':
+                cfg->use_mmap = atoi(optarg);
+                break;
+            case 'd':
+                cfg->delta = atoi(optarg);
+                break;
+            case 'k':
+                cfg->check = atoi(optarg);
+                if (cfg->check < FTP_CHECK_NONE || cfg->check > FTP_CHECK_DGRAM) {
+                    printf("ERROR: Integrity check must be between %d and %d\n", FTP_CHECK_NONE, FTP_CHECK_DGRAM);
+                    exit(-1);
+                }
+                break;
+            case 'B':
+                cfg->block_sz = atoi(optarg) * 1024;
+                if (cfg->block_sz < FTP_SUM_BLOCK_SZ || cfg->block_sz > FTP_MAX_BLOCK_SZ ||
+                        cfg->block_sz % FTP_SUM_BLOCK_SZ != 0) {
+                    printf("ERROR: Block size must be a multiple of %dKB up to %dKB\n",
+                        FTP_SUM_BLOCK_SZ / 1024, FTP_MAX_BLOCK_SZ / 1024);
+                    exit(-1);
+                }
+                break;
+            case 'F':
+                cfg->fec = atoi(optarg);
+                if (cfg->fec != 0 && (cfg->fec < 2 || cfg->fec > DP_FEC_MAX_GROUP)) {
+                    printf("ERROR: FEC groups must be between 2 and %d datagrams, or 0\n", DP_FEC_MAX_GROUP);
+                    exit(-1);
+                }
+                break;
+            case 'D':
+                cfg->dgram_sz = atoi(optarg);
+                if (cfg->dgram_sz < DP_BASE_BUFF_SZ || cfg->dgram_sz > DP_MAX_BUFF_SZ) {
+                    printf("ERROR: Datagram size must be between %d and %d\n", DP_BASE_BUFF_SZ, DP_MAX_BUFF_SZ);
+                    exit(-1);
+                }
+                break;
+            case 'R':
+                cfg->pacing = atoi(optarg);
+                if (cfg->pacing < 0 || cfg->pacing > 1) {
+                    printf("ERROR: Pacing must be 0 or 1\n");
+                    exit(-1);
+                }
+                break;
+            case 'P':
+                cfg->streams = atoi(optarg);
+                if (cfg->streams < 1 || cfg->streams > FTP_MAX_STREAMS) {
+                    printf("ERROR: Connections must be between 1 and %d\n", FTP_MAX_STREAMS);
+                    exit(-1);
+                }
+                break;
+            case 'I':
+                if (dpnetemparse(optarg, &(dp_netem_cfg){0}) < 0) {
+                    printf("ERROR: Bad impairment settings %s\n", optarg);
+                    exit(-1);
+                }
+                strncpy(cfg->impair, optarg, sizeof(cfg->impair) - 1);
+                break;
+            case 't':
+                strncpy(cfg->trace, optarg, sizeof(cfg->trace) - 1);
+                break;
+            case 'v':
+                cfg->verbose = 1;
+                break;
             case 'c':
                 cfg->prog_mode = PROG_MD_CLI;
                 break;
@@ -54,11 +263,32 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
                 cfg->prog_mode = PROG_MD_SVR;
                 break;
             case 'h':
-                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-s] [-c] [-h]\n", argv[0]);
+                printf("USAGE: %s [-p port] [-f fname] [-a svr_addr] [-w wnd] [-l loss] [-n sessions] [-b batch] [-C cc] [-V ver] [-I impair] [-m mmap] [-P conns] [-B block] [-d delta] [-k check] [-F fec] [-D size] [-R pace] [-t trace] [-v] [-s] [-c] [-h] [path ...]\n", argv[0]);
                 printf("WHERE:\n\t[-c] runs in client mode, [-s] runs in server mode; DEFAULT= client_mode\n");
                 printf("\t[-a svr_addr] specifies the servers IP address as a string; DEFAULT = %s\n", cfg->svr_ip_addr);
                 printf("\t[-p portnum] specifies the port number; DEFAULT = %d\n", cfg->port_number);
-                printf("\t[-f fname] specifies the filename to send or recv; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[path ...] files and directories under ./outfile the client sends; DEFAULT = the -f file\n");
+                printf("\t[-f fname] specifies the file to send when no paths are given; DEFAULT = %s\n", cfg->file_name);
+                printf("\t[-w wnd] specifies the send window in datagrams (1 = stop-and-wait); DEFAULT = %d\n", cfg->wnd_sz);
+                printf("\t[-l loss] drops this percent of outgoing datagrams to test recovery; DEFAULT = %d\n", cfg->drop_pct);
+                printf("\t[-I impair] impairs outgoing datagrams, e.g. loss=1,dup=1,reorder=2,delay=10ms,jitter=2ms,rate=20mbit,limit=100,seed=7\n");
+                printf("\t[-b batch] 0 = one syscall per dgram, 1 = sendmmsg/recvmmsg, 2 = plus UDP GSO/GRO; DEFAULT = %d\n", cfg->batch);
+                printf("\t[-C cc] congestion control, none, newreno or vegas; DEFAULT = %s\n", dpccops(cfg->cc)->name);
+                printf("\t[-V ver] highest header version the client offers, 1 = 20 byte host order, 2 = 10 byte network order; DEFAULT = %d\n", cfg->version);
+                printf("\t[-m mmap] 1 = send blocks straight from the mapped file, and write them straight from du-proto's buffers, 0 = pread() and dprecv() them; DEFAULT = %d\n", cfg->use_mmap);
+                printf("\t[-P conns] client connections the files are striped across; DEFAULT = %d\n", cfg->streams);
+                printf("\t[-B block] KB of a file the client hands du-proto at a time, a multiple of %d; DEFAULT = %d\n",
+                    FTP_SUM_BLOCK_SZ / 1024, cfg->block_sz / 1024);
+                printf("\t[-d delta] 1 = only send the parts of files the server does not have already, 0 = everything; DEFAULT = %d\n", cfg->delta);
+                printf("\t[-k check] 0 = no integrity checks, 1 = CRC32C digest of every file, 2 = and of every datagram; DEFAULT = %d\n", cfg->check);
+                printf("\t[-F fec] sends an XOR parity datagram after every group of this many, 2..%d, 0 = off; DEFAULT = %d\n",
+                    DP_FEC_MAX_GROUP, cfg->fec);
+                printf("\t[-D size] largest datagram payload the client offers, %d..%d, %d = no path MTU discovery; DEFAULT = %d\n",
+                    DP_BASE_BUFF_SZ, DP_MAX_BUFF_SZ, DP_BASE_BUFF_SZ, cfg->dgram_sz);
+                printf("\t[-R pace] 1 = spread the window over the round trip, 0 = send it in bursts; DEFAULT = %d\n", cfg->pacing);
+                printf("\t[-t trace] records every datagram to this pcapng file, open it in Wireshark with du-proto.lua\n");
+                printf("\t[-v] prints every PDU to stdout, slow; DEFAULT = off\n");
+                printf("\t[-n sessions] server handles this many client transfers, 0 = forever; DEFAULT = %d\n", cfg->sessions);
                 printf("\t[-p] displays what you are looking at now - the help\n\n");
                 exit(0);
             case ':':
@@ -70,72 +300,1055 @@ static int initParams(int argc, char *argv[], prog_config *cfg){
                 exit(-1);
         }
     }
+    cfg->paths = argv + optind;
+    cfg->npaths = argc - optind;
     return cfg->prog_mode;
 }
 
-int server_loop(dp_connp dpc, void *sBuff, void *rBuff, int sbuff_sz, int rbuff_sz){
-    int rcvSz;
+/*
+ * PDU helpers.  ftp_pdu is kept in host order in memory and converted on
+ * the way in and out, like the du-proto v2 header.
+ */
+static void ftp_pack(const ftp_pdu *pdu, void *wire){
+    ftp_pdu w;
 
-    FILE *f = fopen(full_file_path, "wb+");
-    if(f == NULL){
-        printf("ERROR:  Cannot open file %s\n", full_file_path);
-        exit(-1);
+    w.mtype = pdu->mtype;
+    w.flags = pdu->flags;
+    w.count = htons(pdu->count);
+    w.fileId = htonl(pdu->fileId);
+    w.offset = htobe64(pdu->offset);
+    w.len = htonl(pdu->len);
+    w.status = htonl(pdu->status);
+    memcpy(wire, &w, sizeof(w));
+}
+
+static void ftp_unpack(const void *wire, ftp_pdu *pdu){
+    memcpy(pdu, wire, sizeof(*pdu));
+    pdu->count = ntohs(pdu->count);
+    pdu->fileId = ntohl(pdu->fileId);
+    pdu->offset = be64toh(pdu->offset);
+    pdu->len = ntohl(pdu->len);
+    pdu->status = ntohl(pdu->status);
+}
+
+static int ftp_send(dp_connp dpc, int mtype, int flags, int count, unsigned int fileId,
+                    long long offset, unsigned int len, int status){
+    ftp_pdu pdu = { mtype, flags, count, fileId, offset, len, status };
+    char wire[sizeof(ftp_pdu)];
+
+    ftp_pack(&pdu, wire);
+    return dpsend(dpc, wire, sizeof(wire));
+}
+
+//Receive the next PDU into buff, returns the length of what follows the
+//header (the manifest records) or a du-proto error
+static int ftp_recv(dp_connp dpc, ftp_pdu *pdu, void *buff, int buff_sz){
+    int rc = dprecv(dpc, buff, buff_sz);
+
+    if (rc < 0)
+        return rc;
+    if (rc < (int)sizeof(ftp_pdu))
+        return DP_ERROR_PROTOCOL;
+    ftp_unpack(buff, pdu);
+    return rc - sizeof(ftp_pdu);
+}
+
+//Paths in a manifest are relative and must stay under the directory they
+//are saved in, so no absolute paths and no ".."
+static bool ftp_safe_path(const char *path){
+    const char *p = path;
+
+    if (*path == '\0' || *path == '/')
+        return false;
+    while (*p != '\0') {
+        const char *end = strchr(p, '/');
+        int len = end ? end - p : (int)strlen(p);
+        if (len == 0 || (len == 2 && strncmp(p, "..", 2) == 0))
+            return false;
+        p += len;
+        if (*p == '/')
+            p++;
+    }
+    return true;
+}
+
+//mkdir -p, leaves path as it was
+static int ftp_mkdirs(char *path, mode_t mode){
+    for (char *p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        int rc = mkdir(path, 0755);
+        *p = '/';
+        if (rc < 0 && errno != EEXIST)
+            return -errno;
+    }
+    if (mkdir(path, mode) < 0) {
+        struct stat sb;
+        if (errno != EEXIST)
+            return -errno;
+        if (stat(path, &sb) < 0 || !S_ISDIR(sb.st_mode))
+            return -ENOTDIR;
+    }
+    return 0;
+}
+
+
+/*
+ * Server.  Connection 0 of a session creates the files from the manifest,
+ * every connection writes the blocks it gets at their offsets, and once the
+ * client says it is done connection 0 reports on every file.
+ */
+static svr_session *svr_join(dp_connp dpc, unsigned int id){
+    struct in_addr peer = dpc->outSockAddr.addr.sin_addr;
+    svr_session *ss;
+
+    pthread_mutex_lock(&_svr.lock);
+    for (ss = _svr.sessions; ss != NULL; ss = ss->next)
+        if (ss->id == id && ss->peer.s_addr == peer.s_addr)
+            break;
+    if (ss == NULL && (ss = calloc(1, sizeof(svr_session))) != NULL) {
+        ss->id = id;
+        ss->peer = peer;
+        //With more than one client at a time each host gets a directory of
+        //its own so they dont collide, and a resend finds what it sent before
+        if (_svr.cfg->sessions == 1)
+            snprintf(ss->root, sizeof(ss->root), "./infile");
+        else
+            snprintf(ss->root, sizeof(ss->root), "./infile/%s", inet_ntoa(peer));
+        pthread_mutex_init(&ss->lock, NULL);
+        pthread_cond_init(&ss->cond, NULL);
+        ss->next = _svr.sessions;
+        _svr.sessions = ss;
     }
-    if (dpc->isConnected == false){
+    if (ss != NULL)
+        ss->refs++;
+    pthread_mutex_unlock(&_svr.lock);
+    return ss;
+}
+
+static void svr_leave(svr_session *ss, int idx){
+    bool last;
+
+    pthread_mutex_lock(&ss->lock);
+    if (idx == 0)
+        ss->closed = true;
+    else
+        ss->dataDone++;
+    last = (--ss->refs == 0 && ss->closed);
+    pthread_cond_broadcast(&ss->cond);
+    pthread_mutex_unlock(&ss->lock);
+    if (!last)
+        return;
+
+    pthread_mutex_lock(&_svr.lock);
+    svr_session **pp = &_svr.sessions;
+    while (*pp != ss)
+        pp = &(*pp)->next;
+    *pp = ss->next;
+    _svr.finished++;
+    pthread_cond_broadcast(&_svr.cond);
+    pthread_mutex_unlock(&_svr.lock);
+
+    for (int i = 0; i < ss->nfiles; i++)
+        if (ss->files[i].fd >= 0)
+            close(ss->files[i].fd);
+    free(ss->files);
+    pthread_mutex_destroy(&ss->lock);
+    pthread_cond_destroy(&ss->cond);
+    free(ss);
+}
+
+/*
+ * Tell the client what we already hold: an XXH64 of every FTP_SUM_BLOCK_SZ
+ * piece of the old contents of each file, so it only sends the pieces that
+ * differ.  Pieces are compared by content, so the tail of a file that was
+ * cut short by an interrupted transfer just does not match.
+ */
+static int svr_send_sums(svr_stream *st){
+    svr_session *ss = st->ss;
+    uint64_t *sums = (uint64_t *)(st->mbuffer + sizeof(ftp_pdu));
+    int max = FTP_MANIFEST_SZ / sizeof(uint64_t);
+    int rc;
+
+    for (int i = 0; i < ss->nfiles; i++) {
+        svr_file *f = &ss->files[i];
+        long long npieces = (f->have + FTP_SUM_BLOCK_SZ - 1) / FTP_SUM_BLOCK_SZ;
+        long long first = 0;
+        int n = 0;
+
+        for (long long p = 0; p < npieces; p++) {
+            long long off = p * FTP_SUM_BLOCK_SZ;
+            int len = (f->size - off > FTP_SUM_BLOCK_SZ) ? FTP_SUM_BLOCK_SZ : f->size - off;
+            bool last = (p == npieces - 1);
+
+            if (pread(f->fd, st->rbuffer, len, off) != len)
+                last = true;        //whatever is left gets sent again
+            else
+                sums[n++] = htobe64(dpxxh64(st->rbuffer, len, 0));
+            if ((n == max || last) && n > 0) {
+                ftp_pdu pdu = { FTP_MT_SUMS, 0, n, i, first };
+                ftp_pack(&pdu, st->mbuffer);
+                if ((rc = dpsend(st->dpc, st->mbuffer, sizeof(pdu) + n * sizeof(uint64_t))) < 0)
+                    return rc;
+                first += n;
+                n = 0;
+            }
+            if (last)
+                break;
+        }
+    }
+    return ftp_send(st->dpc, FTP_MT_SUMS, FTP_PF_LAST, 0, 0, 0, 0, 0);
+}
+
+//Create the directories and files a manifest lists.  A file that cannot be
+//created is remembered with its errno, its data is still received
+static int svr_manifest(svr_stream *st, const ftp_pdu *pdu, const char *body, int len){
+    svr_session *ss = st->ss;
+    int off = 0;
+
+    if (ss->nfiles == 0 && ftp_mkdirs(ss->root, 0755) < 0)
+        printf("ERROR: Cannot create %s\n", ss->root);
+
+    for (int i = 0; i < pdu->count; i++) {
+        ftp_entry e;
+        svr_file *f;
+
+        if (off + (int)sizeof(e) > len)
+            return DP_ERROR_PROTOCOL;
+        memcpy(&e, body + off, sizeof(e));
+        off += sizeof(e);
+        e.fileId = ntohl(e.fileId);
+        e.pathLen = ntohs(e.pathLen);
+        e.mode = ntohl(e.mode);
+        e.size = be64toh(e.size);
+        if (off + e.pathLen > len || e.fileId != ss->nfiles || e.pathLen >= FTP_PATH_SZ)
+            return DP_ERROR_PROTOCOL;
+
+        if (ss->nfiles == ss->cap) {
+            int cap = ss->cap ? 2 * ss->cap : 64;
+            svr_file *files = realloc(ss->files, cap * sizeof(svr_file));
+            if (files == NULL)
+                return DP_ERROR_GENERAL;
+            ss->files = files;
+            ss->cap = cap;
+        }
+        f = &ss->files[ss->nfiles];
+        memset(f, 0, sizeof(*f));
+        f->kind = e.kind;
+        f->size = e.size;
+        f->fd = -1;
+        snprintf(f->path, sizeof(f->path), "%s/%.*s", ss->root, e.pathLen, body + off);
+        off += e.pathLen;
+
+        if (!ftp_safe_path(f->path + strlen(ss->root) + 1)) {
+            f->status = -EPERM;
+        } else if (e.kind == FTP_KIND_DIR) {
+            f->status = ftp_mkdirs(f->path, (e.mode & 0777) | 0700);
+        } else {
+            char *slash = strrchr(f->path, '/');
+            *slash = '\0';
+            f->status = ftp_mkdirs(f->path, 0755);
+            *slash = '/';
+            //Sized up front, the blocks can arrive in any order.  For a delta
+            //transfer what is there is kept and only the changes come over.
+            struct stat sb;
+            int flags = ss->delta ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC;
+            if (f->status == 0 && ((f->fd = open(f->path, flags, (e.mode & 0777) | 0600)) < 0 ||
+                    fstat(f->fd, &sb) < 0 || ftruncate(f->fd, f->size) < 0))
+                f->status = -errno;
+            else if (ss->delta)
+                f->have = (sb.st_size < f->size) ? sb.st_size : f->size;
+        }
+
+        pthread_mutex_lock(&ss->lock);
+        ss->nfiles++;
+        pthread_mutex_unlock(&ss->lock);
+    }
+
+    if (pdu->flags & FTP_PF_LAST) {
+        pthread_mutex_lock(&ss->lock);
+        ss->manifestDone = true;
+        pthread_cond_broadcast(&ss->cond);
+        pthread_mutex_unlock(&ss->lock);
+        if (ss->delta)
+            return svr_send_sums(st);
+    }
+    return 0;
+}
+
+/*
+ * Write left bytes of a block at off without copying them, from the buffers
+ * du-proto read them into.  Dgrams are borrowed until there is a run of
+ * SVR_LEND_MAX, or the block is done, and go out with one pwritev().  After
+ * an error the connection is closed, which takes back whatever is still
+ * borrowed.
+ */
+static int svr_data_lent(svr_stream *st, svr_file *f, long long off, long long left){
+    svr_session *ss = st->ss;
+    dp_lent lent[SVR_LEND_MAX];
+    struct iovec iov[SVR_LEND_MAX];
+    long long len = 0;
+    int n = 0, rc;
+
+    while (left > 0) {
+        if ((rc = dprecvlend(st->dpc, lent + n, SVR_LEND_MAX - n)) < 0)
+            return rc;
+        for (int i = n; i < n + rc; i++) {
+            //The block is a message of its own, it ends with its last dgram
+            if (lent[i].len == 0 || lent[i].len > left || (lent[i].len == left) != lent[i].last)
+                return DP_ERROR_PROTOCOL;
+            iov[i].iov_base = (void *)lent[i].data;
+            iov[i].iov_len = lent[i].len;
+            len += lent[i].len;
+            left -= lent[i].len;
+        }
+        n += rc;
+        if (n < SVR_LEND_MAX && left > 0)
+            continue;
+
+        if (f->fd >= 0 && pwritev(f->fd, iov, n, off) != len)
+            f->status = -errno;
+        for (int i = 0; i < n; i++)
+            dprelease(st->dpc, &lent[i]);
+        off += len;
+        pthread_mutex_lock(&ss->lock);
+        f->got += len;
+        pthread_mutex_unlock(&ss->lock);
+        n = 0;
+        len = 0;
+    }
+    return 0;
+}
+
+//The bytes of a block follow its DATA PDU as a message of their own
+static int svr_data(svr_stream *st, const ftp_pdu *pdu){
+    svr_session *ss = st->ss;
+    svr_file *f = NULL;
+    long long off = pdu->offset;
+    long long left = pdu->len;
+    int rc;
+
+    //Blocks can overtake the manifest on another connection
+    pthread_mutex_lock(&ss->lock);
+    while (!ss->manifestDone && !ss->closed)
+        pthread_cond_wait(&ss->cond, &ss->lock);
+    if (ss->manifestDone && pdu->fileId < (unsigned)ss->nfiles)
+        f = &ss->files[pdu->fileId];
+    pthread_mutex_unlock(&ss->lock);
+    if (f == NULL || f->kind != FTP_KIND_FILE || off + left > f->size)
+        return DP_ERROR_PROTOCOL;
+
+    //A range that matched our checksums, nothing follows
+    if (pdu->flags & FTP_PF_SAME) {
+        if (off + left > f->have)
+            return DP_ERROR_PROTOCOL;
+        pthread_mutex_lock(&ss->lock);
+        f->got += left;
+        pthread_mutex_unlock(&ss->lock);
+        return 0;
+    }
+
+    if (_svr.cfg->use_mmap)
+        return svr_data_lent(st, f, off, left);
+    while (left > 0) {
+        rc = dprecv(st->dpc, st->rbuffer, left > RBUFF_SZ ? RBUFF_SZ : left);
+        if (rc <= 0)
+            return rc < 0 ? rc : DP_ERROR_PROTOCOL;
+        if (f->fd >= 0 && pwrite(f->fd, st->rbuffer, rc, off) != rc)
+            f->status = -errno;
+        off += rc;
+        left -= rc;
+        pthread_mutex_lock(&ss->lock);
+        f->got += rc;
+        pthread_mutex_unlock(&ss->lock);
+    }
+    return 0;
+}
+
+//Read a finished file back and check it against the clients digest, this
+//catches anything from the wire to the disk.  Mapped, it is checked
+//straight out of the page cache.
+static int svr_verify(svr_stream *st, svr_file *f){
+    uint32_t crc = 0;
+    long long off = 0;
+    int fd = open(f->path, O_RDONLY);
+    char *data = MAP_FAILED;
+
+    if (fd < 0)
+        return -errno;
+    if (f->size > 0 && (data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+        madvise(data, f->size, MADV_SEQUENTIAL);
+        crc = dpcrc32c(0, data, f->size);
+        munmap(data, f->size);
+        off = f->size;
+    }
+    while (off < f->size) {
+        ssize_t n = pread(fd, st->rbuffer, RBUFF_SZ, off);
+        if (n <= 0) {
+            close(fd);
+            return n < 0 ? -errno : -EIO;
+        }
+        crc = dpcrc32c(crc, st->rbuffer, n);
+        off += n;
+    }
+    close(fd);
+    return (crc == f->digest) ? 0 : -EBADMSG;
+}
+
+//Connection 0 answers a DONE once the other conns connections are over
+static int svr_done(svr_stream *st, int conns){
+    svr_session *ss = st->ss;
+    int saved = 0;
+    long long bytes = 0;
+    int rc;
+
+    pthread_mutex_lock(&ss->lock);
+    while (ss->dataDone < conns)
+        pthread_cond_wait(&ss->cond, &ss->lock);
+    pthread_mutex_unlock(&ss->lock);
+
+    for (int i = 0; i < ss->nfiles; i++) {
+        svr_file *f = &ss->files[i];
+
+        if (f->fd >= 0 && close(f->fd) < 0 && f->status == 0)
+            f->status = -errno;
+        f->fd = -1;
+        if (f->status == 0 && f->kind == FTP_KIND_FILE && f->got != f->size)
+            f->status = -EIO;
+        if (f->status == 0 && f->hasDigest)
+            f->status = svr_verify(st, f);
+        if (f->status == 0) {
+            saved++;
+            bytes += f->got;
+        } else {
+            printf("ERROR: %s: %s\n", f->path, strerror(-f->status));
+        }
+        if ((rc = ftp_send(st->dpc, FTP_MT_STATUS, 0, 0, i, f->got, 0, f->status)) < 0)
+            return rc;
+    }
+    printf("Session %08x from %s: saved %d of %d files (%lld bytes) under %s\n",
+        ss->id, inet_ntoa(ss->peer), saved, ss->nfiles, bytes, ss->root);
+    //The listeners socket is shared, so these are all of its drops meanwhile
+    struct dp_stats ds;
+    dpgetstats(st->dpc, &ds);
+    printf("Session %08x: %ld datagrams dropped by a full receive buffer, which grew to %d bytes\n",
+        ss->id, ds.rcvbufDrops, st->dpc->listener ? st->dpc->listener->rcvBuf : st->dpc->rcvBuf);
+    return ftp_send(st->dpc, FTP_MT_DONE, 0, 0, 0, 0, 0, 0);
+}
+
+int server_loop(svr_stream *st){
+    ftp_pdu pdu;
+    int rc;
+
+    if (st->dpc->isConnected == false){
         perror("Expecting the protocol to be in connect state, but its not");
         exit(-1);
     }
-    //Loop until a disconnect is received, or error hapens
+    //Loop until a disconnect is received, or error hapens.  The client may
+    //close while our last sends are being ACKd, du-proto has freed the
+    //connection by the time any call returns DP_CONNECTION_CLOSED.
     while(1) {
+        rc = ftp_recv(st->dpc, &pdu, st->mbuffer, sizeof(st->mbuffer));
+        if (rc >= 0) {
+            switch (pdu.mtype) {
+            case FTP_MT_MANIFEST:
+                rc = (st->idx == 0) ? svr_manifest(st, &pdu, st->mbuffer + sizeof(pdu), rc) : DP_ERROR_PROTOCOL;
+                break;
+            case FTP_MT_DATA:
+                rc = svr_data(st, &pdu);
+                break;
+            case FTP_MT_STATUS:
+                //The client could not read this file
+                pthread_mutex_lock(&st->ss->lock);
+                if (pdu.fileId < (unsigned)st->ss->nfiles && pdu.status < 0)
+                    st->ss->files[pdu.fileId].status = pdu.status;
+                pthread_mutex_unlock(&st->ss->lock);
+                rc = 0;
+                break;
+            case FTP_MT_DIGEST:
+                pthread_mutex_lock(&st->ss->lock);
+                if (pdu.fileId < (unsigned)st->ss->nfiles) {
+                    st->ss->files[pdu.fileId].hasDigest = true;
+                    st->ss->files[pdu.fileId].digest = pdu.offset;
+                }
+                pthread_mutex_unlock(&st->ss->lock);
+                rc = 0;
+                break;
+            case FTP_MT_DONE:
+                rc = (st->idx == 0) ? svr_done(st, pdu.count) : 0;
+                break;
+            default:
+                rc = DP_ERROR_PROTOCOL;
+            }
+        }
+        if (rc == DP_CONNECTION_CLOSED)
+            return rc;
+        if (rc < 0) {
+            printf("ERROR: Session %08x connection %d failed (%d)\n", st->ss->id, st->idx, rc);
+            dpclose(st->dpc);
+            return rc;
+        }
+    }
+}
+
+static void *server_thread(void *arg){
+    svr_stream *st = arg;
+    ftp_pdu pdu;
+    int rc;
+
+    rc = ftp_recv(st->dpc, &pdu, st->mbuffer, sizeof(st->mbuffer));
+    if (rc < 0 || pdu.mtype != FTP_MT_HELLO || (st->ss = svr_join(st->dpc, pdu.fileId)) == NULL) {
+        printf("ERROR: Expected a HELLO from the client\n");
+        if (rc != DP_CONNECTION_CLOSED)
+            dpclose(st->dpc);
+        free(st);
+        return NULL;
+    }
+    st->idx = pdu.count;
+    if (st->idx == 0)
+        st->ss->delta = (pdu.flags & FTP_PF_DELTA) != 0;
+    server_loop(st);
+    svr_leave(st->ss, st->idx);
+    free(st);
+    return NULL;
+}
+
+static void *accept_thread(void *arg){
+    dp_listenp lp = arg;
+    prog_config *cfg = _svr.cfg;
 
-        //receive request from client
-        rcvSz = dprecv(dpc, rBuff, rbuff_sz);
-        if (rcvSz == DP_CONNECTION_CLOSED){
-            fclose(f);
-            printf("Client closed connection\n");
-            return DP_CONNECTION_CLOSED;
+    while (1) {
+        dp_connp dpc = dpaccept(lp);
+        if (dpc == NULL)
+            break;
+        if (dpsetimpair(dpc, cfg->impair) < 0) {
+            printf("ERROR: Could not impair connection with %s\n", cfg->impair);
+            dpclose(dpc);
+            continue;
         }
-        fwrite(rBuff, 1, rcvSz, f);
-        rcvSz = rcvSz > 50 ? 50 : rcvSz;    //Just print the first 50 characters max
+        if (cfg->drop_pct > 0)
+            dpsetopt(dpc, DP_OPT_DROP, cfg->drop_pct);
+        dpsetopt(dpc, DP_OPT_BATCH, cfg->batch);
+        dpsetopt(dpc, DP_OPT_CC, cfg->cc);
+        dpsetopt(dpc, DP_OPT_CRC, cfg->check >= FTP_CHECK_DGRAM);
+        dpsetopt(dpc, DP_OPT_FEC, cfg->fec);
+        dpsetopt(dpc, DP_OPT_PACING, cfg->pacing);
 
-        printf("========================> \n%.*s\n========================> \n", 
-            rcvSz, (char *)rBuff);
+        svr_stream *st = malloc(sizeof(svr_stream));
+        pthread_t tid;
+        if (st == NULL) {
+            dpclose(dpc);
+            continue;
+        }
+        st->dpc = dpc;
+        st->ss = NULL;
+        if (pthread_create(&tid, NULL, server_thread, st) != 0) {
+            perror("Cannot start session thread");
+            dpclose(dpc);
+            free(st);
+            continue;
+        }
+        pthread_detach(tid);
     }
+    return NULL;
+}
 
+/*
+ * Accept connections on one port, each in its own thread, until -n client
+ * transfers are over (0 = forever).  A transfer may use several connections.
+ */
+void start_server(prog_config *cfg){
+    dp_listenp lp = dpListenerInit(cfg->port_number);
+    pthread_t tid;
+
+    if (lp == NULL) {
+        perror("Error establishing connection");
+        exit(-1);
+    }
+    _svr.cfg = cfg;
+    if (pthread_create(&tid, NULL, accept_thread, lp) != 0) {
+        perror("Cannot start accept thread");
+        exit(-1);
+    }
+
+    pthread_mutex_lock(&_svr.lock);
+    while (cfg->sessions == 0 || _svr.finished < cfg->sessions)
+        pthread_cond_wait(&_svr.cond, &_svr.lock);
+    pthread_mutex_unlock(&_svr.lock);
+    //The accept thread is still blocked in dpaccept(), exiting takes it down
 }
 
 
+/*
+ * Client.  The paths given on the command line are walked into a manifest
+ * (directories first, then what is in them), files are cut into
+ * blockSz blocks, and block n goes out on connection n % streams.
+ */
+static int cli_add(cli_xfer *xf, const char *rel){
+    char full[FNAME_SZ + FTP_PATH_SZ];
+    struct stat sb;
+    cli_file *f;
+
+    snprintf(full, sizeof(full), "./outfile/%s", rel);
+    if (!ftp_safe_path(rel) || strlen(rel) >= FTP_PATH_SZ) {
+        printf("ERROR: %s must be a relative path under ./outfile\n", rel);
+        return -1;
+    }
+    //Links are followed to files, but not into directories
+    if (lstat(full, &sb) < 0 || (S_ISLNK(sb.st_mode) && stat(full, &sb) == 0 && S_ISDIR(sb.st_mode))) {
+        printf("ERROR: Cannot send %s: %s\n", full, S_ISDIR(sb.st_mode) ? "link to a directory" : strerror(errno));
+        return -1;
+    }
+    if (S_ISLNK(sb.st_mode) || (!S_ISREG(sb.st_mode) && !S_ISDIR(sb.st_mode))) {
+        printf("Skipping %s, not a file or directory\n", full);
+        return 0;
+    }
 
-void start_client(dp_connp dpc){
-    static char sBuff[500];
+    if (xf->nfiles == xf->cap) {
+        int cap = xf->cap ? 2 * xf->cap : 64;
+        cli_file *files = realloc(xf->files, cap * sizeof(cli_file));
+        if (files == NULL)
+            return -1;
+        xf->files = files;
+        xf->cap = cap;
+    }
+    f = &xf->files[xf->nfiles++];
+    memset(f, 0, sizeof(*f));
+    snprintf(f->path, sizeof(f->path), "%s", rel);
+    f->mode = sb.st_mode & 0777;
+    if (S_ISREG(sb.st_mode)) {
+        long long nblocks = (sb.st_size + xf->blockSz - 1) / xf->blockSz;
+        f->kind = FTP_KIND_FILE;
+        f->size = sb.st_size;
+        xf->blocks += nblocks;
+        if (xf->cfg->check >= FTP_CHECK_FILE &&
+                (f->crcs = calloc(nblocks ? nblocks : 1, sizeof(uint32_t))) == NULL)
+            return -1;
+        return 0;
+    }
+    f->kind = FTP_KIND_DIR;
 
-    if(!dpc->isConnected) {
-        printf("Client not connected\n");
-        return;
+    DIR *d = opendir(full);
+    struct dirent *de;
+    int rc = 0;
+    if (d == NULL) {
+        printf("ERROR: Cannot read %s: %s\n", full, strerror(errno));
+        return -1;
+    }
+    while (rc == 0 && (de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(full, sizeof(full), "%s/%s", rel, de->d_name);
+        rc = cli_add(xf, full);
     }
+    closedir(d);
+    return rc;
+}
+
+static int cli_send_manifest(dp_connp dpc, cli_xfer *xf){
+    char *mbuff = malloc(MBUFF_SZ);
+    int off = sizeof(ftp_pdu), count = 0;
+    int rc = 0;
 
+    if (mbuff == NULL)
+        return DP_ERROR_GENERAL;
+    for (int i = 0; i <= xf->nfiles && rc >= 0; i++) {
+        bool last = (i == xf->nfiles);
+        int plen = last ? 0 : strlen(xf->files[i].path);
 
-    FILE *f = fopen(full_file_path, "rb");
-    if(f == NULL){
-        printf("ERROR:  Cannot open file %s\n", full_file_path);
+        if (last || off + (int)sizeof(ftp_entry) + plen > MBUFF_SZ) {
+            ftp_pdu pdu = { FTP_MT_MANIFEST, last ? FTP_PF_LAST : 0, count };
+            ftp_pack(&pdu, mbuff);
+            rc = dpsend(dpc, mbuff, off);
+            off = sizeof(ftp_pdu);
+            count = 0;
+        }
+        if (!last) {
+            ftp_entry e = { htonl(i), xf->files[i].kind, 0, htons(plen),
+                htonl(xf->files[i].mode), htobe64(xf->files[i].size) };
+            memcpy(mbuff + off, &e, sizeof(e));
+            memcpy(mbuff + off + sizeof(e), xf->files[i].path, plen);
+            off += sizeof(e) + plen;
+            count++;
+        }
+    }
+    free(mbuff);
+    return rc;
+}
+
+//What the server already has of each file, from its FTP_MT_SUMS
+static int cli_recv_sums(dp_connp dpc, cli_xfer *xf){
+    char *mbuff = malloc(MBUFF_SZ);
+    ftp_pdu pdu;
+    int rc;
+
+    if (mbuff == NULL)
+        return DP_ERROR_GENERAL;
+    while ((rc = ftp_recv(dpc, &pdu, mbuff, MBUFF_SZ)) >= 0) {
+        if (pdu.mtype != FTP_MT_SUMS) {
+            rc = DP_ERROR_PROTOCOL;
+            break;
+        }
+        if (pdu.flags & FTP_PF_LAST)
+            break;
+
+        cli_file *f = &xf->files[pdu.fileId < (unsigned)xf->nfiles ? pdu.fileId : 0];
+        long long npieces = (f->size + FTP_SUM_BLOCK_SZ - 1) / FTP_SUM_BLOCK_SZ;
+        if (pdu.fileId >= (unsigned)xf->nfiles || rc < pdu.count * (int)sizeof(uint64_t) ||
+                pdu.offset + pdu.count > npieces || pdu.offset != f->nsums) {
+            rc = DP_ERROR_PROTOCOL;
+            break;
+        }
+        if (f->sums == NULL && (f->sums = malloc(npieces * sizeof(uint64_t))) == NULL) {
+            rc = DP_ERROR_GENERAL;
+            break;
+        }
+        for (int i = 0; i < pdu.count; i++) {
+            uint64_t sum;
+            memcpy(&sum, mbuff + sizeof(pdu) + i * sizeof(sum), sizeof(sum));
+            f->sums[f->nsums++] = be64toh(sum);
+        }
+    }
+    free(mbuff);
+    return rc < 0 ? rc : 0;
+}
+
+static void cli_file_error(cli_xfer *xf, int i, int err){
+    pthread_mutex_lock(&xf->lock);
+    if (xf->files[i].status == 0)
+        xf->files[i].status = -err;
+    pthread_mutex_unlock(&xf->lock);
+    printf("ERROR: Cannot read ./outfile/%s: %s\n", xf->files[i].path, strerror(err));
+}
+
+//DATA for a run of pieces, with or without the bytes
+static int cli_send_run(cli_stream *cs, int i, long long off, int len, char *data, bool same){
+    int rc = ftp_send(cs->dpc, FTP_MT_DATA, same ? FTP_PF_SAME : 0, 0, i, off, len, 0);
+
+    if (rc < 0)
+        return rc;
+    if (same) {
+        cs->skipped += len;
+        return rc;
+    }
+    cs->bytes += len;
+    return dpsend(cs->dpc, data, len);
+}
+
+//One block at off, skipping the pieces whose checksum the server sent back
+static int cli_send_range(cli_stream *cs, int i, long long off, int len, char *data){
+    cli_file *f = &cs->xf->files[i];
+    long long runOff = off;
+    bool runSame = false;
+    int rc;
+
+    if (off >= f->nsums * FTP_SUM_BLOCK_SZ)
+        return cli_send_run(cs, i, off, len, data, false);
+
+    for (long long p = off; p < off + len; p += FTP_SUM_BLOCK_SZ) {
+        int plen = (off + len - p > FTP_SUM_BLOCK_SZ) ? FTP_SUM_BLOCK_SZ : off + len - p;
+        long long piece = p / FTP_SUM_BLOCK_SZ;
+        bool same = piece < f->nsums && dpxxh64(data + (p - off), plen, 0) == f->sums[piece];
+
+        if (p > runOff && same != runSame) {
+            if ((rc = cli_send_run(cs, i, runOff, p - runOff, data + (runOff - off), runSame)) < 0)
+                return rc;
+            runOff = p;
+        }
+        runSame = same;
+    }
+    return cli_send_run(cs, i, runOff, off + len - runOff, data + (runOff - off), runSame);
+}
+
+//Send the blocks dealt to this connection.  Mapped blocks go to dpsend()
+//straight from the page cache, otherwise they are pread() into buff.
+static int cli_send_blocks(cli_stream *cs, char *buff){
+    cli_xfer *xf = cs->xf;
+    long long b = 0;
+
+    for (int i = 0; i < xf->nfiles; i++) {
+        cli_file *f = &xf->files[i];
+        long long nblocks = (f->size + xf->blockSz - 1) / xf->blockSz;
+        long long first = (cs->idx - b % xf->streams + xf->streams) % xf->streams;
+        char full[FNAME_SZ + FTP_PATH_SZ];
+        int fd = -1;
+
+        b += nblocks;
+        if (f->kind != FTP_KIND_FILE || first >= nblocks)
+            continue;
+        snprintf(full, sizeof(full), "./outfile/%s", f->path);
+        if ((fd = open(full, O_RDONLY)) < 0) {
+            cli_file_error(xf, i, errno);
+            continue;
+        }
+        for (long long k = first; k < nblocks; k += xf->streams) {
+            long long off = k * xf->blockSz;
+            int len = (f->size - off > xf->blockSz) ? xf->blockSz : f->size - off;
+            char *data = MAP_FAILED;
+            int rc;
+
+            //Block offsets are page aligned, so each can be mapped alone
+            if (xf->cfg->use_mmap && (data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, off)) != MAP_FAILED)
+                madvise(data, len, MADV_SEQUENTIAL | MADV_WILLNEED);
+            if (data == MAP_FAILED && pread(fd, buff, len, off) != len) {
+                cli_file_error(xf, i, errno ? errno : EIO);
+                break;
+            }
+            if (data == MAP_FAILED)
+                data = buff;
+            //The file digest is put together from these at the end, so the
+            //file is only read once
+            if (f->crcs != NULL)
+                f->crcs[k] = dpcrc32c(0, data, len);
+            rc = cli_send_range(cs, i, off, len, data);
+            if (data != buff)
+                munmap(data, len);
+            if (rc < 0) {
+                close(fd);
+                return rc;
+            }
+        }
+        close(fd);
+    }
+    return dpflush(cs->dpc);
+}
+
+static dp_connp cli_connect(prog_config *cfg){
+    dp_connp dpc = dpClientInit(cfg->svr_ip_addr, cfg->port_number);
+
+    if (dpc == NULL)
+        return NULL;
+    if (dpsetopt(dpc, DP_OPT_WINDOW, cfg->wnd_sz) < 0) {
+        printf("ERROR: Window must be between 1 and %d\n", DP_MAX_WINDOW);
         exit(-1);
     }
-    if (dpc->isConnected == false){
-        perror("Expecting the protocol to be in connect state, but its not");
+    if (dpsetimpair(dpc, cfg->impair) < 0) {
+        printf("ERROR: Could not impair connection with %s\n", cfg->impair);
+        exit(-1);
+    }
+    if (cfg->drop_pct > 0)
+        dpsetopt(dpc, DP_OPT_DROP, cfg->drop_pct);
+    if (dpsetopt(dpc, DP_OPT_BATCH, cfg->batch) < 0) {
+        printf("ERROR: Batch mode must be between %d and %d\n", DP_BATCH_OFF, DP_BATCH_GSO);
+        exit(-1);
+    }
+    dpsetopt(dpc, DP_OPT_CC, cfg->cc);
+    dpsetopt(dpc, DP_OPT_CRC, cfg->check >= FTP_CHECK_DGRAM);
+    dpsetopt(dpc, DP_OPT_FEC, cfg->fec);
+    dpsetopt(dpc, DP_OPT_DGRAM_SZ, cfg->dgram_sz);
+    dpsetopt(dpc, DP_OPT_PACING, cfg->pacing);
+    if (dpsetopt(dpc, DP_OPT_VERSION, cfg->version) < 0) {
+        printf("ERROR: Header version must be %d or %d\n", DP_PROTO_VER_1, DP_PROTO_VER_2);
         exit(-1);
     }
+    if (dpconnect(dpc) < 0) {
+        perror("Error establishing connection");
+        dpclose(dpc);
+        return NULL;
+    }
+    return dpc;
+}
+
+//Connections other than 0 just say hello and send their blocks
+static void *cli_stream_thread(void *arg){
+    cli_stream *cs = arg;
+    char *buff = cs->xf->cfg->use_mmap ? NULL : malloc(cs->xf->blockSz);
+
+    cs->rc = DP_ERROR_GENERAL;
+    if ((cs->dpc = cli_connect(cs->xf->cfg)) == NULL) {
+        free(buff);
+        return NULL;
+    }
+    cs->rc = ftp_send(cs->dpc, FTP_MT_HELLO, cs->xf->cfg->delta ? FTP_PF_DELTA : 0, cs->idx, cs->xf->sessionId, 0, cs->xf->streams, 0);
+    cs->joined = (cs->rc >= 0);
+    if (cs->rc >= 0)
+        cs->rc = cli_send_blocks(cs, buff);
+    if (cs->rc < 0)
+        printf("ERROR: Connection %d failed (%d), transfer is incomplete\n", cs->idx, cs->rc);
+    dpgetstats(cs->dpc, &cs->st);
+    if (cs->rc >= 0)
+        dpdisconnect(cs->dpc);
+    else
+        dpclose(cs->dpc);
+    free(buff);
+    return NULL;
+}
+
+//CRC32C of the whole file, from the CRCs of its blocks
+static uint32_t cli_digest(cli_xfer *xf, cli_file *f){
+    long long nblocks = (f->size + xf->blockSz - 1) / xf->blockSz;
+    uint32_t crc = 0;
+
+    for (long long k = 0; k < nblocks; k++) {
+        long long off = k * xf->blockSz;
+        int len = (f->size - off > xf->blockSz) ? xf->blockSz : f->size - off;
+        crc = dpcrc32c_combine(crc, f->crcs[k], len);
+    }
+    return crc;
+}
+
+//Wait for the other connections, then trade DONE for the file statuses
+static int cli_finish(cli_stream *cs, cli_stream *all){
+    cli_xfer *xf = cs->xf;
+    char buff[sizeof(ftp_pdu)];
+    ftp_pdu pdu;
+    int joined = 0;
+    int rc = 0;
 
-    int bytes = 0;
+    for (int i = 1; i < xf->streams; i++) {
+        pthread_join(all[i].tid, NULL);
+        joined += all[i].joined;
+    }
+    for (int i = 0; i < xf->nfiles; i++) {
+        cli_file *f = &xf->files[i];
 
-    while ((bytes = fread(sBuff, 1, sizeof(sBuff), f )) > 0)
-        dpsend(dpc, sBuff, bytes);
+        if (f->status < 0)
+            rc = ftp_send(cs->dpc, FTP_MT_STATUS, 0, 0, i, 0, 0, f->status);
+        else if (f->crcs != NULL)
+            rc = ftp_send(cs->dpc, FTP_MT_DIGEST, 0, 0, i, cli_digest(xf, f), 0, 0);
+        if (rc < 0)
+            return rc;
+    }
+    if ((rc = ftp_send(cs->dpc, FTP_MT_DONE, 0, joined, 0, 0, 0, 0)) < 0)
+        return rc;
 
-    fclose(f);
-    dpdisconnect(dpc);
+    while ((rc = ftp_recv(cs->dpc, &pdu, buff, sizeof(buff))) >= 0) {
+        if (pdu.mtype == FTP_MT_DONE)
+            return 0;
+        if (pdu.mtype == FTP_MT_STATUS && pdu.fileId < (unsigned)xf->nfiles)
+            xf->files[pdu.fileId].svrStatus = pdu.status;
+    }
+    return rc;
 }
 
-void start_server(dp_connp dpc){
-    server_loop(dpc, sbuffer, rbuffer, sizeof(sbuffer), sizeof(rbuffer));
+int start_client(prog_config *cfg){
+    cli_xfer xf = { .cfg = cfg, .blockSz = cfg->block_sz, .lock = PTHREAD_MUTEX_INITIALIZER };
+    cli_stream *cs;
+    char *buff = NULL;
+    struct timespec tStart, tEnd;
+    long totalBytes = 0;
+    long long skipped = 0;
+    int failed = 0, checked = 0, rc = 0;
+
+    if (cfg->npaths == 0)
+        rc = cli_add(&xf, cfg->file_name);
+    for (int i = 0; i < cfg->npaths && rc == 0; i++) {
+        //Tolerate "dir/" and "./file" from the shell
+        int len = strlen(cfg->paths[i]);
+        while (len > 1 && cfg->paths[i][len - 1] == '/')
+            cfg->paths[i][--len] = '\0';
+        rc = cli_add(&xf, strncmp(cfg->paths[i], "./", 2) == 0 ? cfg->paths[i] + 2 : cfg->paths[i]);
+    }
+    if (rc < 0 || xf.nfiles == 0) {
+        printf("ERROR: Nothing to send\n");
+        return -1;
+    }
+
+    //No point in more connections than blocks
+    clock_gettime(CLOCK_MONOTONIC, &tStart);
+    xf.sessionId = (unsigned)getpid() * 2654435761u ^ (unsigned)tStart.tv_nsec;
+    xf.streams = (xf.blocks < cfg->streams) ? (xf.blocks > 0 ? xf.blocks : 1) : cfg->streams;
+    cs = calloc(xf.streams, sizeof(cli_stream));
+    if (!cfg->use_mmap)
+        buff = malloc(xf.blockSz);
+    for (int i = 0; i < xf.streams; i++) {
+        cs[i].xf = &xf;
+        cs[i].idx = i;
+    }
+
+    //Connection 0 goes first so the manifest is on its way before any data
+    if ((cs[0].dpc = cli_connect(cfg)) == NULL)
+        exit(-1);
+    rc = ftp_send(cs[0].dpc, FTP_MT_HELLO, cfg->delta ? FTP_PF_DELTA : 0, 0, xf.sessionId, 0, xf.streams, 0);
+    if (rc >= 0)
+        rc = cli_send_manifest(cs[0].dpc, &xf);
+    if (rc >= 0 && cfg->delta)
+        rc = cli_recv_sums(cs[0].dpc, &xf);
+    if (rc < 0) {
+        printf("ERROR: Sending the manifest failed (%d)\n", rc);
+        exit(-1);
+    }
+    for (int i = 1; i < xf.streams; i++)
+        if (pthread_create(&cs[i].tid, NULL, cli_stream_thread, &cs[i]) != 0) {
+            perror("Cannot start connection thread");
+            exit(-1);
+        }
+    rc = cli_send_blocks(&cs[0], buff);
+    if (rc >= 0)
+        rc = cli_finish(&cs[0], cs);
+    clock_gettime(CLOCK_MONOTONIC, &tEnd);
+    if (rc < 0) {
+        printf("ERROR: Transfer aborted (%d)\n", rc);
+        exit(-1);
+    }
+
+    struct dp_stats st;
+    int wireVer = cs[0].dpc->wireVer;
+    int dgramSz = dpdgramsz(cs[0].dpc), dgramMax = cs[0].dpc->dgramMax;
+    int sndBuf = cs[0].dpc->sndBuf;
+    dpgetstats(cs[0].dpc, &cs[0].st);
+    dpdisconnect(cs[0].dpc);
+    memset(&st, 0, sizeof(st));
+    for (int i = 0; i < xf.streams; i++) {
+        totalBytes += cs[i].bytes;
+        skipped += cs[i].skipped;
+        st.retransmits += cs[i].st.retransmits;
+        st.timeouts += cs[i].st.timeouts;
+        st.fastRetransmits += cs[i].st.fastRetransmits;
+        st.sendCalls += cs[i].st.sendCalls;
+        st.recvCalls += cs[i].st.recvCalls;
+        st.dgramsOut += cs[i].st.dgramsOut;
+        st.bytesOut += cs[i].st.bytesOut;
+        st.bytesIn += cs[i].st.bytesIn;
+        st.crcErrors += cs[i].st.crcErrors;
+        st.fecOut += cs[i].st.fecOut;
+        st.fecRepaired += cs[i].st.fecRepaired;
+        st.pmtuProbes += cs[i].st.pmtuProbes;
+        st.paced += cs[i].st.paced;
+    }
+    for (int i = 0; i < xf.nfiles; i++) {
+        int status = xf.files[i].status ? xf.files[i].status : xf.files[i].svrStatus;
+        if (status < 0) {
+            printf("ERROR: %s was not saved: %s\n", xf.files[i].path, strerror(-status));
+            failed++;
+        } else if (xf.files[i].crcs != NULL) {
+            checked++;
+        }
+    }
+
+    //Time includes waiting for the last window to be ACKd
+    double secs = (tEnd.tv_sec - tStart.tv_sec) + (tEnd.tv_nsec - tStart.tv_nsec) / 1e9;
+    printf("Sent %ld bytes in %.3f seconds (%.1f KB/s)\n", totalBytes, secs,
+        secs > 0 ? totalBytes / secs / 1024 : 0);
+    printf("Server saved %d of %d files and directories over %d connections\n",
+        xf.nfiles - failed, xf.nfiles, xf.streams);
+    if (cfg->delta)
+        printf("Skipped %lld bytes the server already had\n", skipped);
+    if (cfg->check >= FTP_CHECK_FILE)
+        printf("Checked %d files against their CRC32C, dropped %ld datagrams with a bad CRC\n",
+            checked, st.crcErrors);
+    printf("Retransmitted %ld datagrams (%ld timeouts, %ld fast retransmits)\n",
+        st.retransmits, st.timeouts, st.fastRetransmits);
+    if (cfg->fec > 0)
+        printf("Sent %ld FEC parity datagrams, %ld NACKd datagrams arrived without a resend\n",
+            st.fecOut, st.fecRepaired);
+    printf("Used %ld send and %ld receive syscalls for %ld datagrams\n",
+        st.sendCalls, st.recvCalls, st.dgramsOut);
+    printf("Header v%d: sent %ld bytes on the wire (%.1f%% overhead), received %ld bytes of ACKs\n",
+        wireVer, st.bytesOut, totalBytes > 0 ? 100.0 * (st.bytesOut - totalBytes) / totalBytes : 0,
+        st.bytesIn);
+    printf("Datagrams carried up to %d bytes of data (%d agreed, %ld path MTU probes)\n",
+        dgramSz, dgramMax, st.pmtuProbes);
+    if (cfg->pacing)
+        printf("Paced the window %ld times, send buffer grew to %d bytes\n", st.paced, sndBuf);
+
+    free(buff);
+    free(cs);
+    for (int i = 0; i < xf.nfiles; i++) {
+        free(xf.files[i].sums);
+        free(xf.files[i].crcs);
+    }
+    free(xf.files);
+    return failed ? -1 : 0;
 }
 
 
@@ -143,8 +1356,6 @@ int main(int argc, char *argv[])
 {
     prog_config cfg;
     int cmd;
-    dp_connp dpc;
-    int rc;
 
 
     //Process the parameters and init the header - look at the helpers
@@ -155,32 +1366,29 @@ int main(int argc, char *argv[])
     printf("PORT %d\n", cfg.port_number);
     printf("FILE NAME: %s\n", cfg.file_name);
 
+    dpsetdebug(cfg.verbose);
+    if (cfg.trace[0] != '\0' && dptapopen(cfg.trace) < 0) {
+        perror("Could not open the trace file");
+        exit(-1);
+    }
+
     switch(cmd){
-        case PROG_MD_CLI:
+        case PROG_MD_CLI: {
             //by default client will look for files in the ./outfile directory
-            snprintf(full_file_path, sizeof(full_file_path), "./outfile/%s", cfg.file_name);
-            dpc = dpClientInit(cfg.svr_ip_addr,cfg.port_number);
-            rc = dpconnect(dpc);
-            if (rc < 0) {
-                perror("Error establishing connection");
-                exit(-1);
+            int rc = start_client(&cfg);
+            if (dptapon()) {
+                if (dptapmissed() > 0)
+                    printf("Trace %s is missing %ld datagrams, the disk could not keep up\n",
+                        cfg.trace, dptapmissed());
+                dptapclose();
             }
-
-            start_client(dpc);
-            exit(0);
+            exit(rc < 0 ? 1 : 0);
             break;
+        }
 
         case PROG_MD_SVR:
-            //by default server will look for files in the ./infile directory
-            snprintf(full_file_path, sizeof(full_file_path), "./infile/%s", cfg.file_name);
-            dpc = dpServerInit(cfg.port_number);
-            rc = dplisten(dpc);
-            if (rc < 0) {
-                perror("Error establishing connection");
-                exit(-1);
-            }
-
-            start_server(dpc);
+            //by default server will write files to the ./infile directory
+            start_server(&cfg);
             break;
         default:
             printf("ERROR: Unknown Program Mode.  Mode set is %d\n", cmd);
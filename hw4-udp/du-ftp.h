@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 #define PROG_MD_CLI     0
 #define PROG_MD_SVR     1
 #define DEF_PORT_NO     2080
@@ -12,4 +14,113 @@ typedef struct prog_config{
     int     port_number;
     char    svr_ip_addr[16];
     char    file_name[128];
+    int     wnd_sz;
+    int     drop_pct;
+    int     sessions;
+    int     batch;
+    int     cc;
+    int     version;
+    char    impair[128];
+    int     use_mmap;
+    int     streams;
+    int     delta;
+    int     check;
+    int     block_sz;
+    int     fec;                //dgrams per FEC parity group, 0 = off
+    int     dgram_sz;           //largest dgram payload the client offers
+    int     pacing;             //DP_OPT_PACING on both ends
+    char    trace[128];         //pcapng file the packet tap writes, or empty
+    int     verbose;
+    char    **paths;            //files and directories to send, under ./outfile
+    int     npaths;
 } prog_config;
+
+
+/*
+ * du-ftp application protocol.  Every PDU is one du-proto message that
+ * starts with an ftp_pdu header in network byte order; the fields that are
+ * used depend on the type:
+ *
+ *  FTP_MT_HELLO    first message on every connection.  fileId is the
+ *                  session id, count this connections index and len the
+ *                  number of connections in the session.  Connection 0
+ *                  carries the manifest and the status, the others only
+ *                  data.  FTP_PF_DELTA asks for FTP_MT_SUMS.
+ *  FTP_MT_MANIFEST count ftp_entry records, each followed by its path.  A
+ *                  long manifest takes several messages, the last one has
+ *                  FTP_PF_LAST set.
+ *  FTP_MT_SUMS     from the server after the manifest if the client asked
+ *                  for them: count XXH64s (uint64_t) of the FTP_SUM_BLOCK_SZ
+ *                  pieces of file fileId it already holds, starting with
+ *                  piece number offset.  The last one has FTP_PF_LAST set.
+ *  FTP_MT_DATA     len bytes of file fileId at offset.  The bytes follow as
+ *                  the next message on the same connection, so the sender
+ *                  can hand dpsend() a slice of a mapped file.  With
+ *                  FTP_PF_SAME no bytes follow, the server already has
+ *                  them.
+ *  FTP_MT_STATUS   the outcome for fileId: status is 0 or a negative errno,
+ *                  offset the bytes written.  The client sends one for a
+ *                  file it could not read, the server one for every file
+ *                  once the transfer is over.
+ *  FTP_MT_DIGEST   from the client, on connection 0, before its DONE:
+ *                  offset is the CRC32C of all of file fileId.  The server
+ *                  reads the file back once it is written and fails it
+ *                  with EBADMSG if it does not add up to the same.
+ *  FTP_MT_DONE     from the client, on connection 0, once the other
+ *                  count connections are finished.  The server answers
+ *                  with the statuses and a DONE of its own.
+ */
+typedef struct __attribute__((packed)) ftp_pdu {
+    uint8_t     mtype;
+    uint8_t     flags;
+    uint16_t    count;
+    uint32_t    fileId;
+    uint64_t    offset;
+    uint32_t    len;
+    int32_t     status;
+} ftp_pdu;
+
+#define FTP_MT_HELLO        1
+#define FTP_MT_MANIFEST     2
+#define FTP_MT_DATA         3
+#define FTP_MT_STATUS       4
+#define FTP_MT_DONE         5
+#define FTP_MT_SUMS         6
+#define FTP_MT_DIGEST       7
+
+#define FTP_PF_LAST         0x01
+#define FTP_PF_SAME         0x02
+#define FTP_PF_DELTA        0x04
+
+//Manifest record, the path (pathLen bytes, no terminator) follows it
+typedef struct __attribute__((packed)) ftp_entry {
+    uint32_t    fileId;
+    uint8_t     kind;
+    uint8_t     reserved;
+    uint16_t    pathLen;
+    uint32_t    mode;
+    uint64_t    size;
+} ftp_entry;
+
+#define FTP_KIND_FILE       1
+#define FTP_KIND_DIR        2
+
+//Files are cut into blocks of FTP_BLOCK_SZ (or -B) and the blocks dealt out
+//to the connections in turn, so a big file is striped across all of them
+//and small files spread out one per connection.  A block is one dpsend(),
+//so it is also how much of a file is in flight at a time per connection.
+#define FTP_BLOCK_SZ        (1024 * 1024)
+#define FTP_MAX_BLOCK_SZ    (64 * 1024 * 1024)
+//Unit the server checksums what it already has in, so a resent file only
+//costs the pieces that changed
+#define FTP_SUM_BLOCK_SZ    (64 * 1024)     //blocks are a multiple of it
+#define FTP_PATH_SZ         1024
+#define FTP_MANIFEST_SZ     (64 * 1024)
+#define FTP_DEF_STREAMS     4
+
+//Integrity checks, -k.  Each level includes the ones below it.
+#define FTP_CHECK_NONE      0
+#define FTP_CHECK_FILE      1       //FTP_MT_DIGEST for every file
+#define FTP_CHECK_DGRAM     2       //and DP_OPT_CRC on every dgram
+#define FTP_DEF_CHECK       FTP_CHECK_DGRAM
+#define FTP_MAX_STREAMS     32
@@ -0,0 +1,298 @@
+/*
+ * du-loop - drives du-proto connections from a single poll() loop
+ *
+ * An exerciser for the non-blocking API.  A server and a client connection
+ * are opened on loopback in the same process and both run from one thread:
+ * every operation is started with a dp*start() call whose callback starts
+ * the next one, and the loop itself only polls dpfd() of each connection
+ * for the smallest dptimeout() and calls dpprocess() on both when the poll
+ * returns.  Nothing ever blocks, so if either side waited on the other the
+ * run would hang instead of finishing.
+ *
+ * The client sends messages of assorted sizes, from one byte to several
+ * dgrams' worth, the server echoes each one back, and the client checks
+ * the echo before it sends the next.  Then the client closes and the server
+ * lingers until its timers run out.  The exit status is 0 if every echo
+ * matched and both connections closed cleanly.
+ *
+ *   usage: ./du-loop [-p port] [-n msgs] [-s seed] [-I impair]
+ *
+ * -I impairs what both connections send, e.g. -I loss=5,delay=2ms,seed=3,
+ * which keeps the retransmit, probe and linger timers busy too.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <getopt.h>
+#include <poll.h>
+
+#include "du-proto.h"
+
+#define LOOP_DEF_PORT   2085
+#define LOOP_DEF_MSGS   200
+#define LOOP_MAX_MSG    (256 * 1024)
+
+//One side of the conversation
+typedef struct loop_end {
+    const char  *name;
+    dp_connp    dp;
+    char        *buff;
+    _Bool       done;           //closed and nothing left to run
+    int         err;            //first DP error seen, 0 if none
+} loop_end;
+
+typedef struct loop_state {
+    loop_end    srv;
+    loop_end    cli;
+    char        *msg;           //what the client sent last
+    int         msgLen;
+    int         msgNum;
+    int         msgs;
+    _Bool       sent;           //the send of msgNum finished
+    _Bool       echoed;         //and its echo came back
+    int         bad;            //echoes that did not match
+    unsigned    seed;
+} loop_state;
+
+static void cli_next(loop_state *ls);
+
+static void end_fail(loop_end *end, const char *what, int rc){
+    if (end->err == 0) {
+        fprintf(stderr, "%s: %s failed with %d\n", end->name, what, rc);
+        end->err = rc;
+    }
+}
+
+//// SERVER - listen, then receive a message and send it back until the peer closes
+
+static void srv_recvd(dp_connp dp, int rc, void *arg);
+
+static void srv_sent(dp_connp dp, int rc, void *arg){
+    loop_state *ls = arg;
+
+    if (rc < 0) {
+        end_fail(&ls->srv, "send", rc);
+        return;
+    }
+    if ((rc = dprecvstart(dp, ls->srv.buff, LOOP_MAX_MSG, srv_recvd, ls)) < 0)
+        end_fail(&ls->srv, "dprecvstart", rc);
+}
+
+static void srv_recvd(dp_connp dp, int rc, void *arg){
+    loop_state *ls = arg;
+
+    if (rc == DP_CONNECTION_CLOSED)
+        return;
+    if (rc < 0) {
+        end_fail(&ls->srv, "recv", rc);
+        return;
+    }
+    if ((rc = dpsendstart(dp, ls->srv.buff, rc, srv_sent, ls)) < 0)
+        end_fail(&ls->srv, "dpsendstart", rc);
+}
+
+static void srv_listened(dp_connp dp, int rc, void *arg){
+    loop_state *ls = arg;
+
+    if (rc < 0) {
+        end_fail(&ls->srv, "listen", rc);
+        return;
+    }
+    if ((rc = dprecvstart(dp, ls->srv.buff, LOOP_MAX_MSG, srv_recvd, ls)) < 0)
+        end_fail(&ls->srv, "dprecvstart", rc);
+}
+
+//// CLIENT - connect, send each message and check its echo, then close
+
+static void cli_closed(dp_connp dp, int rc, void *arg){
+    loop_state *ls = arg;
+
+    if (rc != DP_CONNECTION_CLOSED)
+        end_fail(&ls->cli, "disconnect", rc);
+    ls->cli.done = true;
+}
+
+static void cli_sent(dp_connp dp, int rc, void *arg){
+    loop_state *ls = arg;
+
+    if (rc != ls->msgLen) {
+        end_fail(&ls->cli, "send", rc);
+        return;
+    }
+    ls->sent = true;
+    cli_next(ls);
+}
+
+static void cli_recvd(dp_connp dp, int rc, void *arg){
+    loop_state *ls = arg;
+
+    if (rc < 0) {
+        end_fail(&ls->cli, "recv", rc);
+        return;
+    }
+    if (rc != ls->msgLen || memcmp(ls->cli.buff, ls->msg, rc) != 0) {
+        fprintf(stderr, "client: echo of message %d (%d bytes) came back as %d bytes that dont match\n",
+                ls->msgNum, ls->msgLen, rc);
+        ls->bad++;
+    }
+    ls->echoed = true;
+    cli_next(ls);
+}
+
+/*
+ * Once the last message went out and came back, send the next one, or close
+ * after the last.  The message buffer is only reused once both the send and
+ * the echo are done with it.
+ */
+static void cli_next(loop_state *ls){
+    dp_connp dp = ls->cli.dp;
+    int rc;
+
+    if (!ls->sent || !ls->echoed)
+        return;
+    if (++ls->msgNum == ls->msgs) {
+        if ((rc = dpdisconnectstart(dp, cli_closed, ls)) < 0)
+            end_fail(&ls->cli, "dpdisconnectstart", rc);
+        return;
+    }
+
+    //Mostly small, now and then big enough to take many dgrams
+    ls->msgLen = 1 + rand_r(&ls->seed) % ((ls->msgNum % 8 == 7) ? LOOP_MAX_MSG : 2048);
+    for (int i = 0; i < ls->msgLen; i++)
+        ls->msg[i] = (char)(ls->msgNum + i * 7);
+    ls->sent = ls->echoed = false;
+
+    if ((rc = dprecvstart(dp, ls->cli.buff, LOOP_MAX_MSG, cli_recvd, ls)) < 0 ||
+        (rc = dpsendstart(dp, ls->msg, ls->msgLen, cli_sent, ls)) < 0)
+        end_fail(&ls->cli, "start", rc);
+}
+
+static void cli_connected(dp_connp dp, int rc, void *arg){
+    loop_state *ls = arg;
+
+    if (rc < 0) {
+        end_fail(&ls->cli, "connect", rc);
+        return;
+    }
+    ls->msgNum = -1;
+    ls->sent = ls->echoed = true;
+    cli_next(ls);
+}
+
+//// THE LOOP
+
+/*
+ * Poll both sockets for as long as the nearer of the two timers allows, and
+ * run dpprocess() on both whatever woke us.  A connection is finished once
+ * it is closed and has no timer left.
+ */
+static int run_loop(loop_state *ls){
+    loop_end *ends[2] = { &ls->srv, &ls->cli };
+
+    while (!(ls->srv.done && ls->cli.done)) {
+        struct pollfd pfd[2];
+        int n = 0, timeout = -1;
+
+        for (int i = 0; i < 2; i++) {
+            int t;
+            if (ends[i]->done)
+                continue;
+            pfd[n].fd = dpfd(ends[i]->dp);
+            pfd[n].events = POLLIN;
+            n++;
+            t = dptimeout(ends[i]->dp);
+            if (t >= 0 && (timeout < 0 || t < timeout))
+                timeout = t;
+        }
+        if (poll(pfd, n, timeout) < 0) {
+            perror("poll");
+            return -1;
+        }
+
+        for (int i = 0; i < 2; i++) {
+            int rc;
+            if (ends[i]->done)
+                continue;
+            rc = dpprocess(ends[i]->dp);
+            if (rc == DP_CONNECTION_CLOSED) {
+                if (dpdeadline(ends[i]->dp) == 0)
+                    ends[i]->done = true;
+            } else if (rc < 0) {
+                end_fail(ends[i], "dpprocess", rc);
+                ends[i]->done = true;
+            }
+            //Nothing can move on after an error, dont wait for the idle timeout
+            if (ends[i]->err != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]){
+    loop_state ls;
+    int port = LOOP_DEF_PORT;
+    const char *impair = NULL;
+    int option, rc;
+
+    memset(&ls, 0, sizeof(ls));
+    ls.msgs = LOOP_DEF_MSGS;
+    ls.seed = 1;
+    while ((option = getopt(argc, argv, ":p:n:s:I:h")) != -1) {
+        switch (option) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            ls.msgs = atoi(optarg);
+            break;
+        case 's':
+            ls.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'I':
+            impair = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-n msgs] [-s seed] [-I impair]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (ls.msgs < 1)
+        ls.msgs = 1;
+
+    ls.srv.name = "server";
+    ls.cli.name = "client";
+    ls.msg = malloc(LOOP_MAX_MSG);
+    ls.srv.buff = malloc(LOOP_MAX_MSG);
+    ls.cli.buff = malloc(LOOP_MAX_MSG);
+    ls.srv.dp = dpServerInit(port);
+    ls.cli.dp = dpClientInit("127.0.0.1", port);
+    if (ls.msg == NULL || ls.srv.buff == NULL || ls.cli.buff == NULL ||
+        ls.srv.dp == NULL || ls.cli.dp == NULL) {
+        fprintf(stderr, "could not set up the connections\n");
+        return 1;
+    }
+    if (impair != NULL &&
+        (dpsetimpair(ls.srv.dp, impair) < 0 || dpsetimpair(ls.cli.dp, impair) < 0)) {
+        fprintf(stderr, "bad impairment %s\n", impair);
+        return 1;
+    }
+
+    if ((rc = dplistenstart(ls.srv.dp, srv_listened, &ls)) < 0 ||
+        (rc = dpconnectstart(ls.cli.dp, cli_connected, &ls)) < 0) {
+        fprintf(stderr, "could not start: %d\n", rc);
+        return 1;
+    }
+    rc = run_loop(&ls);
+
+    printf("%d of %d messages echoed intact, client %s, server %s\n",
+           ls.msgNum < 0 ? 0 : ls.msgNum - ls.bad, ls.msgs,
+           ls.cli.err ? "failed" : "closed", ls.srv.err ? "failed" : "closed");
+    dpclose(ls.cli.dp);
+    dpclose(ls.srv.dp);
+    free(ls.msg);
+    free(ls.srv.buff);
+    free(ls.cli.buff);
+    return (rc == 0 && ls.bad == 0 && ls.msgNum == ls.msgs) ? 0 : 1;
+}
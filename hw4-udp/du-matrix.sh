@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# du-matrix.sh - du-ftp benchmark matrix over loopback, as CSV
+#
+# Runs a du-ftp server and client for every combination of file size,
+# block size, window and impairment, checks each copy arrived intact and
+# prints one CSV row per run on stdout, so results from different commits
+# can be concatenated and compared.
+#
+#   usage: ./du-matrix.sh [runs]
+#
+# The matrix comes from the environment, space separated lists:
+#   BENCH_SIZES    file sizes in KB                  (default "1024 16384")
+#   BENCH_BLOCKS   du-ftp -B block sizes in KB       (default "64 1024 4096")
+#   BENCH_WINDOWS  du-ftp -w windows in datagrams    (default "16 64")
+#   BENCH_IMPAIRS  du-ftp -I settings for both ends, "none" for a clean
+#                  link (default "none loss=1,delay=1ms,seed=7")
+# Other du-ftp options for both ends can go in BENCH_OPTS, e.g. "-b 0".
+# BENCH_TIMEOUT caps one run in seconds (default 120), a run that hits it
+# is reported with ok=0.
+#
+# Columns:
+#   commit, size_kb, block_kb, window, impair, run
+#   ok              1 if the copy matched
+#   seconds         client wall time, connect to last ACK
+#   goodput_kbs     file KB per second over that time
+#   retransmits     datagrams the client sent again
+#   syscalls        client du-proto send and receive syscalls
+#   syscalls_per_mb syscalls per MB of file
+#   client_cpu      client user + system seconds
+#   server_cpu      server user + system seconds
+
+RUNS=${1:-1}
+SIZES=${BENCH_SIZES:-"1024 16384"}
+BLOCKS=${BENCH_BLOCKS:-"64 1024 4096"}
+WINDOWS=${BENCH_WINDOWS:-"16 64"}
+IMPAIRS=${BENCH_IMPAIRS:-"none loss=1,delay=1ms,seed=7"}
+OPTS=${BENCH_OPTS:-}
+LIMIT=${BENCH_TIMEOUT:-120}
+PORT=${BENCH_PORT:-2090}
+FNAME=matrix.bin
+
+cd "$(dirname "$0")"
+if [ ! -x ./du-ftp ]; then
+    echo "build du-ftp first (make)" >&2
+    exit 1
+fi
+
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if ! git diff --quiet HEAD -- . 2>/dev/null; then
+    COMMIT="$COMMIT+"
+fi
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP" ./outfile/$FNAME ./infile/$FNAME' EXIT
+TIMEFORMAT="%U %S"
+
+echo "commit,size_kb,block_kb,window,impair,run,ok,seconds,goodput_kbs,retransmits,syscalls,syscalls_per_mb,client_cpu,server_cpu"
+for size in $SIZES; do
+    head -c $((size * 1024)) /dev/urandom > ./outfile/$FNAME
+    for block in $BLOCKS; do
+    for w in $WINDOWS; do
+    for imp in $IMPAIRS; do
+    for run in $(seq 1 $RUNS); do
+        impair=""
+        [ "$imp" != "none" ] && impair="-I $imp"
+        rm -f ./infile/$FNAME
+
+        # Each end is timed in its own shell so both CPU times come back
+        ( time timeout $LIMIT ./du-ftp -s -p $PORT -f $FNAME -d 0 $impair $OPTS > /dev/null 2>&1 ) 2> $TMP/svr.time &
+        svr=$!
+        sleep 0.2
+        { time timeout $LIMIT ./du-ftp -c -p $PORT -f $FNAME -B $block -w $w -P 1 -d 0 $impair $OPTS \
+            > $TMP/cli.out 2>&1 ; } 2> $TMP/cli.time
+        wait $svr
+
+        ok=0
+        cmp -s ./outfile/$FNAME ./infile/$FNAME && ok=1
+        # Sent <bytes> bytes in <secs> seconds (<rate> KB/s)
+        secs=$(awk '/^Sent .* bytes in/ {print $5}' $TMP/cli.out)
+        rate=$(awk '/^Sent .* bytes in/ {print $7}' $TMP/cli.out | tr -d '(')
+        # Retransmitted <n> datagrams ...
+        retx=$(awk '/^Retransmitted/ {print $2}' $TMP/cli.out)
+        # Used <n> send and <n> receive syscalls ...
+        calls=$(awk '/^Used/ {print $2 + $5}' $TMP/cli.out)
+        perMb=$(awk -v c="${calls:-0}" -v kb=$size 'BEGIN {printf "%.1f", c * 1024 / kb}')
+        ccpu=$(awk 'NF == 2 {printf "%.3f", $1 + $2}' $TMP/cli.time)
+        scpu=$(awk 'NF == 2 {printf "%.3f", $1 + $2}' $TMP/svr.time)
+        echo "$COMMIT,$size,$block,$w,\"$imp\",$run,$ok,${secs:-},${rate:-},${retx:-},${calls:-},$perMb,${ccpu:-},${scpu:-}"
+    done
+    done
+    done
+    done
+done
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "du-netem.h"
+
+//A dgram waiting on the delay line, gathered into one buffer
+typedef struct dp_nedgram {
+    long long           at;
+    unsigned long       id;
+    int                 sock;
+    struct sockaddr_in  to;
+    int                 len;
+    char                data[];
+} dp_nedgram;
+
+static long long nenow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//splitmix64, small and good enough, and the same everywhere unlike rand()
+static double nerand(dp_netem *ne){
+    unsigned long long z = (ne->rng += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static _Bool nechance(dp_netem *ne, double pct){
+    return pct > 0 && nerand(ne) * 100 < pct;
+}
+
+
+/*
+ * Settings as a comma separated list, e.g.
+ *
+ *      loss=2,delay=10ms,jitter=2ms,rate=20mbit,corrupt=0.1,seed=7
+ *
+ * Percentages may have fractions, times are in ms unless they end in us or
+ * s, rates are in kbit/s unless they end in bit, kbit, mbit or gbit.  burst
+ * is a number of dgrams, 1 or more.
+ * Settings not mentioned keep what is already in cfg.
+ */
+int dpnetemparse(const char *spec, dp_netem_cfg *cfg){
+    char buff[256];
+    char *save = NULL;
+
+    snprintf(buff, sizeof(buff), "%s", spec);
+    for (char *tok = strtok_r(buff, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        char *end;
+        double num;
+
+        if (val == NULL)
+            return -1;
+        *val++ = '\0';
+        num = strtod(val, &end);
+        if (end == val || num < 0)
+            return -1;
+
+        if (strcmp(tok, "loss") == 0 || strcmp(tok, "dup") == 0 ||
+            strcmp(tok, "reorder") == 0 || strcmp(tok, "corrupt") == 0) {
+            if (num > 100 || (*end != '\0' && strcmp(end, "%") != 0))
+                return -1;
+            if (tok[0] == 'l')
+                cfg->lossPct = num;
+            else if (tok[0] == 'd')
+                cfg->dupPct = num;
+            else if (tok[0] == 'r')
+                cfg->reorderPct = num;
+            else
+                cfg->corruptPct = num;
+        } else if (strcmp(tok, "delay") == 0 || strcmp(tok, "jitter") == 0) {
+            double us;
+            if (*end == '\0' || strcmp(end, "ms") == 0)
+                us = num * 1000;
+            else if (strcmp(end, "us") == 0)
+                us = num;
+            else if (strcmp(end, "s") == 0)
+                us = num * 1000000;
+            else
+                return -1;
+            if (tok[0] == 'd')
+                cfg->delayUs = us;
+            else
+                cfg->jitterUs = us;
+        } else if (strcmp(tok, "rate") == 0) {
+            if (*end == '\0' || strcmp(end, "kbit") == 0)
+                cfg->rateBps = num * 1000;
+            else if (strcmp(end, "bit") == 0)
+                cfg->rateBps = num;
+            else if (strcmp(end, "mbit") == 0)
+                cfg->rateBps = num * 1000000;
+            else if (strcmp(end, "gbit") == 0)
+                cfg->rateBps = num * 1000000000;
+            else
+                return -1;
+        } else if (strcmp(tok, "burst") == 0 && *end == '\0' && num >= 1) {
+            cfg->lossBurst = num;
+        } else if (strcmp(tok, "limit") == 0 && *end == '\0' && num >= 1) {
+            cfg->limit = num;
+        } else if (strcmp(tok, "seed") == 0 && *end == '\0') {
+            cfg->seed = strtoull(val, NULL, 10);
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+dp_netem *dpnetemnew(const dp_netem_cfg *cfg){
+    dp_netem *ne = calloc(1, sizeof(dp_netem));
+    pthread_condattr_t ca;
+
+    if (ne == NULL)
+        return NULL;
+    ne->cfg = *cfg;
+    if (ne->cfg.limit < 1)
+        ne->cfg.limit = DP_NETEM_LIMIT;
+    ne->rng = ne->cfg.seed;
+    pthread_mutex_init(&ne->lock, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&ne->cond, &ca);
+    pthread_condattr_destroy(&ca);
+    return ne;
+}
+
+/*
+ * Lets whatever is still on the delay line go out first, so a last ACK is
+ * not lost just because the connection closed
+ */
+void dpnetemfree(dp_netem *ne){
+    if (ne == NULL)
+        return;
+    pthread_mutex_lock(&ne->lock);
+    ne->stopping = true;
+    pthread_cond_signal(&ne->cond);
+    pthread_mutex_unlock(&ne->lock);
+    if (ne->running)
+        pthread_join(ne->tid, NULL);
+
+    for (int i = 0; i < ne->count; i++)
+        free(ne->heap[i]);
+    free(ne->heap);
+    pthread_mutex_destroy(&ne->lock);
+    pthread_cond_destroy(&ne->cond);
+    free(ne);
+}
+
+/*
+ * Is the next dgram lost?  With a burst length losses come in runs, a two
+ * state (Gilbert-Elliott) model: every dgram sent in the bad state is lost,
+ * and each one leaves it with a chance of 1/burst.  The chance of going bad
+ * is set so that over time lossPct of the dgrams are still lost.
+ *
+ * A burst is something that happens to the link, not to the sender, so it
+ * also ends once DP_NETEM_BURST_GAP_US pass without a dgram.  Otherwise a
+ * sender backing off after a timeout would find the link just as bad on
+ * every resend, however long it waited.
+ */
+static _Bool nelost(dp_netem *ne){
+    double p = ne->cfg.lossPct / 100, burst = ne->cfg.lossBurst;
+    long long now;
+
+    if (burst <= 1 || p <= 0 || p >= 1)
+        return nechance(ne, ne->cfg.lossPct);
+    now = nenow();
+    if (ne->inBurst && now - ne->lastDrawAt > DP_NETEM_BURST_GAP_US)
+        ne->inBurst = false;
+    ne->lastDrawAt = now;
+    if (ne->inBurst)
+        ne->inBurst = nerand(ne) * burst >= 1;
+    else
+        ne->inBurst = nerand(ne) < p / (burst * (1 - p));
+    return ne->inBurst;
+}
+
+//How many copies of the next dgram to send: 0 if it is lost, 2 for a dup
+int dpnetemfate(dp_netem *ne){
+    if (nelost(ne)) {
+        ne->stats.dropped++;
+        return 0;
+    }
+    if (nechance(ne, ne->cfg.dupPct)) {
+        ne->stats.duplicated++;
+        return 2;
+    }
+    return 1;
+}
+
+//Anything more than loss has to go through dpnetemsend()
+_Bool dpnetemdelays(dp_netem *ne){
+    return ne->cfg.dupPct > 0 || ne->cfg.reorderPct > 0 || ne->cfg.delayUs > 0 ||
+        ne->cfg.jitterUs > 0 || ne->cfg.rateBps > 0 || ne->cfg.corruptPct > 0;
+}
+
+
+//Min heap on (at, id)
+static _Bool nebefore(dp_nedgram *a, dp_nedgram *b){
+    return a->at < b->at || (a->at == b->at && a->id < b->id);
+}
+
+static void neheappush(dp_netem *ne, dp_nedgram *nd){
+    int i = ne->count++;
+    while (i > 0 && nebefore(nd, ne->heap[(i - 1) / 2])) {
+        ne->heap[i] = ne->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    ne->heap[i] = nd;
+}
+
+static dp_nedgram *neheappop(dp_netem *ne){
+    dp_nedgram *top = ne->heap[0];
+    dp_nedgram *last = ne->heap[--ne->count];
+    int i = 0;
+
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= ne->count)
+            break;
+        if (c + 1 < ne->count && nebefore(ne->heap[c + 1], ne->heap[c]))
+            c++;
+        if (!nebefore(ne->heap[c], last))
+            break;
+        ne->heap[i] = ne->heap[c];
+        i = c;
+    }
+    if (ne->count > 0)
+        ne->heap[i] = last;
+    return top;
+}
+
+//Sends each dgram on the delay line when its time comes
+static void *dpnetemthread(void *arg){
+    dp_netem *ne = arg;
+
+    pthread_mutex_lock(&ne->lock);
+    for (;;) {
+        if (ne->count == 0) {
+            if (ne->stopping)
+                break;
+            pthread_cond_wait(&ne->cond, &ne->lock);
+            continue;
+        }
+        dp_nedgram *nd = ne->heap[0];
+        if (nd->at > nenow()) {
+            struct timespec ts = { nd->at / 1000000, (nd->at % 1000000) * 1000 };
+            pthread_cond_timedwait(&ne->cond, &ne->lock, &ts);
+            continue;
+        }
+        neheappop(ne);
+        pthread_mutex_unlock(&ne->lock);
+        sendto(nd->sock, nd->data, nd->len, 0, (struct sockaddr *)&nd->to, sizeof(nd->to));
+        free(nd);
+        pthread_mutex_lock(&ne->lock);
+    }
+    pthread_mutex_unlock(&ne->lock);
+    return NULL;
+}
+
+/*
+ * Put a dgram on the delay line.  It waits for the link if there is a rate,
+ * then the delay plus or minus jitter, plus DP_NETEM_REORDER_US if it was
+ * picked to be reordered.  Returns the length as if it had been sent.
+ */
+int dpnetemsend(dp_netem *ne, int sock, const struct sockaddr_in *to,
+                const struct iovec *iov, int iovcnt){
+    long long now = nenow();
+    long long at = now;
+    int len = 0, off = 0;
+    dp_nedgram *nd;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    pthread_mutex_lock(&ne->lock);
+    if (ne->count >= ne->cfg.limit) {
+        ne->stats.overflow++;
+        pthread_mutex_unlock(&ne->lock);
+        return len;
+    }
+    if (ne->count == ne->cap) {
+        int cap = ne->cap ? 2 * ne->cap : 64;
+        dp_nedgram **heap = realloc(ne->heap, cap * sizeof(dp_nedgram *));
+        if (heap == NULL) {
+            pthread_mutex_unlock(&ne->lock);
+            return -1;
+        }
+        ne->heap = heap;
+        ne->cap = cap;
+    }
+    if (!ne->running) {
+        if (pthread_create(&ne->tid, NULL, dpnetemthread, ne) != 0) {
+            pthread_mutex_unlock(&ne->lock);
+            return -1;
+        }
+        ne->running = true;
+    }
+    if ((nd = malloc(sizeof(dp_nedgram) + len)) == NULL) {
+        pthread_mutex_unlock(&ne->lock);
+        return -1;
+    }
+
+    if (ne->cfg.rateBps > 0) {
+        if (ne->linkFreeAt > at)
+            at = ne->linkFreeAt;
+        at += len * 8 * 1000000LL / ne->cfg.rateBps;
+        ne->linkFreeAt = at;
+    }
+    at += ne->cfg.delayUs;
+    if (ne->cfg.jitterUs > 0)
+        at += (long long)((2 * nerand(ne) - 1) * ne->cfg.jitterUs);
+    //Jitter alone does not reorder, like a real link - only reorder does
+    if (nechance(ne, ne->cfg.reorderPct)) {
+        ne->stats.reordered++;
+        at += DP_NETEM_REORDER_US;
+    } else {
+        if (at < ne->lastAt)
+            at = ne->lastAt;
+        ne->lastAt = at;
+    }
+
+    nd->at = (at > now) ? at : now;
+    nd->id = ne->nextId++;
+    nd->sock = sock;
+    nd->to = *to;
+    nd->len = len;
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(nd->data + off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    if (len > 0 && nechance(ne, ne->cfg.corruptPct)) {
+        int bit = (int)(nerand(ne) * len * 8);
+        nd->data[bit / 8] ^= 1 << (bit % 8);
+        ne->stats.corrupted++;
+    }
+    neheappush(ne, nd);
+    pthread_cond_signal(&ne->cond);
+    pthread_mutex_unlock(&ne->lock);
+    return len;
+}
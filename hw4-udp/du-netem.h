@@ -0,0 +1,82 @@
+#pragma once
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <pthread.h>
+
+/*
+ * Network impairment for testing du-proto on loopback, in the spirit of
+ * Linux netem.  It sits between the raw send functions and the socket of
+ * one connection and works on outgoing dgrams only - give both ends their
+ * own settings to impair both directions.
+ *
+ *  loss, dup, reorder  - percent of dgrams dropped, sent twice, or held
+ *                        back DP_NETEM_REORDER_US so later ones overtake
+ *  burst               - mean length of a run of lost dgrams, the loss
+ *                        rate stays the same (1 = each loss on its own);
+ *                        a run ends early after DP_NETEM_BURST_GAP_US idle
+ *  corrupt             - percent of dgrams sent with one bit flipped
+ *  delay, jitter       - one way delay, plus or minus up to jitter (dgrams
+ *                        still leave in order)
+ *  rate                - bottleneck bandwidth, dgrams queue up behind it
+ *  limit               - dgrams on the delay line before new ones are lost
+ *
+ * All the random choices come from a generator seeded with cfg.seed, so
+ * the same seed gives the same loss pattern run after run.  With nothing
+ * but loss configured dgrams are sent (or not) right away; anything else
+ * puts them on a delay line that a background thread sends from.
+ */
+typedef struct dp_netem_cfg {
+    double      lossPct;
+    double      lossBurst;          //dgrams, <= 1 for independent losses
+    double      dupPct;
+    double      reorderPct;
+    double      corruptPct;
+    long long   delayUs;
+    long long   jitterUs;
+    long long   rateBps;            //bits per second, 0 = no limit
+    int         limit;
+    unsigned long long seed;
+} dp_netem_cfg;
+
+typedef struct dp_netem {
+    dp_netem_cfg        cfg;
+    unsigned long long  rng;
+    long long           linkFreeAt;     //rate limit - when the link is idle again
+    long long           lastAt;         //release time of the last in order dgram
+    _Bool               inBurst;        //losing every dgram, see lossBurst
+    long long           lastDrawAt;     //when the last dgram was lost or not
+
+    //Delay line, a heap ordered by release time
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           tid;
+    _Bool               running;
+    _Bool               stopping;
+    struct dp_nedgram   **heap;
+    int                 count;
+    int                 cap;
+    unsigned long       nextId;         //keeps equal release times in order
+
+    struct {
+        long            dropped;
+        long            duplicated;
+        long            reordered;
+        long            corrupted;
+        long            overflow;       //lost to the limit
+    } stats;
+} dp_netem;
+
+#define     DP_NETEM_SEED           1
+#define     DP_NETEM_LIMIT          1000
+#define     DP_NETEM_REORDER_US     1000
+#define     DP_NETEM_BURST_GAP_US   5000
+
+int  dpnetemparse(const char *spec, dp_netem_cfg *cfg);
+dp_netem *dpnetemnew(const dp_netem_cfg *cfg);
+void dpnetemfree(dp_netem *ne);
+int  dpnetemfate(dp_netem *ne);
+_Bool dpnetemdelays(dp_netem *ne);
+int  dpnetemsend(dp_netem *ne, int sock, const struct sockaddr_in *to,
+                 const struct iovec *iov, int iovcnt);
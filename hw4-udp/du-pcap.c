@@ -0,0 +1,314 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "du-pcap.h"
+
+/*
+ * pcapng (draft-ietf-opsawg-pcapng) - a section header, one interface and
+ * then an enhanced packet block per dgram, all in host byte order
+ */
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_MAGIC        0x1A2B3C4D
+#define PCAPNG_OPT_END      0
+#define PCAPNG_OPT_NAME     2           //if_name
+#define PCAPNG_OPT_TSRESOL  9           //if_tsresol, 6 = microseconds
+#define PCAPNG_OPT_FLAGS    2           //epb_flags
+#define LINKTYPE_RAW        101         //starts with the IP header
+
+#define TAP_IPUDP_SZ        28          //made up IPv4 + UDP header
+#define TAP_EPB_SZ(len)     (28 + (((len) + 3) & ~3) + 12 + 4)
+#define TAP_MAX_DGRAM       65507
+
+typedef struct dp_tap {
+    FILE            *fp;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_t       tid;
+    bool            stopping;
+    char            *buff[2];
+    int             fill;               //buffer being filled
+    int             len;
+    int             pendingLen;         //the other one, waiting to be written
+    uint16_t        ipId;
+    long            missed;
+} dp_tap;
+
+static dp_tap *_tap;
+
+
+static int tapopt(char *p, int code, const void *val, int len){
+    uint16_t hdr[2] = { code, len };
+    int pad = ((len + 3) & ~3) - len;
+
+    memcpy(p, hdr, 4);
+    memcpy(p + 4, val, len);
+    memset(p + 4 + len, 0, pad);
+    return 4 + len + pad;
+}
+
+//The section header and the one interface everything is recorded on
+static int tapheader(FILE *fp){
+    char b[128];
+    uint32_t u32;
+    uint16_t u16;
+    int64_t sectionLen = -1;
+    int off, start;
+
+    off = 8;
+    u32 = PCAPNG_MAGIC;
+    memcpy(b + off, &u32, 4);
+    u16 = 1;
+    memcpy(b + off + 4, &u16, 2);
+    u16 = 0;
+    memcpy(b + off + 6, &u16, 2);
+    memcpy(b + off + 8, &sectionLen, 8);
+    off += 16;
+    off += tapopt(b + off, PCAPNG_OPT_END, NULL, 0);
+    u32 = PCAPNG_SHB;
+    memcpy(b, &u32, 4);
+    u32 = off + 4;
+    memcpy(b + 4, &u32, 4);
+    memcpy(b + off, &u32, 4);
+    off += 4;
+
+    start = off;
+    off += 8;
+    u16 = LINKTYPE_RAW;
+    memcpy(b + off, &u16, 2);
+    u16 = 0;
+    memcpy(b + off + 2, &u16, 2);
+    u32 = TAP_IPUDP_SZ + TAP_MAX_DGRAM;
+    memcpy(b + off + 4, &u32, 4);
+    off += 8;
+    off += tapopt(b + off, PCAPNG_OPT_NAME, "du-proto", 8);
+    off += tapopt(b + off, PCAPNG_OPT_TSRESOL, "\x06", 1);
+    off += tapopt(b + off, PCAPNG_OPT_END, NULL, 0);
+    u32 = PCAPNG_IDB;
+    memcpy(b + start, &u32, 4);
+    u32 = off + 4 - start;
+    memcpy(b + start + 4, &u32, 4);
+    memcpy(b + off, &u32, 4);
+    off += 4;
+
+    return fwrite(b, 1, off, fp) == off ? 0 : -1;
+}
+
+//The buffer being filled becomes the one waiting to be written
+static void taphandover(dp_tap *tap){
+    tap->pendingLen = tap->len;
+    tap->fill ^= 1;
+    tap->len = 0;
+}
+
+//Writes out whatever was handed over, or the partly full buffer once
+//DP_TAP_FLUSH_MS go by without one
+static void *tapwriter(void *arg){
+    dp_tap *tap = arg;
+
+    pthread_mutex_lock(&tap->lock);
+    for (;;) {
+        if (tap->pendingLen == 0 && !tap->stopping) {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += DP_TAP_FLUSH_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&tap->cond, &tap->lock, &ts) != 0 &&
+                    tap->pendingLen == 0 && tap->len > 0)
+                taphandover(tap);
+        }
+        if (tap->pendingLen == 0 && tap->stopping && tap->len > 0)
+            taphandover(tap);
+        if (tap->pendingLen == 0) {
+            if (tap->stopping)
+                break;
+            continue;
+        }
+        char *out = tap->buff[tap->fill ^ 1];
+        int len = tap->pendingLen;
+        pthread_mutex_unlock(&tap->lock);
+        fwrite(out, 1, len, tap->fp);
+        fflush(tap->fp);
+        pthread_mutex_lock(&tap->lock);
+        tap->pendingLen = 0;
+    }
+    pthread_mutex_unlock(&tap->lock);
+    return NULL;
+}
+
+/*
+ * Start recording to path, replacing the file.  Anything still buffered is
+ * written out by dptapclose(), which also runs at exit.
+ */
+int dptapopen(const char *path){
+    dp_tap *tap;
+    pthread_condattr_t ca;
+
+    if (_tap != NULL)
+        return -1;
+    if ((tap = calloc(1, sizeof(dp_tap))) == NULL)
+        return -1;
+    tap->buff[0] = malloc(DP_TAP_BUFF_SZ);
+    tap->buff[1] = malloc(DP_TAP_BUFF_SZ);
+    if (tap->buff[0] == NULL || tap->buff[1] == NULL ||
+            (tap->fp = fopen(path, "wb")) == NULL || tapheader(tap->fp) < 0) {
+        if (tap->fp != NULL)
+            fclose(tap->fp);
+        free(tap->buff[0]);
+        free(tap->buff[1]);
+        free(tap);
+        return -1;
+    }
+    pthread_mutex_init(&tap->lock, NULL);
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_cond_init(&tap->cond, &ca);
+    pthread_condattr_destroy(&ca);
+    if (pthread_create(&tap->tid, NULL, tapwriter, tap) != 0) {
+        fclose(tap->fp);
+        free(tap->buff[0]);
+        free(tap->buff[1]);
+        free(tap);
+        return -1;
+    }
+    _tap = tap;
+    atexit(dptapclose);
+    return 0;
+}
+
+void dptapclose(){
+    dp_tap *tap = _tap;
+
+    if (tap == NULL)
+        return;
+    _tap = NULL;
+    pthread_mutex_lock(&tap->lock);
+    tap->stopping = true;
+    pthread_cond_signal(&tap->cond);
+    pthread_mutex_unlock(&tap->lock);
+    pthread_join(tap->tid, NULL);
+
+    fclose(tap->fp);
+    pthread_mutex_destroy(&tap->lock);
+    pthread_cond_destroy(&tap->cond);
+    free(tap->buff[0]);
+    free(tap->buff[1]);
+    free(tap);
+}
+
+_Bool dptapon(){
+    return _tap != NULL;
+}
+
+long dptapmissed(){
+    return (_tap != NULL) ? _tap->missed : 0;
+}
+
+static uint16_t tapcsum(const void *data, int len){
+    const uint16_t *w = data;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *w++;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/*
+ * Record one dgram of len bytes gathered from iov, going from src to dst.
+ * Called from the send and receive paths, so it only ever copies.
+ */
+void dptaprecord(int dir, const struct sockaddr_in *src, const struct sockaddr_in *dst,
+                 const struct iovec *iov, int iovcnt, int len){
+    dp_tap *tap = _tap;
+    struct timespec ts;
+    uint32_t u32, epbLen;
+    uint64_t usec;
+    char *p;
+
+    if (tap == NULL || len < 0 || len > TAP_MAX_DGRAM)
+        return;
+    epbLen = TAP_EPB_SZ(TAP_IPUDP_SZ + len);
+
+    //Stamped under the lock so the trace is in time order across threads
+    pthread_mutex_lock(&tap->lock);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    usec = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+    if (tap->stopping) {
+        pthread_mutex_unlock(&tap->lock);
+        return;
+    }
+    if (tap->len + epbLen > DP_TAP_BUFF_SZ) {
+        //Hand this buffer to the writer, unless it is still busy with the
+        //other one
+        if (tap->pendingLen > 0) {
+            tap->missed++;
+            pthread_mutex_unlock(&tap->lock);
+            return;
+        }
+        taphandover(tap);
+        pthread_cond_signal(&tap->cond);
+    }
+    p = tap->buff[tap->fill] + tap->len;
+    tap->len += epbLen;
+
+    u32 = PCAPNG_EPB;
+    memcpy(p, &u32, 4);
+    memcpy(p + 4, &epbLen, 4);
+    u32 = 0;                                //interface
+    memcpy(p + 8, &u32, 4);
+    u32 = usec >> 32;
+    memcpy(p + 12, &u32, 4);
+    u32 = (uint32_t)usec;
+    memcpy(p + 16, &u32, 4);
+    u32 = TAP_IPUDP_SZ + len;
+    memcpy(p + 20, &u32, 4);
+    memcpy(p + 24, &u32, 4);
+
+    //IPv4 and UDP, with no UDP checksum
+    unsigned char *ip = (unsigned char *)p + 28;
+    uint16_t u16;
+    memset(ip, 0, TAP_IPUDP_SZ);
+    ip[0] = 0x45;
+    u16 = htons(TAP_IPUDP_SZ + len);
+    memcpy(ip + 2, &u16, 2);
+    u16 = htons(tap->ipId++);
+    memcpy(ip + 4, &u16, 2);
+    ip[6] = 0x40;                           //DF
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy(ip + 12, &src->sin_addr, 4);
+    memcpy(ip + 16, &dst->sin_addr, 4);
+    u16 = tapcsum(ip, 20);
+    memcpy(ip + 10, &u16, 2);
+    memcpy(ip + 20, &src->sin_port, 2);
+    memcpy(ip + 22, &dst->sin_port, 2);
+    u16 = htons(8 + len);
+    memcpy(ip + 24, &u16, 2);
+
+    char *d = (char *)ip + TAP_IPUDP_SZ;
+    int left = len;
+    for (int i = 0; i < iovcnt && left > 0; i++) {
+        int n = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+        memcpy(d, iov[i].iov_base, n);
+        d += n;
+        left -= n;
+    }
+    p += 28 + ((TAP_IPUDP_SZ + len + 3) & ~3);
+    memset(d, 0, p - d);
+
+    u32 = dir;
+    p += tapopt(p, PCAPNG_OPT_FLAGS, &u32, 4);
+    p += tapopt(p, PCAPNG_OPT_END, NULL, 0);
+    memcpy(p, &epbLen, 4);
+    pthread_mutex_unlock(&tap->lock);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+/*
+ * Packet tap.  Records every du-proto dgram the process sends or receives
+ * into a pcapng file that Wireshark (with du-proto.lua) or tshark can open.
+ * There is one tap per process, shared by all its connections.
+ *
+ * Each dgram is recorded as it meets the socket, wrapped in a made up IPv4
+ * and UDP header (LINKTYPE_RAW) so the trace shows who it was between, and
+ * the pcapng direction flag says whether it was inbound or outbound.  A
+ * dgram the impairment shim drops is never recorded, one it corrupts is
+ * recorded as it was before the damage.
+ *
+ * Recording only copies the dgram into a buffer; a background thread
+ * writes full buffers out.  If the writer falls a whole buffer behind,
+ * dgrams are left out of the trace (and counted) rather than slowing the
+ * connection down.
+ */
+#define     DP_TAP_IN           1       //epb_flags direction bits
+#define     DP_TAP_OUT          2
+#define     DP_TAP_BUFF_SZ      (4 * 1024 * 1024)
+#define     DP_TAP_FLUSH_MS     200     //writes out a partly full buffer after this
+
+int   dptapopen(const char *path);
+void  dptapclose();
+_Bool dptapon();
+void  dptaprecord(int dir, const struct sockaddr_in *src, const struct sockaddr_in *dst,
+                  const struct iovec *iov, int iovcnt, int len);
+long  dptapmissed();
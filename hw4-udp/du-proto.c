@@ -1,3 +1,4 @@
+#define _GNU_SOURCE             //sendmmsg(), recvmmsg()
 #include <stdio.h> 
 #include <stdlib.h>
 #include <string.h>
@@ -6,11 +7,34 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 
 #include "du-proto.h"
-
-static char _dpBuffer[DP_MAX_DGRAM_SZ];
-static int  _debugMode = 1;
+#include "du-cc.h"
+#include "du-netem.h"
+#include "du-sum.h"
+#include "du-pcap.h"
+
+//Older headers do not have the UDP offload options
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT     103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO         104
+#endif
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL     40
+#endif
+
+//Print every PDU and event to stdout, see dpsetdebug().  A trace from the
+//packet tap (du-pcap.h) costs far less and shows more.
+static int  _debugMode = 0;
 
 static dp_connp dpinit(){
     dp_connp dpsession = malloc(sizeof(dp_connection));
@@ -22,22 +46,316 @@ static dp_connp dpinit(){
     dpsession->seqNum = 0;
     dpsession->isConnected = false;
     dpsession->dbgMode = true;
+
+    dpsession->wndSz = DP_DEF_WINDOW;
+    dpsession->wireVer = dpsession->rxVer = DP_PROTO_VER_1;
+    dpsession->maxVer = DP_DEF_VERSION;
+    dpsession->crc = DP_DEF_CRC;
+    dpsession->dgramMax = DP_DEF_DGRAM_SZ;
+    dpsession->pmtu = DP_BASE_BUFF_SZ;
+    dpsession->pmtuHigh = DP_MAX_BUFF_SZ + 1;
+    dpsession->pacing = DP_DEF_PACING;
+    dpsession->rto = DP_RTO_INIT_MS * 1000LL;
+    dpsession->cc = dpccops(DP_DEF_CC);
+    dpsession->cc->init(dpsession);
+    dpsession->txWnd = calloc(DP_MAX_WINDOW, sizeof(dp_txslot));
+    dpsession->rxWnd = calloc(DP_MAX_WINDOW, sizeof(dp_rxslot));
+    dpsession->dgramBuff = malloc(DP_MAX_DGRAM_SZ);
+    dpsession->loans = calloc(DP_MAX_LOANS, sizeof(dp_loan));
+    if (dpsession->txWnd == NULL || dpsession->rxWnd == NULL ||
+        dpsession->dgramBuff == NULL || dpsession->loans == NULL) {
+        dpclose(dpsession);
+        return NULL;
+    }
     return dpsession;
 }
 
 void dpclose(dp_connp dpsession) {
+    print_stats(dpsession);
+
+    //Whatever the application still holds goes back where it came from
+    for (int i = 0; dpsession->loans != NULL && i < DP_MAX_LOANS; i++)
+        if (dpsession->loans[i].inUse)
+            dploanfree(dpsession, &dpsession->loans[i]);
+
+    //A listener connection just gives its slot in the hash table back, the
+    //socket belongs to the listener
+    dp_listenp lp = dpsession->listener;
+    if (lp != NULL) {
+        pthread_mutex_lock(&lp->lock);
+        dp_connp *pp = &lp->buckets[dplhash(&dpsession->outSockAddr.addr)];
+        while (*pp != NULL && *pp != dpsession)
+            pp = &(*pp)->hashNext;
+        if (*pp != NULL)
+            *pp = dpsession->hashNext;
+        lp->rcvBuf -= dpsession->rcvBuf;
+        lp->sndBuf -= dpsession->sndBuf;
+        while (dpsession->inHead != NULL) {
+            dp_qdgram *qd = dpsession->inHead;
+            dpsession->inHead = qd->next;
+            qd->next = lp->freeList;
+            lp->freeList = qd;
+        }
+        pthread_mutex_unlock(&lp->lock);
+    }
+    //Anything still on the delay line goes out before the socket closes
+    dpnetemfree(dpsession->netem);
+    if (lp == NULL && dpsession->udp_sock > 0)
+        close(dpsession->udp_sock);
+
+    free(dpsession->txWnd);
+    free(dpsession->rxWnd);
+    free(dpsession->dgramBuff);
+    free(dpsession->fecAcc);
+    free(dpsession->fecTx);
+    free(dpsession->fecHist);
+    free(dpsession->fecRx);
+    free(dpsession->loans);
+    if (dpsession->rxb != NULL) {
+        for (int i = 0; i < DP_BATCH_MAX; i++)
+            free(dpsession->rxb->bufs[i]);
+        while (dpsession->rxb->freeList != NULL) {
+            dp_rxbuf *buf = dpsession->rxb->freeList;
+            dpsession->rxb->freeList = buf->next;
+            free(buf);
+        }
+    }
+    free(dpsession->rxb);
     free(dpsession);
 }
 
+int dpsetopt(dp_connp dp, int opt, int val) {
+    switch(opt){
+        case DP_OPT_WINDOW:
+            if (val < 1 || val > DP_MAX_WINDOW)
+                return DP_ERROR_GENERAL;
+            dp->wndSz = val;
+            return DP_NO_ERROR;
+        case DP_OPT_DROP:
+            if (val < 0 || val > 99)
+                return DP_ERROR_GENERAL;
+            if (val == 0 && dp->netem == NULL)
+                return DP_NO_ERROR;
+            if (dp->netem == NULL && dpsetimpair(dp, "loss=0") < 0)
+                return DP_ERROR_GENERAL;
+            dp->netem->cfg.lossPct = val;
+            return DP_NO_ERROR;
+        case DP_OPT_VERSION:
+            if (val < DP_PROTO_VER_1 || val > DP_PROTO_VER_2 || dp->isConnected)
+                return DP_ERROR_GENERAL;
+            dp->maxVer = val;
+            return DP_NO_ERROR;
+        case DP_OPT_CRC:
+            if (val < 0 || val > 1)
+                return DP_ERROR_GENERAL;
+            dp->crc = val;
+            return DP_NO_ERROR;
+        case DP_OPT_FEC:
+            if (val != 0 && (val < 2 || val > DP_FEC_MAX_GROUP))
+                return DP_ERROR_GENERAL;
+            if (val > 0 && dp->fecAcc == NULL) {
+                dp->fecAcc = calloc(1, DP_MAX_BUFF_SZ);
+                dp->fecTx = calloc(DP_FEC_MAX_TX, sizeof(dp_txslot));
+                if (dp->fecAcc == NULL || dp->fecTx == NULL) {
+                    free(dp->fecAcc);
+                    free(dp->fecTx);
+                    dp->fecAcc = NULL;
+                    dp->fecTx = NULL;
+                    return DP_ERROR_GENERAL;
+                }
+            }
+            //A group already started ends at the new size, or goes out
+            //without parity if FEC is now off
+            dp->fecK = val;
+            return DP_NO_ERROR;
+        case DP_OPT_DGRAM_SZ:
+            if (val < DP_BASE_BUFF_SZ || val > DP_MAX_BUFF_SZ || dp->state != DP_ST_IDLE)
+                return DP_ERROR_GENERAL;
+            dp->dgramMax = val;
+            return DP_NO_ERROR;
+        case DP_OPT_PACING:
+            if (val < 0 || val > 1)
+                return DP_ERROR_GENERAL;
+            dp->pacing = val;
+            dp->paceAt = 0;
+            return DP_NO_ERROR;
+        case DP_OPT_CC:
+            if (dpccops(val) == NULL)
+                return DP_ERROR_GENERAL;
+            dp->cc = dpccops(val);
+            dp->cc->init(dp);
+            return DP_NO_ERROR;
+        case DP_OPT_BATCH:
+            if (val < DP_BATCH_OFF || val > DP_BATCH_GSO)
+                return DP_ERROR_GENERAL;
+            dp->batch = val;
+            //Listener connections are fed from the listeners own batches
+            if (val == DP_BATCH_OFF || dp->listener != NULL)
+                return DP_NO_ERROR;
+            if (dp->rxb == NULL) {
+                dp->rxb = calloc(1, sizeof(dp_rxbatch));
+                if (dp->rxb == NULL)
+                    return DP_ERROR_GENERAL;
+            }
+            dp->gro = (val == DP_BATCH_GSO) &&
+                setsockopt(dp->udp_sock, SOL_UDP, UDP_GRO, &(int){1}, sizeof(int)) == 0;
+            if (val == DP_BATCH_GSO && !dp->gro)
+                setsockopt(dp->udp_sock, SOL_UDP, UDP_GRO, &(int){0}, sizeof(int));
+            //Room for DP_GRO_BUFS super-dgrams, or DP_BATCH_MAX plain ones
+            int buffSz = dp->gro ? DP_GRO_BUFF_SZ : DP_MAX_DGRAM_SZ;
+            int nbufs = dp->gro ? DP_GRO_BUFS : DP_BATCH_MAX;
+            if (dp->rxb->buffSz != buffSz) {
+                //Buffers of the old size are freed once their loans are back
+                dp_rxbatch *rb = dp->rxb;
+                for (int i = 0; i < DP_BATCH_MAX; i++) {
+                    if (rb->bufs[i] != NULL)
+                        dprxbput(rb, rb->bufs[i]);
+                    rb->bufs[i] = NULL;
+                }
+                rb->buffSz = buffSz;
+                while (rb->freeList != NULL) {
+                    dp_rxbuf *buf = rb->freeList;
+                    rb->freeList = buf->next;
+                    free(buf);
+                }
+                for (int i = 0; i < nbufs; i++)
+                    if ((rb->bufs[i] = dprxbget(rb)) == NULL)
+                        return DP_ERROR_GENERAL;
+                rb->count = rb->cur = rb->off = 0;
+            }
+            return DP_NO_ERROR;
+        default:
+            return DP_ERROR_GENERAL;
+    }
+}
+
+//Sequence numbers wrap, so compare them by their signed distance
+static inline _Bool dpseqbefore(unsigned int a, unsigned int b) {
+    return (int)(a - b) < 0;
+}
+
+//Is there room for another dgram?  The window caps everything outstanding,
+//cwnd only what is still in the network, so dgrams the peer reported in a
+//NACK dont count against it.  Limited transmit (RFC 3042) lets a new dgram
+//out for each of the first two duplicate ACKs, so a small cwnd still gets
+//enough of them for a fast retransmit.
+static inline _Bool dpwndfull(dp_connp dp) {
+    int cwnd = dp->cwnd;
+    if (!dp->inRecovery)
+        cwnd += (dp->dupAcks < 2) ? dp->dupAcks : 2;
+    return dp->txCount >= dp->wndSz || dp->txCount - dp->txSacked >= cwnd;
+}
+
+//Data moves the seqnum by its size, control (empty) dgrams move it by one
+static inline int dpseqspan(int dgram_sz) {
+    return (dgram_sz == 0) ? 1 : dgram_sz;
+}
+
+//The seqnum just past the last dgram that went out, pacing may be holding
+//back the end of the window
+static inline unsigned int dpsentseq(dp_connp dp) {
+    dp_txslot *last;
+
+    if (dp->txCount == dp->txUnsent)
+        return dp->sndUna;
+    last = &dp->txWnd[(dp->txHead + dp->txCount - dp->txUnsent - 1) % DP_MAX_WINDOW];
+    return last->seqnum + last->span;
+}
+
+//Do we send parity?  Only over v2, to a peer that agreed to it at connect
+static inline _Bool dpfecon(dp_connp dp) {
+    return dp->fecK > 0 && dp->fecPeer && dp->wireVer == DP_PROTO_VER_2;
+}
+
+static long long dpnow(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void dpgetstats(dp_connp dp, struct dp_stats *stats) {
+    memcpy(stats, &dp->stats, sizeof(struct dp_stats));
+}
+
 int  dpmaxdgram(){
     return DP_MAX_BUFF_SZ;
 }
 
+//How much data goes in one dgram right now, see DP_HS_DGRAM.  Parity is
+//DP_FEC_HDR_SZ bigger than the data it covers and has to get through too.
+int  dpdgramsz(dp_connp dp){
+    int sz = dp->pmtu;
+
+    if (dpfecon(dp) && sz - DP_FEC_HDR_SZ >= DP_BASE_BUFF_SZ)
+        sz -= DP_FEC_HDR_SZ;
+    return sz;
+}
+
+
+/*
+ * Create a UDP socket bound to port on all interfaces, filling in sa
+ */
+static int dpbindsock(struct dp_sock *sa, int port) {
+    struct sockaddr_in *servaddr = &(sa->addr);
+    int sock;
+
+    // Creating socket file descriptor 
+    if ( (sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { 
+        perror("socket creation failed"); 
+        return -1;
+    } 
+
+    // Filling server information 
+    servaddr->sin_family    = AF_INET; // IPv4 
+    servaddr->sin_addr.s_addr = INADDR_ANY; 
+    servaddr->sin_port = htons(port); 
+    sa->len = sizeof(struct sockaddr_in);
+
+    // Set socket options so that we dont have to wait for ports held by OS
+    // if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
+    //     perror("setsockopt(SO_REUSEADDR) failed");
+    //     close(sock);
+    //     return -1;
+    // }
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0){
+        perror("setsockopt(SO_REUSEADDR) failed");
+        close(sock);
+        return -1;
+    }
+    if (bind(sock, (const struct sockaddr *)servaddr, sa->len) < 0) { 
+        perror("bind failed"); 
+        close (sock);
+        return -1;
+    } 
+
+    sa->isAddrInit = true;
+    return sock;
+}
 
 dp_connp dpServerInit(int port) {
+
+    dp_connp dpc = dpinit();
+    if (dpc == NULL) {
+        perror("drexel protocol create failure"); 
+        return NULL;
+    }
+
+    dpc->udp_sock = dpbindsock(&dpc->inSockAddr, port);
+    if (dpc->udp_sock < 0) {
+        dpclose(dpc);
+        return NULL;
+    }
+    dpc->bufCap = dpbufinit(dpc->udp_sock, &dpc->rcvBuf, &dpc->sndBuf);
+
+    dpc->outSockAddr.len = sizeof(struct sockaddr_in);
+    dpsetopt(dpc, DP_OPT_BATCH, DP_DEF_BATCH);
+    return dpc;
+}
+
+
+dp_connp dpClientInit(char *addr, int port) {
     struct sockaddr_in *servaddr;
     int *sock;
-    int rc;
 
     dp_connp dpc = dpinit();
     if (dpc == NULL) {
@@ -46,8 +364,7 @@ dp_connp dpServerInit(int port) {
     }
 
     sock = &(dpc->udp_sock);
-    servaddr = &(dpc->inSockAddr.addr);
-        
+    servaddr = &(dpc->outSockAddr.addr);
 
     // Creating socket file descriptor 
     if ( (*sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { 
@@ -56,374 +373,3148 @@ dp_connp dpServerInit(int port) {
     } 
 
     // Filling server information 
-    servaddr->sin_family    = AF_INET; // IPv4 
-    servaddr->sin_addr.s_addr = INADDR_ANY; 
+    servaddr->sin_family = AF_INET; 
     servaddr->sin_port = htons(port); 
+    servaddr->sin_addr.s_addr = inet_addr(addr);
+    dpc->outSockAddr.len = sizeof(struct sockaddr_in); 
+    dpc->outSockAddr.isAddrInit = true;
 
-    // Set socket options so that we dont have to wait for ports held by OS
-    // if (setsockopt(*sock, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0){
-    //     perror("setsockopt(SO_REUSEADDR) failed");
-    //     close(*sock);
-    //     return NULL;
-    // }
-    if (setsockopt(*sock, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0){
-        perror("setsockopt(SO_REUSEADDR) failed");
-        close(*sock);
-        return NULL;
-    }
-    if ( (rc = bind(*sock, (const struct sockaddr *)servaddr,  
-            dpc->inSockAddr.len)) < 0 ) 
-    { 
-        perror("bind failed"); 
-        close (*sock);
-        return NULL;
-    } 
+    // The inbound address is the same as the outbound address
+    memcpy(&dpc->inSockAddr, &dpc->outSockAddr, sizeof(dpc->outSockAddr));
+    dpc->bufCap = dpbufinit(*sock, &dpc->rcvBuf, &dpc->sndBuf);
 
-    dpc->inSockAddr.isAddrInit = true;
-    dpc->outSockAddr.len = sizeof(struct sockaddr_in);
+    dpsetopt(dpc, DP_OPT_BATCH, DP_DEF_BATCH);
     return dpc;
 }
 
 
-dp_connp dpClientInit(char *addr, int port) {
-    struct sockaddr_in *servaddr;
-    int *sock;
+/*
+ * Receive one message of any length.  A message bigger than a dgram arrives
+ * as a run of DP_MT_FRAGMENT dgrams closed off by a plain DP_MT_SND, and the
+ * pieces are placed straight into buff as they come in.  If the message is
+ * bigger than buff_sz, buff is filled and the rest of the message is
+ * returned by the next call(s).  Returns the number of bytes placed in buff.
+ */
+int dprecv(dp_connp dp, void *buff, int buff_sz){
+    int rc;
+
+    if ((rc = dprecvstart(dp, buff, buff_sz, NULL, NULL)) < 0)
+        return rc;
+    return dpwaitfor(dp, &dp->rxOp);
+}
+
+/*
+ * Start receiving one message into buff, as dprecv() does.  done is called
+ * with the number of bytes placed in buff, or a DP error.
+ */
+int dprecvstart(dp_connp dp, void *buff, int buff_sz, dp_done_fn done, void *arg){
+    int rc;
+
+    if (buff_sz < 1)
+        return DP_BUFF_UNDERSIZED;
+    if ((rc = dprxbegin(dp, done, arg)) < 0)
+        return rc;
+    dp->rxOp.buff = buff;
+    dp->rxOp.len = buff_sz;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Receive up to n dgrams without copying them, see DP_MAX_LOANS.  Each of
+ * lent[] that is used is pointed at a payload, which stays where it is
+ * until dprelease().  It waits for the first dgram, then lends the ones
+ * that are already here, up to the end of the message.  Returns how many
+ * were lent, or a DP error.
+ */
+int dprecvlend(dp_connp dp, dp_lent *lent, int n){
+    int rc;
+
+    if ((rc = dprecvlendstart(dp, lent, n, NULL, NULL)) < 0)
+        return rc;
+    return dpwaitfor(dp, &dp->rxOp);
+}
+
+/*
+ * Start lending dgrams, as dprecvlend() does.  done is called with how many
+ * of lent[] were filled in, or with a DP error.  Gives DP_ERROR_BUSY while
+ * DP_MAX_LOANS are out.
+ */
+int dprecvlendstart(dp_connp dp, dp_lent *lent, int n, dp_done_fn done, void *arg){
+    int rc;
+
+    if (n < 1)
+        return DP_BUFF_UNDERSIZED;
+    if (dp->loanCount >= DP_MAX_LOANS)
+        return DP_ERROR_BUSY;
+    //Only batched and listener dgrams are read somewhere they can stay
+    if (dp->rxb == NULL && dp->listener == NULL)
+        return DP_ERROR_GENERAL;
+    if ((rc = dprxbegin(dp, done, arg)) < 0)
+        return rc;
+    dp->rxOp.lent = lent;
+    dp->rxOp.len = (n < DP_MAX_LOANS - dp->loanCount) ? n : DP_MAX_LOANS - dp->loanCount;
+    return DP_NO_ERROR;
+}
+
+//Give a dgram from dprecvlend() back
+void dprelease(dp_connp dp, dp_lent *lent){
+    if (lent->loan < 0 || lent->loan >= DP_MAX_LOANS || !dp->loans[lent->loan].inUse)
+        return;
+    dploanfree(dp, &dp->loans[lent->loan]);
+    lent->data = NULL;
+}
+
+//What dprecvstart() and dprecvlendstart() have in common
+static int dprxbegin(dp_connp dp, dp_done_fn done, void *arg){
+    if (dp->rxOp.pending)
+        return DP_ERROR_BUSY;
+    if (dp->state == DP_ST_PEERCLOSED || dp->state == DP_ST_CLOSED)
+        return DP_CONNECTION_CLOSED;
+
+    memset(&dp->rxOp, 0, sizeof(dp_op));
+    dp->rxOp.pending = true;
+    dp->rxOp.done = done;
+    dp->rxOp.arg = arg;
+    dp->rxOp.idleAt = dpnow() + DP_IDLE_TIMEOUT_MS * 1000LL;
+    dp->kick = true;
+    return DP_NO_ERROR;
+}
+
+//Is a receive pending that can take data now?  Not until our own sends are
+//all ACKd, so the sequence numbers line up.
+static _Bool dprxwaiting(dp_connp dp){
+    return dp->rxOp.pending && !dp->rxOp.finished && dp->state == DP_ST_OPEN &&
+        dp->txCount == 0 && !dp->txOp.pending;
+}
+
+//Dgrams that arrived early may already be in sequence and waiting
+static void dprxstep(dp_connp dp){
+    dp_op *op = &dp->rxOp;
+    _Bool last;
+    int rc;
+
+    while (dprxwaiting(dp) && dp->rcvDlv != dp->seqNum) {
+        if (op->lent != NULL) {
+            dplendparked(dp);
+            continue;
+        }
+        last = false;
+        if ((rc = dprecvparked(dp, op->buff + op->off, op->len - op->off, &last)) < 0) {
+            dpfinish(op, rc);
+            return;
+        }
+        op->off += rc;
+        //callers buffer is full, rest comes next time
+        if (last || op->off == op->len)
+            dpfinish(op, op->off);
+    }
+}
+
+/*
+ * Hand the caller the next in-sequence dgram from the reorder buffer, or as
+ * much of it as fits
+ */
+static int dprecvparked(dp_connp dp, void *buff, int buff_sz, _Bool *last){
+    dp_rxslot *slot = dprxfind(dp, dp->rcvDlv);
+    int len;
+
+    //Should not happen, seqNum only moves past dgrams we are holding
+    if (slot == NULL)
+        return DP_ERROR_PROTOCOL;
+
+    len = slot->len - slot->off;
+    if (len > buff_sz)
+        len = buff_sz;
+    memcpy(buff, slot->data + slot->off, len);
+    slot->off += len;
+
+    if (slot->off == slot->len) {
+        slot->inUse = false;
+        dp->rcvDlv += dpseqspan(slot->len);
+        *last = !(slot->mtype & DP_MT_FRAGMENT);
+    }
+    return len;
+}
+
+//Lend the next in-sequence dgram from the reorder buffer where it is
+static void dplendparked(dp_connp dp){
+    dp_rxslot *slot = dprxfind(dp, dp->rcvDlv);
+    int idx = dprxloan(dp);
+
+    //Should not happen, seqNum only moves past dgrams we are holding, and
+    //dprecvlendstart() made sure there were loans free
+    if (slot == NULL || idx < 0) {
+        dpfinish(&dp->rxOp, DP_ERROR_PROTOCOL);
+        return;
+    }
+    slot->lent = true;
+    dp->loans[idx].slot = slot;
+    dp->rcvDlv += dpseqspan(slot->len);
+    dprxlent(dp, idx, slot->data + slot->off, slot->len - slot->off, slot->mtype);
+}
+
+//Fill in the next of the pending receive's dp_lent, see dprecvlend()
+static void dprxlent(dp_connp dp, int idx, char *data, int len, int mtype){
+    dp_op *op = &dp->rxOp;
+    dp_lent *lent = &op->lent[op->off++];
+
+    lent->data = data;
+    lent->len = len;
+    lent->last = !(mtype & DP_MT_FRAGMENT);
+    lent->loan = idx;
+    dp->stats.lent++;
+    if (lent->last || op->off == op->len)
+        dpfinish(op, op->off);
+}
+
+static dp_rxslot *dprxfind(dp_connp dp, unsigned int seqnum){
+    for (int i = 0; i < DP_MAX_WINDOW; i++)
+        if (dp->rxWnd[i].inUse && !dp->rxWnd[i].lent && dp->rxWnd[i].seqnum == seqnum)
+            return &dp->rxWnd[i];
+    return NULL;
+}
+
+static dp_rxslot *dprxpark(dp_connp dp, dp_pdu *pdu, void *payload){
+    for (int i = 0; i < DP_MAX_WINDOW; i++) {
+        dp_rxslot *slot = &dp->rxWnd[i];
+        if (slot->inUse)
+            continue;
+        slot->inUse = true;
+        slot->seqnum = pdu->seqnum;
+        slot->mtype = pdu->mtype;
+        slot->len = pdu->dgram_sz;
+        slot->off = 0;
+        memcpy(slot->data, payload, pdu->dgram_sz);
+        return slot;
+    }
+    return NULL;
+}
+
+/*
+ * dpinput() says the dgram in pdu/payload is the next one in sequence, and
+ * the pending receive wants it lent.  payload is still in the batch buffer
+ * or listener queue entry it was read into, which now stays put for it.
+ */
+static void dprxlend(dp_connp dp, dp_pdu *pdu, char *payload){
+    dp_op *op = &dp->rxOp;
+    int idx = dprxloan(dp);
+
+    //dprecvlendstart() made sure there were enough free
+    if (idx < 0) {
+        dpfinish(op, DP_ERROR_GENERAL);
+        return;
+    }
+    dp->rcvDlv = pdu->seqnum + dpseqspan(pdu->dgram_sz);
+    if (dp->rxBuf != NULL) {
+        dp->rxBuf->refs++;
+        dp->loans[idx].buf = dp->rxBuf;
+    } else {
+        dp->loans[idx].qd = dp->rxQd;
+        dp->rxQd = NULL;
+    }
+    dprxlent(dp, idx, payload, pdu->dgram_sz, pdu->mtype);
+}
+
+//A free loan, marked in use, or -1
+static int dprxloan(dp_connp dp){
+    if (dp->loanCount >= DP_MAX_LOANS)
+        return -1;
+    for (int i = 0; i < DP_MAX_LOANS; i++) {
+        if (dp->loans[i].inUse)
+            continue;
+        memset(&dp->loans[i], 0, sizeof(dp_loan));
+        dp->loans[i].inUse = true;
+        dp->loanCount++;
+        return i;
+    }
+    return -1;
+}
+
+//Done with the dgram dpinputall() read, unless it was lent
+static void dprxdone(dp_connp dp){
+    if (dp->rxQd != NULL) {
+        dp_listenp lp = dp->listener;
+        pthread_mutex_lock(&lp->lock);
+        dp->rxQd->next = lp->freeList;
+        lp->freeList = dp->rxQd;
+        pthread_mutex_unlock(&lp->lock);
+    }
+    dp->rxQd = NULL;
+    dp->rxBuf = NULL;
+    dp->rxAt = NULL;
+}
+
+static void dploanfree(dp_connp dp, dp_loan *loan){
+    if (loan->buf != NULL)
+        dprxbput(dp->rxb, loan->buf);
+    if (loan->qd != NULL) {
+        dp_listenp lp = dp->listener;
+        pthread_mutex_lock(&lp->lock);
+        loan->qd->next = lp->freeList;
+        lp->freeList = loan->qd;
+        pthread_mutex_unlock(&lp->lock);
+    }
+    if (loan->slot != NULL)
+        loan->slot->inUse = loan->slot->lent = false;
+    memset(loan, 0, sizeof(dp_loan));
+    dp->loanCount--;
+}
+
+/*
+ * dpinput() says the dgram in pdu/payload is the next one in sequence, hand
+ * it to the pending receive.  As long as the receive had room for a full
+ * dgram the payload was received directly into its buffer, so in-sequence
+ * data is never copied.
+ */
+static int dprxdeliver(dp_connp dp, dp_pdu *pdu, char *payload){
+    dp_op *op = &dp->rxOp;
+    _Bool last = !(pdu->mtype & DP_MT_FRAGMENT);
+    int len = pdu->dgram_sz;
+
+    if (payload == op->buff + op->off) {
+        dp->rcvDlv = pdu->seqnum + dpseqspan(pdu->dgram_sz);
+    } else {
+        //Only part of it fits, already ACKd so park the rest for the next call
+        if (len > op->len - op->off)
+            len = op->len - op->off;
+        memcpy(op->buff + op->off, payload, len);
+        if (len == pdu->dgram_sz) {
+            dp->rcvDlv = pdu->seqnum + dpseqspan(pdu->dgram_sz);
+        } else {
+            dp_rxslot *slot = dprxpark(dp, pdu, payload);
+            if (slot == NULL)
+                return DP_ERROR_GENERAL;
+            slot->off = len;
+            last = false;
+        }
+    }
+    op->off += len;
+    if (last || op->off == op->len)
+        dpfinish(op, op->off);
+    return DP_NO_ERROR;
+}
+
+/*
+ * Process one inbound dgram, header in pdu and payload wherever it was
+ * received.  ACKs slide the send window.  Data that is next in sequence is
+ * left where it is for the caller if canDeliver is set, otherwise it is
+ * parked in the reorder buffer.  Data that is ahead of sequence is parked,
+ * and duplicates are dropped.  Every data dgram gets a cumulative ACK
+ * carrying the next sequence number we expect.
+ *
+ * Returns true if payload holds the next in-sequence data for the caller,
+ * DP_NO_ERROR (0) if there is nothing for the caller, or a DP error.
+ */
+static int dpinput(dp_connp dp, dp_pdu *pdu, void *payload, int bytesIn, _Bool canDeliver){
+    dp_pdu inPdu;
+    dp_rxslot *slot;
+
+    //Failed its CRC, it is gone as far as anyone is concerned
+    if (bytesIn == 0)
+        return DP_NO_ERROR;
+
+    //check for some sort of error, tell the peer and drop the dgram
+    if (bytesIn < (int)sizeof(dp_pdu)) {
+        dpsendack(dp, DP_MT_ERROR, DP_ERROR_BAD_DGRAM);
+        return DP_NO_ERROR;
+    }
+    memcpy(&inPdu, pdu, sizeof(dp_pdu));
+    if (inPdu.dgram_sz < 0 || inPdu.dgram_sz > bytesIn - (int)sizeof(dp_pdu) ||
+        inPdu.dgram_sz > ((inPdu.mtype & DP_MT_FEC) ? DP_MAX_PAYLOAD_SZ : DP_MAX_BUFF_SZ)) {
+        dpsendack(dp, DP_MT_ERROR, DP_BUFF_UNDERSIZED);
+        return DP_NO_ERROR;
+    }
+
+    //Fragments are just data that does not end a message
+    switch(inPdu.mtype & ~(DP_MT_FRAGMENT | DP_MT_PROTECTED)){
+        case DP_MT_SNDACK:
+            dp->peerHigh = inPdu.seqnum;
+            dpprocessack(dp, &inPdu);
+            return DP_NO_ERROR;
+
+        case DP_MT_NACK:
+        {
+            dp_nack nack = {0};
+            memcpy(&nack, payload, inPdu.dgram_sz < sizeof(nack) ? inPdu.dgram_sz : sizeof(nack));
+            if (dp->rxVer == DP_PROTO_VER_2)
+                dpnackntoh(&nack);
+            if (inPdu.dgram_sz < DP_NACK_SZ(0) || nack.count < 0 ||
+                nack.count > DP_MAX_NACK_RANGES || inPdu.dgram_sz < DP_NACK_SZ(nack.count))
+                return DP_NO_ERROR;
+            dpprocessnack(dp, &inPdu, &nack);
+            return DP_NO_ERROR;
+        }
+
+        case DP_MT_SND:
+            if (inPdu.seqnum == dp->seqNum) {
+                //In sequence, plus anything parked right behind it
+                if (!canDeliver && dprxpark(dp, &inPdu, payload) == NULL)
+                    return DP_NO_ERROR;     //no room, let it come again
+                dpfecremember(dp, inPdu.seqnum, inPdu.mtype, payload, inPdu.dgram_sz);
+                dp->seqNum += dpseqspan(inPdu.dgram_sz);
+                while ((slot = dprxfind(dp, dp->seqNum)) != NULL) {
+                    dpfecremember(dp, slot->seqnum, slot->mtype, slot->data, slot->len);
+                    dp->seqNum += dpseqspan(slot->len);
+                }
+                if (dp->fecPending > 0)
+                    dpfectry(dp);
+                //One cumulative ACK covers a whole received batch
+                if (dprxbpending(dp))
+                    dp->ackPending = true;
+                else if (dpsendack(dp, DP_MT_SNDACK, DP_NO_ERROR) < 0)
+                    return DP_ERROR_PROTOCOL;
+                return canDeliver;
+            }
+            if (dpseqbefore(dp->seqNum, inPdu.seqnum) &&
+                dpseqbefore(inPdu.seqnum, dp->seqNum + DP_MAX_WINDOW * DP_MAX_BUFF_SZ) &&
+                dprxfind(dp, inPdu.seqnum) == NULL &&
+                dprxpark(dp, &inPdu, payload) != NULL && dp->fecPending > 0)
+                dpfectry(dp);
+            //Early or duplicate, either way re-ACK (NACK) what we have
+            if (dprxbpending(dp))
+                dp->ackPending = true;
+            else if (dpsendack(dp, DP_MT_SNDACK, DP_NO_ERROR) < 0)
+                return DP_ERROR_PROTOCOL;
+            return DP_NO_ERROR;
+
+        case DP_MT_FEC:
+            if (dp->fecPeer)
+                dpfecinput(dp, &inPdu, payload);
+            return DP_NO_ERROR;
+
+        case DP_MT_CLOSE:
+            //Hang around briefly in case the CLOSE/ACK is lost and the peer
+            //sends the CLOSE again, see dptimers()
+            dp->seqNum++;
+            dp->state = DP_ST_PEERCLOSED;
+            dp->isConnected = false;
+            dp->lingerUntil = dpnow() + DP_LINGER_MS * 1000LL;
+            if (dpsendack(dp, DP_MT_CLOSEACK, DP_NO_ERROR) < 0)
+                return DP_ERROR_PROTOCOL;
+            return DP_CONNECTION_CLOSED;
+
+        case DP_MT_PROBE:
+        {
+            //Tell the sender a dgram this big got through
+            dp_pdu ackPdu = {0};
+            ackPdu.proto_ver = dp->wireVer;
+            ackPdu.mtype = DP_MT_PROBEACK;
+            ackPdu.seqnum = inPdu.dgram_sz;
+            dpsendrawv(dp, &ackPdu, NULL, 0);
+            return DP_NO_ERROR;
+        }
+
+        case DP_MT_PROBEACK:
+            dppmtuack(dp, inPdu.seqnum);
+            return DP_NO_ERROR;
+
+        case DP_MT_CONNECT:
+        {
+            //Our CONNECT/ACK was lost and the peer is trying again, it gets
+            //the same answer
+            dp_pdu ackPdu = inPdu;
+            uint32_t agreed;
+            int n = dpnegotiate(dp, &ackPdu, &agreed);
+            ackPdu.mtype = DP_MT_CNTACK;
+            ackPdu.seqnum = inPdu.seqnum + 1;
+            dpsendrawv(dp, &ackPdu, &agreed, n);
+            return DP_NO_ERROR;
+        }
+
+        case DP_MT_CNTACK:
+        case DP_MT_CLOSEACK:
+            //Duplicates of handshake ACKs we already have
+            return DP_NO_ERROR;
+
+        case DP_MT_ERROR:
+            printf("WARNING: Peer reported error %d\n", inPdu.err_num);
+            return DP_NO_ERROR;
+
+        default:
+            printf("ERROR: Unexpected or bad mtype in header %d\n", inPdu.mtype);
+            return DP_ERROR_PROTOCOL;
+    }
+}
+
+static int dpsendack(dp_connp dp, int mtype, int errCode){
+    dp_pdu outPdu = {0};
+    dp_nack nack;
+    int nackSz = 0;
+
+    //With holes in what we hold, tell the sender which ones
+    if (mtype == DP_MT_SNDACK && (nackSz = dpbuildnack(dp, &nack)) > 0)
+        mtype = DP_MT_NACK;
+
+    outPdu.proto_ver = dp->wireVer;
+    outPdu.mtype = mtype;
+    outPdu.dgram_sz = nackSz;
+    outPdu.seqnum = dp->seqNum;
+    outPdu.err_num = errCode;
+
+    //Every ACK carries seqNum, so this covers any that was held back
+    dp->ackPending = false;
+    if (nackSz > 0 && dp->wireVer == DP_PROTO_VER_2)
+        dpnackhton(&nack);
+    if (dpsendrawv(dp, &outPdu, &nack, nackSz) != sizeof(dp_pdu) + nackSz)
+        return DP_ERROR_PROTOCOL;
+    return DP_NO_ERROR;
+}
+
+/*
+ * List the holes between seqNum and the dgrams parked ahead of it.  Returns
+ * the NACK payload size, or 0 if nothing is parked ahead (no holes).
+ */
+static int dpbuildnack(dp_connp dp, dp_nack *nack){
+    dp_rxslot *ahead[DP_MAX_WINDOW];
+    int n = 0;
+    unsigned int expect = dp->seqNum;
+
+    for (int i = 0; i < DP_MAX_WINDOW; i++)
+        if (dp->rxWnd[i].inUse && dpseqbefore(dp->seqNum, dp->rxWnd[i].seqnum))
+            ahead[n++] = &dp->rxWnd[i];
+    if (n == 0)
+        return 0;
+
+    //Few enough to just insertion sort by seqnum
+    for (int i = 1; i < n; i++)
+        for (int j = i; j > 0 && dpseqbefore(ahead[j]->seqnum, ahead[j - 1]->seqnum); j--) {
+            dp_rxslot *t = ahead[j];
+            ahead[j] = ahead[j - 1];
+            ahead[j - 1] = t;
+        }
+
+    nack->count = 0;
+    for (int i = 0; i < n; i++) {
+        if (ahead[i]->seqnum != expect) {
+            //Out of room, only claim what we can describe
+            if (nack->count == DP_MAX_NACK_RANGES)
+                break;
+            nack->ranges[nack->count].start = expect;
+            nack->ranges[nack->count++].end = ahead[i]->seqnum;
+        }
+        expect = ahead[i]->seqnum + dpseqspan(ahead[i]->len);
+    }
+    nack->highSeq = expect;
+    return DP_NACK_SZ(nack->count);
+}
+
+/*
+ * A cumulative ACK covers every dgram that ends at or before its seqnum, so
+ * release those from the front of the send window.  An ACK that does not
+ * move the window while dgrams are outstanding is a duplicate, meaning the
+ * receiver is holding later dgrams and is missing the oldest one.
+ *
+ * Once a loss is detected we stay in recovery until everything that was in
+ * flight at the time is ACKd.  An ACK that moves the window but stops short
+ * of that (a partial ACK, RFC 6582) points straight at the next hole, so it
+ * is resent right away instead of waiting for more duplicates or the RTO.
+ */
+static void dpprocessack(dp_connp dp, dp_pdu *pdu){
+    unsigned int ack = pdu->seqnum;
+    long long now = dpnow();
+    long long rtt = -1;
+    int acked = 0;
+
+    if (ack == dp->sndUna && dp->txCount > dp->txUnsent) {
+        dp->stats.dupAcks++;
+        if (++dp->dupAcks == DP_DUPACK_THRESH && !dp->inRecovery) {
+            dp->cc->onloss(dp, false);
+            dp->inRecovery = true;
+            dp->recoverSeq = dpsentseq(dp);
+            dp->stats.fastRetransmits++;
+            dpretransmit(dp, &dp->txWnd[dp->txHead], "fast retransmit");
+        }
+        return;
+    }
+    //Both directions share the seqnum, and the peers only moves over data
+    //it has in sequence.  An ACK past it means the peer had all we sent and
+    //is sending its own, which happens when its ACK of our tail was lost.
+    if (dpseqbefore(dp->seqNum, ack) && dp->txCount > 0) {
+        dp_txslot *tail = &dp->txWnd[(dp->txHead + dp->txCount - 1) % DP_MAX_WINDOW];
+        ack = tail->seqnum + tail->span;
+    }
+    if (!dpseqbefore(dp->sndUna, ack) || dpseqbefore(dp->seqNum, ack))
+        return;     //old or bogus ACK
+    dp->sndUna = ack;
+
+    while (dp->txCount > 0) {
+        dp_txslot *slot = &dp->txWnd[dp->txHead];
+        if (dpseqbefore(ack, slot->seqnum + slot->span))
+            break;
+        //Karn - only time dgrams that were never resent, and that were not
+        //stuck behind a hole a retransmit just filled
+        if (slot->retx == 0 && slot->sentAt > dp->lastRetxAt)
+            rtt = now - slot->sentAt;
+        if (slot->fecHeld && slot->retx == 0)
+            dp->stats.fecRepaired++;
+        if (slot->sacked)
+            dp->txSacked--;
+        dp->txHead = (dp->txHead + 1) % DP_MAX_WINDOW;
+        dp->txCount--;
+        acked++;
+    }
+    //New data ACKd, so the peer is alive - drop any timeout backoff and
+    //restart the retransmit timer
+    if (rtt >= 0)
+        dprttsample(dp, rtt);
+    else
+        dpsetrto(dp);
+    dp->cc->onack(dp, acked, rtt);
+    dp->retries = 0;
+    dp->dupAcks = 0;
+    dp->probeSent = false;
+    //An ACK from a peer that moved on to its own data may take the unsent
+    //tail with it
+    if (dp->txUnsent > dp->txCount)
+        dp->txUnsent = dp->txCount;
+    dp->rtoDeadline = (dp->txCount > dp->txUnsent) ? now + dp->rto : 0;
+
+    if (dp->inRecovery) {
+        if (dp->txCount > dp->txUnsent && dpseqbefore(ack, dp->recoverSeq)) {
+            //A NACK may well have had it resent already, or left it to the
+            //parity
+            if (dpresenddue(dp, &dp->txWnd[dp->txHead], now) &&
+                    !dpfecwait(dp, &dp->txWnd[dp->txHead]))
+                dpretransmit(dp, &dp->txWnd[dp->txHead], "partial ack");
+        } else {
+            dp->inRecovery = false;
+        }
+    }
+}
+
+/*
+ * A NACK is a cumulative ACK plus the list of holes the receiver has below
+ * highSeq.  Every unACKd dgram in a hole is resent (unless it was resent so
+ * recently that the copy may still be on its way), and the ones outside the
+ * holes are marked as delivered so they no longer count as in flight.  The
+ * first NACK of a loss episode is a congestion signal, same as a fast
+ * retransmit.  Holes the peer may still fill from FEC parity are left alone
+ * for now, see dpfecwait().
+ */
+static void dpprocessnack(dp_connp dp, dp_pdu *pdu, dp_nack *nack){
+    long long now = dpnow();
+
+    dp->stats.nacks++;
+    dp->peerHigh = nack->highSeq;
+    if (dpseqbefore(dp->sndUna, pdu->seqnum))
+        dpprocessack(dp, pdu);
+    if (nack->count == 0 || dp->txCount == 0)
+        return;
+
+    if (!dp->inRecovery) {
+        dp->cc->onloss(dp, false);
+        dp->inRecovery = true;
+        dp->recoverSeq = dpsentseq(dp);
+    }
+
+    dp->txSacked = 0;
+    for (int i = 0; i < dp->txCount; i++) {
+        dp_txslot *slot = &dp->txWnd[(dp->txHead + i) % DP_MAX_WINDOW];
+        _Bool missing = false;
+
+        if (!dpseqbefore(slot->seqnum, nack->highSeq))
+            break;
+        for (int r = 0; r < nack->count && !missing; r++)
+            missing = !dpseqbefore(slot->seqnum, nack->ranges[r].start) &&
+                dpseqbefore(slot->seqnum, nack->ranges[r].end);
+
+        slot->sacked = !missing;
+        if (slot->sacked)
+            dp->txSacked++;
+        else if (dpfecwait(dp, slot))
+            slot->fecHeld = true;
+        else if (dpresenddue(dp, slot, now))
+            dpretransmit(dp, slot, "nack");
+    }
+    //Later dgrams keep their marks from earlier NACKs
+    for (int i = 0; i < dp->txCount; i++) {
+        dp_txslot *slot = &dp->txWnd[(dp->txHead + i) % DP_MAX_WINDOW];
+        if (!dpseqbefore(slot->seqnum, nack->highSeq) && slot->sacked)
+            dp->txSacked++;
+    }
+}
+
+//v2 sends the NACK payload in network byte order too
+static void dpnackhton(dp_nack *nack){
+    for (int i = 0; i < nack->count; i++) {
+        nack->ranges[i].start = htonl(nack->ranges[i].start);
+        nack->ranges[i].end = htonl(nack->ranges[i].end);
+    }
+    nack->highSeq = htonl(nack->highSeq);
+    nack->count = htonl(nack->count);
+}
+
+static void dpnackntoh(dp_nack *nack){
+    nack->highSeq = ntohl(nack->highSeq);
+    nack->count = ntohl(nack->count);
+    for (int i = 0; i < nack->count && i < DP_MAX_NACK_RANGES; i++) {
+        nack->ranges[i].start = ntohl(nack->ranges[i].start);
+        nack->ranges[i].end = ntohl(nack->ranges[i].end);
+    }
+}
+
+//// FORWARD ERROR CORRECTION, see DP_MT_FEC in du-proto.h
+
+/*
+ * Fold a dgram going out for the first time into the parity of its group,
+ * idx being where it is in the send window.  The group ends after fecK
+ * dgrams or with the message, whichever comes first, see dptxpush() for
+ * groups that fill slowly.
+ */
+static void dpfecadd(dp_connp dp, dp_txslot *slot, int idx){
+    int len = slot->hdr.dgram_sz;
+
+    if (!(slot->hdr.mtype & DP_MT_PROTECTED)) {
+        //FEC was turned off part way through a group, it goes without
+        if (dp->fecCount > 0)
+            dpfecclose(dp, -1);
+        return;
+    }
+    if (dp->fecCount == 0) {
+        dp->fecStart = slot->seqnum;
+        dp->fecOpenAt = slot->sentAt;
+        dp->fecLen = dp->fecLenXor = 0;
+        dp->fecFrag = false;
+    }
+    dpxor(dp->fecAcc, slot->payload, len);
+    if (len > dp->fecLen)
+        dp->fecLen = len;
+    dp->fecLenXor ^= len;
+    dp->fecFrag ^= (slot->hdr.mtype & DP_MT_FRAGMENT) != 0;
+    if (++dp->fecCount >= dp->fecK || !(slot->hdr.mtype & DP_MT_FRAGMENT))
+        dpfecclose(dp, idx);
+}
+
+/*
+ * The group ending with the dgram at idx is complete, build its parity for
+ * dpfecpush() to send and mark the group's dgrams as covered by it.  With
+ * idx -1 the group is dropped instead.
+ */
+static void dpfecclose(dp_connp dp, int idx){
+    dp_txslot *par;
+    dp_fec_hdr fh;
+
+    //Only so much room per push, a group that misses out is just unprotected
+    if (idx >= 0 && dp->fecTxCount < DP_FEC_MAX_TX) {
+        dp_txslot *last = &dp->txWnd[(dp->txHead + idx) % DP_MAX_WINDOW];
+        unsigned int end = last->seqnum + last->span;
+
+        par = &dp->fecTx[dp->fecTxCount++];
+        par->hdr.proto_ver = dp->wireVer;
+        par->hdr.mtype = DP_MT_FEC | (dp->fecFrag ? DP_MT_FRAGMENT : 0);
+        par->hdr.seqnum = dp->fecStart;
+        par->hdr.dgram_sz = DP_FEC_HDR_SZ + dp->fecLen;
+        par->hdr.err_num = DP_NO_ERROR;
+        fh.endSeq = htonl(end);
+        fh.lenXor = htons(dp->fecLenXor);
+        fh.count = htons(dp->fecCount);
+        memcpy(par->buff, &fh, DP_FEC_HDR_SZ);
+        memcpy(par->buff + DP_FEC_HDR_SZ, dp->fecAcc, dp->fecLen);
+        par->payload = par->buff;
+        dp->stats.fecOut++;
+
+        for (int i = idx; i >= 0; i--) {
+            dp_txslot *slot = &dp->txWnd[(dp->txHead + i) % DP_MAX_WINDOW];
+            if (dpseqbefore(slot->seqnum, dp->fecStart))
+                break;
+            slot->fecSent = true;
+            slot->fecEnd = end;
+        }
+    }
+    memset(dp->fecAcc, 0, dp->fecLen);
+    dp->fecCount = dp->fecLen = 0;
+}
+
+//Send the parity dptxpush() built, all in one go after the data when it is
+//batched, otherwise the same way the data went
+static int dpfecpush(dp_connp dp){
+    dp_txslot *batch[DP_FEC_MAX_TX];
+    int n = 0;
+
+    for (int i = 0; i < dp->fecTxCount; i++) {
+        if (dp->batch == DP_BATCH_OFF || (dp->netem != NULL && dpnetemdelays(dp->netem))) {
+            dpsendrawv(dp, &dp->fecTx[i].hdr, dp->fecTx[i].payload, dp->fecTx[i].hdr.dgram_sz);
+            continue;
+        }
+        if (dpsimfate(dp, &dp->fecTx[i].hdr) == 0)
+            continue;
+        print_out_pdu(&dp->fecTx[i].hdr);
+        batch[n++] = &dp->fecTx[i];
+    }
+    dp->fecTxCount = 0;
+    if (n == 0)
+        return DP_NO_ERROR;
+    return dpsendmmsg(dp, batch, n);
+}
+
+/*
+ * Parity that trails its data by more than part of a round trip is no
+ * quicker than the resend a NACK would get, so when the window is ack
+ * clocked and a group fills slowly, close it early with what it has.  A
+ * timer, see dpdeadline().
+ */
+static int dpfecflush(dp_connp dp){
+    if (dpnow() - dp->fecOpenAt < dp->srtt / DP_FEC_HOLD_DIV)
+        return DP_NO_ERROR;
+    //Everything in it was ACKd already, otherwise it ends with the newest
+    //dgram that went out
+    if (dp->txCount == dp->txUnsent) {
+        dpfecclose(dp, -1);
+        return DP_NO_ERROR;
+    }
+    dpfecclose(dp, dp->txCount - dp->txUnsent - 1);
+    return dpfecpush(dp);
+}
+
+/*
+ * Should a NACKd dgram be left to the parity of its group?  Only while the
+ * peer has reported nothing past the end of the group, and not for longer
+ * than the NACK would usually take, so a lost parity (or a NACK drawn out by
+ * a tail probe) costs at most about a round trip more than before.
+ */
+static _Bool dpfecwait(dp_connp dp, dp_txslot *slot){
+    return slot->fecSent && slot->retx == 0 && !dpseqbefore(slot->fecEnd, dp->peerHigh) &&
+        dpnow() - slot->sentAt <= 2 * dp->srtt + 4 * dp->rttvar;
+}
+
+//The receive side state is only set up once the peer sends us parity
+static _Bool dpfecrxinit(dp_connp dp){
+    if (dp->fecHist != NULL)
+        return true;
+    dp->fecHist = calloc(DP_FEC_MAX_GROUP, sizeof(dp_fechist));
+    dp->fecRx = calloc(DP_FEC_PENDING, sizeof(dp_fecgrp));
+    if (dp->fecHist == NULL || dp->fecRx == NULL) {
+        free(dp->fecHist);
+        free(dp->fecRx);
+        dp->fecHist = NULL;
+        dp->fecRx = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * seqNum is moving past a dgram.  Keep a copy of the last DP_FEC_MAX_GROUP
+ * protected ones, parity arriving later may need them to rebuild another
+ * dgram of the same group.
+ */
+static void dpfecremember(dp_connp dp, unsigned int seqnum, int mtype, const char *data, int len){
+    dp_fechist *h;
+
+    if (!(mtype & DP_MT_PROTECTED) || !dp->fecPeer || !dpfecrxinit(dp))
+        return;
+    h = &dp->fecHist[dp->fecHistHead];
+    dp->fecHistHead = (dp->fecHistHead + 1) % DP_FEC_MAX_GROUP;
+    h->seqnum = seqnum;
+    h->mtype = mtype;
+    h->len = len;
+    memcpy(h->data, data, len);
+}
+
+//Hold on to parity that cannot be used yet, in place of the oldest if full
+static void dpfechold(dp_connp dp, dp_fecgrp *grp){
+    int victim = 0;
+
+    for (int i = 0; i < DP_FEC_PENDING; i++) {
+        if (!dp->fecRx[i].inUse) {
+            victim = i;
+            break;
+        }
+        if (dpseqbefore(dp->fecRx[i].start, dp->fecRx[victim].start))
+            victim = i;
+    }
+    if (!dp->fecRx[victim].inUse)
+        dp->fecPending++;
+    dp->fecRx[victim] = *grp;
+    dp->fecRx[victim].inUse = true;
+}
+
+//A DP_MT_FEC came in.  Most of the time the group all arrived and it is of
+//no use, otherwise rebuild what is missing now or once more turns up.
+static void dpfecinput(dp_connp dp, dp_pdu *pdu, const char *payload){
+    dp_fecgrp grp;
+    dp_fec_hdr fh;
+
+    if (pdu->dgram_sz < DP_FEC_HDR_SZ || !dpfecrxinit(dp))
+        return;
+    memcpy(&fh, payload, DP_FEC_HDR_SZ);
+    grp.start = pdu->seqnum;
+    grp.end = ntohl(fh.endSeq);
+    grp.count = ntohs(fh.count);
+    grp.lenXor = ntohs(fh.lenXor);
+    grp.frag = (pdu->mtype & DP_MT_FRAGMENT) != 0;
+    grp.len = pdu->dgram_sz - DP_FEC_HDR_SZ;
+    if (grp.count < 1 || grp.count > DP_FEC_MAX_GROUP || grp.len > DP_MAX_BUFF_SZ ||
+        !dpseqbefore(grp.start, grp.end) ||
+        dpseqbefore(grp.start + DP_FEC_MAX_GROUP * DP_MAX_BUFF_SZ, grp.end))
+        return;
+    if (!dpseqbefore(dp->seqNum, grp.end))
+        return;
+    memcpy(grp.data, payload + DP_FEC_HDR_SZ, grp.len);
+    if (dpfecrecover(dp, &grp) == 0)
+        dpfechold(dp, &grp);
+}
+
+/*
+ * Rebuild the one dgram of grp that is missing, from the parity and the
+ * rest of the group - the ones seqNum already passed out of the history,
+ * the others out of the reorder buffer.  Returns 1 if it was rebuilt (or
+ * nothing is missing any more), 0 if more of the group has to arrive
+ * first, or -1 if it never can be.
+ */
+static int dpfecrecover(dp_connp dp, dp_fecgrp *grp){
+    char data[DP_MAX_BUFF_SZ];
+    unsigned int seq = grp->start, gap = 0, next = 0;
+    int lenXor = grp->lenXor, n = 0;
+    _Bool frag = grp->frag, found = false;
+    dp_pdu pdu = {0};
+
+    if (!dpseqbefore(dp->seqNum, grp->end))
+        return 1;
+    memcpy(data, grp->data, grp->len);
+
+    while (dpseqbefore(seq, grp->end)) {
+        const char *d = NULL;
+        int len = 0, mtype = 0;
+
+        if (dpseqbefore(seq, dp->seqNum)) {
+            for (int i = 0; i < DP_FEC_MAX_GROUP && d == NULL; i++) {
+                dp_fechist *h = &dp->fecHist[i];
+                if ((h->mtype & DP_MT_PROTECTED) && h->seqnum == seq) {
+                    d = h->data;
+                    len = h->len;
+                    mtype = h->mtype;
+                }
+            }
+            if (d == NULL)
+                return -1;      //already gone from the history
+        } else {
+            dp_rxslot *slot = dprxfind(dp, seq);
+            if (slot != NULL) {
+                d = slot->data;
+                len = slot->len;
+                mtype = slot->mtype;
+            }
+        }
+
+        if (d == NULL) {
+            //The hole, up to the next dgram of the group we hold
+            if (found)
+                return 0;       //two of them, wait for one to be filled
+            found = true;
+            gap = seq;
+            next = grp->end;
+            for (int i = 0; i < DP_MAX_WINDOW; i++) {
+                dp_rxslot *slot = &dp->rxWnd[i];
+                if (slot->inUse && !dpseqbefore(slot->seqnum, gap) && dpseqbefore(slot->seqnum, next))
+                    next = slot->seqnum;
+            }
+            seq = next;
+            continue;
+        }
+        if (++n > grp->count || len > grp->len)
+            return -1;
+        dpxor(data, d, len);
+        lenXor ^= len;
+        frag ^= (mtype & DP_MT_FRAGMENT) != 0;
+        seq += dpseqspan(len);
+    }
+    if (!found)
+        return 1;       //the hole is ahead of the group
+    if (n >= grp->count)
+        return -1;
+    if (n != grp->count - 1)
+        return 0;       //the hole is more than one dgram
+    if (lenXor > grp->len || dpseqspan(lenXor) != (int)(next - gap))
+        return -1;
+
+    pdu.proto_ver = dp->wireVer;
+    pdu.mtype = DP_MT_SND | DP_MT_PROTECTED | (frag ? DP_MT_FRAGMENT : 0);
+    pdu.seqnum = gap;
+    pdu.dgram_sz = lenXor;
+    dp->stats.fecRecovered++;
+    if (_debugMode == 1)
+        printf("FEC rebuilt seq %u from the parity of [%u, %u)\n", gap, grp->start, grp->end);
+    dpinput(dp, &pdu, data, sizeof(dp_pdu) + lenXor, false);
+    return 1;
+}
+
+//Parity that had to wait may be usable now something else came in
+static void dpfectry(dp_connp dp){
+    dp_fecgrp grp;
+
+    for (int i = 0; i < DP_FEC_PENDING; i++) {
+        if (!dp->fecRx[i].inUse)
+            continue;
+        grp = dp->fecRx[i];
+        dp->fecRx[i].inUse = false;
+        dp->fecPending--;
+        if (dpfecrecover(dp, &grp) == 0)
+            dpfechold(dp, &grp);
+    }
+}
+
+//// PATH MTU DISCOVERY, see DP_HS_DGRAM in du-proto.h
+
+/*
+ * A timer, see dpdeadline().  Give up on a probe that went unanswered
+ * DP_PMTU_PROBES times, and start the next one while the gap between what
+ * got through and what did not is still worth closing.
+ */
+static void dppmtustep(dp_connp dp, long long now){
+    if (dp->state != DP_ST_OPEN || (dp->pmtu >= dp->dgramMax && dp->probeSz == 0))
+        return;
+    if (dp->probeSz > 0) {
+        if (now < dp->probeAt + dp->rto)
+            return;
+        if (++dp->probeTries < DP_PMTU_PROBES && dppmtusend(dp) == 0)
+            return;
+        dp->pmtuHigh = dp->probeSz;
+        dp->probeSz = 0;
+    }
+    while (now >= dp->pmtuNextAt) {
+        int high = (dp->pmtuHigh > dp->dgramMax) ? dp->dgramMax + 1 : dp->pmtuHigh;
+        if (high - dp->pmtu <= DP_PMTU_STEP) {
+            //As big as it gets for now, try for more later
+            dp->pmtuHigh = dp->dgramMax + 1;
+            dp->pmtuNextAt = now + DP_PMTU_RAISE_MS * 1000LL;
+            return;
+        }
+        //The agreed size first, it usually just works
+        dp->probeSz = (high > dp->dgramMax) ? dp->dgramMax : (dp->pmtu + high) / 2;
+        dp->probeTries = 0;
+        if (dppmtusend(dp) == 0)
+            return;
+        dp->pmtuHigh = dp->probeSz;
+        dp->probeSz = 0;
+    }
+}
+
+/*
+ * Send a probe of probeSz, padding only, with DF set just for it.  The
+ * socket may be a listener's, shared with other connections, which must
+ * not switch DF back off in between.  Returns -1 if the kernel already
+ * knows it is too big for the route.
+ */
+static int dppmtusend(dp_connp dp){
+    static const char pad[DP_MAX_BUFF_SZ];
+    dp_pdu pdu = {0};
+    int rc, err;
+
+    pdu.proto_ver = dp->wireVer;
+    pdu.mtype = DP_MT_PROBE;
+    pdu.seqnum = dp->seqNum;
+    pdu.dgram_sz = dp->probeSz;
+    dp->probeAt = dpnow();
+    dp->stats.pmtuProbes++;
+    if (_debugMode == 1)
+        printf("PMTU probe %d bytes, attempt %d\n", dp->probeSz, dp->probeTries + 1);
+
+    if (dp->listener != NULL)
+        pthread_mutex_lock(&dp->listener->lock);
+    setsockopt(dp->udp_sock, IPPROTO_IP, IP_MTU_DISCOVER, &(int){IP_PMTUDISC_PROBE}, sizeof(int));
+    rc = dpsendrawv(dp, &pdu, pad, dp->probeSz);
+    err = errno;
+    setsockopt(dp->udp_sock, IPPROTO_IP, IP_MTU_DISCOVER, &(int){IP_PMTUDISC_WANT}, sizeof(int));
+    if (dp->listener != NULL)
+        pthread_mutex_unlock(&dp->listener->lock);
+    return (rc < 0 && err == EMSGSIZE) ? -1 : 0;
+}
+
+//The peer got a probe of sz, data can go out that big from now on
+static void dppmtuack(dp_connp dp, unsigned int sz){
+    //Late answer to one we gave up on
+    if (dp->probeSz == 0 || sz != (unsigned int)dp->probeSz)
+        return;
+    if (sz > dp->pmtu)
+        dp->pmtu = sz;
+    dp->probeSz = 0;
+    if (_debugMode == 1)
+        printf("PMTU %d bytes\n", dp->pmtu);
+}
+
+//// PACING, see DP_OPT_PACING in du-proto.h
+
+//Payload bytes per second the window is spread at, 0 for no pacing
+static long long dppacerate(dp_connp dp){
+    int cwnd = (dp->cwnd < dp->wndSz) ? dp->cwnd : dp->wndSz;
+    int gain = (dp->cwnd < dp->ssthresh) ? DP_PACE_GAIN_SS : DP_PACE_GAIN_CA;
+
+    if (!dp->pacing || dp->srtt == 0)
+        return 0;
+    return (long long)cwnd * dpdgramsz(dp) * gain / 100 * 1000000LL / dp->srtt;
+}
+
+/*
+ * Fill the bucket for the time since it was last filled, and take out n
+ * unsent dgrams, starting first in the window, for as long as there is
+ * something in it.  Returns how many can go now; for the rest paceNext says
+ * when to try again.
+ */
+static int dppaceallow(dp_connp dp, long long now, int first, int n){
+    long long rate = dppacerate(dp);
+    long long depth = rate * DP_PACE_QUANTUM_US / 1000000;
+    int i;
+
+    if (rate == 0)
+        return n;
+    if (depth < DP_PACE_MIN_BURST * dpdgramsz(dp))
+        depth = DP_PACE_MIN_BURST * dpdgramsz(dp);
+    if (dp->paceAt == 0 || now - dp->paceAt > 1000000LL)
+        dp->paceTokens = depth;
+    else
+        dp->paceTokens += (now - dp->paceAt) * rate / 1000000;
+    if (dp->paceTokens > depth)
+        dp->paceTokens = depth;
+    dp->paceAt = now;
+
+    for (i = 0; i < n && dp->paceTokens > 0; i++)
+        dp->paceTokens -= dp->txWnd[(dp->txHead + first + i) % DP_MAX_WINDOW].hdr.dgram_sz;
+    if (i < n) {
+        dp->paceNext = now + (1 - dp->paceTokens) * 1000000 / rate;
+        dp->stats.paced++;
+    }
+    return i;
+}
+
+//// SOCKET BUFFERS, see DP_BUF_HEADROOM in du-proto.h
+
+/*
+ * Find out how big the kernel lets the receive buffer get, then leave both
+ * buffers at the default until the connection opens, see dpbufopen(), and
+ * ask for SO_RXQ_OVFL.
+ * Returns the biggest receive buffer, as the kernel counts it.
+ */
+static int dpbufinit(int sock, int *rcvBuf, int *sndBuf){
+    int cap = 0;
+    socklen_t len = sizeof(int);
+
+    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, rcvBuf, &len);
+    len = sizeof(int);
+    getsockopt(sock, SOL_SOCKET, SO_SNDBUF, sndBuf, &len);
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &(int){DP_BUF_MAX / 2}, sizeof(int));
+    len = sizeof(int);
+    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &cap, &len);
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &(int){*rcvBuf / 2}, sizeof(int));
+    setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &(int){1}, sizeof(int));
+    return (cap > *rcvBuf) ? cap : *rcvBuf;
+}
+
+/*
+ * A timer, run with the others.  Once an SRTT (DP_BUF_TUNE_MIN_US at least)
+ * has gone by, what went through the socket each way in that time, scaled
+ * to one SRTT, is the bandwidth delay product: by Little's law, what was in
+ * flight or waiting in a queue, which is what the buffers have to hold.
+ * Both are counted the way the kernel charges for them, DP_SKB_OVERHEAD a
+ * dgram, and grow to DP_BUF_HEADROOM times that.  New drops on the socket
+ * double the receive buffer whatever the measure says.  Without an RTT
+ * sample yet it goes by DP_BUF_TUNE_MIN_US.
+ */
+static void dpbuftune(dp_connp dp, long long now){
+    long long rtt = (dp->srtt > 0) ? dp->srtt : DP_BUF_TUNE_MIN_US;
+    long long elapsed = now - dp->tuneAt;
+    long in = dp->stats.bytesIn + dp->stats.dgramsIn * DP_SKB_OVERHEAD;
+    long out = dp->stats.bytesOut + dp->stats.dgramsOut * DP_SKB_OVERHEAD;
+    long long rcv, snd;
+
+    if (dp->state != DP_ST_OPEN || elapsed < rtt || elapsed < DP_BUF_TUNE_MIN_US)
+        return;
+    if (dp->tuneAt > 0) {
+        rcv = DP_BUF_HEADROOM * (in - dp->tuneIn) * rtt / elapsed;
+        snd = DP_BUF_HEADROOM * (out - dp->tuneOut) * rtt / elapsed;
+        if (dp->stats.rcvbufDrops > dp->tuneDrops && rcv < 2LL * dp->rcvBuf)
+            rcv = 2LL * dp->rcvBuf;
+        dpbufgrow(dp, SO_RCVBUF, &dp->rcvBuf, rcv);
+        dpbufgrow(dp, SO_SNDBUF, &dp->sndBuf, snd);
+    }
+    dp->tuneAt = now;
+    dp->tuneIn = in;
+    dp->tuneOut = out;
+    dp->tuneDrops = dp->stats.rcvbufDrops;
+}
+
+/*
+ * Grow one of the buffers to want, never past bufCap and never shrinking.
+ * A listeners socket is shared, so there have is this connection's share
+ * and the socket gets the default plus all of them.
+ */
+static void dpbufgrow(dp_connp dp, int opt, int *have, long long want){
+    dp_listenp lp = dp->listener;
+
+    if (lp != NULL)
+        pthread_mutex_lock(&lp->lock);
+    dpbufgrowlocked(dp, opt, have, want);
+    if (lp != NULL)
+        pthread_mutex_unlock(&lp->lock);
+}
+
+//dpbufgrow() for a caller that already holds the listener's lock
+static void dpbufgrowlocked(dp_connp dp, int opt, int *have, long long want){
+    dp_listenp lp = dp->listener;
+    int sz;
+
+    if (want > dp->bufCap)
+        want = dp->bufCap;
+    if (want <= *have)
+        return;
+    if (_debugMode == 1)
+        printf("%s grows to %lld bytes\n", (opt == SO_RCVBUF) ? "SO_RCVBUF" : "SO_SNDBUF", want);
+    if (lp == NULL) {
+        *have = want;
+        setsockopt(dp->udp_sock, SOL_SOCKET, opt, &(int){*have / 2}, sizeof(int));
+        return;
+    }
+    int *total = (opt == SO_RCVBUF) ? &lp->rcvBuf : &lp->sndBuf;
+    *total += want - *have;
+    *have = want;
+    sz = (*total < lp->bufCap) ? *total : lp->bufCap;
+    setsockopt(dp->udp_sock, SOL_SOCKET, opt, &(int){sz / 2}, sizeof(int));
+}
+
+/*
+ * A connection that just opened can be sent a full window of the biggest
+ * dgrams it agreed to before dpbuftune() has measured anything, so the
+ * receive buffer starts out big enough for that.  The caller holds the
+ * listener's lock, if there is one.
+ */
+static void dpbufopen(dp_connp dp){
+    dpbufgrowlocked(dp, SO_RCVBUF, &dp->rcvBuf, (long long)dp->wndSz * DP_BUF_DGRAM(dp->dgramMax));
+}
+
+//The socket's count of dgrams the kernel dropped, if it came with msg
+static void dprxqovfl(struct msghdr *msg, uint32_t *drops){
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm))
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL)
+            memcpy(drops, CMSG_DATA(cm), sizeof(uint32_t));
+}
+
+//Resend a missing dgram unless the last copy could still be on its way
+static _Bool dpresenddue(dp_connp dp, dp_txslot *slot, long long now){
+    return slot->retx == 0 || now - slot->sentAt > dp->srtt + 4 * dp->rttvar;
+}
+
+/*
+ * RFC 6298: SRTT and RTTVAR are smoothed with gains of 1/8 and 1/4, and
+ * RTO = SRTT + 4*RTTVAR
+ */
+static void dprttsample(dp_connp dp, long long rtt){
+    if (dp->srtt == 0) {
+        dp->srtt = rtt;
+        dp->rttvar = rtt / 2;
+    } else {
+        long long err = dp->srtt - rtt;
+        dp->rttvar += ((err < 0 ? -err : err) - dp->rttvar) / 4;
+        dp->srtt += (rtt - dp->srtt) / 8;
+    }
+    dpsetrto(dp);
+}
+
+//Recompute the RTO from the estimator, which also undoes any backoff
+static void dpsetrto(dp_connp dp){
+    if (dp->srtt == 0)
+        dp->rto = DP_RTO_INIT_MS * 1000LL;
+    else
+        dp->rto = dp->srtt + 4 * dp->rttvar;
+    if (dp->rto < DP_RTO_MIN_MS * 1000LL)
+        dp->rto = DP_RTO_MIN_MS * 1000LL;
+    if (dp->rto > DP_RTO_MAX_MS * 1000LL)
+        dp->rto = DP_RTO_MAX_MS * 1000LL;
+}
+
+/*
+ * The oldest unACKd dgram timed out.  Resend it and back the RTO off, the
+ * receiver is holding whatever came after it so one cumulative ACK will
+ * catch the window up again.
+ */
+static int dpontimeout(dp_connp dp){
+    long long now = dpnow();
+
+    if (dp->txCount == 0)
+        return DP_NO_ERROR;
+    if (dp->retries++ == 0)
+        dp->stallSince = now;
+    if (now - dp->stallSince >= DP_USER_TIMEOUT_MS * 1000LL) {
+        printf("dpsend: no ACK for %d ms after %d retries, giving up\n",
+               DP_USER_TIMEOUT_MS, dp->retries - 1);
+        return DP_ERROR_TIMEOUT;
+    }
+    dp->rto *= 2;
+    if (dp->rto > DP_RTO_MAX_MS * 1000LL)
+        dp->rto = DP_RTO_MAX_MS * 1000LL;
+    dp->stats.timeouts++;
+    //Maybe the path no longer takes dgrams our size, start over small
+    if (dp->retries == DP_PMTU_BLACKHOLE && dp->pmtu > DP_BASE_BUFF_SZ) {
+        dp->pmtu = DP_BASE_BUFF_SZ;
+        dp->pmtuHigh = dp->dgramMax + 1;
+        dp->probeSz = 0;
+        dp->pmtuNextAt = 0;
+    }
+    dp->dupAcks = 0;
+    dp->cc->onloss(dp, true);
+    dp->inRecovery = true;
+    dp->recoverSeq = dpsentseq(dp);
+    dpretransmit(dp, &dp->txWnd[dp->txHead], "timeout");
+    //The last backoff is cut short so the give up comes on time
+    dp->rtoDeadline = now + dp->rto;
+    if (dp->rtoDeadline > dp->stallSince + DP_USER_TIMEOUT_MS * 1000LL)
+        dp->rtoDeadline = dp->stallSince + DP_USER_TIMEOUT_MS * 1000LL;
+    return DP_NO_ERROR;
+}
+
+static void dpretransmit(dp_connp dp, dp_txslot *slot, const char *reason){
+    slot->retx++;
+    slot->sentAt = dp->lastRetxAt = dp->lastSendAt = dpnow();
+    dp->stats.retransmits++;
+    if (dp->paceAt > 0)
+        dp->paceTokens -= slot->hdr.dgram_sz;
+    if (_debugMode == 1)
+        printf("RETRANSMIT (%s) seq %u, attempt %d, rto %lld ms\n",
+            reason, slot->seqnum, slot->retx, dp->rto / 1000);
+    dpsendrawv(dp, &slot->hdr, slot->payload, slot->hdr.dgram_sz);
+}
+
+/*
+ * When the send side next needs attention.  That is the RTO, unless a tail
+ * loss probe is due first: losing the last dgrams of a burst leaves nothing
+ * behind them to make the receiver NACK, so well before the RTO we send the
+ * newest unACKd dgram again (RFC 8985) and let the ACK or NACK it draws out
+ * start the repair.
+ */
+static long long dptxdeadline(dp_connp dp, _Bool *probe){
+    long long deadline = dp->rtoDeadline;
+
+    *probe = false;
+    if (!dp->probeSent && dp->srtt > 0) {
+        long long pto = 2 * dp->srtt;
+        if (pto < DP_PTO_MIN_MS * 1000LL)
+            pto = DP_PTO_MIN_MS * 1000LL;
+        if (dp->lastSendAt + pto < deadline) {
+            deadline = dp->lastSendAt + pto;
+            *probe = true;
+        }
+    }
+    return deadline;
+}
+
+/*
+ * The socket to wait on for dpprocess(), readable means there is work.
+ * Connections accepted from a listener share its socket.
+ */
+int dpfd(dp_connp dp){
+    return dp->udp_sock;
+}
+
+/*
+ * Absolute time (usec, CLOCK_MONOTONIC) of the next timer dpprocess() has
+ * to run even if nothing arrives, or 0 if there is none
+ */
+long long dpdeadline(dp_connp dp){
+    long long deadline = 0;
+    _Bool probe;
+
+#define DP_SOONER(t)    if (deadline == 0 || (t) < deadline) deadline = (t)
+    if (dp->ctlOp.pending && !dp->ctlOp.finished && dp->ctlSentAt > 0)
+        DP_SOONER(dp->ctlDeadline);
+    if (dp->state == DP_ST_OPEN && dp->txCount > dp->txUnsent)
+        DP_SOONER(dptxdeadline(dp, &probe));
+    if (dp->state == DP_ST_OPEN && dp->txUnsent > 0)
+        DP_SOONER(dp->paceNext);
+    if (dp->state == DP_ST_OPEN && dp->fecCount > 0)
+        DP_SOONER(dp->fecOpenAt + dp->srtt / DP_FEC_HOLD_DIV);
+    if (dp->state == DP_ST_OPEN && dp->probeSz > 0)
+        DP_SOONER(dp->probeAt + dp->rto);
+    if (dp->state == DP_ST_OPEN && dp->probeSz == 0 && dp->pmtu < dp->dgramMax)
+        DP_SOONER(dp->pmtuNextAt > 0 ? dp->pmtuNextAt : dpnow());
+    if (dprxwaiting(dp))
+        DP_SOONER(dp->rxOp.idleAt);
+    //Data parked while a send was pending can go as soon as that send's
+    //callback has run, nothing else would wake us for it
+    if (dprxwaiting(dp) && dp->rcvDlv != dp->seqNum)
+        DP_SOONER(dpnow());
+    if (dp->state == DP_ST_PEERCLOSED)
+        DP_SOONER(dp->lingerUntil);
+#undef DP_SOONER
+    return deadline;
+}
+
+/*
+ * How long to poll dpfd() for before calling dpprocess() anyway, in msec as
+ * poll() and epoll_wait() take it: 0 if there is work already, -1 for no
+ * timer at all
+ */
+int dptimeout(dp_connp dp){
+    long long deadline, left;
+
+    if (dp->kick || dprxbpending(dp))
+        return 0;
+    if ((deadline = dpdeadline(dp)) == 0)
+        return -1;
+    left = deadline - dpnow();
+    return (left <= 0) ? 0 : (int)((left + 999) / 1000);
+}
+
+/*
+ * Do whatever the connection has to do without blocking: handle the dgrams
+ * waiting on the socket, run the timers, fill the send window and call the
+ * callbacks of the operations that finished.  Returns DP_NO_ERROR, a DP
+ * error that also failed every pending operation, or DP_CONNECTION_CLOSED
+ * once the connection is closed; after the peer closes, dpclose() it any
+ * time, ideally once dpdeadline() says the linger is over.
+ */
+int dpprocess(dp_connp dp){
+    return dpstep(dp, true);
+}
+
+//One pass of dpprocess(), only reading the socket if input is set
+static int dpstep(dp_connp dp, _Bool input){
+    int rc = DP_NO_ERROR;
+
+    dp->kick = false;
+    dprxstep(dp);
+    if (input)
+        rc = dpinputall(dp);
+    if (rc >= 0)
+        rc = dptxstep(dp);
+    if (rc >= 0)
+        rc = dpctlstep(dp);
+    //Last, so whatever just came in or went out has moved the deadlines
+    if (rc >= 0)
+        rc = dptimers(dp);
+    if (rc >= 0)
+        dprxstep(dp);
+    //A loan is ready with fewer dgrams than asked for once no more are here
+    if (rc >= 0 && dp->rxOp.lent != NULL && dp->rxOp.off > 0 && !dprxbpending(dp))
+        dpfinish(&dp->rxOp, dp->rxOp.off);
+
+    //ACKs for a batch of dgrams are held back until the batch is used up,
+    //dont leave the last one waiting while the application is busy
+    if (rc >= 0 && dp->ackPending && dp->state == DP_ST_OPEN)
+        rc = dpsendack(dp, DP_MT_SNDACK, DP_NO_ERROR);
+
+    if (rc >= 0 && (dp->state == DP_ST_PEERCLOSED || dp->state == DP_ST_CLOSED))
+        rc = DP_CONNECTION_CLOSED;
+    if (rc < 0)
+        dpfailall(dp, rc);
+    dpcallbacks(dp);
+    return rc;
+}
+
+/*
+ * Handle one read of the socket's worth of dgrams, a single dgram or a
+ * whole recvmmsg() batch, the way the connection's state calls for.  While
+ * a receive is waiting, in-sequence data goes straight into its buffer if
+ * there is room for a full dgram, and we stop once it has its message so
+ * the rest of the batch is not copied in and out of the reorder buffer.
+ * A receive that wants a loan has every dgram left where it was read, and
+ * takes the in-sequence one from there.
+ */
+static int dpinputall(dp_connp dp){
+    dp_op *rx = &dp->rxOp;
+    dp_pdu inPdu;
+    char *payload;
+    _Bool deliver;
+    long seen;
+    int bytesIn, rc = DP_NO_ERROR;
+    int room = dp->dgramMax + DP_FEC_HDR_SZ;    //the most the peer sends
+    _Bool lend;
+
+    do {
+        deliver = dprxwaiting(dp) && dp->rcvDlv == dp->seqNum;
+        lend = dprxwaiting(dp) && rx->lent != NULL;
+        payload = (deliver && rx->len - rx->off >= room) ?
+            rx->buff + rx->off : dp->dgramBuff;
+
+        //A dgram that fails its CRC comes back as 0 bytes too, so go by
+        //the count to tell it from an empty socket
+        seen = dp->stats.dgramsIn;
+        bytesIn = dprecvrawv(dp, &inPdu, lend ? NULL : payload, room, MSG_DONTWAIT);
+        if (lend)
+            payload = (dp->rxAt != NULL) ? dp->rxAt : dp->dgramBuff;
+        if (bytesIn < 0)
+            return DP_ERROR_GENERAL;
+        if (dp->stats.dgramsIn == seen)
+            break;
+        if (rx->pending)
+            rx->idleAt = dpnow() + DP_IDLE_TIMEOUT_MS * 1000LL;
+
+        switch (dp->state) {
+            case DP_ST_OPEN:
+                rc = dpinput(dp, &inPdu, payload, bytesIn, deliver);
+                if (rc == true && lend)
+                    dprxlend(dp, &inPdu, payload);
+                else if (rc == true)
+                    rc = dprxdeliver(dp, &inPdu, payload);
+                break;
+            case DP_ST_LISTEN:
+                dplisteninput(dp, &inPdu, bytesIn);
+                break;
+            case DP_ST_CONNECT:
+            case DP_ST_CLOSING:
+                dpctlinput(dp, &inPdu, payload, bytesIn);
+                break;
+            case DP_ST_PEERCLOSED:
+                if (bytesIn >= (int)sizeof(dp_pdu) && inPdu.mtype == DP_MT_CLOSE)
+                    dpsendack(dp, DP_MT_CLOSEACK, DP_NO_ERROR);
+                break;
+            default:
+                break;      //not connected, strays
+        }
+        dprxdone(dp);
+        if (rc < 0)
+            return rc;
+        dprxstep(dp);
+    } while (dprxbpending(dp) && !(rx->pending && rx->finished));
+    return DP_NO_ERROR;
+}
+
+//Run whichever timers have gone off
+static int dptimers(dp_connp dp){
+    long long now = dpnow();
+    _Bool probe;
+
+    if (dp->ctlOp.pending && !dp->ctlOp.finished && dp->ctlSentAt > 0 &&
+        now >= dp->ctlDeadline) {
+        int maxRetries = (dp->state == DP_ST_CLOSING) ? DP_CLOSE_RETRIES : DP_MAX_RETRIES;
+        dp->rto *= 2;
+        if (dp->rto > DP_RTO_MAX_MS * 1000LL)
+            dp->rto = DP_RTO_MAX_MS * 1000LL;
+        if (++dp->ctlTries > maxRetries)
+            dpctldone(dp, DP_ERROR_TIMEOUT);
+        else if (dpctlsend(dp) < 0)
+            dpctldone(dp, DP_ERROR_GENERAL);
+    }
+
+    //A FEC group that is filling too slowly goes out as it is
+    if (dp->state == DP_ST_OPEN && dp->fecCount > 0 && dpfecflush(dp) < 0)
+        return DP_ERROR_GENERAL;
+
+    dppmtustep(dp, now);
+
+    dpbuftune(dp, now);
+
+    //Only what went out can time out, pacing may be holding the rest
+    if (dp->state == DP_ST_OPEN && dp->txCount > dp->txUnsent && now >= dptxdeadline(dp, &probe)) {
+        if (!probe)
+            return dpontimeout(dp);
+        dp->probeSent = true;
+        dp->stats.probes++;
+        dpretransmit(dp, &dp->txWnd[(dp->txHead + dp->txCount - dp->txUnsent - 1) % DP_MAX_WINDOW], "tail probe");
+    }
+
+    //Dont wait forever on a peer that went away
+    if (dprxwaiting(dp) && now >= dp->rxOp.idleAt) {
+        printf("dprecv: nothing received for %d ms, giving up\n", DP_IDLE_TIMEOUT_MS);
+        dpfinish(&dp->rxOp, DP_ERROR_TIMEOUT);
+    }
+
+    if (dp->state == DP_ST_PEERCLOSED && now >= dp->lingerUntil)
+        dp->state = DP_ST_CLOSED;
+    return DP_NO_ERROR;
+}
+
+static void dpfinish(dp_op *op, int rc){
+    if (!op->pending || op->finished)
+        return;
+    op->finished = true;
+    op->rc = rc;
+}
+
+//A connection level failure ends everything that is pending
+static void dpfailall(dp_connp dp, int rc){
+    dpfinish(&dp->txOp, rc);
+    dpfinish(&dp->rxOp, rc);
+    dpfinish(&dp->ctlOp, rc);
+}
+
+//Hand finished operations back.  Each is cleared first so its callback can
+//start the next one.  The blocking calls collect theirs in dpwaitfor().
+static void dpcallbacks(dp_connp dp){
+    dp_op *ops[] = { &dp->ctlOp, &dp->txOp, &dp->rxOp };
+
+    for (int i = 0; i < 3; i++) {
+        dp_op op = *ops[i];
+        if (!op.finished || op.done == NULL)
+            continue;
+        memset(ops[i], 0, sizeof(dp_op));
+        op.done(dp, op.rc, op.arg);
+    }
+}
+
+/*
+ * Wait for the socket to become readable, up to an absolute deadline in usec
+ * (or forever if deadline is 0).  Returns 1 if there is data, 0 on timeout.
+ */
+static int dppoll(dp_connp dp, long long deadline){
+    struct pollfd pfd = { .fd = dp->udp_sock, .events = POLLIN };
+    int timeout = -1;
+    int rc;
+
+    //Left over from the last batch, no need to ask the socket
+    if (dprxbpending(dp))
+        return 1;
+    if (dp->listener != NULL)
+        return dplwait(dp->listener, dp, deadline);
+
+    if (deadline > 0) {
+        long long left = deadline - dpnow();
+        timeout = (left <= 0) ? 0 : (int)((left + 999) / 1000);
+    }
+    do {
+        rc = poll(&pfd, 1, timeout);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0)
+        perror("dppoll: poll() failed");
+    return rc;
+}
+
+/*
+ * One round of a blocking call: wait in dppoll() for a dgram or the next
+ * timer, unless there is work already, then run the connection
+ */
+static int dpblock(dp_connp dp){
+    _Bool ready = dprxbpending(dp);
+    int rc;
+
+    if (!ready && !dp->kick) {
+        if ((rc = dppoll(dp, dpdeadline(dp))) < 0)
+            return DP_ERROR_GENERAL;
+        ready = (rc > 0);
+    }
+    return dpstep(dp, ready);
+}
+
+/*
+ * Run the connection until op finishes and return its result.  The blocking
+ * calls close the connection for the caller when they report that the peer
+ * closed it, after lingering in case our CLOSE/ACK was lost.
+ */
+static int dpwaitfor(dp_connp dp, dp_op *op){
+    int rc = DP_NO_ERROR;
+
+    while (!op->finished && rc >= 0)
+        rc = dpblock(dp);
+    if (op->finished)
+        rc = op->rc;
+    memset(op, 0, sizeof(dp_op));
+
+    if (rc == DP_CONNECTION_CLOSED) {
+        dplinger(dp);
+        dpclose(dp);
+    }
+    return rc;
+}
+
+//Wait until everything in the send window has been ACKd
+int dpflush(dp_connp dp){
+    int rc;
+
+    while (dp->txCount > 0 || dp->txOp.pending)
+        if ((rc = dpblock(dp)) < 0) {
+            if (rc == DP_CONNECTION_CLOSED) {
+                dplinger(dp);
+                dpclose(dp);
+            }
+            return rc;
+        }
+    return DP_NO_ERROR;
+}
+
+//After ACKing the peers CLOSE, keep answering it until the linger is over
+static void dplinger(dp_connp dp){
+    while (dp->state == DP_ST_PEERCLOSED)
+        if (dpblock(dp) == DP_ERROR_GENERAL)
+            break;
+}
+
+
+static int dprecvraw(dp_connp dp, void *buff, int buff_sz, int flags){
+    return dprecvrawv(dp, buff, (char *)buff + sizeof(dp_pdu),
+        buff_sz - sizeof(dp_pdu), flags);
+}
+
+/*
+ * Receive one dgram with the header and payload going to separate places,
+ * so a payload can land directly in the application's buffer.  With payload
+ * NULL a batched or listener dgram is left where it was read instead, and
+ * dp->rxAt points at its payload, see dprecvlend().
+ */
+static int dprecvrawv(dp_connp dp, dp_pdu *pdu, void *payload, int payload_sz, int flags){
+    int bytes = 0;
+    struct iovec iov[3];
+    struct msghdr msg = {0};
+    char wire[DP_HDR_MAX_SZ];
+    char trailer[DP_CRC_SZ];
+    char ctrl[CMSG_SPACE(sizeof(uint32_t))];
+    uint32_t drops;
+    int hlen = (dp->wireVer == DP_PROTO_VER_2) ? DP_HDR_V2_SZ : DP_HDR_V1_SZ;
+
+    if(!dp->inSockAddr.isAddrInit) {
+        perror("dprecv: dp connection not setup properly - cli struct not init");
+        return -1;
+    }
+
+    //Shared socket, our dgrams have already been routed to our queue
+    if (dp->listener != NULL) {
+        if (dplwait(dp->listener, dp, (flags & MSG_DONTWAIT) ? dpnow() : 0) <= 0)
+            return (flags & MSG_DONTWAIT) ? 0 : -1;
+        bytes = dplpop(dp, pdu, payload, payload_sz);
+        dp->stats.dgramsIn++;
+        dp->stats.rcvbufDrops = (uint32_t)(dp->listener->rxqOvfl - dp->rxqBase);
+        if (bytes >= sizeof(dp_pdu))
+            print_in_pdu(pdu);
+        return bytes;
+    }
+
+    //Batched, hand out the next dgram of the last recvmmsg()
+    if (dp->rxb != NULL && (dp->batch != DP_BATCH_OFF || dprxbpending(dp) || payload == NULL)) {
+        if (!dprxbpending(dp) && (bytes = dprxbfill(dp, flags)) <= 0)
+            return bytes;
+        bytes = dprxbpop(dp, pdu, payload, payload_sz);
+        dp->stats.dgramsIn++;
+        if (bytes >= sizeof(dp_pdu))
+            print_in_pdu(pdu);
+        return bytes;
+    }
+
+    //Payload straight into place, assuming the peer uses our header format
+    iov[0].iov_base = wire;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = (payload_sz > 0) ? payload_sz : 0;
+    iov[2].iov_base = trailer;      //the CRC of a full sized dgram
+    iov[2].iov_len = DP_CRC_SZ;
+    msg.msg_name = &(dp->outSockAddr.addr);
+    msg.msg_namelen = dp->outSockAddr.len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+
+    bytes = recvmsg(dp->udp_sock, &msg, flags);
+    dp->stats.recvCalls++;
+
+    //Nothing waiting on a non-blocking receive is not an error
+    if (bytes < 0 && (flags & MSG_DONTWAIT) &&
+        (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (bytes < 0) {
+        perror("dprecv: received error from recvmsg()");
+        return -1;
+    }
+    dp->outSockAddr.len = msg.msg_namelen;
+    dp->outSockAddr.isAddrInit = true;
+    dp->stats.dgramsIn++;
+    dp->stats.bytesIn += bytes;
+    drops = dp->stats.rcvbufDrops;
+    dprxqovfl(&msg, &drops);
+    dp->stats.rcvbufDrops = drops;
+    dptap(dp, DP_TAP_IN, iov, 3, bytes);
+    if ((bytes = dpcrccheck(dp, iov, 3, bytes)) < 0)
+        return 0;
+
+    //Decode the header from wire, plus the front of payload in case the
+    //peer used the longer v1 header (e.g. a CONNECT that came again)
+    char hdr[DP_HDR_MAX_SZ];
+    int got = (bytes < hlen) ? bytes : hlen;
+    int more = bytes - got;
+    if (more > DP_HDR_MAX_SZ - got)
+        more = DP_HDR_MAX_SZ - got;
+    if (more > payload_sz)
+        more = (payload_sz > 0) ? payload_sz : 0;
+    memcpy(hdr, wire, got);
+    memcpy(hdr + got, payload, more);
+    int th = dphdrdec(hdr, got + more, pdu);
+    if (th < 0)
+        return (bytes < (int)sizeof(dp_pdu)) ? bytes : (int)sizeof(dp_pdu) - 1;
+    dp->rxVer = (th == DP_HDR_V2_SZ) ? DP_PROTO_VER_2 : DP_PROTO_VER_1;
+
+    //Then line the payload up if the header was not the size we guessed
+    int plen = bytes - th;
+    if (th > hlen) {
+        memmove(payload, (char *)payload + (th - hlen), plen);
+    } else if (th < hlen) {
+        int inWire = got - th;
+        int inPay = bytes - got;
+        if (inWire > payload_sz)
+            inWire = (payload_sz > 0) ? payload_sz : 0;
+        if (inPay > payload_sz - inWire)
+            inPay = payload_sz - inWire;
+        memmove((char *)payload + inWire, payload, inPay);
+        memcpy(payload, wire + th, inWire);
+        plen = inWire + inPay;
+    }
+
+    //some helper code if you want to do debugging
+    if (plen > 0){
+        if(false) {                         //just diabling for now
+            printf("DATA : %.*s\n", pdu->dgram_sz , (char *)payload); 
+        }
+    }
+
+    print_in_pdu(pdu);
+
+    //return the number of bytes received, as if the header was a dp_pdu
+    return sizeof(dp_pdu) + plen;
+}
+
+/*
+ * Send a message of any length.  Anything up to dpdgramsz() is copied into
+ * the send window and we return as soon as it is on its way.  Bigger messages
+ * are cut into DP_MT_FRAGMENT dgrams that point straight into sbuff, no copy,
+ * so in that case every fragment has to be ACKd before sbuff is handed back.
+ * With batching on the fragments are not sent one at a time, they pile up
+ * at the end of the window and go out together when it fills.
+ */
+int dpsend(dp_connp dp, void *sbuff, int sbuff_sz){
+    int rc;
+
+    if ((rc = dpsendstart(dp, sbuff, sbuff_sz, NULL, NULL)) < 0)
+        return rc;
+    return dpwaitfor(dp, &dp->txOp);
+}
+
+/*
+ * Start sending a message, as dpsend() does.  done is called with sbuff_sz
+ * once sbuff can be reused, or with a DP error.  Sending can start before
+ * the connection is up, it waits for the connect or listen to finish.
+ */
+int dpsendstart(dp_connp dp, const void *sbuff, int sbuff_sz, dp_done_fn done, void *arg){
+    int rc;
+
+    if (sbuff_sz < 0)
+        return DP_ERROR_GENERAL;
+    if ((rc = dpsendvstart(dp, NULL, 0, done, arg)) < 0)
+        return rc;
+    dp->txOp.one.iov_base = (void *)sbuff;
+    dp->txOp.one.iov_len = sbuff_sz;
+    dp->txOp.iov = &dp->txOp.one;
+    dp->txOp.iovcnt = 1;
+    dp->txOp.len = sbuff_sz;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Send one message made of iovcnt pieces, as dpsend() would send them one
+ * after the other.  Fragments that fall inside a piece point straight into
+ * it, only one that straddles two pieces is put together in the window.  A
+ * message too big for one dgram is borrowed like dpsend()'s, so both iov
+ * and the memory it points at have to stay intact until dpsendv() returns.
+ */
+int dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt){
+    int rc;
+
+    if ((rc = dpsendvstart(dp, iov, iovcnt, NULL, NULL)) < 0)
+        return rc;
+    return dpwaitfor(dp, &dp->txOp);
+}
+
+//Start sending a message in pieces, see dpsendv() and dpsendstart()
+int dpsendvstart(dp_connp dp, const struct iovec *iov, int iovcnt, dp_done_fn done, void *arg){
+    long long len = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    if(!dp->outSockAddr.isAddrInit && dp->state != DP_ST_LISTEN) {
+        perror("dpsend:dp connection not setup properly");
+        return DP_ERROR_GENERAL;
+    }
+    if (dp->txOp.pending)
+        return DP_ERROR_BUSY;
+    if (dp->state == DP_ST_PEERCLOSED || dp->state == DP_ST_CLOSED)
+        return DP_CONNECTION_CLOSED;
+    if (dp->state == DP_ST_IDLE || iovcnt < 0 || len > INT_MAX)
+        return DP_ERROR_GENERAL;
+
+    memset(&dp->txOp, 0, sizeof(dp_op));
+    dp->txOp.pending = true;
+    dp->txOp.done = done;
+    dp->txOp.arg = arg;
+    dp->txOp.iov = iov;
+    dp->txOp.iovcnt = iovcnt;
+    dp->txOp.len = len;
+    dp->kick = true;
+    return DP_NO_ERROR;
+}
+
+/*
+ * Move as much of the pending send into the send window as there is room
+ * for, and transmit it.  Up to wndSz dgrams can be in flight, and anything
+ * still unACKd is drained before we receive or close.  Borrowed fragments
+ * are queued up and go out together in dptxpush() once the window is full
+ * or the message is all in.
+ */
+static int dptxstep(dp_connp dp){
+    dp_op *op = &dp->txOp;
+    int chunk, mtype, rc, max = dpdgramsz(dp);
+
+    if (dp->state != DP_ST_OPEN)
+        return DP_NO_ERROR;
+    //Dgrams pacing held back go out even once their send is done with
+    if (!op->pending || op->finished)
+        return (dp->txUnsent > 0) ? dptxpush(dp) : DP_NO_ERROR;
+
+    //The dgram size can change part way through, so decide once
+    if (op->off == 0 && !op->queued)
+        op->borrow = (op->len > max);
+    while (!op->queued && !dpwndfull(dp)) {
+        chunk = op->len - op->off;
+        mtype = DP_MT_SND;
+        if (chunk > max) {
+            chunk = max;
+            mtype |= DP_MT_FRAGMENT;
+        }
+        while (op->iovIdx < op->iovcnt && op->iovOff == (int)op->iov[op->iovIdx].iov_len) {
+            op->iovIdx++;
+            op->iovOff = 0;
+        }
+        if (op->iovIdx < op->iovcnt && op->iov[op->iovIdx].iov_len - op->iovOff >= (size_t)chunk) {
+            dptxqueue(dp, (char *)op->iov[op->iovIdx].iov_base + op->iovOff, chunk, mtype, op->borrow);
+        } else {
+            //Straddles two pieces, put it together in the slot it goes in
+            dp_txslot *slot = &dp->txWnd[(dp->txHead + dp->txCount) % DP_MAX_WINDOW];
+            dpgather(op->iov + op->iovIdx, op->iovcnt - op->iovIdx, op->iovOff, slot->buff, chunk);
+            dptxqueue(dp, slot->buff, chunk, mtype, true);
+        }
+        dpiovskip(op, chunk);
+        op->off += chunk;
+        if (op->off == op->len) {
+            op->queued = true;
+            op->endSeq = dp->seqNum;
+        }
+    }
+    if (dp->txUnsent > 0 && (rc = dptxpush(dp)) < 0)
+        return rc;
+
+    //Copies are done with as soon as they are queued, borrowed fragments
+    //once they are all ACKd
+    if (op->queued && (!op->borrow || !dpseqbefore(dp->sndUna, op->endSeq)))
+        dpfinish(op, op->len);
+    return DP_NO_ERROR;
+}
+
+//Move the pending send's place in its pieces on by n bytes
+static void dpiovskip(dp_op *op, int n){
+    while (n > 0 && op->iovIdx < op->iovcnt) {
+        int left = op->iov[op->iovIdx].iov_len - op->iovOff;
+        if (n < left) {
+            op->iovOff += n;
+            return;
+        }
+        n -= left;
+        op->iovIdx++;
+        op->iovOff = 0;
+    }
+}
+
+/*
+ * Put one dgram at the end of the send window, for dptxpush() to send.
+ * With borrow set the slot points at sbuff rather than taking a copy, and
+ * the caller has to keep sbuff intact until it is ACKd.
+ */
+static void dptxqueue(dp_connp dp, const char *sbuff, int sbuff_sz, int mtype, _Bool borrow){
+    //Build the PDU in the next free window slot
+    dp_txslot *slot = &dp->txWnd[(dp->txHead + dp->txCount) % DP_MAX_WINDOW];
+    dp_pdu *outPdu = &slot->hdr;
+    int    sndSz = sbuff_sz;
+    outPdu->proto_ver = dp->wireVer;
+    outPdu->mtype = mtype;
+    outPdu->dgram_sz = sndSz;
+    outPdu->seqnum = dp->seqNum;
+    outPdu->err_num = DP_NO_ERROR;
+    if (dpfecon(dp))
+        outPdu->mtype |= DP_MT_PROTECTED;
+
+    if (borrow) {
+        slot->payload = sbuff;
+    } else {
+        memcpy(slot->buff, sbuff, sndSz);
+        slot->payload = slot->buff;
+    }
+
+    slot->seqnum = dp->seqNum;
+    slot->span = dpseqspan(sndSz);
+    slot->retx = 0;
+    slot->sacked = false;
+    slot->fecSent = false;
+    slot->fecHeld = false;
+    dp->txCount++;
+    dp->txUnsent++;
+
+    //update seq number after send.  Both directions share it, so when the
+    //peer answers it starts where our data ended, nothing is left to deliver
+    //in between
+    if (dp->rcvDlv == dp->seqNum)
+        dp->rcvDlv += slot->span;
+    dp->seqNum += slot->span;
+}
+
+/*
+ * Transmit the dgrams at the end of the send window that have not gone out
+ * yet, or as many of them as pacing lets go now.  Without batching that is
+ * one sendmsg() each, otherwise they go out with as few syscalls as the
+ * kernel lets us.  FEC parity for the groups they complete follows them.
+ */
+static int dptxpush(dp_connp dp){
+    dp_txslot *batch[DP_MAX_WINDOW];
+    int first = dp->txCount - dp->txUnsent;
+    int n = 0, rc, go;
+    long long now = dpnow();
+
+    if ((go = dppaceallow(dp, now, first, dp->txUnsent)) == 0)
+        return DP_NO_ERROR;
+    for (int i = first; i < first + go; i++) {
+        dp_txslot *slot = &dp->txWnd[(dp->txHead + i) % DP_MAX_WINDOW];
+        int sz = slot->hdr.dgram_sz;
+
+        slot->sentAt = now;
+        if (dp->fecAcc != NULL)
+            dpfecadd(dp, slot, i);
+        //Delayed or duplicated dgrams go out one at a time through the shim,
+        //along with the parity of a group they end
+        if (dp->batch == DP_BATCH_OFF || (dp->netem != NULL && dpnetemdelays(dp->netem))) {
+            int bytesOut = dpsendrawv(dp, &slot->hdr, slot->payload, sz);
+            if (bytesOut != sz + sizeof(dp_pdu))
+                printf("Warning send %d, but expected %d!\n", bytesOut, (int)(sz + sizeof(dp_pdu)));
+            dpfecpush(dp);
+            continue;
+        }
+        if (dpsimfate(dp, &slot->hdr) == 0)
+            continue;
+        print_out_pdu(&slot->hdr);
+        batch[n++] = slot;
+    }
+    if (first == 0)
+        dp->rtoDeadline = now + dp->rto;
+    dp->txUnsent -= go;
+    dp->lastSendAt = now;
+
+    if (n > 0 && (rc = (dp->batch == DP_BATCH_GSO) ? dpsendgso(dp, batch, n) :
+            dpsendmmsg(dp, batch, n)) < 0)
+        return rc;
+    return dpfecpush(dp);
+}
+
+//Fill in one dgram's worth of a batch, see dpframe()
+static void dpbatchmsg(dp_connp dp, struct msghdr *msg, struct iovec *iov, dp_txslot *slot, char *wire){
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &(dp->outSockAddr.addr);
+    msg->msg_namelen = dp->outSockAddr.len;
+    msg->msg_iov = iov;
+    msg->msg_iovlen = dpframe(dp, &slot->hdr, slot->payload, slot->hdr.dgram_sz, iov, wire);
+}
+
+/*
+ * Gather a dgram - the header encoded into wire, the payload where it is,
+ * and with DP_WF_CRC the trailer, also kept in wire (which needs
+ * DP_HDR_MAX_SZ + DP_CRC_SZ bytes).  Returns how many of iov (up to 3) it
+ * used.
+ */
+static int dpframe(dp_connp dp, dp_pdu *pdu, const void *payload, int payload_sz, struct iovec *iov, char *wire){
+    int hlen = dphdrenc(dp, pdu, wire);
+    int n = 0;
+
+    iov[n].iov_base = wire;
+    iov[n++].iov_len = hlen;
+    if (payload_sz > 0) {
+        iov[n].iov_base = (void *)payload;
+        iov[n++].iov_len = payload_sz;
+    }
+    if (hlen == DP_HDR_V2_SZ && (((dp_wire_hdr *)wire)->flags & DP_WF_CRC)) {
+        uint32_t crc = dpcrc32c(0, wire, hlen);
+        if (payload_sz > 0)
+            crc = dpcrc32c(crc, payload, payload_sz);
+        crc = htonl(crc);
+        memcpy(wire + DP_HDR_MAX_SZ, &crc, DP_CRC_SZ);
+        iov[n].iov_base = wire + DP_HDR_MAX_SZ;
+        iov[n++].iov_len = DP_CRC_SZ;
+    }
+    return n;
+}
+
+//Copy len bytes starting off bytes into a dgram spread over iov
+static void dpgather(const struct iovec *iov, int iovcnt, int off, void *out, int len){
+    char *o = out;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        int n = iov[i].iov_len;
+        if (off >= n) {
+            off -= n;
+            continue;
+        }
+        n -= off;
+        if (n > len)
+            n = len;
+        memcpy(o, (char *)iov[i].iov_base + off, n);
+        o += n;
+        len -= n;
+        off = 0;
+    }
+}
+
+/*
+ * Check the DP_WF_CRC trailer of a received dgram of len bytes, spread over
+ * iov.  Returns the length of the dgram without the trailer, or -1 (and
+ * counts it) if the CRC does not match or the dgram was cut short before it.
+ */
+static int dpcrccheck(dp_connp dp, const struct iovec *iov, int iovcnt, int len){
+    unsigned char hdr[DP_HDR_V2_SZ];
+    uint16_t sz;
+    uint32_t crc = 0, want;
+    int covered;
+
+    if (len < DP_HDR_V2_SZ)
+        return len;
+    dpgather(iov, iovcnt, 0, hdr, DP_HDR_V2_SZ);
+    if (hdr[0] != DP_PROTO_VER_2 || hdr[1] == 0 || !(hdr[2] & DP_WF_CRC))
+        return len;
+    memcpy(&sz, hdr + offsetof(dp_wire_hdr, dgram_sz), sizeof(sz));
+    covered = DP_HDR_V2_SZ + ntohs(sz);
+
+    if (len >= covered + DP_CRC_SZ) {
+        int left = covered;
+        for (int i = 0; i < iovcnt && left > 0; i++) {
+            int n = (iov[i].iov_len < left) ? iov[i].iov_len : left;
+            crc = dpcrc32c(crc, iov[i].iov_base, n);
+            left -= n;
+        }
+        dpgather(iov, iovcnt, covered, &want, DP_CRC_SZ);
+        if (ntohl(want) == crc)
+            return covered;
+    }
+    dp->stats.crcErrors++;
+    if (_debugMode == 1)
+        printf("DROPPED bad CRC, %d bytes\n", len);
+    return -1;
+}
+
+/*
+ * Hand a dgram of len bytes to the packet tap, if one is open.  Our end is
+ * the address the socket is bound to, or the peer's when it is bound to any
+ * address and the peer is on loopback, which is where it has to be then.
+ */
+static void dptap(dp_connp dp, int dir, const struct iovec *iov, int iovcnt, int len){
+    struct sockaddr_in *local = &dp->tapSockAddr.addr;
+
+    if (!dptapon() || len < 0 || !dp->outSockAddr.isAddrInit)
+        return;
+    if (!dp->tapSockAddr.isAddrInit) {
+        socklen_t sl = sizeof(*local);
+        //A client socket gets its port when the first dgram goes out, which
+        //the impairment shim may not have done yet, so bind it now
+        if (getsockname(dp->udp_sock, (struct sockaddr *)local, &sl) == 0 && local->sin_port == 0) {
+            struct sockaddr_in any = { .sin_family = AF_INET };
+            bind(dp->udp_sock, (struct sockaddr *)&any, sizeof(any));
+            sl = sizeof(*local);
+            getsockname(dp->udp_sock, (struct sockaddr *)local, &sl);
+        }
+        if (local->sin_addr.s_addr == htonl(INADDR_ANY) &&
+            (ntohl(dp->outSockAddr.addr.sin_addr.s_addr) >> 24) == 127)
+            local->sin_addr = dp->outSockAddr.addr.sin_addr;
+        dp->tapSockAddr.isAddrInit = true;
+    }
+    if (dir == DP_TAP_IN)
+        dptaprecord(dir, &dp->outSockAddr.addr, local, iov, iovcnt, len);
+    else
+        dptaprecord(dir, local, &dp->outSockAddr.addr, iov, iovcnt, len);
+}
+
+static int dpsendmmsg(dp_connp dp, dp_txslot **slots, int n){
+    struct mmsghdr msgs[DP_MAX_WINDOW];
+    struct iovec iov[DP_MAX_WINDOW][3];
+    char wire[DP_MAX_WINDOW][DP_HDR_MAX_SZ + DP_CRC_SZ];
+    int sent = 0, rc;
+
+    for (int i = 0; i < n; i++) {
+        dpbatchmsg(dp, &msgs[i].msg_hdr, iov[i], slots[i], wire[i]);
+        msgs[i].msg_len = 0;
+    }
+    while (sent < n) {
+        rc = sendmmsg(dp->udp_sock, msgs + sent, n - sent, 0);
+        dp->stats.sendCalls++;
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            //Same as a lost dgram as far as the window is concerned
+            perror("dpsend: sendmmsg() failed");
+            return DP_NO_ERROR;
+        }
+        for (int i = sent; i < sent + rc; i++) {
+            dp->stats.bytesOut += msgs[i].msg_len;
+            dptap(dp, DP_TAP_OUT, msgs[i].msg_hdr.msg_iov, msgs[i].msg_hdr.msg_iovlen, msgs[i].msg_len);
+        }
+        sent += rc;
+    }
+    return DP_NO_ERROR;
+}
+
+/*
+ * UDP GSO - a run of dgrams that are all the same size (the last one may be
+ * shorter) is handed to the kernel as one big send with a UDP_SEGMENT size,
+ * and the kernel (or the NIC) cuts it back into dgrams.  Anything that does
+ * not fit a run goes out with sendmmsg().
+ */
+static int dpsendgso(dp_connp dp, dp_txslot **slots, int n){
+    struct iovec iov[3 * DP_GSO_MAX_SEGS];
+    char wire[DP_GSO_MAX_SEGS][DP_HDR_MAX_SZ + DP_CRC_SZ];
+    char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    int hlen = (dp->wireVer == DP_PROTO_VER_2) ? DP_HDR_V2_SZ : DP_HDR_V1_SZ;
+    int i = 0, lone = 0;
+
+    //Every segment carries its own header, and CRC trailer if there is one
+    if (hlen == DP_HDR_V2_SZ && dp->crc)
+        hlen += DP_CRC_SZ;
+
+    while (i < n) {
+        int segSz = hlen + slots[i]->hdr.dgram_sz;
+        int j = i + 1;
+        while (j < n && j - i < DP_GSO_MAX_SEGS && (j - i + 1) * segSz <= DP_GSO_MAX_BYTES &&
+               hlen + slots[j - 1]->hdr.dgram_sz == segSz &&
+               hlen + slots[j]->hdr.dgram_sz <= segSz)
+            j++;
+        if (j - i == 1) {
+            //Nothing to gain from GSO, collect these for one sendmmsg()
+            slots[lone++] = slots[i++];
+            continue;
+        }
+        if (lone > 0) {
+            dpsendmmsg(dp, slots, lone);
+            lone = 0;
+        }
+
+        int iovlen = 0;
+        int segIov[DP_GSO_MAX_SEGS];
+        for (int k = i; k < j; k++) {
+            segIov[k - i] = dpframe(dp, &slots[k]->hdr, slots[k]->payload,
+                                    slots[k]->hdr.dgram_sz, iov + iovlen, wire[k - i]);
+            iovlen += segIov[k - i];
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &(dp->outSockAddr.addr);
+        msg.msg_namelen = dp->outSockAddr.len;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovlen;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        cm = CMSG_FIRSTHDR(&msg);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cm) = segSz;
+
+        int rc;
+        do {
+            rc = sendmsg(dp->udp_sock, &msg, 0);
+            dp->stats.sendCalls++;
+        } while (rc < 0 && errno == EINTR);
+        if (rc < 0) {
+            //No GSO here, stick to sendmmsg() from now on
+            if (_debugMode == 1)
+                printf("dpsend: UDP_SEGMENT not supported (%s), using sendmmsg()\n", strerror(errno));
+            dp->batch = DP_BATCH_MMSG;
+            return dpsendmmsg(dp, slots + i, n - i);
+        }
+        dp->stats.bytesOut += rc;
+        if (dptapon()) {
+            struct iovec *seg = iov;
+            for (int k = i; k < j; k++) {
+                dptap(dp, DP_TAP_OUT, seg, segIov[k - i], hlen + slots[k]->hdr.dgram_sz);
+                seg += segIov[k - i];
+            }
+        }
+        i = j;
+    }
+    if (lone > 0)
+        dpsendmmsg(dp, slots, lone);
+    return DP_NO_ERROR;
+}
+
+
+static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
+    return dpsendrawv(dp, sbuff, (char *)sbuff + sizeof(dp_pdu),
+        sbuff_sz - sizeof(dp_pdu));
+}
+
+/*
+ * Send one dgram gathered from a header and a separate payload, so payloads
+ * go out of the send window or the application's memory without a copy
+ */
+static int dpsendrawv(dp_connp dp, dp_pdu *pdu, const void *payload, int payload_sz){
+    int bytesOut = 0, extra = 0;
+    struct iovec iov[3];
+    struct msghdr msg = {0};
+    char wire[DP_HDR_MAX_SZ + DP_CRC_SZ];
+
+    if(!dp->outSockAddr.isAddrInit) {
+        perror("dpsendraw:dp connection not setup properly");
+        return -1;
+    }
 
-    dp_connp dpc = dpinit();
-    if (dpc == NULL) {
-        perror("drexel protocol create failure"); 
-        return NULL;
+    //Simulated loss - pretend the dgram went out so the sender carries on
+    int copies = dpsimfate(dp, pdu);
+    if (copies == 0)
+        return sizeof(dp_pdu) + payload_sz;
+
+    msg.msg_name = &(dp->outSockAddr.addr);
+    msg.msg_namelen = dp->outSockAddr.len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = dpframe(dp, pdu, payload, payload_sz, iov, wire);
+    for (int i = 0; i < msg.msg_iovlen; i++)
+        extra += iov[i].iov_len;
+    extra -= (payload_sz > 0) ? payload_sz : 0;
+
+    if (dp->netem != NULL && dpnetemdelays(dp->netem)) {
+        //Each copy goes out later with a sendto() of its own
+        for (int i = 0; i < copies; i++) {
+            bytesOut = dpnetemsend(dp->netem, dp->udp_sock, &dp->outSockAddr.addr, iov, msg.msg_iovlen);
+            dp->stats.sendCalls++;
+            dptap(dp, DP_TAP_OUT, iov, msg.msg_iovlen, bytesOut);
+        }
+    } else {
+        bytesOut = sendmsg(dp->udp_sock, &msg, 0);
+        dp->stats.sendCalls++;
+        dptap(dp, DP_TAP_OUT, iov, msg.msg_iovlen, bytesOut);
     }
 
-    sock = &(dpc->udp_sock);
-    servaddr = &(dpc->outSockAddr.addr);
+    print_out_pdu(pdu);
 
-    // Creating socket file descriptor 
-    if ( (*sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) { 
-        perror("socket creation failed"); 
-        return NULL;
-    } 
+    //Callers count in dp_pdu sized headers, whatever went on the wire
+    if (bytesOut < 0)
+        return bytesOut;
+    dp->stats.bytesOut += bytesOut;
+    return bytesOut - extra + sizeof(dp_pdu);
+}
 
-    // Filling server information 
-    servaddr->sin_family = AF_INET; 
-    servaddr->sin_port = htons(port); 
-    servaddr->sin_addr.s_addr = inet_addr(addr);
-    dpc->outSockAddr.len = sizeof(struct sockaddr_in); 
-    dpc->outSockAddr.isAddrInit = true;
 
-    // The inbound address is the same as the outbound address
-    memcpy(&dpc->inSockAddr, &dpc->outSockAddr, sizeof(dpc->outSockAddr));
+//Count a dgram going out, and ask the impairment shim how many copies of
+//it to send - 0 if it is lost
+static int dpsimfate(dp_connp dp, dp_pdu *pdu){
+    int copies;
 
-    return dpc;
+    dp->stats.dgramsOut++;
+    if (dp->netem == NULL || (copies = dpnetemfate(dp->netem)) > 0)
+        return (dp->netem == NULL) ? 1 : copies;
+    dp->stats.dropped++;
+    if (_debugMode == 1)
+        printf("DROPPED (simulated) seq %d\n", pdu->seqnum);
+    return 0;
 }
 
+/*
+ * Impair everything this connection sends from now on, see du-netem.h for
+ * the settings, e.g. "loss=1,delay=20ms,jitter=5ms,rate=50mbit,seed=3".
+ * Settings left out are off; an empty spec turns the shim off.
+ */
+int dpsetimpair(dp_connp dp, const char *spec){
+    dp_netem_cfg cfg = { .seed = DP_NETEM_SEED };
+    dp_netem *ne = NULL;
+
+    if (spec != NULL && spec[0] != '\0') {
+        if (dpnetemparse(spec, &cfg) < 0)
+            return DP_ERROR_GENERAL;
+        if ((ne = dpnetemnew(&cfg)) == NULL)
+            return DP_ERROR_GENERAL;
+    }
+    dpnetemfree(dp->netem);
+    dp->netem = ne;
+    return DP_NO_ERROR;
+}
 
-int dprecv(dp_connp dp, void *buff, int buff_sz){
-
-    dp_pdu *inPdu;
-    int rcvLen = dprecvdgram(dp, _dpBuffer, sizeof(_dpBuffer));
+/*
+ * Pull in as many dgrams as are waiting with one recvmmsg(), blocking for
+ * the first one unless flags has MSG_DONTWAIT.  With UDP_GRO each buffer
+ * can hold a run of dgrams the kernel glued together, all segSz long but
+ * the last.  Returns the number of buffers filled.
+ */
+static int dprxbfill(dp_connp dp, int flags){
+    dp_rxbatch *rb = dp->rxb;
+    struct mmsghdr msgs[DP_BATCH_MAX];
+    struct iovec iov[DP_BATCH_MAX];
+    char ctrl[DP_BATCH_MAX][CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(uint32_t))];
+    int nbufs = dp->gro ? DP_GRO_BUFS : DP_BATCH_MAX;
+    uint32_t drops = dp->stats.rcvbufDrops;
+    int n;
+
+    //Buffers with dgrams still lent out of them are left to their loans
+    for (int i = 0; i < nbufs; i++) {
+        if (rb->bufs[i] != NULL && rb->bufs[i]->refs == 1)
+            continue;
+        if (rb->bufs[i] != NULL)
+            dprxbput(rb, rb->bufs[i]);
+        if ((rb->bufs[i] = dprxbget(rb)) == NULL) {
+            nbufs = i;
+            break;
+        }
+    }
+    if (nbufs == 0)
+        return -1;
 
-    if(rcvLen == DP_CONNECTION_CLOSED)
-        return DP_CONNECTION_CLOSED;
+    memset(msgs, 0, sizeof(msgs[0]) * nbufs);
+    for (int i = 0; i < nbufs; i++) {
+        iov[i].iov_base = rb->bufs[i]->data;
+        iov[i].iov_len = rb->buffSz;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &rb->from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_control = ctrl[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+    }
 
-    inPdu = (dp_pdu *)_dpBuffer;
-    if(rcvLen > sizeof(dp_pdu))
-        memcpy(buff, (_dpBuffer+sizeof(dp_pdu)), inPdu->dgram_sz);
+    do {
+        n = recvmmsg(dp->udp_sock, msgs, nbufs,
+            (flags & MSG_DONTWAIT) ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        dp->stats.recvCalls++;
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (n < 0) {
+        perror("dprecv: received error from recvmmsg()");
+        return -1;
+    }
 
-    return inPdu->dgram_sz;
+    for (int i = 0; i < n; i++) {
+        rb->len[i] = msgs[i].msg_len;
+        rb->segSz[i] = rb->len[i];
+        dprxqovfl(&msgs[i].msg_hdr, &drops);
+        dp->stats.rcvbufDrops = drops;
+        if (!dp->gro)
+            continue;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL;
+             cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm))
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                rb->segSz[i] = *(int *)CMSG_DATA(cm);
+    }
+    rb->count = n;
+    rb->cur = 0;
+    rb->off = 0;
+    return n;
 }
 
+//Take the next dgram out of the batch, split into header and payload
+static int dprxbpop(dp_connp dp, dp_pdu *pdu, void *payload, int payload_sz){
+    dp_rxbatch *rb = dp->rxb;
+    char *dgram = rb->bufs[rb->cur]->data + rb->off;
+    int len = rb->len[rb->cur] - rb->off;
 
-static int dprecvdgram(dp_connp dp, void *buff, int buff_sz){
-    int bytesIn = 0;
-    int errCode = DP_NO_ERROR;
-
-    if(buff_sz > DP_MAX_DGRAM_SZ)
-        return DP_BUFF_OVERSIZED;
-
-    bytesIn = dprecvraw(dp, buff, buff_sz);
+    if (payload == NULL)
+        dp->rxBuf = rb->bufs[rb->cur];
 
-    //check for some sort of error and just return it
-    if (bytesIn < sizeof(dp_pdu))
-        errCode = DP_ERROR_BAD_DGRAM;
+    if (len > rb->segSz[rb->cur])
+        len = rb->segSz[rb->cur];
 
-    dp_pdu inPdu;
-    memcpy(&inPdu, buff, sizeof(dp_pdu));
-    if (inPdu.dgram_sz > buff_sz)
-        errCode = DP_BUFF_UNDERSIZED;
+    memcpy(&dp->outSockAddr.addr, &rb->from[rb->cur], sizeof(struct sockaddr_in));
+    dp->outSockAddr.len = sizeof(struct sockaddr_in);
+    dp->outSockAddr.isAddrInit = true;
 
-    //Copy buffer back
-    // memcpy(buff, (_dpBuffer+sizeof(dp_pdu)), inPdu.dgram_sz);
-    
-    
-    //UDPATE SEQ NUMBER AND PREPARE ACK
-    if (errCode == DP_NO_ERROR){
-        if(inPdu.dgram_sz == 0)
-            //Update Seq Number to just ack a control message - just got PDU
-            dp->seqNum ++;
-        else
-            //Update Seq Number to increas by the inbound PDU dgram_sz
-            dp->seqNum += inPdu.dgram_sz;
-    } else {
-        //Update seq number to ACK error
-        dp->seqNum++;
+    rb->off += len;
+    if (rb->off >= rb->len[rb->cur] || len == 0) {
+        rb->cur++;
+        rb->off = 0;
     }
 
-    dp_pdu outPdu;
-    outPdu.proto_ver = DP_PROTO_VER_1;
-    outPdu.dgram_sz = 0;
-    outPdu.seqnum = dp->seqNum;
-    outPdu.err_num = errCode;
+    return dpsplit(dp, dgram, len, pdu, payload, payload_sz);
+}
 
-    int actSndSz = 0;
-    //HANDLE ERROR SITUATION
-    if(errCode != DP_NO_ERROR) {
-        outPdu.mtype = DP_MT_ERROR;
-        actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
-        if (actSndSz != sizeof(dp_pdu))
-            return DP_ERROR_PROTOCOL;
-    }
+//A buffer for the batch, with the batch's reference on it
+static dp_rxbuf *dprxbget(dp_rxbatch *rb){
+    dp_rxbuf *buf = rb->freeList;
 
+    if (buf != NULL)
+        rb->freeList = buf->next;
+    else if ((buf = malloc(sizeof(dp_rxbuf) + rb->buffSz)) == NULL)
+        return NULL;
+    buf->size = rb->buffSz;
+    buf->refs = 1;
+    return buf;
+}
 
-    switch(inPdu.mtype){
-        case DP_MT_SND:
-            outPdu.mtype = DP_MT_SNDACK;
-            actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
-            if (actSndSz != sizeof(dp_pdu))
-                return DP_ERROR_PROTOCOL;
-            break;
-        case DP_MT_CLOSE:
-            outPdu.mtype = DP_MT_CLOSEACK;
-            actSndSz = dpsendraw(dp, &outPdu, sizeof(dp_pdu));
-            if (actSndSz != sizeof(dp_pdu))
-                return DP_ERROR_PROTOCOL;
-            dpclose(dp);
-            return DP_CONNECTION_CLOSED;
-        default:
-        {
-            printf("ERROR: Unexpected or bad mtype in header %d\n", inPdu.mtype);
-            return DP_ERROR_PROTOCOL;
-        }
+//Drop a reference, the last one puts the buffer back on the free list
+static void dprxbput(dp_rxbatch *rb, dp_rxbuf *buf){
+    if (--buf->refs > 0)
+        return;
+    if (buf->size != rb->buffSz) {
+        free(buf);
+        return;
     }
+    buf->next = rb->freeList;
+    rb->freeList = buf;
+}
 
-    return bytesIn;
+/*
+ * Split a whole received dgram into the header, decoded into pdu, and the
+ * payload, or with payload NULL just point dp->rxAt at it.  Returns the
+ * length as if the header had been a dp_pdu, so callers do not care which
+ * version came in.
+ */
+static int dpsplit(dp_connp dp, const char *dgram, int len, dp_pdu *pdu, void *payload, int payload_sz){
+    struct iovec whole = { (void *)dgram, len };
+    int hlen = dphdrdec(dgram, len, pdu);
+    int plen;
+
+    dp->stats.bytesIn += len;
+    dptap(dp, DP_TAP_IN, &whole, 1, len);
+    if ((len = dpcrccheck(dp, &whole, 1, len)) < 0)
+        return 0;
+    if (hlen < 0)
+        return (len < (int)sizeof(dp_pdu)) ? len : (int)sizeof(dp_pdu) - 1;
+    dp->rxVer = (hlen == DP_HDR_V2_SZ) ? DP_PROTO_VER_2 : DP_PROTO_VER_1;
+    plen = len - hlen;
+    if (plen > payload_sz)
+        plen = payload_sz;
+    if (payload == NULL)
+        dp->rxAt = (char *)dgram + hlen;
+    else if (plen > 0)
+        memcpy(payload, dgram + hlen, plen);
+    return sizeof(dp_pdu) + (plen > 0 ? plen : 0);
 }
 
+//Header in the format this connection sends, returns its length
+static int dphdrenc(dp_connp dp, dp_pdu *pdu, void *wire){
+    dp_wire_hdr hdr;
 
-static int dprecvraw(dp_connp dp, void *buff, int buff_sz){
-    int bytes = 0;
+    if (dp->wireVer != DP_PROTO_VER_2) {
+        memcpy(wire, pdu, sizeof(dp_pdu));
+        return DP_HDR_V1_SZ;
+    }
+    hdr.ver = DP_PROTO_VER_2;
+    hdr.mtype = pdu->mtype & ~(DP_MT_FRAGMENT | DP_MT_PROTECTED);
+    hdr.flags = (pdu->mtype & DP_MT_FRAGMENT) ? DP_WF_FRAGMENT : 0;
+    if (pdu->mtype & DP_MT_PROTECTED)
+        hdr.flags |= DP_WF_FEC;
+    if (dp->crc)
+        hdr.flags |= DP_WF_CRC;     //dpframe() adds the trailer
+    hdr.err = pdu->err_num;
+    hdr.seqnum = htonl(pdu->seqnum);
+    hdr.dgram_sz = htons(pdu->dgram_sz);
+    memcpy(wire, &hdr, sizeof(hdr));
+    return DP_HDR_V2_SZ;
+}
 
-    if(!dp->inSockAddr.isAddrInit) {
-        perror("dprecv: dp connection not setup properly - cli struct not init");
-        return -1;
+//Header of either version, returns its length or -1 if the dgram is short
+static int dphdrdec(const void *wire, int len, dp_pdu *pdu){
+    const unsigned char *b = wire;
+    dp_wire_hdr hdr;
+
+    if (len >= 2 && b[0] == DP_PROTO_VER_2 && b[1] != 0) {
+        if (len < DP_HDR_V2_SZ)
+            return -1;
+        memcpy(&hdr, wire, sizeof(hdr));
+        pdu->proto_ver = hdr.ver;
+        pdu->mtype = hdr.mtype | ((hdr.flags & DP_WF_FRAGMENT) ? DP_MT_FRAGMENT : 0) |
+            ((hdr.flags & DP_WF_FEC) ? DP_MT_PROTECTED : 0);
+        pdu->err_num = hdr.err;
+        pdu->seqnum = ntohl(hdr.seqnum);
+        pdu->dgram_sz = ntohs(hdr.dgram_sz);
+        return DP_HDR_V2_SZ;
     }
+    if (len < DP_HDR_V1_SZ)
+        return -1;
+    memcpy(pdu, wire, sizeof(dp_pdu));
+    return DP_HDR_V1_SZ;
+}
 
-    bytes = recvfrom(dp->udp_sock, (char *)buff, buff_sz,  
-                MSG_WAITALL, ( struct sockaddr *) &(dp->outSockAddr.addr), 
-                &(dp->outSockAddr.len)); 
+//Dgrams already received but not processed yet, either batch or listener
+static _Bool dprxbpending(dp_connp dp){
+    _Bool pending;
 
-    if (bytes < 0) {
-        perror("dprecv: received error from recvfrom()");
-        return -1;
+    if (dp->listener != NULL) {
+        pthread_mutex_lock(&dp->listener->lock);
+        pending = (dp->inHead != NULL);
+        pthread_mutex_unlock(&dp->listener->lock);
+        return pending;
     }
-    dp->outSockAddr.isAddrInit = true;
+    return dp->rxb != NULL && dp->rxb->cur < dp->rxb->count;
+}
 
-    //some helper code if you want to do debugging
-    if (bytes > sizeof(dp_pdu)){
-        if(false) {                         //just diabling for now
-            dp_pdu *inPdu = buff;
-            char * payload = (char *)buff + sizeof(dp_pdu);
-            printf("DATA : %.*s\n", inPdu->dgram_sz , payload); 
-        }
+/*
+ * LISTENER - many connections on one socket
+ *
+ * Every connection accepted by a listener shares its socket.  A thread that
+ * needs a dgram for its connection (or dpaccept() waiting for a new one)
+ * checks its queue, and if it is empty and nobody else is reading, takes a
+ * turn reading the socket and routing whatever arrives to the right queue.
+ * Threads that find someone already reading just wait to be signalled.
+ */
+dp_listenp dpListenerInit(int port) {
+    dp_listenp lp = malloc(sizeof(dp_listener));
+    if (lp == NULL) {
+        perror("drexel protocol create failure");
+        return NULL;
     }
+    bzero(lp, sizeof(dp_listener));
 
-    dp_pdu *inPdu = buff;
-    print_in_pdu(inPdu);
-
-    //return the number of bytes received 
-    return bytes;
+    lp->udp_sock = dpbindsock(&lp->inSockAddr, port);
+    if (lp->udp_sock < 0) {
+        free(lp);
+        return NULL;
+    }
+    lp->bufCap = dpbufinit(lp->udp_sock, &lp->rcvBuf, &lp->sndBuf);
+    //deadlines come from dpnow(), so the condition has to wait on the same clock
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_mutex_init(&lp->lock, NULL);
+    pthread_cond_init(&lp->cond, &ca);
+    pthread_condattr_destroy(&ca);
+    return lp;
 }
 
-int dpsend(dp_connp dp, void *sbuff, int sbuff_sz){
-
-
-    //For now, we will not be able to send larger than the biggest datagram
-    if(sbuff_sz > dpmaxdgram()) {
-        return DP_BUFF_UNDERSIZED;
+//Connections that were never accepted go with the listener, the rest must
+//be closed by their owners first
+void dplistenerclose(dp_listenp lp) {
+    while (lp->acceptHead != NULL) {
+        dp_connp dp = lp->acceptHead;
+        lp->acceptHead = dp->acceptNext;
+        dpclose(dp);
     }
+    while (lp->freeList != NULL) {
+        dp_qdgram *qd = lp->freeList;
+        lp->freeList = qd->next;
+        free(qd);
+    }
+    close(lp->udp_sock);
+    pthread_mutex_destroy(&lp->lock);
+    pthread_cond_destroy(&lp->cond);
+    free(lp);
+}
 
-    int sndSz = dpsenddgram(dp, sbuff, sbuff_sz);
+//Block until a new peer connects, the CONNECT/ACK has already been sent
+dp_connp dpaccept(dp_listenp lp) {
+    return dplaccept(lp, 0);
+}
 
-    return sndSz;
+//dpaccept() without blocking, NULL if nobody new has connected
+dp_connp dptryaccept(dp_listenp lp) {
+    return dplaccept(lp, dpnow());
 }
 
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz){
-    int bytesOut = 0;
+int dplistenerfd(dp_listenp lp) {
+    return lp->udp_sock;
+}
 
-    if(!dp->outSockAddr.isAddrInit) {
-        perror("dpsend:dp connection not setup properly");
-        return DP_ERROR_GENERAL;
-    }
+static dp_connp dplaccept(dp_listenp lp, long long deadline) {
+    dp_connp dp;
 
-    if(sbuff_sz > DP_MAX_BUFF_SZ)
-        return DP_ERROR_GENERAL;
+    if (dplwait(lp, NULL, deadline) <= 0)
+        return NULL;
 
-    //Build the PDU and out buffer
-    dp_pdu *outPdu = (dp_pdu *)_dpBuffer;
-    int    sndSz = sbuff_sz;
-    outPdu->proto_ver = DP_PROTO_VER_1;
-    outPdu->mtype = DP_MT_SND;
-    outPdu->dgram_sz = sndSz;
-    outPdu->seqnum = dp->seqNum;
+    pthread_mutex_lock(&lp->lock);
+    dp = lp->acceptHead;
+    lp->acceptHead = dp->acceptNext;
+    if (lp->acceptHead == NULL)
+        lp->acceptTail = NULL;
+    dp->acceptNext = NULL;
+    pthread_mutex_unlock(&lp->lock);
 
-    memcpy((_dpBuffer + sizeof(dp_pdu)), sbuff, sndSz);
+    printf("Connection established OK!\n");
+    return dp;
+}
 
-    int totalSendSz = outPdu->dgram_sz + sizeof(dp_pdu);
-    bytesOut = dpsendraw(dp, _dpBuffer, totalSendSz);
+static unsigned int dplhash(struct sockaddr_in *addr) {
+    unsigned int h = addr->sin_addr.s_addr ^ (addr->sin_port * 2654435761u);
+    return (h ^ (h >> 16)) % DP_LISTEN_BUCKETS;
+}
 
-    if(bytesOut != totalSendSz){
-        printf("Warning send %d, but expected %d!\n", bytesOut, totalSendSz);
-    }
+/*
+ * Wait until dp has a dgram queued (or, for dp == NULL, a connection is
+ * waiting to be accepted), reading the socket ourselves when nobody else
+ * is.  Same deadline rules as dppoll(), returns 1 if ready, 0 on timeout.
+ */
+static int dplwait(dp_listenp lp, dp_connp dp, long long deadline) {
+    int rc = 0;
 
-    //update seq number after send
-    if(outPdu->dgram_sz == 0)
-        dp->seqNum++;
-    else
-        dp->seqNum += outPdu->dgram_sz;
+    pthread_mutex_lock(&lp->lock);
+    while (1) {
+        if ((dp != NULL) ? (dp->inHead != NULL) : (lp->acceptHead != NULL)) {
+            rc = 1;
+            break;
+        }
+        if (!lp->reading) {
+            lp->reading = true;
+            pthread_mutex_unlock(&lp->lock);
+            rc = dplread(lp, deadline);
+            pthread_mutex_lock(&lp->lock);
+            lp->reading = false;
+            pthread_cond_broadcast(&lp->cond);
+            if (rc > 0)
+                continue;
+            if (rc == 0 && ((dp != NULL) ? (dp->inHead != NULL) : (lp->acceptHead != NULL)))
+                rc = 1;
+            break;
+        }
+        if (deadline > 0 && dpnow() >= deadline) {
+            rc = 0;
+            break;
+        }
+        if (deadline > 0) {
+            struct timespec ts = { deadline / 1000000, (deadline % 1000000) * 1000 };
+            pthread_cond_timedwait(&lp->cond, &lp->lock, &ts);
+        } else {
+            pthread_cond_wait(&lp->cond, &lp->lock);
+        }
+    }
+    pthread_mutex_unlock(&lp->lock);
+    return rc;
+}
 
-    //need to get an ack
-    dp_pdu inPdu = {0};
-    int bytesIn = dprecvraw(dp, &inPdu, sizeof(dp_pdu));
-    if ((bytesIn < sizeof(dp_pdu)) && (inPdu.mtype != DP_MT_SNDACK)){
-        printf("Expected SND/ACK but got a different mtype %d\n", inPdu.mtype);
+/*
+ * Read whatever is waiting on the listener socket (blocking until deadline
+ * for the first dgram) and route it.  Returns 1 if anything was read.
+ */
+static int dplread(dp_listenp lp, long long deadline) {
+    struct pollfd pfd = { .fd = lp->udp_sock, .events = POLLIN };
+    int timeout = -1;
+    int rc, got = 0;
+
+    if (deadline > 0) {
+        long long left = deadline - dpnow();
+        timeout = (left <= 0) ? 0 : (int)((left + 999) / 1000);
     }
+    do {
+        rc = poll(&pfd, 1, timeout);
+    } while (rc < 0 && errno == EINTR);
+    if (rc <= 0)
+        return rc;
+
+    //Grab a batch of free queue entries and fill them with one recvmmsg()
+    dp_qdgram *qds[DP_BATCH_MAX];
+    struct mmsghdr msgs[DP_BATCH_MAX];
+    struct iovec iov[DP_BATCH_MAX];
+    struct sockaddr_in from[DP_BATCH_MAX];
+    char ctrl[DP_BATCH_MAX][CMSG_SPACE(sizeof(uint32_t))];
+    int n;
+
+    pthread_mutex_lock(&lp->lock);
+    for (n = 0; n < DP_BATCH_MAX && lp->freeList != NULL; n++) {
+        qds[n] = lp->freeList;
+        lp->freeList = qds[n]->next;
+    }
+    pthread_mutex_unlock(&lp->lock);
+    for (; n < DP_BATCH_MAX; n++)
+        if ((qds[n] = malloc(sizeof(dp_qdgram))) == NULL)
+            break;
 
-    return bytesOut - sizeof(dp_pdu);
+    memset(msgs, 0, sizeof(msgs[0]) * n);
+    for (int i = 0; i < n; i++) {
+        iov[i].iov_base = qds[i]->dgram;
+        iov[i].iov_len = DP_MAX_DGRAM_SZ;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &from[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        msgs[i].msg_hdr.msg_control = ctrl[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+    }
+    do {
+        rc = recvmmsg(lp->udp_sock, msgs, n, MSG_DONTWAIT, NULL);
+    } while (rc < 0 && errno == EINTR);
+
+    for (int i = 0; i < n; i++) {
+        if (i < rc) {
+            qds[i]->len = msgs[i].msg_len;
+            dprxqovfl(&msgs[i].msg_hdr, &lp->rxqOvfl);
+            dplroute(lp, qds[i], &from[i]);
+            got = 1;
+            continue;
+        }
+        pthread_mutex_lock(&lp->lock);
+        qds[i]->next = lp->freeList;
+        lp->freeList = qds[i];
+        pthread_mutex_unlock(&lp->lock);
+    }
+    return got;
 }
 
+/*
+ * Queue a dgram on the connection for its peer.  A CONNECT from a peer we
+ * dont know yet creates a connection, answers it and puts it on the accept
+ * queue; anything else from an unknown peer is a stray and is dropped.
+ */
+static void dplroute(dp_listenp lp, dp_qdgram *qd, struct sockaddr_in *from) {
+    dp_pdu pdu;
+    dp_connp dp;
+    unsigned int h = dplhash(from);
+
+    pthread_mutex_lock(&lp->lock);
+    for (dp = lp->buckets[h]; dp != NULL; dp = dp->hashNext)
+        if (dp->outSockAddr.addr.sin_addr.s_addr == from->sin_addr.s_addr &&
+            dp->outSockAddr.addr.sin_port == from->sin_port)
+            break;
 
-static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz){
-    int bytesOut = 0;
-    // dp_pdu *pdu = sbuff;
-
-    if(!dp->outSockAddr.isAddrInit) {
-        perror("dpsendraw:dp connection not setup properly");
-        return -1;
+    if (dp == NULL && dphdrdec(qd->dgram, qd->len, &pdu) > 0) {
+        if (pdu.mtype == DP_MT_CONNECT && (dp = dpinit()) != NULL) {
+            dp->listener = lp;
+            dp->udp_sock = lp->udp_sock;
+            dp->bufCap = lp->bufCap;
+            dp->rxqBase = lp->rxqOvfl;
+            memcpy(&dp->inSockAddr, &lp->inSockAddr, sizeof(struct dp_sock));
+            memcpy(&dp->outSockAddr.addr, from, sizeof(struct sockaddr_in));
+            dp->outSockAddr.isAddrInit = true;
+            print_in_pdu(&pdu);
+
+            uint32_t agreed;
+            int n = dpnegotiate(dp, &pdu, &agreed);
+            pdu.mtype = DP_MT_CNTACK;
+            dp->seqNum = pdu.seqnum + 1;
+            pdu.seqnum = dp->seqNum;
+            dpsendrawv(dp, &pdu, &agreed, n);
+            dp->isConnected = true;
+            dp->state = DP_ST_OPEN;
+            dp->sndUna = dp->rcvDlv = dp->seqNum;
+            dpbufopen(dp);
+
+            dp->hashNext = lp->buckets[h];
+            lp->buckets[h] = dp;
+            if (lp->acceptTail != NULL)
+                lp->acceptTail->acceptNext = dp;
+            else
+                lp->acceptHead = dp;
+            lp->acceptTail = dp;
+            pthread_cond_broadcast(&lp->cond);
+        }
+        dp = NULL;
     }
 
-    dp_pdu *outPdu = sbuff;
-    bytesOut = sendto(dp->udp_sock, (const char *)sbuff, sbuff_sz, 
-        0, (const struct sockaddr *) &(dp->outSockAddr.addr), 
-            dp->outSockAddr.len); 
+    if (dp == NULL || dp->inCount >= DP_MAX_INQUEUE) {
+        //stray, or a connection that is not keeping up - it will be resent
+        qd->next = lp->freeList;
+        lp->freeList = qd;
+    } else {
+        qd->next = NULL;
+        if (dp->inTail != NULL)
+            dp->inTail->next = qd;
+        else
+            dp->inHead = qd;
+        dp->inTail = qd;
+        dp->inCount++;
+        pthread_cond_broadcast(&lp->cond);
+    }
+    pthread_mutex_unlock(&lp->lock);
+}
 
-    
-    print_out_pdu(outPdu);
+//Take the next queued dgram for dp, split into header and payload, see
+//dpsplit()
+static int dplpop(dp_connp dp, dp_pdu *pdu, void *payload, int payload_sz) {
+    dp_listenp lp = dp->listener;
+    dp_qdgram *qd;
+    int len;
+
+    pthread_mutex_lock(&lp->lock);
+    qd = dp->inHead;
+    dp->inHead = qd->next;
+    if (dp->inHead == NULL)
+        dp->inTail = NULL;
+    dp->inCount--;
+    pthread_mutex_unlock(&lp->lock);
+
+    len = dpsplit(dp, qd->dgram, qd->len, pdu, payload, payload_sz);
+
+    //Left for dprxdone(), or a loan
+    if (payload == NULL) {
+        dp->rxQd = qd;
+        return len;
+    }
+    pthread_mutex_lock(&lp->lock);
+    qd->next = lp->freeList;
+    lp->freeList = qd;
+    pthread_mutex_unlock(&lp->lock);
 
-    return bytesOut;
+    return len;
 }
 
 
 int dplisten(dp_connp dp) {
-    int sndSz, rcvSz;
+    int rc;
+
+    if ((rc = dplistenstart(dp, NULL, NULL)) < 0)
+        return rc;
+    return dpwaitfor(dp, &dp->ctlOp);
+}
 
+//Wait for a peer to connect, done gets true once it has
+int dplistenstart(dp_connp dp, dp_done_fn done, void *arg) {
     if(!dp->inSockAddr.isAddrInit) {
         perror("dplisten:dp connection not setup properly - cli struct not init");
         return DP_ERROR_GENERAL;
     }
+    if (dp->ctlOp.pending)
+        return DP_ERROR_BUSY;
+    if (dp->state != DP_ST_IDLE)
+        return DP_ERROR_GENERAL;
 
-    dp_pdu pdu = {0};
-
+    memset(&dp->ctlOp, 0, sizeof(dp_op));
+    dp->ctlOp.pending = true;
+    dp->ctlOp.done = done;
+    dp->ctlOp.arg = arg;
+    dp->state = DP_ST_LISTEN;
     printf("Waiting for a connection...\n");
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(pdu)) {
-        perror("dplisten:The wrong number of bytes were received");
-        return DP_ERROR_GENERAL;
-    }
+    return DP_NO_ERROR;
+}
 
-    pdu.mtype = DP_MT_CNTACK;
-    dp->seqNum = pdu.seqnum + 1;
-    pdu.seqnum = dp->seqNum;
-    
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    
-    if (sndSz != sizeof(pdu)) {
+//Skip over strays, e.g. retransmits from a connection that already closed
+static void dplisteninput(dp_connp dp, dp_pdu *pdu, int bytesIn) {
+    uint32_t agreed;
+    int sndSz, n;
+
+    if (bytesIn != sizeof(dp_pdu) || pdu->mtype != DP_MT_CONNECT)
+        return;
+
+    n = dpnegotiate(dp, pdu, &agreed);
+    pdu->mtype = DP_MT_CNTACK;
+    dp->seqNum = pdu->seqnum + 1;
+    pdu->seqnum = dp->seqNum;
+
+    sndSz = dpsendrawv(dp, pdu, &agreed, n);
+
+    if (sndSz != sizeof(dp_pdu) + n) {
         perror("dplisten:The wrong number of bytes were sent");
-        return DP_ERROR_GENERAL;
+        dp->state = DP_ST_IDLE;
+        dpfailall(dp, DP_ERROR_GENERAL);
+        return;
     }
-    dp->isConnected = true; 
+    dp->isConnected = true;
+    dp->state = DP_ST_OPEN;
+    dp->sndUna = dp->rcvDlv = dp->seqNum;
+    dpbufopen(dp);
     //For non data transmissions, ACK of just control data increase seq # by one
     printf("Connection established OK!\n");
+    dpfinish(&dp->ctlOp, true);
+}
 
-    return true;
+/*
+ * Server side of the version negotiation, pick the header format from the
+ * offer in the CONNECT and turn it into the CONNECT/ACK.  Old clients leave
+ * the version at 0 or 1.  FEC and a bigger dgram size go along with v2 if
+ * the client offered them, see DP_HS_FEC and DP_HS_DGRAM.  Returns the size
+ * of the CONNECT/ACK payload, the agreed dgram size if there is one.
+ */
+static int dpnegotiate(dp_connp dp, dp_pdu *connect, uint32_t *agreed){
+    unsigned int offer = (unsigned int)connect->err_num >> 16;
+    int hs = connect->err_num, room;
+
+    if (connect->proto_ver >= DP_PROTO_VER_2 && dp->maxVer >= DP_PROTO_VER_2)
+        dp->wireVer = DP_PROTO_VER_2;
+    else
+        dp->wireVer = DP_PROTO_VER_1;
+    dp->fecPeer = (dp->wireVer == DP_PROTO_VER_2 && (hs & DP_HS_FEC));
+    connect->proto_ver = dp->wireVer;
+    connect->err_num = dp->fecPeer ? DP_HS_FEC_OK : 0;
+    connect->dgram_sz = 0;
+
+    if (dp->wireVer != DP_PROTO_VER_2 || !(hs & DP_HS_DGRAM) || offer < DP_BASE_BUFF_SZ) {
+        dp->dgramMax = DP_BASE_BUFF_SZ;
+        return 0;
+    }
+    if (dp->dgramMax > offer)
+        dp->dgramMax = offer;
+    if ((room = dprcvroom(dp)) < dp->dgramMax)
+        dp->dgramMax = room;
+    connect->err_num |= DP_HS_DGRAM_OK;
+    connect->dgram_sz = sizeof(*agreed);
+    *agreed = htonl(dp->dgramMax);
+    return sizeof(*agreed);
+}
+
+/*
+ * The biggest payload a full window of which fits in the biggest receive
+ * buffer the kernel lets us have (net.core.rmem_max caps it), counting what
+ * the kernel charges for a dgram, not just its bytes
+ */
+static int dprcvroom(dp_connp dp){
+    int room = dp->bufCap / DP_MAX_WINDOW - DP_BUF_DGRAM(0);
+
+    return (room < DP_BASE_BUFF_SZ) ? DP_BASE_BUFF_SZ : room;
 }
 
 int dpconnect(dp_connp dp) {
+    int rc;
 
-    int sndSz, rcvSz;
+    if ((rc = dpconnectstart(dp, NULL, NULL)) < 0)
+        return rc;
+    return dpwaitfor(dp, &dp->ctlOp);
+}
 
+//Connect to the server, done gets true once we are
+int dpconnectstart(dp_connp dp, dp_done_fn done, void *arg) {
     if(!dp->outSockAddr.isAddrInit) {
         perror("dpconnect:dp connection not setup properly - svr struct not init");
         return DP_ERROR_GENERAL;
     }
+    if (dp->ctlOp.pending)
+        return DP_ERROR_BUSY;
+    if (dp->state != DP_ST_IDLE)
+        return DP_ERROR_GENERAL;
 
-    dp_pdu pdu = {0};
-    pdu.mtype = DP_MT_CONNECT;
-    pdu.seqnum = dp->seqNum;
-    pdu.dgram_sz = 0;
+    memset(&dp->ctlOp, 0, sizeof(dp_op));
+    dp->ctlOp.pending = true;
+    dp->ctlOp.done = done;
+    dp->ctlOp.arg = arg;
+    dp->ctlTries = 0;
+    dp->ctlSentAt = 0;
+    dp->state = DP_ST_CONNECT;
+    dp->kick = true;
+    return DP_NO_ERROR;
+}
 
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    if (sndSz != sizeof(dp_pdu)) {
-        perror("dpconnect:Wrong about of connection data sent");
-        return -1;
-    }
-    
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(dp_pdu)) {
-        perror("dpconnect:Wrong about of connection data received");
-        return -1;
-    }
-    if (pdu.mtype != DP_MT_CNTACK) {
-        perror("dpconnect:Expected CNTACT Message but didnt get it");
-        return -1;
-    }
+int dpdisconnect(dp_connp dp) {
+    int rc;
 
-    //For non data transmissions, ACK of just control data increase seq # by one
-    dp->seqNum++;
-    dp->isConnected = true;
-    printf("Connection established OK!\n");
+    if ((rc = dpdisconnectstart(dp, NULL, NULL)) < 0)
+        return rc;
+    rc = dpwaitfor(dp, &dp->ctlOp);
+    return (rc == DP_CONNECTION_CLOSED) ? rc : DP_ERROR_GENERAL;
+}
 
-    return true;
+/*
+ * Close the connection once everything we sent has been ACKd.  done gets
+ * DP_CONNECTION_CLOSED, after which the connection has to be dpclose()d.
+ */
+int dpdisconnectstart(dp_connp dp, dp_done_fn done, void *arg) {
+    if (dp->ctlOp.pending)
+        return DP_ERROR_BUSY;
+    if (dp->state == DP_ST_PEERCLOSED || dp->state == DP_ST_CLOSED)
+        return DP_CONNECTION_CLOSED;
+    if (dp->state != DP_ST_OPEN)
+        return DP_ERROR_GENERAL;
+
+    memset(&dp->ctlOp, 0, sizeof(dp_op));
+    dp->ctlOp.pending = true;
+    dp->ctlOp.done = done;
+    dp->ctlOp.arg = arg;
+    dp->ctlTries = 0;
+    dp->ctlSentAt = 0;
+    dp->kick = true;
+    return DP_NO_ERROR;
 }
 
-int dpdisconnect(dp_connp dp) {
+//Get a pending CONNECT, or CLOSE once the send window is empty, going
+static int dpctlstep(dp_connp dp){
+    if (!dp->ctlOp.pending || dp->ctlOp.finished || dp->ctlSentAt > 0)
+        return DP_NO_ERROR;
 
-    int sndSz, rcvSz;
+    if (dp->state == DP_ST_OPEN) {
+        //Everything we sent has to be ACKd before the close goes out
+        if (dp->txCount > 0 || dp->txOp.pending)
+            return DP_NO_ERROR;
+        dp->state = DP_ST_CLOSING;
+    }
+    if (dp->state != DP_ST_CONNECT && dp->state != DP_ST_CLOSING)
+        return DP_NO_ERROR;
+    if (dpctlsend(dp) < 0)
+        dpctldone(dp, DP_ERROR_GENERAL);
+    return DP_NO_ERROR;
+}
 
+/*
+ * Send the CONNECT or CLOSE, again on each timeout with the RTO backed off
+ * (see dptimers()).  The CONNECT always has a v1 header, with the best
+ * version we speak as the offer.
+ */
+static int dpctlsend(dp_connp dp){
     dp_pdu pdu = {0};
-    pdu.proto_ver = DP_PROTO_VER_1;
-    pdu.mtype = DP_MT_CLOSE;
+    int room;
+
+    pdu.proto_ver = (dp->state == DP_ST_CONNECT) ? dp->maxVer : dp->wireVer;
+    pdu.mtype = (dp->state == DP_ST_CONNECT) ? DP_MT_CONNECT : DP_MT_CLOSE;
     pdu.seqnum = dp->seqNum;
     pdu.dgram_sz = 0;
+    if (dp->state == DP_ST_CONNECT && dp->maxVer >= DP_PROTO_VER_2) {
+        //Offer no more than we have room for a window of, see DP_HS_DGRAM
+        if ((room = dprcvroom(dp)) < dp->dgramMax)
+            dp->dgramMax = room;
+        pdu.err_num = DP_HS_FEC | DP_HS_DGRAM | ((unsigned int)dp->dgramMax << 16);
+    }
 
-    sndSz = dpsendraw(dp, &pdu, sizeof(pdu));
-    if (sndSz != sizeof(dp_pdu)) {
-        perror("dpdisconnect:Wrong about of connection data sent");
-        return DP_ERROR_GENERAL;
+    if (dp->ctlTries > 0) {
+        dp->stats.retransmits++;
+        dp->stats.timeouts++;
+        if (_debugMode == 1)
+            printf("RETRANSMIT (timeout) %s, attempt %d, rto %lld ms\n",
+                pdu_msg_to_string(&pdu), dp->ctlTries, dp->rto / 1000);
     }
-    
-    rcvSz = dprecvraw(dp, &pdu, sizeof(pdu));
-    if (rcvSz != sizeof(dp_pdu)) {
-        perror("dpdisconnect:Wrong about of connection data received");
+    dp->ctlSentAt = dpnow();
+    dp->ctlDeadline = dp->ctlSentAt + dp->rto;
+    if (dpsendraw(dp, &pdu, sizeof(dp_pdu)) != sizeof(dp_pdu))
         return DP_ERROR_GENERAL;
+    return DP_NO_ERROR;
+}
+
+//While a CONNECT or CLOSE is out, all we look for is its ACK
+static void dpctlinput(dp_connp dp, dp_pdu *pdu, const char *payload, int bytesIn){
+    int ackType = (dp->state == DP_ST_CONNECT) ? DP_MT_CNTACK : DP_MT_CLOSEACK;
+    uint32_t agreed = DP_BASE_BUFF_SZ;
+
+    if (bytesIn < (int)sizeof(dp_pdu) || dp->ctlSentAt == 0)
+        return;
+    if (pdu->mtype == ackType) {
+        if (dp->ctlTries == 0)
+            dprttsample(dp, dpnow() - dp->ctlSentAt);
+        if (ackType == DP_MT_CNTACK) {
+            dp->fecPeer = (pdu->err_num & DP_HS_FEC_OK) != 0;
+            //An older server echoes our offer back, without the OK
+            if ((pdu->err_num & DP_HS_DGRAM_OK) && pdu->dgram_sz >= sizeof(agreed) &&
+                bytesIn >= (int)(sizeof(dp_pdu) + sizeof(agreed))) {
+                memcpy(&agreed, payload, sizeof(agreed));
+                agreed = ntohl(agreed);
+                if (agreed < DP_BASE_BUFF_SZ || agreed > dp->dgramMax)
+                    agreed = DP_BASE_BUFF_SZ;
+            }
+            dp->dgramMax = agreed;
+        }
+        dpctldone(dp, dp->ctlTries + 1);
+        return;
     }
-    if (pdu.mtype != DP_MT_CLOSEACK) {
-        perror("dpdisconnect:Expected CNTACT Message but didnt get it"); 
-        return DP_ERROR_GENERAL;
+    //Late duplicate ACKs for data can still be in front of ours
+    if (pdu->mtype == DP_MT_SNDACK || pdu->mtype == DP_MT_NACK)
+        dpprocessack(dp, pdu);
+}
+
+//The CONNECT or CLOSE was ACKd after rc tries, or failed with rc
+static void dpctldone(dp_connp dp, int rc){
+    if (dp->state == DP_ST_CONNECT) {
+        if (rc < 0) {
+            if (rc == DP_ERROR_TIMEOUT)
+                printf("dpconnect: no answer from server after %d tries\n", DP_MAX_RETRIES + 1);
+            else
+                perror("dpconnect:Wrong about of connection data sent");
+            dp->state = DP_ST_IDLE;
+            dpfailall(dp, -1);
+            return;
+        }
+
+        //A v2 CONNECT/ACK means the server took the offer
+        if (dp->rxVer == DP_PROTO_VER_2 && dp->maxVer >= DP_PROTO_VER_2)
+            dp->wireVer = DP_PROTO_VER_2;
+        else {
+            dp->fecPeer = false;
+            dp->dgramMax = DP_BASE_BUFF_SZ;
+        }
+
+        //For non data transmissions, ACK of just control data increase seq # by one
+        dp->seqNum++;
+        dp->isConnected = true;
+        dp->state = DP_ST_OPEN;
+        dp->sndUna = dp->rcvDlv = dp->seqNum;
+        dpbufopen(dp);
+        printf("Connection established OK!\n");
+        dpfinish(&dp->ctlOp, true);
+        return;
     }
-    //For non data transmissions, ACK of just control data increase seq # by one
-    dpclose(dp);
 
-    return DP_CONNECTION_CLOSED;
+    //If the CLOSE/ACK keeps getting lost the peer has most likely already
+    //closed its side, so give up quietly after a few tries
+    if (rc == DP_ERROR_TIMEOUT) {
+        printf("dpdisconnect: no CLOSE/ACK from peer, closing anyway\n");
+    } else if (rc < 0) {
+        perror("dpdisconnect:Wrong about of connection data sent");
+        dp->state = DP_ST_OPEN;
+        dpfinish(&dp->ctlOp, DP_ERROR_GENERAL);
+        return;
+    }
+    dp->state = DP_ST_CLOSED;
+    dp->isConnected = false;
+    dpfailall(dp, DP_CONNECTION_CLOSED);
 }
 
 void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
@@ -439,6 +3530,13 @@ void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz) {
 
 
 //// MISC HELPERS
+
+//Turn printing every PDU, retransmit and drop to stdout on or off.  Off by
+//default, it slows a transfer down more than anything else.
+void dpsetdebug(int on){
+    _debugMode = on ? 1 : 0;
+}
+
 void print_out_pdu(dp_pdu *pdu) {
     if (_debugMode != 1)
         return;
@@ -451,6 +3549,27 @@ void print_in_pdu(dp_pdu *pdu) {
     printf("===> PDU DETAILS  [IN]\n");
     print_pdu_details(pdu);
 }
+static void print_stats(dp_connp dp){
+    if (_debugMode != 1)
+        return;
+    printf("DP STATS: out %ld, in %ld, retransmits %ld (timeouts %ld, fast %ld), "
+        "NACKs %ld, probes %ld, dup ACKs %ld, dropped %ld, bad CRC %ld, srtt %lld us, rto %lld ms, %s cwnd %d ssthresh %d\n",
+        dp->stats.dgramsOut, dp->stats.dgramsIn, dp->stats.retransmits,
+        dp->stats.timeouts, dp->stats.fastRetransmits, dp->stats.nacks, dp->stats.probes, dp->stats.dupAcks,
+        dp->stats.dropped, dp->stats.crcErrors, dp->srtt, dp->rto / 1000, dp->cc->name, dp->cwnd, dp->ssthresh);
+    printf("DP PMTU: data in %d bytes of %d agreed, %ld probes\n",
+        dpdgramsz(dp), dp->dgramMax, dp->stats.pmtuProbes);
+    printf("DP BUFFERS: receive %d, send %d bytes, %ld dgrams dropped by a full receive buffer, paced %ld times at %lld KB/s, %ld dgrams lent\n",
+        dp->rcvBuf, dp->sndBuf, dp->stats.rcvbufDrops, dp->stats.paced, dppacerate(dp) / 1024, dp->stats.lent);
+    if (dp->fecK > 0 || dp->stats.fecRecovered > 0)
+        printf("DP FEC: parity out %ld, rebuilt %ld, NACKd but not resent %ld\n",
+            dp->stats.fecOut, dp->stats.fecRecovered, dp->stats.fecRepaired);
+    if (dp->netem != NULL)
+        printf("DP IMPAIR: lost %ld, duplicated %ld, reordered %ld, corrupted %ld, over the limit %ld\n",
+            dp->netem->stats.dropped, dp->netem->stats.duplicated,
+            dp->netem->stats.reordered, dp->netem->stats.corrupted, dp->netem->stats.overflow);
+}
+
 static void print_pdu_details(dp_pdu *pdu){
     
     printf("\tVersion:  %d\n", pdu->proto_ver);
@@ -461,11 +3580,13 @@ static void print_pdu_details(dp_pdu *pdu){
 }
 
 static char * pdu_msg_to_string(dp_pdu *pdu) {
-    switch(pdu->mtype){
+    switch(pdu->mtype & ~DP_MT_PROTECTED){
         case DP_MT_ACK:
             return "ACK";     
         case DP_MT_SND:
             return "SEND";      
+        case DP_MT_SND | DP_MT_FRAGMENT:
+            return "SEND/FRAGMENT";
         case DP_MT_CONNECT:
             return "CONNECT";   
         case DP_MT_CLOSE:
@@ -478,6 +3599,15 @@ static char * pdu_msg_to_string(dp_pdu *pdu) {
             return "CONNECT/ACK";    
         case DP_MT_CLOSEACK:
             return "CLOSE/ACK";
+        case DP_MT_ERROR:
+            return "ERROR";
+        case DP_MT_FEC:
+        case DP_MT_FEC | DP_MT_FRAGMENT:
+            return "FEC";
+        case DP_MT_PROBE:
+            return "PROBE";
+        case DP_MT_PROBEACK:
+            return "PROBE/ACK";
         default:
             return "***UNKNOWN***";  
     }
@@ -490,8 +3620,11 @@ static char * pdu_msg_to_string(dp_pdu *pdu) {
  *      if threshold is < 1 it always returns FALSE or zero
  *      if threshold is > 99 it always returns TRUE or 1
  *      if (1 <= threshold <= 99) it generates a random number between
- *          1..100 and if the random number is less than the threshold
+ *          1..100 and if the random number is at most the threshold
  *          it returns TRUE, else it returns false
+ *
+ *  The generator is seeded once, reseeding on every call with time(0)
+ *  handed back the same answer for a whole second at a time.
  * 
  *  Example: dprand(50) is a coin flip
  *              dprand(25) will return true 25% of the time
@@ -504,10 +3637,14 @@ int dprand(int threshold){
     if (threshold > 99)
         return 1;
     //initialize randome number seed
-    srand(time(0));
+    static _Bool seeded = false;
+    if (!seeded) {
+        srand(time(0) ^ getpid());
+        seeded = true;
+    }
 
     int rndInRange = (rand() % (100-1+1)) + 1;
-    if (threshold < rndInRange)
+    if (rndInRange <= threshold)
         return 1;
     else
         return 0;
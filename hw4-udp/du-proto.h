@@ -2,6 +2,8 @@
 
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
 
 
 struct dp_sock{
@@ -10,17 +12,235 @@ struct dp_sock{
     struct sockaddr_in addr;
 };
 
+struct dp_connection;
+
+/*
+ * Completion callback for the non-blocking calls (dpsendstart() and
+ * friends), rc is what the matching blocking call would have returned
+ */
+typedef void (*dp_done_fn)(struct dp_connection *dp, int rc, void *arg);
+
+typedef struct dp_op {
+    _Bool              pending;
+    dp_done_fn         done;            //NULL for the blocking calls
+    void               *arg;
+    char               *buff;           //receive - where it goes
+    int                len;
+    int                off;             //put in the window, or received, so far
+    struct dp_lent     *lent;           //receive - lend up to len dgrams instead, see dprecvlend()
+    const struct iovec *iov;            //send - the message, in pieces, see dpsendv()
+    int                iovcnt;
+    int                iovIdx;          //send - the piece at off
+    int                iovOff;          //and how far into it
+    struct iovec       one;             //send - dpsend()'s only piece
+    _Bool              queued;          //send - all of it is in the window
+    unsigned int       endSeq;          //send - seqnum just past its last dgram
+    _Bool              borrow;          //send - the dgrams point into buff
+    long long          idleAt;          //receive - when to give up on the peer
+    _Bool              finished;        //rc is set, callback is due
+    int                rc;
+} dp_op;
+
 typedef struct dp_connection{
     unsigned int       seqNum;
     int                udp_sock;
     _Bool              isConnected;
     struct dp_sock     outSockAddr;
     struct dp_sock     inSockAddr;
+    struct dp_sock     tapSockAddr;     //our end, as the packet tap records it
     int                dbgMode;
+
+    //Send window - dgrams that have been sent but not ACKd yet, kept in
+    //a ring so that up to wndSz of them can be in flight at once
+    int                wndSz;
+    unsigned int       sndUna;
+    int                txHead;
+    int                txCount;
+    int                txSacked;        //of those, how many the peer has (NACK)
+    struct dp_txslot   *txWnd;
+
+    //Receive window - reorder buffer for dgrams that arrive ahead of
+    //seqNum, and in-sequence dgrams that have not been handed to dprecv()
+    unsigned int       rcvDlv;
+    struct dp_rxslot   *rxWnd;
+
+    //Retransmission - RFC 6298 style RTT estimator, all times in usec
+    long long          srtt;
+    long long          rttvar;
+    long long          rto;
+    long long          rtoDeadline;     //when the oldest unACKd dgram times out
+    long long          lastRetxAt;      //dgrams sent before this are not timed
+    long long          lastSendAt;
+    _Bool              probeSent;       //tail loss probe, once per ACK
+    int                retries;         //back to back timeouts
+    long long          stallSince;      //first of them, see DP_USER_TIMEOUT_MS
+    int                dupAcks;
+    _Bool              inRecovery;      //repairing losses, until recoverSeq is ACKd
+    unsigned int       recoverSeq;
+    struct dp_netem    *netem;          //impaired sends for testing, see du-netem.h
+
+    //Header format, see DP_PROTO_VER_2.  Every dgram is sent with wireVer,
+    //which starts at v1 and goes up to maxVer if the peer agrees at connect.
+    int                wireVer;
+    int                maxVer;
+    int                rxVer;           //what the last dgram received came in
+    _Bool              crc;             //put a DP_WF_CRC trailer on v2 dgrams
+
+    //Forward error correction, see DP_MT_FEC.  We send parity for groups of
+    //fecK dgrams if the peer agreed at connect, and keep what we need to
+    //rebuild a lost dgram from the parity the peer sends.
+    int                fecK;            //0 = off
+    _Bool              fecPeer;         //peer understands DP_MT_FEC
+    int                fecCount;        //the group being built
+    unsigned int       fecStart;
+    long long          fecOpenAt;       //when its first dgram went out
+    int                fecLen;          //longest payload in it
+    int                fecLenXor;
+    _Bool              fecFrag;         //XOR of its DP_MT_FRAGMENT bits
+    char               *fecAcc;         //XOR of its payloads
+    struct dp_txslot   *fecTx;          //parity dgrams for the next push
+    int                fecTxCount;
+    unsigned int       peerHigh;        //end of what the peer holds, last NACK
+    struct dp_fechist  *fecHist;        //in-sequence DP_MT_PROTECTED dgrams
+    int                fecHistHead;
+    struct dp_fecgrp   *fecRx;          //parity that could not be used yet
+    int                fecPending;
+
+    //Datagram size, see DP_HS_DGRAM.  dgramMax is what the two ends agreed
+    //on at connect (before it, what we offer) and pmtu how much of that the
+    //path has been seen to carry; data goes out in dgrams of pmtu.
+    int                dgramMax;
+    int                pmtu;
+    int                pmtuHigh;        //smallest size a probe failed at
+    int                probeSz;         //probe out, 0 if none
+    int                probeTries;
+    long long          probeAt;
+    long long          pmtuNextAt;      //when to look for a bigger size again
+
+    //Congestion control, see du-cc.h.  The sender keeps at most
+    //min(wndSz, cwnd) dgrams outstanding.
+    const struct dp_cc_ops *cc;
+    int                cwnd;
+    int                ssthresh;
+    int                cwndCnt;         //ACKs towards the next +1 in avoidance
+    int                ccRoundLeft;     //ACKs left in this RTT round
+    long long          ccBaseRtt;       //delay based - lowest RTT seen
+    long long          ccRoundRtt;      //and lowest RTT this round
+
+    //Pacing, see DP_OPT_PACING.  New dgrams go out of a token bucket of
+    //payload bytes that fills at about cwnd dgrams per SRTT.
+    _Bool              pacing;
+    long long          paceTokens;
+    long long          paceAt;          //when it was last filled, 0 = full
+    long long          paceNext;        //when the dgrams held back can go
+
+    //Socket buffers, see dpbuftune().  Sizes are as the kernel counts them,
+    //twice what setsockopt() is asked for.
+    int                bufCap;          //the most the kernel lets us have
+    int                rcvBuf;          //what we have, or our share of a listeners
+    int                sndBuf;
+    long long          tuneAt;          //start of the interval being measured
+    long               tuneIn;          //what the socket had taken in by then
+    long               tuneOut;
+    long               tuneDrops;
+    uint32_t           rxqBase;         //listeners SO_RXQ_OVFL count at accept
+
+    struct dp_stats {
+        long           dgramsOut;
+        long           dgramsIn;
+        long           retransmits;
+        long           timeouts;
+        long           fastRetransmits;
+        long           nacks;           //NACKs received
+        long           probes;          //tail loss probes sent
+        long           dupAcks;
+        long           dropped;
+        long           sendCalls;       //syscalls, several dgrams each when batching
+        long           recvCalls;
+        long           bytesOut;        //on the wire, headers included
+        long           bytesIn;
+        long           crcErrors;       //dgrams dropped for a bad DP_WF_CRC
+        long           fecOut;          //parity dgrams sent
+        long           fecRecovered;    //lost dgrams rebuilt from parity
+        long           fecRepaired;     //NACKd dgrams ACKd later without a resend
+        long           pmtuProbes;      //path MTU probes sent
+        long           paced;           //times new dgrams were held back
+        long           rcvbufDrops;     //dgrams the kernel dropped, SO_RXQ_OVFL
+        long           lent;            //dgrams handed out by dprecvlend(), no copy
+    } stats;
+
+    //Batched I/O, see DP_OPT_BATCH.  Fragments of a big dpsend() queue up
+    //at the end of the window (txUnsent) and go out together, and received
+    //dgrams are pulled in a batch at a time into rxb.
+    int                batch;
+    _Bool              gro;             //UDP_GRO is on for this socket
+    int                txUnsent;
+    _Bool              ackPending;      //in-sequence data not ACKd yet
+    struct dp_rxbatch  *rxb;
+
+    //Scratch space for dgrams that are not received straight into the
+    //callers buffer (ACKs, short reads), one per connection
+    char               *dgramBuff;
+
+    //Zero-copy receive, see dprecvlend().  While a loan is wanted, dgrams
+    //are left where they were read and these say where that was.
+    char               *rxAt;           //the payload of the last dgram read
+    struct dp_rxbuf    *rxBuf;          //the batch buffer it is in, or
+    struct dp_qdgram   *rxQd;           //the listener queue entry
+    struct dp_loan     *loans;          //dgrams the application holds
+    int                loanCount;
+
+    //Set for connections accepted on a shared dp_listener socket.  The
+    //listener queues their dgrams here and chains them in its hash table.
+    struct dp_listener *listener;
+    struct dp_connection *hashNext;
+    struct dp_connection *acceptNext;
+    struct dp_qdgram   *inHead;
+    struct dp_qdgram   *inTail;
+    int                inCount;
+
+    //Non-blocking API, see dpprocess().  One send, one receive and one
+    //connect, listen or disconnect can be pending at a time.
+    int                state;           //DP_ST_*
+    _Bool              kick;            //an operation was started, run now
+    dp_op              txOp;
+    dp_op              rxOp;
+    dp_op              ctlOp;
+    int                ctlTries;        //CONNECT or CLOSE, resent until ACKd
+    long long          ctlSentAt;       //0 until it first goes out
+    long long          ctlDeadline;
+    long long          lingerUntil;     //peer closed, answer its CLOSEs until then
 } dp_connection;
 
 typedef struct dp_connection *dp_connp;
 
+/*
+ * A listener owns one UDP socket shared by many connections.  Whichever
+ * thread is waiting on it reads dgrams and routes them by peer address to
+ * the owning connection's queue; a CONNECT from an unknown peer creates a
+ * new connection that is handed out by dpaccept().
+ */
+#define DP_LISTEN_BUCKETS   64
+#define DP_MAX_INQUEUE      (2 * DP_MAX_WINDOW)   //per connection, then drop
+
+typedef struct dp_listener{
+    int                udp_sock;
+    struct dp_sock     inSockAddr;
+    pthread_mutex_t    lock;
+    pthread_cond_t     cond;
+    _Bool              reading;         //a thread is reading the socket
+    dp_connp           buckets[DP_LISTEN_BUCKETS];
+    dp_connp           acceptHead;
+    dp_connp           acceptTail;
+    struct dp_qdgram   *freeList;
+    int                bufCap;          //see dpbuftune()
+    int                rcvBuf;          //the default plus its connections shares
+    int                sndBuf;
+    uint32_t           rxqOvfl;         //SO_RXQ_OVFL, drops on the socket so far
+} dp_listener;
+
+typedef struct dp_listener *dp_listenp;
+
 
 /*
  * Drexel Protocol (dp) PDU
@@ -44,11 +264,18 @@ typedef struct dp_connection *dp_connp;
 #define DP_MT_NACK       16             //NEG ACK
 #define DP_MT_FRAGMENT   32             //DGRAM IS A FRAGMENT
 #define DP_MT_ERROR      64             //SIMULATE ERROR
+#define DP_MT_FEC        128            //XOR parity of a group of dgrams
+#define DP_MT_PROTECTED  256            //SND covered by a DP_MT_FEC, v2 flag
+
+//No dgram is both parity and a NACK, so that pair is free for path MTU
+//probes, see DP_HS_DGRAM
+#define DP_MT_PROBE     (DP_MT_FEC | DP_MT_NACK)
 
 //Message ACKS, ACK OR'ed with Message Type
 #define DP_MT_SNDACK    (DP_MT_SND     | DP_MT_ACK)
 #define DP_MT_CNTACK    (DP_MT_CONNECT | DP_MT_ACK)
 #define DP_MT_CLOSEACK  (DP_MT_CLOSE   | DP_MT_ACK)
+#define DP_MT_PROBEACK  (DP_MT_PROBE   | DP_MT_ACK)
 
 typedef struct dp_pdu {
     int     proto_ver;
@@ -58,8 +285,347 @@ typedef struct dp_pdu {
     int     err_num;
 } dp_pdu;
 
-#define     DP_MAX_BUFF_SZ          512
-#define     DP_MAX_DGRAM_SZ         (DP_MAX_BUFF_SZ + sizeof(dp_pdu))
+/*
+ * dp_pdu is what the code works with.  DP_PROTO_VER_1 also puts it on the
+ * wire as is, five host order ints.  DP_PROTO_VER_2 packs the same fields
+ * into 10 bytes in network byte order, with the fragment bit moved out of
+ * the mtype into a flag byte:
+ *
+ *     0       1       2       3       4               8              10
+ *   +-------+-------+-------+-------+---------------+---------------+
+ *   |  ver  | mtype | flags |  err  |    seqnum     |   dgram_sz    |
+ *   +-------+-------+-------+-------+---------------+---------------+
+ *
+ * A v2 header starts with a 2 followed by a non zero mtype.  A v1 header
+ * never does, the upper bytes of its version int are zero, so any dgram
+ * can be decoded without knowing what the connection agreed on.  The client
+ * offers v2 in the version of its (v1) CONNECT.  A server that speaks v2
+ * answers with a v2 CONNECT/ACK and both sides send v2 from then on; an
+ * older server echoes a v1 header back and the connection stays on v1.
+ */
+#define DP_PROTO_VER_2   2
+#define DP_DEF_VERSION   DP_PROTO_VER_2
+
+typedef struct __attribute__((packed)) dp_wire_hdr {
+    uint8_t     ver;
+    uint8_t     mtype;
+    uint8_t     flags;
+    int8_t      err;
+    uint32_t    seqnum;
+    uint16_t    dgram_sz;
+} dp_wire_hdr;
+
+#define DP_WF_FRAGMENT   0x01           //DP_MT_FRAGMENT on the wire
+#define DP_WF_CRC        0x02           //a DP_CRC_SZ trailer follows the payload
+#define DP_WF_FEC        0x04           //DP_MT_PROTECTED on the wire
+
+#define DP_HDR_V1_SZ     ((int)sizeof(dp_pdu))
+#define DP_HDR_V2_SZ     ((int)sizeof(dp_wire_hdr))
+#define DP_HDR_MAX_SZ    DP_HDR_V1_SZ
+
+/*
+ * Integrity.  UDP's own checksum is 16 bits, optional on IPv4 and left to
+ * NICs that do not always get it right.  A v2 dgram with DP_WF_CRC set ends
+ * in a CRC32C (network order) of the header and payload, just past
+ * dgram_sz.  A dgram whose CRC does not match is dropped as if it had been
+ * lost, and the sender repairs it like any other loss.  Older v2 peers
+ * ignore flags they do not know and anything past dgram_sz, so the trailer
+ * needs no negotiation.
+ */
+#define DP_CRC_SZ        4
+#define DP_DEF_CRC       1
+
+/*
+ * Datagram size.  Every peer takes payloads of DP_BASE_BUFF_SZ, which is
+ * all an older one ever sends or expects.  The client offers the most it
+ * can take in the upper 16 bits of its CONNECT's err, with DP_HS_DGRAM
+ * set, and a server that understands answers with DP_HS_DGRAM_OK and the
+ * agreed size, the smaller of the two, as a 4 byte payload (network order)
+ * of its CONNECT/ACK.  Each end offers no more than DP_OPT_DGRAM_SZ and no
+ * more than a window of them that fits in the biggest socket receive buffer
+ * the kernel lets it have, see dpbuftune().  v2 headers only.
+ *
+ * The path in between may carry less than that, so data starts out at
+ * DP_BASE_BUFF_SZ and the sender probes for more (RFC 8899 style): a
+ * DP_MT_PROBE is padding of the size being tried, sent with DF set so no
+ * router fragments it, takes no seqnum and is answered with a
+ * DP_MT_PROBEACK carrying that size in its seqnum.  An answer raises the
+ * data size to it, DP_PMTU_PROBES tries without one (an RTO apart) or an
+ * EMSGSIZE from the kernel caps the search, which then halves the gap
+ * down to DP_PMTU_STEP.  The agreed size is tried first, which is what a
+ * loopback or jumbo frame path takes.  After DP_PMTU_RAISE_MS it looks
+ * for more again, and back to back timeouts (a path that got smaller)
+ * drop data back to DP_BASE_BUFF_SZ while it searches.  Only probes have
+ * DF set, a data dgram that is too big for a changed path is fragmented
+ * rather than lost for good, since it cannot be cut up again.
+ */
+#define     DP_BASE_BUFF_SZ         512
+#define     DP_MAX_BUFF_SZ          16384   //largest we ever offer
+#define     DP_DEF_DGRAM_SZ         DP_MAX_BUFF_SZ
+#define     DP_MAX_PAYLOAD_SZ       (DP_MAX_BUFF_SZ + DP_FEC_HDR_SZ)  //a DP_MT_FEC
+#define     DP_MAX_DGRAM_SZ         (DP_MAX_PAYLOAD_SZ + sizeof(dp_pdu))
+#define     DP_HS_DGRAM             0x04
+#define     DP_HS_DGRAM_OK          0x08
+#define     DP_PMTU_PROBES          3
+#define     DP_PMTU_STEP            32      //search ends when it is this close
+#define     DP_PMTU_RAISE_MS        600000
+#define     DP_PMTU_BLACKHOLE       2       //back to back timeouts
+#define     DP_SKB_OVERHEAD         1024    //kernel bookkeeping per queued dgram
+#define     DP_BUF_DGRAM(sz)        ((sz) + DP_FEC_HDR_SZ + DP_HDR_MAX_SZ + DP_CRC_SZ + DP_SKB_OVERHEAD)
+
+/*
+ * Forward error correction.  With DP_OPT_FEC set to k, and if the peer
+ * agreed at connect, every run of k SND dgrams (or fewer, a group also ends
+ * with the message, or once its first dgram has been out for a quarter of
+ * the RTT) is followed by a DP_MT_FEC dgram.  Its seqnum is where the
+ * group starts, DP_WF_FRAGMENT is the XOR of the groups fragment bits,
+ * and the payload is a dp_fec_hdr followed by the XOR of the groups
+ * payloads, each padded with zeros to the longest.  A receiver missing one
+ * dgram of the group rebuilds it from the parity and the others, without
+ * waiting a round trip for a resend.  The group's dgrams carry DP_WF_FEC so
+ * the receiver knows to keep a copy of them (DP_FEC_MAX_GROUP of the last
+ * ones) after they are delivered.
+ *
+ * Parity does not use up sequence numbers and is never resent or ACKd.
+ * The sender holds off resending a dgram the peer NACKs until the peer
+ * reports holding data past the end of its group, since by then the parity
+ * has had its chance, or about a round trip goes by.  Timeouts resend as
+ * usual.
+ *
+ * The client offers DP_HS_FEC in the err field of its CONNECT, and a server
+ * that understands DP_MT_FEC answers with DP_HS_FEC_OK in its CONNECT/ACK.
+ * Older servers echo the CONNECT back, so they never seem to agree.  Both
+ * ends then pick their own k, 0 sends no parity.  v2 headers only.
+ */
+typedef struct __attribute__((packed)) dp_fec_hdr {
+    uint32_t    endSeq;             //seqnum just past the group
+    uint16_t    lenXor;             //XOR of the groups dgram_sz
+    uint16_t    count;              //dgrams in the group
+} dp_fec_hdr;
+
+#define     DP_FEC_HDR_SZ           ((int)sizeof(dp_fec_hdr))
+#define     DP_FEC_MAX_GROUP        32
+#define     DP_FEC_MAX_TX           (DP_MAX_WINDOW / 2 + 1)    //parity per push, groups of 2 or more
+#define     DP_FEC_PENDING          4
+#define     DP_FEC_HOLD_DIV         4       //an open group closes after SRTT/this
+#define     DP_HS_FEC               0x01
+#define     DP_HS_FEC_OK            0x02
+
+typedef struct dp_fechist {
+    unsigned int    seqnum;
+    int             mtype;
+    int             len;
+    char            data[DP_MAX_BUFF_SZ];
+} dp_fechist;
+
+typedef struct dp_fecgrp {
+    _Bool           inUse;
+    unsigned int    start;
+    unsigned int    end;
+    int             count;
+    int             lenXor;
+    _Bool           frag;
+    int             len;
+    char            data[DP_MAX_BUFF_SZ];
+} dp_fecgrp;
+
+/*
+ * Sliding window.  The sender may have up to wndSz dgrams outstanding (or
+ * fewer if congestion control says so, see du-cc.h), the
+ * receiver ACKs cumulatively with the next sequence number it expects (the
+ * same byte-count seqnum used for stop-and-wait).  DP_MAX_WINDOW also sizes
+ * the receivers reorder buffer, so any sender window up to it is safe.
+ */
+#define     DP_DEF_WINDOW           DP_MAX_WINDOW   //cwnd keeps it in check
+#define     DP_MAX_WINDOW           64
+
+typedef struct dp_txslot {
+    unsigned int    seqnum;         //seqnum of the dgram
+    int             span;           //how far the dgram moves the seqnum
+    long long       sentAt;         //usec timestamp of the last (re)send
+    int             retx;           //times this dgram was resent
+    _Bool           sacked;         //peer has it, but it is not ACKd yet
+    _Bool           fecSent;        //the parity of its group is out
+    _Bool           fecHeld;        //NACKd, but left to the parity
+    unsigned int    fecEnd;         //seqnum just past its group
+    dp_pdu          hdr;
+    const char      *payload;       //buff, or the callers memory if borrowed
+    char            buff[DP_MAX_PAYLOAD_SZ];    //room for a DP_MT_FEC
+} dp_txslot;
+
+/*
+ * Batched I/O.  DP_BATCH_MMSG moves up to DP_BATCH_MAX dgrams per
+ * sendmmsg()/recvmmsg().  DP_BATCH_GSO also hands runs of equal sized dgrams
+ * to the kernel as one UDP_SEGMENT send, and turns on UDP_GRO so the
+ * receiver gets back-to-back dgrams as DP_GRO_BUFF_SZ super-dgrams.  Either
+ * falls back to the next mode down if the kernel does not support it.
+ */
+#define     DP_BATCH_OFF            0   //one syscall per dgram
+#define     DP_BATCH_MMSG           1
+#define     DP_BATCH_GSO            2
+#define     DP_DEF_BATCH            DP_BATCH_GSO
+#define     DP_BATCH_MAX            DP_MAX_WINDOW
+#define     DP_GSO_MAX_SEGS         64
+#define     DP_GRO_BUFS             4
+#define     DP_GRO_BUFF_SZ          65536
+#define     DP_GSO_MAX_BYTES        65507   //a GSO send is one UDP dgram to the kernel
+
+//One recvmmsg() buffer.  A buffer that still has dgrams lent out of it is
+//swapped for one from the free list before the next recvmmsg().
+typedef struct dp_rxbuf {
+    struct dp_rxbuf *next;          //on the free list
+    int             refs;           //the batch, plus each dgram lent out of it
+    int             size;
+    char            data[];
+} dp_rxbuf;
+
+typedef struct dp_rxbatch {
+    int             count;          //buffers filled by the last recvmmsg()
+    int             cur;            //buffer we are handing dgrams out of
+    int             off;            //where the next dgram starts in it
+    int             buffSz;
+    int             len[DP_BATCH_MAX];
+    int             segSz[DP_BATCH_MAX];    //GRO segment size, otherwise len
+    struct sockaddr_in from[DP_BATCH_MAX];
+    dp_rxbuf        *bufs[DP_BATCH_MAX];
+    dp_rxbuf        *freeList;
+} dp_rxbatch;
+
+/*
+ * Selective ACK.  While the receiver is holding dgrams beyond a hole it
+ * answers with a DP_MT_NACK instead of a DP_MT_SNDACK.  The seqnum is still
+ * the cumulative ACK, and the payload lists the byte ranges [start, end)
+ * that are missing below highSeq, the end of what the receiver holds.  The
+ * sender resends just those, and counts everything else below highSeq as
+ * delivered when working out how much is in flight.
+ */
+#define     DP_MAX_NACK_RANGES      16
+
+typedef struct dp_nack {
+    unsigned int    highSeq;
+    int             count;
+    struct {
+        unsigned int start;
+        unsigned int end;
+    } ranges[DP_MAX_NACK_RANGES];
+} dp_nack;
+
+#define     DP_NACK_SZ(n)   (2 * sizeof(int) + (n) * 2 * sizeof(unsigned int))
+
+typedef struct dp_qdgram {
+    struct dp_qdgram   *next;
+    int                len;
+    char               dgram[DP_MAX_DGRAM_SZ];
+} dp_qdgram;
+
+typedef struct dp_rxslot {
+    _Bool           inUse;
+    _Bool           lent;           //delivered, but dprecvlend() handed it out
+    unsigned int    seqnum;
+    int             mtype;
+    int             len;
+    int             off;            //bytes already handed to dprecv()
+    char            data[DP_MAX_BUFF_SZ];
+} dp_rxslot;
+
+/*
+ * Zero-copy receive.  dprecvlend() hands the application the payload of the
+ * next in-sequence dgram where it already is, in a recvmmsg() batch buffer,
+ * a listener queue entry or the reorder buffer, instead of copying it out.
+ * It stays put until dprelease(), and up to DP_MAX_LOANS can be held at
+ * once, so an application can collect a run of them for one pwritev().
+ * Each call lends as many dgrams as are here, up to the end of a message;
+ * messages are not put back together, last says which dgram ends one.
+ * Batch buffers with loans in them are replaced from a pool before the next
+ * read.  Reorder slots are not, a held one is one less for dgrams that
+ * arrive out of order, so give them back soon.
+ * dpclose() takes back whatever is still out, and so do the blocking calls
+ * when they close the connection for the caller.
+ */
+#define     DP_MAX_LOANS            DP_MAX_WINDOW
+
+typedef struct dp_lent {
+    const char      *data;          //good until dprelease()
+    int             len;
+    _Bool           last;           //ends a message
+    int             loan;           //which of the connection's loans
+} dp_lent;
+
+typedef struct dp_loan {
+    _Bool           inUse;
+    dp_rxbuf        *buf;           //where the dgram is, one of these
+    dp_qdgram       *qd;
+    dp_rxslot       *slot;
+} dp_loan;
+
+/*
+ * Pacing.  Even within cwnd a sender that fills its window all at once
+ * sends it in one burst, which is what overflows a bottleneck queue or the
+ * receivers socket buffer.  With DP_OPT_PACING on, new dgrams go out at
+ * cwnd per SRTT times a gain (more in slow start, so cwnd can still grow),
+ * in bursts of at most DP_PACE_QUANTUM_US worth, DP_PACE_MIN_BURST dgrams
+ * at least.  The quantum is coarse because dpprocess() is woken by poll(),
+ * which sleeps in msec; at a loopback RTT a whole window fits in it and
+ * pacing changes nothing.  Resends are counted against the bucket but never
+ * wait for it.  Nothing is paced until there is an RTT sample.
+ *
+ * SO_TXTIME would leave the spacing to the kernel, but only the fq and etf
+ * qdiscs honor it and neither is on loopback or a default interface.
+ */
+#define     DP_DEF_PACING           1
+#define     DP_PACE_GAIN_SS         200     //percent of cwnd/SRTT, slow start
+#define     DP_PACE_GAIN_CA         120     //and congestion avoidance
+#define     DP_PACE_QUANTUM_US      1000
+#define     DP_PACE_MIN_BURST       2
+
+/*
+ * The receive buffer starts out holding a full window of the agreed dgram
+ * size, the send buffer at the kernel default, and both grow with the
+ * bandwidth delay product each way, measured at least every
+ * DP_BUF_TUNE_MIN_US, see dpbuftune().  Every socket also counts what the kernel drops on it for
+ * want of buffer space (SO_RXQ_OVFL), which grows the receive buffer too.
+ */
+#define     DP_BUF_HEADROOM         2       //times the BDP
+#define     DP_BUF_TUNE_MIN_US      1000
+#define     DP_BUF_MAX              (64 << 20)  //then net.core.[rw]mem_max cap it
+
+/*
+ * Retransmission timeouts (msec).  RTO starts at DP_RTO_INIT_MS until the
+ * first RTT sample, is kept between MIN and MAX, and doubles on each back
+ * to back timeout.  A sender gives up on data once DP_USER_TIMEOUT_MS go by
+ * without an ACK after the first timeout, however many resends that took,
+ * like TCP_USER_TIMEOUT; it is no shorter than the receiver's idle timeout
+ * so the sender does not quit on a peer that is still waiting for it.
+ * DP_MAX_RETRIES only limits CONNECT.  DP_DUPACK_THRESH duplicate ACKs
+ * trigger a fast retransmit of the oldest unACKd dgram without waiting for
+ * the RTO.
+ */
+#define     DP_RTO_INIT_MS          500
+#define     DP_RTO_MIN_MS           50
+#define     DP_RTO_MAX_MS           8000
+#define     DP_MAX_RETRIES          8
+#define     DP_CLOSE_RETRIES        3
+#define     DP_DUPACK_THRESH        3
+#define     DP_IDLE_TIMEOUT_MS      30000   //receiver gives up on a silent peer
+#define     DP_USER_TIMEOUT_MS      DP_IDLE_TIMEOUT_MS  //sender gives up on unACKd data
+#define     DP_LINGER_MS            (4 * DP_RTO_MIN_MS)
+#define     DP_PTO_MIN_MS           1       //tail loss probe after 2*SRTT, at least this
+
+//Options for dpsetopt()
+#define     DP_OPT_WINDOW           1   //send window in dgrams, 1..DP_MAX_WINDOW
+#define     DP_OPT_DROP             2   //percent of sent dgrams to drop, 0..99, see dpsetimpair()
+#define     DP_OPT_BATCH            3   //DP_BATCH_OFF, _MMSG or _GSO
+#define     DP_OPT_CC               4   //congestion control, DP_CC_*
+#define     DP_OPT_VERSION          5   //highest header version to use, before connect
+#define     DP_OPT_CRC              6   //0/1, DP_WF_CRC on every v2 dgram sent
+#define     DP_OPT_FEC              7   //dgrams per parity group, 2..DP_FEC_MAX_GROUP, 0 = off
+#define     DP_OPT_DGRAM_SZ         8   //largest payload to offer, DP_BASE_BUFF_SZ..DP_MAX_BUFF_SZ, before connect
+#define     DP_OPT_PACING           9   //0/1, spread new dgrams over the RTT
+
+#define     DP_CC_NONE              0   //fixed window
+#define     DP_CC_NEWRENO           1
+#define     DP_CC_VEGAS             2
+#define     DP_DEF_CC               DP_CC_NEWRENO
 
 #define     DP_NO_ERROR             0
 #define     DP_ERROR_GENERAL        -1
@@ -68,28 +634,175 @@ typedef struct dp_pdu {
 #define     DP_BUFF_OVERSIZED       -8
 #define     DP_CONNECTION_CLOSED    -16
 #define     DP_ERROR_BAD_DGRAM      -32
+#define     DP_ERROR_TIMEOUT        -64
+#define     DP_ERROR_BUSY           -128    //that kind of operation is already pending
+
+/*
+ * Non-blocking use.  An operation is started with one of the dp*start()
+ * calls and its callback runs, from inside dpprocess(), once it is done.
+ * The application waits for dpfd() to become readable (POLLIN, level
+ * triggered) for at most dptimeout() msec, or until dpdeadline(), and then
+ * calls dpprocess().  That never blocks; it handles the dgrams that are
+ * waiting, runs the retransmit, probe and idle timers, fills the send
+ * window and calls the callbacks of whatever finished.  A callback may
+ * start the next operation but must not dpclose() the connection.
+ *
+ * A pending receive only starts taking data once everything sent before it
+ * has been ACKd, the same as dprecv() flushing first.  The blocking calls
+ * are the start call plus a poll()/dpprocess() loop.
+ *
+ * Connections from a dp_listener share its socket (dplistenerfd()), so when
+ * it is readable call dptryaccept() and dpprocess() on each of them, since
+ * whichever reads the socket routes dgrams to all the others.
+ */
+#define     DP_ST_IDLE              0   //not connected yet
+#define     DP_ST_LISTEN            1
+#define     DP_ST_CONNECT           2
+#define     DP_ST_OPEN              3
+#define     DP_ST_CLOSING           4   //our CLOSE is out
+#define     DP_ST_PEERCLOSED        5   //lingering after the peers CLOSE
+#define     DP_ST_CLOSED            6
 
 //PROTOTYPES - INTERNAL HELPERS
 static dp_connp dpinit();
 
 dp_connp dpServerInit(int port);
 dp_connp dpClientInit(char *addr, int port);
+dp_listenp dpListenerInit(int port);
+dp_connp dpaccept(dp_listenp lp);
+void dplistenerclose(dp_listenp lp);
 static char * pdu_msg_to_string(dp_pdu *pdu);
 
 //API Interface
 void * dp_prepare_send(dp_pdu *pdu_ptr, void *buff, int buff_sz);
 int dprecv(dp_connp dp, void *buff, int buff_sz);
 int dpsend(dp_connp dp, void *sbuff, int sbuff_sz);
+int dpsendv(dp_connp dp, const struct iovec *iov, int iovcnt);
+int dprecvlend(dp_connp dp, dp_lent *lent, int n);
+void dprelease(dp_connp dp, dp_lent *lent);
 int dplisten(dp_connp dp);
 int dpconnect(dp_connp dp);
 int dpdisconnect(dp_connp dp);
+int dpsetopt(dp_connp dp, int opt, int val);
+int dpsetimpair(dp_connp dp, const char *spec);
+int dpflush(dp_connp dp);
+void dpgetstats(dp_connp dp, struct dp_stats *stats);
+
+//Non-blocking API
+int dpconnectstart(dp_connp dp, dp_done_fn done, void *arg);
+int dplistenstart(dp_connp dp, dp_done_fn done, void *arg);
+int dpsendstart(dp_connp dp, const void *sbuff, int sbuff_sz, dp_done_fn done, void *arg);
+int dprecvstart(dp_connp dp, void *buff, int buff_sz, dp_done_fn done, void *arg);
+int dpsendvstart(dp_connp dp, const struct iovec *iov, int iovcnt, dp_done_fn done, void *arg);
+int dprecvlendstart(dp_connp dp, dp_lent *lent, int n, dp_done_fn done, void *arg);
+int dpdisconnectstart(dp_connp dp, dp_done_fn done, void *arg);
+int dpprocess(dp_connp dp);
+int dpfd(dp_connp dp);
+int dptimeout(dp_connp dp);
+long long dpdeadline(dp_connp dp);
+int dplistenerfd(dp_listenp lp);
+dp_connp dptryaccept(dp_listenp lp);
+int dprand(int threshold);
 
 void dpclose(dp_connp dpsession);
+void dpsetdebug(int on);
 void print_out_pdu(dp_pdu *pdu);
 void print_in_pdu(dp_pdu *pdu);
 int  dpmaxdgram();
+int  dpdgramsz(dp_connp dp);
 static void print_pdu_details(dp_pdu *pdu);
 static int dpsendraw(dp_connp dp, void *sbuff, int sbuff_sz);
-static int dprecvraw(dp_connp dp, void *buff, int buff_sz);
-static int dprecvdgram(dp_connp dp, void *buff, int buff_sz);
-static int dpsenddgram(dp_connp dp, void *sbuff, int sbuff_sz);
+static int dprecvraw(dp_connp dp, void *buff, int buff_sz, int flags);
+static int dprecvrawv(dp_connp dp, dp_pdu *pdu, void *payload, int payload_sz, int flags);
+static int dpsendrawv(dp_connp dp, dp_pdu *pdu, const void *payload, int payload_sz);
+static int dpsimfate(dp_connp dp, dp_pdu *pdu);
+static int dphdrenc(dp_connp dp, dp_pdu *pdu, void *wire);
+static int dphdrdec(const void *wire, int len, dp_pdu *pdu);
+static int dpsplit(dp_connp dp, const char *dgram, int len, dp_pdu *pdu, void *payload, int payload_sz);
+static int dpframe(dp_connp dp, dp_pdu *pdu, const void *payload, int payload_sz, struct iovec *iov, char *wire);
+static void dpgather(const struct iovec *iov, int iovcnt, int off, void *out, int len);
+static int dpcrccheck(dp_connp dp, const struct iovec *iov, int iovcnt, int len);
+static void dptap(dp_connp dp, int dir, const struct iovec *iov, int iovcnt, int len);
+static void dpnackntoh(dp_nack *nack);
+static void dpnackhton(dp_nack *nack);
+static int dpnegotiate(dp_connp dp, dp_pdu *connect, uint32_t *agreed);
+static int dprcvroom(dp_connp dp);
+static int dpbufinit(int sock, int *rcvBuf, int *sndBuf);
+static void dpbuftune(dp_connp dp, long long now);
+static void dpbufgrow(dp_connp dp, int opt, int *have, long long want);
+static void dpbufgrowlocked(dp_connp dp, int opt, int *have, long long want);
+static void dpbufopen(dp_connp dp);
+static void dprxqovfl(struct msghdr *msg, uint32_t *drops);
+static long long dppacerate(dp_connp dp);
+static int dppaceallow(dp_connp dp, long long now, int first, int n);
+static void dppmtustep(dp_connp dp, long long now);
+static int dppmtusend(dp_connp dp);
+static void dppmtuack(dp_connp dp, unsigned int sz);
+static int dptxpush(dp_connp dp);
+static int dpsendmmsg(dp_connp dp, struct dp_txslot **slots, int n);
+static int dpsendgso(dp_connp dp, struct dp_txslot **slots, int n);
+static int dprxbfill(dp_connp dp, int flags);
+static int dprxbpop(dp_connp dp, dp_pdu *pdu, void *payload, int payload_sz);
+static _Bool dprxbpending(dp_connp dp);
+static int dprxdeliver(dp_connp dp, dp_pdu *pdu, char *payload);
+static int dprxbegin(dp_connp dp, dp_done_fn done, void *arg);
+static void dprxlend(dp_connp dp, dp_pdu *pdu, char *payload);
+static int dprxloan(dp_connp dp);
+static void dprxdone(dp_connp dp);
+static void dploanfree(dp_connp dp, struct dp_loan *loan);
+static dp_rxbuf *dprxbget(dp_rxbatch *rb);
+static void dprxbput(dp_rxbatch *rb, dp_rxbuf *buf);
+static void dprxstep(dp_connp dp);
+static _Bool dprxwaiting(dp_connp dp);
+static void dptxqueue(dp_connp dp, const char *sbuff, int sbuff_sz, int mtype, _Bool borrow);
+static int dptxstep(dp_connp dp);
+static void dpiovskip(struct dp_op *op, int n);
+static long long dptxdeadline(dp_connp dp, _Bool *probe);
+static int dpstep(dp_connp dp, _Bool input);
+static int dpinputall(dp_connp dp);
+static int dptimers(dp_connp dp);
+static int dpblock(dp_connp dp);
+static int dpwaitfor(dp_connp dp, dp_op *op);
+static void dpfinish(dp_op *op, int rc);
+static void dpfailall(dp_connp dp, int rc);
+static void dpcallbacks(dp_connp dp);
+static int dpctlstep(dp_connp dp);
+static int dpctlsend(dp_connp dp);
+static void dpctlinput(dp_connp dp, dp_pdu *pdu, const char *payload, int bytesIn);
+static void dpctldone(dp_connp dp, int rc);
+static void dplisteninput(dp_connp dp, dp_pdu *pdu, int bytesIn);
+static dp_connp dplaccept(dp_listenp lp, long long deadline);
+static int dpinput(dp_connp dp, dp_pdu *pdu, void *payload, int bytesIn, _Bool canDeliver);
+static int dpsendack(dp_connp dp, int mtype, int errCode);
+static void dpprocessack(dp_connp dp, dp_pdu *pdu);
+static void dpprocessnack(dp_connp dp, dp_pdu *pdu, dp_nack *nack);
+static int dpbuildnack(dp_connp dp, dp_nack *nack);
+static void dpfecadd(dp_connp dp, struct dp_txslot *slot, int idx);
+static void dpfecclose(dp_connp dp, int idx);
+static int dpfecpush(dp_connp dp);
+static int dpfecflush(dp_connp dp);
+static _Bool dpfecwait(dp_connp dp, struct dp_txslot *slot);
+static _Bool dpfecrxinit(dp_connp dp);
+static void dpfechold(dp_connp dp, struct dp_fecgrp *grp);
+static void dpfecremember(dp_connp dp, unsigned int seqnum, int mtype, const char *data, int len);
+static void dpfecinput(dp_connp dp, dp_pdu *pdu, const char *payload);
+static int dpfecrecover(dp_connp dp, struct dp_fecgrp *grp);
+static void dpfectry(dp_connp dp);
+static _Bool dpresenddue(dp_connp dp, struct dp_txslot *slot, long long now);
+static int dprecvparked(dp_connp dp, void *buff, int buff_sz, _Bool *last);
+static void dplendparked(dp_connp dp);
+static void dprxlent(dp_connp dp, int idx, char *data, int len, int mtype);
+static struct dp_rxslot *dprxfind(dp_connp dp, unsigned int seqnum);
+static int dppoll(dp_connp dp, long long deadline);
+static int dpontimeout(dp_connp dp);
+static void dpretransmit(dp_connp dp, struct dp_txslot *slot, const char *reason);
+static void dprttsample(dp_connp dp, long long rtt);
+static void dpsetrto(dp_connp dp);
+static void dplinger(dp_connp dp);
+static void print_stats(dp_connp dp);
+static int dpbindsock(struct dp_sock *sa, int port);
+static unsigned int dplhash(struct sockaddr_in *addr);
+static int dplwait(dp_listenp lp, dp_connp dp, long long deadline);
+static int dplread(dp_listenp lp, long long deadline);
+static void dplroute(dp_listenp lp, dp_qdgram *qd, struct sockaddr_in *from);
+static int dplpop(dp_connp dp, dp_pdu *pdu, void *payload, int payload_sz);
@@ -0,0 +1,231 @@
+-- Wireshark dissector for du-proto, for traces from du-ftp -t (du-pcap.h)
+-- or captured off the wire.
+--
+--   mkdir -p ~/.local/lib/wireshark/plugins
+--   cp du-proto.lua ~/.local/lib/wireshark/plugins/
+--
+-- or once off: wireshark -X lua_script:du-proto.lua trace.pcapng
+--
+-- UDP port 2080 is decoded as du-proto, and any other port where a dgram
+-- looks like a du-proto header (Decode As works too).  Both header versions
+-- are understood, see dp_pdu and dp_wire_hdr in du-proto.h.
+
+local dup = Proto("duproto", "du-proto")
+
+local mtypes = {
+    [1] = "ACK", [2] = "SEND", [4] = "CONNECT", [8] = "CLOSE", [16] = "NACK",
+    [64] = "ERROR", [128] = "FEC", [3] = "SEND/ACK", [5] = "CONNECT/ACK", [9] = "CLOSE/ACK",
+    [144] = "PROBE", [145] = "PROBE/ACK",
+}
+
+local DP_MT_NACK = 16
+local DP_MT_FRAGMENT = 32
+local DP_MT_FEC = 128
+local DP_MT_CONNECT = 4
+local DP_MT_CNTACK = 5
+local DP_HS_DGRAM = 0x04
+local DP_HS_DGRAM_OK = 0x08
+local DP_WF_FRAGMENT = 0x01
+local DP_WF_CRC = 0x02
+local DP_WF_FEC = 0x04
+local DP_HDR_V1_SZ = 20
+local DP_HDR_V2_SZ = 10
+local DP_CRC_SZ = 4
+local DP_FEC_HDR_SZ = 8
+
+local f = dup.fields
+f.ver      = ProtoField.uint8("duproto.ver", "Version")
+f.mtype    = ProtoField.uint8("duproto.mtype", "Msg Type", base.DEC, mtypes)
+f.flags    = ProtoField.uint8("duproto.flags", "Flags", base.HEX)
+f.ffrag    = ProtoField.bool("duproto.flags.fragment", "Fragment", 8, nil, DP_WF_FRAGMENT)
+f.fcrc     = ProtoField.bool("duproto.flags.crc", "CRC trailer", 8, nil, DP_WF_CRC)
+f.ffec     = ProtoField.bool("duproto.flags.fec", "FEC protected", 8, nil, DP_WF_FEC)
+f.err      = ProtoField.int8("duproto.err", "Error")
+f.ver1     = ProtoField.uint32("duproto.v1.ver", "Version")
+f.mtype1   = ProtoField.uint32("duproto.v1.mtype", "Msg Type", base.HEX)
+f.err1     = ProtoField.int32("duproto.v1.err", "Error")
+f.seqnum   = ProtoField.uint32("duproto.seqnum", "Seq Numb")
+f.dgram_sz = ProtoField.uint32("duproto.dgram_sz", "Msg Size")
+f.payload  = ProtoField.bytes("duproto.payload", "Payload")
+f.crc      = ProtoField.uint32("duproto.crc", "CRC32C", base.HEX)
+f.crcgood  = ProtoField.bool("duproto.crc.good", "CRC good")
+f.highseq  = ProtoField.uint32("duproto.nack.highseq", "Held up to")
+f.nranges  = ProtoField.int32("duproto.nack.count", "Missing ranges")
+f.rstart   = ProtoField.uint32("duproto.nack.start", "Missing from")
+f.rend     = ProtoField.uint32("duproto.nack.end", "Missing to")
+f.fecend   = ProtoField.uint32("duproto.fec.end", "Group ends at")
+f.feclen   = ProtoField.uint16("duproto.fec.lenxor", "Sizes XOR", base.HEX)
+f.feccount = ProtoField.uint16("duproto.fec.count", "Group dgrams")
+f.dgoffer  = ProtoField.uint16("duproto.dgram.offer", "Dgram size offered")
+f.dgagreed = ProtoField.uint32("duproto.dgram.agreed", "Dgram size agreed")
+
+local ef_crc = ProtoExpert.new("duproto.crc.bad", "Bad CRC32C", expert.group.CHECKSUM, expert.severity.ERROR)
+local ef_short = ProtoExpert.new("duproto.short", "Dgram shorter than its header says",
+                                 expert.group.MALFORMED, expert.severity.ERROR)
+dup.experts = { ef_crc, ef_short }
+
+dup.prefs.port = Pref.uint("UDP port", 2080, "du-ftp's default port")
+dup.prefs.checkcrc = Pref.bool("Verify CRCs", true, "Check the CRC32C trailer of v2 dgrams")
+
+-- CRC32C (Castagnoli), reflected, the same as dpcrc32c()
+local crctab = {}
+for i = 0, 255 do
+    local c = i
+    for _ = 1, 8 do
+        if bit.band(c, 1) ~= 0 then
+            c = bit.bxor(bit.rshift(c, 1), 0x82F63B78)
+        else
+            c = bit.rshift(c, 1)
+        end
+    end
+    crctab[i] = c
+end
+
+local function crc32c(tvb, off, len)
+    local crc = 0xFFFFFFFF
+    local bytes = tvb:raw(off, len)
+    for i = 1, len do
+        crc = bit.bxor(crctab[bit.band(bit.bxor(crc, bytes:byte(i)), 0xFF)], bit.rshift(crc, 8))
+    end
+    return bit.tobit(bit.bnot(crc))
+end
+
+-- A v2 header starts with a 2 and a non zero mtype, a v1 one never does
+local function isv2(tvb)
+    return tvb:len() >= DP_HDR_V2_SZ and tvb(0, 1):uint() == 2 and tvb(1, 1):uint() ~= 0
+end
+
+local function looksv1(tvb)
+    if tvb:len() < DP_HDR_V1_SZ then return false end
+    local ver = tvb(0, 4):le_uint()
+    local mt = bit.band(tvb(4, 4):le_uint(), bit.bnot(DP_MT_FRAGMENT))
+    return ver <= 2 and mtypes[mt] ~= nil and tvb(12, 4):le_uint() == tvb:len() - DP_HDR_V1_SZ
+end
+
+local function nacktree(tvb, tree, off, len, le)
+    local get = le and function(o) return tvb(o, 4):le_uint() end or function(o) return tvb(o, 4):uint() end
+    local add = le and tree.add_le or tree.add
+    if len < 8 then return end
+    add(tree, f.highseq, tvb(off, 4))
+    add(tree, f.nranges, tvb(off + 4, 4))
+    local n = get(off + 4)
+    for i = 0, n - 1 do
+        local o = off + 8 + i * 8
+        if o + 8 > off + len then break end
+        local r = tree:add(tvb(o, 8), string.format("Missing [%u, %u)", get(o), get(o + 4)))
+        add(r, f.rstart, tvb(o, 4))
+        add(r, f.rend, tvb(o + 4, 4))
+    end
+end
+
+local function dissect(tvb, pinfo, tree)
+    local len = tvb:len()
+    local hlen, mtype, seq, sz, frag
+    local t = tree:add(dup, tvb())
+
+    pinfo.cols.protocol = "du-proto"
+    if isv2(tvb) then
+        hlen = DP_HDR_V2_SZ
+        mtype = tvb(1, 1):uint()
+        local flags = tvb(2, 1):uint()
+        seq = tvb(4, 4):uint()
+        sz = tvb(8, 2):uint()
+        frag = bit.band(flags, DP_WF_FRAGMENT) ~= 0
+        t:add(f.ver, tvb(0, 1))
+        t:add(f.mtype, tvb(1, 1))
+        local ft = t:add(f.flags, tvb(2, 1))
+        ft:add(f.ffrag, tvb(2, 1))
+        ft:add(f.fcrc, tvb(2, 1))
+        ft:add(f.ffec, tvb(2, 1))
+        t:add(f.err, tvb(3, 1))
+        t:add(f.seqnum, tvb(4, 4))
+        t:add(f.dgram_sz, tvb(8, 2))
+        if bit.band(flags, DP_WF_CRC) ~= 0 then
+            if len < hlen + sz + DP_CRC_SZ then
+                t:add_proto_expert_info(ef_short)
+            else
+                local ct = t:add(f.crc, tvb(hlen + sz, DP_CRC_SZ))
+                if dup.prefs.checkcrc then
+                    local good = crc32c(tvb, 0, hlen + sz) == tvb(hlen + sz, DP_CRC_SZ):int()
+                    ct:add(f.crcgood, good):set_generated()
+                    if not good then ct:add_proto_expert_info(ef_crc) end
+                end
+            end
+        end
+    else
+        hlen = DP_HDR_V1_SZ
+        if len < hlen then
+            t:add_proto_expert_info(ef_short)
+            return len
+        end
+        mtype = tvb(4, 4):le_uint()
+        frag = bit.band(mtype, DP_MT_FRAGMENT) ~= 0
+        mtype = bit.band(mtype, bit.bnot(DP_MT_FRAGMENT))
+        seq = tvb(8, 4):le_uint()
+        sz = tvb(12, 4):le_uint()
+        t:add_le(f.ver1, tvb(0, 4))
+        t:add_le(f.mtype1, tvb(4, 4))
+        t:add_le(f.seqnum, tvb(8, 4))
+        t:add_le(f.dgram_sz, tvb(12, 4))
+        t:add_le(f.err1, tvb(16, 4))
+        -- The CONNECT offers a dgram size in the upper half of err
+        if mtype == DP_MT_CONNECT and bit.band(tvb(16, 4):le_uint(), DP_HS_DGRAM) ~= 0 then
+            t:add_le(f.dgoffer, tvb(18, 2))
+        end
+    end
+
+    local name = mtypes[mtype] or string.format("0x%x", mtype)
+    if frag then name = name .. "/FRAGMENT" end
+    t:append_text(string.format(", v%d %s, Seq %u, Size %u", (hlen == DP_HDR_V2_SZ) and 2 or 1, name, seq, sz))
+    pinfo.cols.info = string.format("%-14s Seq=%u Len=%u", name, seq, sz)
+
+    local plen = math.min(sz, len - hlen)
+    if plen < sz then t:add_proto_expert_info(ef_short) end
+    if plen > 0 then
+        t:add(f.payload, tvb(hlen, plen))
+        if mtype == DP_MT_NACK then
+            nacktree(tvb, t, hlen, plen, hlen == DP_HDR_V1_SZ)
+        elseif mtype == DP_MT_FEC and plen >= DP_FEC_HDR_SZ then
+            t:add(f.fecend, tvb(hlen, 4))
+            t:add(f.feclen, tvb(hlen + 4, 2))
+            t:add(f.feccount, tvb(hlen + 6, 2))
+        elseif mtype == DP_MT_CNTACK and plen >= 4 and hlen == DP_HDR_V2_SZ and
+               bit.band(tvb(3, 1):uint(), DP_HS_DGRAM_OK) ~= 0 then
+            t:add(f.dgagreed, tvb(hlen, 4))
+        end
+    end
+    return len
+end
+
+function dup.dissector(tvb, pinfo, tree)
+    return dissect(tvb, pinfo, tree)
+end
+
+-- Stricter than isv2(), the length has to add up exactly
+local function looksv2(tvb)
+    if not isv2(tvb) or mtypes[tvb(1, 1):uint()] == nil then return false end
+    local flags = tvb(2, 1):uint()
+    local want = DP_HDR_V2_SZ + tvb(8, 2):uint()
+    if bit.band(flags, DP_WF_CRC) ~= 0 then want = want + DP_CRC_SZ end
+    return bit.band(flags, bit.bnot(DP_WF_FRAGMENT + DP_WF_CRC + DP_WF_FEC)) == 0 and tvb:len() == want
+end
+
+local function heuristic(tvb, pinfo, tree)
+    if not looksv2(tvb) and not looksv1(tvb) then return false end
+    dissect(tvb, pinfo, tree)
+    return true
+end
+
+local udp_port = DissectorTable.get("udp.port")
+local registered = dup.prefs.port
+
+function dup.prefs_changed()
+    if registered ~= dup.prefs.port then
+        udp_port:remove(registered, dup)
+        registered = dup.prefs.port
+        udp_port:add(registered, dup)
+    end
+end
+
+udp_port:add(registered, dup)
+dup:register_heuristic("udp", heuristic)
@@ -0,0 +1,281 @@
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+#include "du-sum.h"
+
+/*
+ * CRC32C, reflected polynomial 0x82F63B78.  The table version works 8 bytes
+ * at a time with 8 tables (slicing-by-8), the hardware version feeds the
+ * SSE4.2 crc32 instruction 8 bytes at a time and uses PCLMULQDQ to stitch
+ * lanes together.  Both are hot enough that the makefile builds this file
+ * optimized.
+ */
+#define CRC32C_POLY     0x82F63B78u
+
+//a * b modulo the polynomial, both in the bit reversed order of a CRC
+static uint32_t crcmulmod(uint32_t a, uint32_t b){
+    uint32_t m = 1u << 31, p = 0;
+
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+//x^bits modulo the polynomial.  A CRC multiplied by x^(8 * len) moves len
+//bytes along.  The powers x^(2^k) come from repeated squaring.
+static uint32_t crcxpow(uint64_t bits){
+    uint32_t x2k = 1u << 30;        //x^1, squared into x^(2^k)
+    uint32_t p = 1u << 31;          //x^0
+
+    while (bits > 0) {
+        if (bits & 1)
+            p = crcmulmod(x2k, p);
+        x2k = crcmulmod(x2k, x2k);
+        bits >>= 1;
+    }
+    return p;
+}
+
+//The hardware version runs three lanes of up to CRC_LANE_MAX bytes side by
+//side, for anything of at least CRC_LANES_MIN bytes
+#define CRC_LANE_MAX    4096
+#define CRC_LANES_MIN   192
+
+static uint32_t _crcTab[8][256];
+static uint32_t _crcLaneK[CRC_LANE_MAX / 8 + 1];   //see crclaneshift()
+static pthread_once_t _crcOnce = PTHREAD_ONCE_INIT;
+
+static void crcinit(){
+    for (int i = 1; i <= CRC_LANE_MAX / 8; i++)
+        _crcLaneK[i] = crcxpow(64 * i - 33);
+    for (int i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        _crcTab[0][i] = c;
+    }
+    for (int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            _crcTab[t][i] = (_crcTab[t - 1][i] >> 8) ^ _crcTab[0][_crcTab[t - 1][i] & 0xff];
+}
+
+uint32_t dpcrc32c_sw(uint32_t crc, const void *data, size_t len){
+    const unsigned char *p = data;
+
+    pthread_once(&_crcOnce, crcinit);
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = _crcTab[7][lo & 0xff] ^ _crcTab[6][(lo >> 8) & 0xff] ^
+              _crcTab[5][(lo >> 16) & 0xff] ^ _crcTab[4][lo >> 24] ^
+              _crcTab[3][hi & 0xff] ^ _crcTab[2][(hi >> 8) & 0xff] ^
+              _crcTab[1][(hi >> 16) & 0xff] ^ _crcTab[0][hi >> 24];
+    }
+    while (len-- > 0)
+        crc = (crc >> 8) ^ _crcTab[0][(crc ^ *p++) & 0xff];
+    return ~crc;
+}
+
+/*
+ * CRC of A followed by B from crc(A), crc(B) and the length of B, so pieces
+ * of a file checksummed in any order add up to the CRC of the whole (the
+ * zlib crc32_combine() method)
+ */
+uint32_t dpcrc32c_combine(uint32_t crcA, uint32_t crcB, uint64_t lenB){
+    return crcmulmod(crcxpow(lenB * 8), crcA) ^ crcB;
+}
+
+#if defined(__x86_64__)
+/*
+ * Moves a CRC register lane bytes along: carry-less multiply by
+ * x^(8 * lane - 33) and let crc32 reduce the 64 bit product, the same as
+ * crcmulmod() by x^(8 * lane) but a few cycles instead of a few hundred
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint64_t crclaneshift(uint64_t c, int lane){
+    __m128i r = _mm_clmulepi64_si128(_mm_cvtsi32_si128(c), _mm_cvtsi32_si128(_crcLaneK[lane / 8]), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(r));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crchw(uint32_t crc, const void *data, size_t len){
+    const unsigned char *p = data;
+    uint64_t c = ~crc;
+
+    //crc32 takes three cycles but can start one every cycle, so anything
+    //but a short buffer is done three lanes at a time.  The second and
+    //third lanes start from zero and are shifted onto the first.
+    if (len >= CRC_LANES_MIN)
+        pthread_once(&_crcOnce, crcinit);
+    while (len >= CRC_LANES_MIN) {
+        int lane = (len >= 3 * CRC_LANE_MAX) ? CRC_LANE_MAX : len / 24 * 8;
+        uint64_t c1 = 0, c2 = 0;
+
+        for (int i = 0; i < lane; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p + i, 8);
+            memcpy(&v1, p + lane + i, 8);
+            memcpy(&v2, p + 2 * lane + i, 8);
+            c = _mm_crc32_u64(c, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c = crclaneshift(crclaneshift(c, lane) ^ c1, lane) ^ c2;
+        p += 3 * lane;
+        len -= 3 * lane;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    while (len-- > 0)
+        c = _mm_crc32_u8(c, *p++);
+    return ~(uint32_t)c;
+}
+
+_Bool dpcrc32c_hw(){
+    static int hw = -1;
+    if (hw < 0)
+        hw = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+    return hw;
+}
+
+uint32_t dpcrc32c(uint32_t crc, const void *data, size_t len){
+    if (dpcrc32c_hw())
+        return crchw(crc, data, len);
+    return dpcrc32c_sw(crc, data, len);
+}
+#else
+_Bool dpcrc32c_hw(){
+    return 0;
+}
+
+uint32_t dpcrc32c(uint32_t crc, const void *data, size_t len){
+    return dpcrc32c_sw(crc, data, len);
+}
+#endif
+
+/*
+ * XXH64 (Yann Collet, BSD licensed reference at github.com/Cyan4973/xxHash).
+ * Four lanes of multiply-rotate over 32 byte stripes, then the tail, then a
+ * final avalanche.  Inputs are read little endian, as on x86.
+ */
+#define XXH_P1  0x9E3779B185EBCA87ULL
+#define XXH_P2  0xC2B2AE3D27D4EB4FULL
+#define XXH_P3  0x165667B19E3779F9ULL
+#define XXH_P4  0x85EBCA77C2B2AE63ULL
+#define XXH_P5  0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxrotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxread64(const unsigned char *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t xxread32(const unsigned char *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxround(uint64_t acc, uint64_t in){
+    acc += in * XXH_P2;
+    acc = xxrotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxmerge(uint64_t acc, uint64_t val){
+    acc ^= xxround(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t dpxxh64(const void *data, size_t len, uint64_t seed){
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const unsigned char *limit = end - 32;
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+
+        do {
+            v1 = xxround(v1, xxread64(p));
+            v2 = xxround(v2, xxread64(p + 8));
+            v3 = xxround(v3, xxread64(p + 16));
+            v4 = xxround(v4, xxread64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = xxrotl(v1, 1) + xxrotl(v2, 7) + xxrotl(v3, 12) + xxrotl(v4, 18);
+        h = xxmerge(h, v1);
+        h = xxmerge(h, v2);
+        h = xxmerge(h, v3);
+        h = xxmerge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxround(0, xxread64(p));
+        h = xxrotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxread32(p) * XXH_P1;
+        h = xxrotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_P5;
+        h = xxrotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * XOR parity for du-proto's FEC.  Eight bytes at a time, which the
+ * optimizer turns into vector code, then the tail.
+ */
+void dpxor(void *dst, const void *src, size_t len){
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, d + i, sizeof(a));
+        memcpy(&b, s + i, sizeof(b));
+        a ^= b;
+        memcpy(d + i, &a, sizeof(a));
+    }
+    for (; i < len; i++)
+        d[i] ^= s[i];
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Checksums shared by du-proto and du-ftp.
+ *
+ *  dpcrc32c    - CRC32C (Castagnoli), what iSCSI and ext4 use.  Start with
+ *                crc = 0 and feed it the previous result to checksum data
+ *                in pieces.  Uses the SSE4.2 crc32 instruction (and
+ *                PCLMULQDQ) when the CPU has them, a slicing-by-8 table
+ *                otherwise.  du-proto puts one
+ *                on every dgram, du-ftp one on every file.
+ *  dpcrc32c_combine - the CRC32C of A then B, from the CRCs of both and
+ *                the length of B, for data checksummed in pieces.
+ *  dpxxh64     - XXH64, a fast 64 bit non-cryptographic hash.  du-ftp uses
+ *                it to tell which blocks of a file the server already has.
+ *  dpxor       - dst ^= src over len bytes, the parity du-proto's FEC sends.
+ */
+uint32_t dpcrc32c(uint32_t crc, const void *data, size_t len);
+uint32_t dpcrc32c_sw(uint32_t crc, const void *data, size_t len);
+uint32_t dpcrc32c_combine(uint32_t crcA, uint32_t crcB, uint64_t lenB);
+_Bool    dpcrc32c_hw();
+uint64_t dpxxh64(const void *data, size_t len, uint64_t seed);
+void     dpxor(void *dst, const void *src, size_t len);